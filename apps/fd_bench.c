@@ -0,0 +1,116 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <fs.h>
+
+#define BENCH_FILE "fd_bench"
+#define MAX_THREADS 64
+
+/* Descriptors each thread keeps open at once, closed oldest first */
+#define BATCH 16
+
+static int baseFd;
+static int iters;
+static int useOpen;
+static pthread_mutex_t openLock = PTHREAD_MUTEX_INITIALIZER;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * fs_dup() runs without locks. fs_open() looks the file up, so threads must
+ * take turns; closes never drop the last descriptor (baseFd) and need no lock.
+ */
+static int new_fd(void)
+{
+	if (!useOpen)
+		return fs_dup(baseFd);
+	pthread_mutex_lock(&openLock);
+	int ret = fs_open(BENCH_FILE);
+	pthread_mutex_unlock(&openLock);
+	return ret;
+}
+
+static void *worker(void *arg)
+{
+	int fds[BATCH];
+
+	(void)arg;
+	for (int i = 0; i < iters; i += BATCH) {
+		for (int k = 0; k < BATCH; k++)
+			if ((fds[k] = new_fd()) < 0)
+				return (void *)1;
+		for (int k = 0; k < BATCH; k++)
+			if (fs_close(fds[k]))
+				return (void *)1;
+	}
+	return NULL;
+}
+
+/* Open and close iters descriptors in each of @threads threads, in Mops/s */
+static double run(int threads)
+{
+	pthread_t tid[MAX_THREADS];
+	int failed = 0;
+
+	double start = now();
+	for (int t = 0; t < threads; t++)
+		pthread_create(&tid[t], NULL, worker, NULL);
+	for (int t = 0; t < threads; t++) {
+		void *ret;
+		pthread_join(tid[t], &ret);
+		failed |= ret != NULL;
+	}
+	double elapsed = now() - start;
+
+	if (failed) {
+		fprintf(stderr, "fd_bench: descriptor allocation failed\n");
+		exit(1);
+	}
+	return 2.0 * iters * threads / elapsed / 1e6;
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s <diskname> [iterations per thread] [max threads]\n",
+			argv[0]);
+		return 1;
+	}
+	iters = argc > 2 ? atoi(argv[2]) : 1000000;
+	int maxThreads = argc > 3 ? atoi(argv[3]) : 8;
+	if (maxThreads > MAX_THREADS)
+		maxThreads = MAX_THREADS;
+
+	if (fs_mount(argv[1])) {
+		fprintf(stderr, "fd_bench: cannot mount %s\n", argv[1]);
+		return 1;
+	}
+	fs_create(BENCH_FILE);
+	baseFd = fs_open(BENCH_FILE);
+	if (baseFd < 0)
+		return 1;
+
+	printf("%d descriptors per thread, Mops/s (one op is an open or a close)\n", iters);
+	printf("%-8s %12s %12s\n", "threads", "dup+close", "open+close");
+	for (int threads = 1; threads <= maxThreads; threads *= 2) {
+		useOpen = 0;
+		double dupRate = run(threads);
+		useOpen = 1;
+		double openRate = run(threads);
+		printf("%-8d %12.2f %12.2f\n", threads, dupRate, openRate);
+	}
+
+	fs_close(baseFd);
+	fs_delete(BENCH_FILE);
+	fs_umount();
+	return 0;
+}
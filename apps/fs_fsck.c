@@ -0,0 +1,85 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <fs.h>
+
+/* Exit codes, as for fsck(8) */
+#define FSCK_OK 0
+#define FSCK_REPAIRED 1
+#define FSCK_UNCORRECTED 4
+#define FSCK_ERROR 8
+
+static void usage(char *program)
+{
+	fprintf(stderr, "Usage: %s [-n] [-j <threads>] <diskname>\n", program);
+	fprintf(stderr, "\t-n\tcheck only, do not repair\n");
+	fprintf(stderr, "\t-j\tthreads loading and sweeping the FAT, at most one per FAT block\n"
+		"\t\t(default: one per CPU)\n");
+	exit(FSCK_ERROR);
+}
+
+int main(int argc, char *argv[])
+{
+	struct fs_fsck_report report;
+	struct timespec start, end;
+	int repair = 1, threads = 0;
+	char *diskname;
+	int opt, ret;
+
+	while ((opt = getopt(argc, argv, "nj:")) != -1) {
+		switch (opt) {
+		case 'n':
+			repair = 0;
+			break;
+		case 'j':
+			threads = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1)
+		usage(argv[0]);
+	diskname = argv[optind];
+
+	if (fs_mount(diskname)) {
+		fprintf(stderr, "Cannot mount %s\n", diskname);
+		return FSCK_ERROR;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	ret = fs_fsck(repair, threads, &report);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (ret < 0) {
+		fs_umount();
+		fprintf(stderr, "Cannot check %s\n", diskname);
+		return FSCK_ERROR;
+	}
+	if (fs_umount()) {
+		fprintf(stderr, "Cannot unmount %s\n", diskname);
+		return FSCK_ERROR;
+	}
+
+	printf("%s: %u files, %u directories, %u blocks used\n", diskname,
+	       report.files, report.directories, report.usedBlocks);
+	printf("leaked_blocks=%u\n", report.leakedBlocks);
+	printf("cycles=%u\n", report.cycles);
+	printf("cross_links=%u\n", report.crossLinks);
+	printf("bad_refcounts=%u\n", report.badRefcounts);
+	printf("bad_pointers=%u\n", report.badPointers);
+	printf("size_mismatches=%u\n", report.sizeMismatches);
+	printf("bad_chunks=%u\n", report.badChunks);
+	printf("bad_directories=%u\n", report.badDirectories);
+	printf("summary_errors=%u\n", report.summaryErrors);
+	printf("problems=%u repaired=%u\n", report.errors, report.repaired);
+	printf("checked in %.3f ms with %d threads\n",
+	       (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6,
+	       report.threads);
+
+	if (report.errors > report.repaired)
+		return FSCK_UNCORRECTED;
+	return report.errors ? FSCK_REPAIRED : FSCK_OK;
+}
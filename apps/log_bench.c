@@ -0,0 +1,98 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <fs.h>
+
+#define BLOCK 4096
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Overwrite every block of a @blocks file once, in order or shuffled */
+static void overwrite(const char *mode, size_t blocks, int shuffled)
+{
+	static char buf[BLOCK];
+	size_t *order = malloc(blocks * sizeof(*order));
+
+	if (!order)
+		exit(1);
+	srand(1);
+	for (size_t i = 0; i < blocks; i++)
+		order[i] = i;
+	for (size_t i = blocks - 1; shuffled && i > 0; i--) {
+		size_t j = rand() % (i + 1), t = order[i];
+		order[i] = order[j];
+		order[j] = t;
+	}
+
+	int fd = fs_open("bench");
+	double start = now();
+	for (size_t i = 0; i < blocks; i++) {
+		memset(buf, (int)i, BLOCK);
+		if (fs_lseek(fd, order[i] * BLOCK) || fs_write(fd, buf, BLOCK) != BLOCK) {
+			fprintf(stderr, "log_bench: write failed\n");
+			exit(1);
+		}
+	}
+	fs_close(fd);
+	double elapsed = now() - start;
+
+	printf("%-8s %-10s %5zu blocks  %7.1f MB/s\n", mode,
+	       shuffled ? "random" : "sequential", blocks, blocks * BLOCK / elapsed / 1e6);
+	free(order);
+}
+
+/* Create a @blocks file, then overwrite it in place or through the log */
+static void run(size_t blocks, int log)
+{
+	static char buf[BLOCK];
+	const char *mode = log ? "log" : "in-place";
+
+	if (fs_features(log ? FS_FEATURE_LOG : 0, log ? 0 : FS_FEATURE_LOG) < 0 ||
+	    fs_create("bench")) {
+		fprintf(stderr, "log_bench: cannot create file\n");
+		exit(1);
+	}
+	int fd = fs_open("bench");
+	for (size_t i = 0; i < blocks; i++)
+		if (fs_write(fd, buf, BLOCK) != BLOCK) {
+			fprintf(stderr, "log_bench: disk full\n");
+			exit(1);
+		}
+	fs_close(fd);
+
+	overwrite(mode, blocks, 0);
+	overwrite(mode, blocks, 1);
+
+	struct fs_log_stats stats;
+	if (log && !fs_log_stats(&stats))
+		printf("%-8s relocated %llu  checkpoints %u  dead %u  free segments %u/%u\n",
+		       mode, (unsigned long long)stats.relocatedBlocks, stats.checkpoints,
+		       stats.deadBlocks, stats.freeSegments, stats.segments);
+	fs_delete("bench");
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s <diskname> [blocks]\n", argv[0]);
+		return 1;
+	}
+	size_t blocks = argc > 2 ? (size_t)atoi(argv[2]) : 2048;
+
+	if (fs_mount(argv[1])) {
+		fprintf(stderr, "log_bench: cannot mount %s\n", argv[1]);
+		return 1;
+	}
+	run(blocks, 0);
+	run(blocks, 1);
+	fs_umount();
+	return 0;
+}
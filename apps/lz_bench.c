@@ -0,0 +1,147 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <fs.h>
+#include <lz.h>
+
+#define IO_SIZE 4096
+#define CHUNK 16384
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Log-like text, which compresses, or random bytes, which do not */
+static void fill(char *buf, size_t len, int text)
+{
+	size_t n = 0;
+
+	srand(1);
+	if (!text) {
+		while (n < len)
+			buf[n++] = rand();
+		return;
+	}
+	for (int line = 0; n < len; line++) {
+		char rec[128];
+		int r = snprintf(rec, sizeof(rec),
+				 "2024-01-01 12:%02d:%02d worker-%d request %d status %d\n",
+				 line / 60 % 60, line % 60, rand() % 8, line, rand() % 4 ? 200 : 404);
+		for (int k = 0; k < r && n < len; k++)
+			buf[n++] = rec[k];
+	}
+}
+
+/* Compress then decompress @len bytes in 16 KiB chunks, as the file system does */
+static void codec(const char *name, const char *data, size_t len)
+{
+	static char out[CHUNK];
+	char *packed = malloc(len);
+	size_t *packedLength = malloc(len / CHUNK * sizeof(*packedLength));
+	size_t packedTotal = 0, unpacked = 0;
+
+	if (!packed || !packedLength)
+		exit(1);
+
+	double start = now();
+	for (size_t i = 0; i < len / CHUNK; i++)
+		packedLength[i] = lz_compress(data + i * CHUNK, CHUNK, packed + i * CHUNK, CHUNK);
+	double comp = now() - start;
+
+	start = now();
+	for (size_t i = 0; i < len / CHUNK; i++) {
+		/* chunks that do not shrink are stored raw */
+		if (!packedLength[i]) {
+			packedTotal += CHUNK;
+			continue;
+		}
+		packedTotal += packedLength[i];
+		unpacked += CHUNK;
+		if (lz_decompress(packed + i * CHUNK, packedLength[i], out, CHUNK) != CHUNK ||
+		    memcmp(out, data + i * CHUNK, CHUNK)) {
+			fprintf(stderr, "lz_bench: round trip failed\n");
+			exit(1);
+		}
+	}
+	double decomp = now() - start;
+
+	printf("%-8s codec    ratio %5.2f  compress %7.1f MB/s", name,
+	       (double)len / packedTotal, len / comp / 1e6);
+	if (unpacked)
+		printf("  decompress %7.1f MB/s\n", unpacked / decomp / 1e6);
+	else
+		printf("  (no chunk shrinks)\n");
+	free(packed);
+	free(packedLength);
+}
+
+/* Write then read back @len bytes of @data in IO_SIZE calls */
+static void file(const char *name, const char *data, size_t len, int compress)
+{
+	static char buf[IO_SIZE];
+	struct fs_dirent dirent;
+
+	if (fs_create(name) || (compress && fs_compress(name, 1))) {
+		fprintf(stderr, "lz_bench: cannot create %s\n", name);
+		exit(1);
+	}
+
+	int fd = fs_open(name);
+	double start = now();
+	for (size_t off = 0; off < len; off += IO_SIZE)
+		if (fs_write(fd, (char *)data + off, IO_SIZE) != IO_SIZE) {
+			fprintf(stderr, "lz_bench: disk full\n");
+			exit(1);
+		}
+	fs_close(fd);
+	double write = now() - start;
+
+	fd = fs_open(name);
+	start = now();
+	for (size_t off = 0; off < len; off += IO_SIZE)
+		if (fs_read(fd, buf, IO_SIZE) != IO_SIZE || memcmp(buf, data + off, IO_SIZE)) {
+			fprintf(stderr, "lz_bench: %s reads back wrong\n", name);
+			exit(1);
+		}
+	fs_close(fd);
+	double read = now() - start;
+
+	fs_stat_name(name, &dirent);
+	printf("%-8s %-8s %5u blocks  write %7.1f MB/s  read %7.1f MB/s\n", name,
+	       compress ? "lz" : "plain", dirent.blocks, len / write / 1e6, len / read / 1e6);
+	fs_delete(name);
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s <diskname> [MiB]\n", argv[0]);
+		return 1;
+	}
+	size_t len = (size_t)(argc > 2 ? atoi(argv[2]) : 4) << 20;
+	char *text = malloc(len), *random = malloc(len);
+	if (!text || !random)
+		return 1;
+	fill(text, len, 1);
+	fill(random, len, 0);
+
+	codec("text", text, len);
+	codec("random", random, len);
+
+	if (fs_mount(argv[1])) {
+		fprintf(stderr, "lz_bench: cannot mount %s\n", argv[1]);
+		return 1;
+	}
+	file("text", text, len, 0);
+	file("text", text, len, 1);
+	file("random", random, len, 0);
+	file("random", random, len, 1);
+	fs_umount();
+	return 0;
+}
@@ -0,0 +1,96 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <crc32c.h>
+#include <scan.h>
+
+/* Largest FAT: 32 blocks of 2048 entries */
+#define FAT_ENTRIES 65536
+#define DIR_ENTRIES 128
+
+static uint16_t fat[FAT_ENTRIES];
+static uint8_t block[4096];
+static uint8_t dir[DIR_ENTRIES * SCAN_DIRENT_SIZE];
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Time @iters calls of one kernel, returning nanoseconds per call */
+#define BENCH(iters, result, call)					\
+({									\
+	double start = now();						\
+	for (int it = 0; it < (iters); it++) {				\
+		result += (call);					\
+		__asm__ volatile("" ::: "memory");			\
+	}								\
+	(now() - start) * 1e9 / (iters);				\
+})
+
+int main(int argc, char *argv[])
+{
+	int iters = argc > 1 ? atoi(argv[1]) : 2000;
+	int best = scan_level();
+	double base[5] = { 0 };
+
+	/* a FAT full but for one entry in 64, with its last 8192 entries free */
+	srand(1);
+	for (int i = 0; i < FAT_ENTRIES - 8192; i++)
+		fat[i] = rand() % 64 ? 1 + rand() % 0xFFFE : 0;
+	/* a full root directory, looked up by its last name */
+	for (int i = 0; i < DIR_ENTRIES; i++)
+		snprintf((char *)dir + i * SCAN_DIRENT_SIZE, SCAN_NAME_LEN, "file%04d.log", i);
+
+	printf("%d-entry FAT, %d-entry directory, best kernels: %s\n",
+	       FAT_ENTRIES, DIR_ENTRIES, scan_level_name(best));
+	printf("%-8s %14s %14s %14s %14s %14s\n", "kernels", "count_zero",
+	       "find_zero", "find_nonzero", "free_dirent", "find_dirent");
+
+	size_t expected[5] = { 0 };
+	for (int level = SCAN_SCALAR; level <= best; level++) {
+		size_t result[5] = { 0 };
+		double ns[5];
+
+		scan_set_level(level);
+		ns[0] = BENCH(iters, result[0], scan_count_zero16(fat, FAT_ENTRIES));
+		/* next free entry from the start of the FAT, as fat_alloc() */
+		ns[1] = BENCH(iters, result[1],
+			      scan_find_zero16(fat + it % 4096, FAT_ENTRIES - it % 4096));
+		/* length of the free run at the end, as the defragmenter */
+		ns[2] = BENCH(iters, result[2],
+			      scan_find_nonzero16(fat + FAT_ENTRIES - 8192, 8192));
+		ns[3] = BENCH(iters * 16, result[3], scan_find_free_dirent(dir, DIR_ENTRIES));
+		ns[4] = BENCH(iters * 16, result[4],
+			      scan_find_dirent(dir, DIR_ENTRIES, "file0127.log"));
+
+		printf("%-8s", scan_level_name(level));
+		for (int k = 0; k < 5; k++) {
+			if (level == SCAN_SCALAR) {
+				base[k] = ns[k];
+				expected[k] = result[k];
+			} else if (result[k] != expected[k]) {
+				fprintf(stderr, "%s kernel %d disagrees with scalar\n",
+					scan_level_name(level), k);
+				return 1;
+			}
+			printf(" %8.0f ns %3.0fx", ns[k], base[k] / ns[k]);
+		}
+		printf("\n");
+	}
+
+	/* the checksum computed for every block read or written with FS_FEATURE_CHECKSUM */
+	size_t crc = 0;
+	for (size_t i = 0; i < sizeof(block); i++)
+		block[i] = rand();
+	double ns = BENCH(iters * 16, crc, crc32c(0, block, sizeof(block)));
+	printf("crc32c (%s) of a 4 KiB block: %.0f ns, %.1f GB/s\n",
+	       crc32c_hardware() ? "SSE4.2" : "table", ns, sizeof(block) / ns);
+	(void)crc;
+	return 0;
+}
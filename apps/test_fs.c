@@ -34,6 +34,36 @@ struct thread_arg {
 	char **argv;
 };
 
+/* Data borrowed by a script, and a copy of it to check that it stays put */
+#define MAX_LEASES 16
+
+struct script_lease {
+	struct fs_iovec *iov;
+	int iovcnt;
+	char *copy;
+	int len;
+};
+
+/* A request queued by AWRITE, AREAD or ACLOSE, checked by REAP */
+struct script_async {
+	char *command;
+	char *data;
+	char *buf;
+};
+
+/* Descriptors DUP set aside, to go back to when the duplicate is closed */
+#define MAX_DUPS 16
+
+/* Release the free blocks of the mounted disk, and say how many */
+static int trim_print(void)
+{
+	int ret = fs_trim();
+
+	if (ret >= 0)
+		printf("Released: %d blocks\n", ret);
+	return ret;
+}
+
 void thread_fs_script(void *arg)
 {
 	struct thread_arg *t_arg = arg;
@@ -62,6 +92,23 @@ void thread_fs_script(void *arg)
 
 	int fs_fd = -1;
 
+	/* Buffered stream over fs_fd, when BUFFER is on */
+	struct fs_stream *fs_stream = NULL;
+	int buffer_size = -1;
+	int buffer_mode = FS_STREAM_FULL;
+
+	/* Leases taken by BORROW, given back by RELEASE */
+	struct script_lease leases[MAX_LEASES];
+	int lease_count = 0;
+
+	/* Descriptors set aside by DUP */
+	int dup_fds[MAX_DUPS];
+	int dup_count = 0;
+
+	/* Mapping made by MMAP */
+	char *map = NULL;
+	size_t map_len = 0;
+
 	/* Loop through the script and execute the specified commands */
 	while (fgets(line_buffer, 1024, fd_script) != NULL) {
 		/* Remove trailing newline from command line */
@@ -87,7 +134,19 @@ void thread_fs_script(void *arg)
 			break;
 
 		if (strcmp(command, "MOUNT") == 0) {
-			if (fs_mount(diskname))
+			/* "ram" or "ram+save" mounts a RAM disk of the image */
+			char ram_name[PATH_MAX + 16];
+			char *name = diskname;
+
+			if (command_args[1]) {
+				if (strcmp(command_args[1], "ram") &&
+				    strcmp(command_args[1], "ram+save"))
+					die("Unknown disk type %s", command_args[1]);
+				snprintf(ram_name, sizeof(ram_name), "%s:%s",
+					 command_args[1], diskname);
+				name = ram_name;
+			}
+			if (fs_mount(name))
 				die("Cannot mount disk");
 			else {
 				printf("MOUNT successful.\n");
@@ -122,30 +181,306 @@ void thread_fs_script(void *arg)
 
 			printf("DELETE successful.\n");
 
+		} else if (strcmp(command, "MKDIR") == 0) {
+			fs_filename = command_args[1];
+
+			if(fs_mkdir(fs_filename)) {
+				fs_umount();
+				die("Cannot create directory");
+			}
+
+			printf("MKDIR successful.\n");
+
+		} else if (strcmp(command, "RMDIR") == 0) {
+			fs_filename = command_args[1];
+
+			if(fs_rmdir(fs_filename)) {
+				fs_umount();
+				die("Cannot remove directory");
+			}
+
+			printf("RMDIR successful.\n");
+
+		} else if (strcmp(command, "READDIR") == 0) {
+			struct fs_dir *dir = fs_opendir(command_args[1] ? command_args[1] : "");
+			struct fs_dirent dirent;
+			int entries = 0, ret;
+
+			if (!dir) {
+				fs_umount();
+				die("Cannot open directory");
+			}
+			while ((ret = fs_readdir(dir, &dirent)) == 1) {
+				printf("%s%s: %u bytes in %u blocks\n", dirent.filename,
+				       dirent.isDirectory ? "/" : "", dirent.size, dirent.blocks);
+				entries++;
+			}
+			fs_closedir(dir);
+			if (ret < 0) {
+				fs_umount();
+				die("Cannot read directory");
+			}
+
+			if (command_args[1] && command_args[2] && entries != atoi(command_args[2]))
+				printf("Listed %d entries instead of %s!\n", entries, command_args[2]);
+			else
+				printf("READDIR listed %d entries.\n", entries);
+
+		} else if (strcmp(command, "CLONE") == 0) {
+			if(!command_args[1] || !command_args[2] ||
+			   fs_clone(command_args[1], command_args[2])) {
+				fs_umount();
+				die("Cannot clone file");
+			}
+
+			printf("CLONE successful.\n");
+
+		} else if (strcmp(command, "SNAPSHOT") == 0 && command_args[1]) {
+			int snapshot = command_args[2] ? atoi(command_args[2]) : -1;
+
+			if (strcmp(command_args[1], "mount") == 0) {
+				if (fs_snapshot_mount(diskname, snapshot))
+					die("Cannot mount snapshot");
+				mounted = 1;
+			} else if (strcmp(command_args[1], "delete") == 0) {
+				if (fs_snapshot_delete(snapshot)) {
+					fs_umount();
+					die("Cannot delete snapshot");
+				}
+			} else {
+				fs_umount();
+				die("Unknown snapshot operation %s", command_args[1]);
+			}
+
+			printf("SNAPSHOT %s %d successful.\n", command_args[1], snapshot);
+
+		} else if (strcmp(command, "SNAPSHOT") == 0) {
+			int snapshot = fs_snapshot_create();
+
+			if (snapshot < 0) {
+				fs_umount();
+				die("Cannot create snapshot");
+			}
+
+			printf("SNAPSHOT %d successful.\n", snapshot);
+
+		} else if (strcmp(command, "READONLY") == 0) {
+			int fd;
+
+			/* every change to the filesystem must be refused */
+			if (!command_args[1] || !fs_delete(command_args[1]) ||
+			    !fs_create("readonly_probe") || !fs_mkdir("readonly_probe") ||
+			    (fd = fs_open(command_args[1])) < 0) {
+				fs_umount();
+				die("Filesystem is not read-only");
+			}
+			count = fs_write(fd, "x", 1);
+			fs_close(fd);
+			if (count >= 0) {
+				fs_umount();
+				die("Filesystem is not read-only");
+			}
+
+			printf("READONLY successful.\n");
+
+		} else if (strcmp(command, "TRIM") == 0) {
+			if (trim_print() < 0) {
+				fs_umount();
+				die("Cannot trim disk");
+			}
+
+		} else if (strcmp(command, "COMPRESS") == 0) {
+			fs_filename = command_args[1];
+
+			if(fs_compress(fs_filename, 1)) {
+				fs_umount();
+				die("Cannot compress file");
+			}
+
+			printf("COMPRESS successful.\n");
+
+		} else if (strcmp(command, "INLINE") == 0) {
+			int on = command_args[1] && strcmp(command_args[1], "off") != 0;
+
+			if (fs_features(on ? FS_FEATURE_INLINE : 0,
+					on ? 0 : FS_FEATURE_INLINE) < 0) {
+				fs_umount();
+				die("Cannot change inline files");
+			}
+
+			printf("INLINE successful.\n");
+
+		} else if (strcmp(command, "DEDUP") == 0) {
+			int on = command_args[1] && strcmp(command_args[1], "off") != 0;
+
+			if (fs_features(on ? FS_FEATURE_DEDUP : 0,
+					on ? 0 : FS_FEATURE_DEDUP) < 0) {
+				fs_umount();
+				die("Cannot change deduplication");
+			}
+
+			printf("DEDUP successful.\n");
+
+		} else if (strcmp(command, "CHECKSUM") == 0) {
+			int on = command_args[1] && strcmp(command_args[1], "off") != 0;
+
+			if (fs_features(on ? FS_FEATURE_CHECKSUM : 0,
+					on ? 0 : FS_FEATURE_CHECKSUM) < 0) {
+				fs_umount();
+				die("Cannot change checksums");
+			}
+
+			printf("CHECKSUM successful.\n");
+
+		} else if (strcmp(command, "LOG") == 0 && command_args[1] &&
+			   strcmp(command_args[1], "stats") == 0) {
+			struct fs_log_stats stats;
+
+			if (fs_log_stats(&stats)) {
+				fs_umount();
+				die("Cannot get log statistics");
+			}
+			printf("Log: %llu appended, %llu relocated, %llu cleaned blocks, "
+			       "%u checkpoints, %u dead blocks, %u of %u segments free.\n",
+			       (unsigned long long)stats.appendedBlocks,
+			       (unsigned long long)stats.relocatedBlocks,
+			       (unsigned long long)stats.cleanedBlocks, stats.checkpoints,
+			       stats.deadBlocks, stats.freeSegments, stats.segments);
+
+		} else if (strcmp(command, "LOG") == 0 && command_args[1] &&
+			   strcmp(command_args[1], "clean") == 0) {
+			int cleaned = fs_log_clean(command_args[2] ? atoi(command_args[2]) : 1);
+
+			if (cleaned < 0) {
+				fs_umount();
+				die("Cannot clean the log");
+			}
+			printf("Cleaned %d segments.\n", cleaned);
+
+		} else if (strcmp(command, "LOG") == 0) {
+			int on = command_args[1] && strcmp(command_args[1], "off") != 0;
+
+			if (fs_features(on ? FS_FEATURE_LOG : 0,
+					on ? 0 : FS_FEATURE_LOG) < 0) {
+				fs_umount();
+				die("Cannot change log-structured mode");
+			}
+
+			printf("LOG successful.\n");
+
+		} else if (strcmp(command, "BUFFER") == 0) {
+			if (!command_args[1]) {
+				fs_umount();
+				die("Missing buffer size");
+			}
+			buffer_size = strcmp(command_args[1], "off") ? atoi(command_args[1]) : -1;
+			buffer_mode = command_args[2] && strcmp(command_args[2], "line") == 0 ?
+				FS_STREAM_LINE : FS_STREAM_FULL;
+
+			/* Wrap the currently opened file, which goes back to offset 0 */
+			if (!fs_stream && fs_fd >= 0 && buffer_size >= 0) {
+				if (lease_count) {
+					fs_umount();
+					die("Cannot buffer a file with borrowed data");
+				}
+				fs_stream = fs_fdopen(fs_fd);
+				if (!fs_stream) {
+					fs_umount();
+					die("Cannot buffer file");
+				}
+			}
+			if (fs_stream && fs_setvbuf(fs_stream, buffer_size < 0 ? 0 : buffer_size,
+						    buffer_mode)) {
+				fs_umount();
+				die("Cannot change buffering");
+			}
+
+			printf("BUFFER successful.\n");
+
+		} else if (strcmp(command, "FLUSHER") == 0) {
+			if (!command_args[1]) {
+				fs_umount();
+				die("Missing expiry time");
+			}
+			if (strcmp(command_args[1], "stats") == 0) {
+				struct fs_flusher_stats stats;
+
+				/* give the flusher time for a pass */
+				if (command_args[2])
+					usleep(atoi(command_args[2]) * 1000);
+				if (fs_flusher_stats(&stats)) {
+					fs_umount();
+					die("Cannot get flusher statistics");
+				}
+				printf("Flusher: %u of %u cached metadata blocks dirty.\n",
+				       stats.dirtyBlocks, stats.cachedBlocks);
+				continue;
+			}
+			if (strcmp(command_args[1], "off") == 0)
+				fs_flusher_stop();
+			else if (fs_flusher_start(atoi(command_args[1]),
+					command_args[2] ? atoi(command_args[2]) : 10,
+					command_args[2] && command_args[3] ? atoi(command_args[3]) : 40)) {
+				fs_umount();
+				die("Cannot start the flusher");
+			}
+
+			printf("FLUSHER successful.\n");
+
 		} else if (strcmp(command, "OPEN") == 0) {
 			fs_filename = command_args[1];
 
-			fs_fd = fs_open(fs_filename);
+			if (command_args[2] && strcmp(command_args[2], "append") == 0)
+				fs_fd = fs_open_append(fs_filename);
+			else
+				fs_fd = fs_open(fs_filename);
 
 			if (fs_fd < 0) {
 				fs_umount();
 				die("Cannot open file");
 			}
 
+			fs_stream = NULL;
+			if (buffer_size >= 0) {
+				fs_stream = fs_fdopen(fs_fd);
+				if (!fs_stream ||
+				    fs_setvbuf(fs_stream, buffer_size, buffer_mode)) {
+					fs_umount();
+					die("Cannot buffer file");
+				}
+			}
+
 			printf("OPEN successful.\n");
 
 		} else if (strcmp(command, "CLOSE") == 0) {
-			if (fs_close(fs_fd)) {
+			if (fs_stream ? fs_fclose(fs_stream) : fs_close(fs_fd)) {
 				fs_umount();
 				die("Cannot close file");
 			}
+			fs_stream = NULL;
+			fs_fd = dup_count ? dup_fds[--dup_count] : -1;
 
 			printf("CLOSE successful.\n");
 
+		} else if (strcmp(command, "DUP") == 0) {
+			if (fs_stream || dup_count == MAX_DUPS) {
+				fs_umount();
+				die("Cannot duplicate a stream or more than %d times", MAX_DUPS);
+			}
+			dup_fds[dup_count] = fs_fd;
+			fs_fd = fs_dup(fs_fd);
+			if (fs_fd < 0) {
+				fs_umount();
+				die("Cannot duplicate file descriptor");
+			}
+			dup_count++;
+
+			printf("DUP successful.\n");
+
 		} else if (strcmp(command, "SEEK") == 0) {
 			offset = atoi(command_args[1]);
 
-			if (fs_lseek(fs_fd, offset)) {
+			if (fs_stream ? fs_fseek(fs_stream, offset) : fs_lseek(fs_fd, offset)) {
 				fs_umount();
 				die("Cannot seek to position");
 			} else {
@@ -185,14 +520,26 @@ void thread_fs_script(void *arg)
 				die_perror("Could not find data to write");
 			}
 
-			count = fs_write(fs_fd, data, data_size);
-			if (count < 0) {
-				fs_umount();
-				die("write error");
+			/* the data is written <times> times in a row */
+			int times = command_args[3] ? atoi(command_args[3]) : 1;
+			count = 0;
+			for (int k = 0; k < times; k++) {
+				int written;
+
+				if (fs_stream)
+					written = fs_fwrite(fs_stream, data, data_size);
+				else
+					written = fs_write(fs_fd, data, data_size);
+				if (written < 0) {
+					fs_umount();
+					die("write error");
+				}
+				count += written;
 			}
 			printf("Wrote %d bytes to file.\n", count);
 
-		} else if (strcmp(command, "READ") == 0) {
+		} else if (strcmp(command, "READ") == 0 || strcmp(command, "BORROW") == 0) {
+			int borrow = strcmp(command, "BORROW") == 0;
 			int read_req_length = atoi(command_args[1]);
 			data_source = command_args[2];
 			data_description = command_args[3];
@@ -239,8 +586,30 @@ void thread_fs_script(void *arg)
 				die("invalid data read length");
 			}
 
+			if (borrow && (fs_stream || lease_count == MAX_LEASES)) {
+				fs_umount();
+				die("Cannot borrow from a stream or more than %d times", MAX_LEASES);
+			}
+
 			read_buf = calloc(read_req_length+1, sizeof(char));
-			count = fs_read(fs_fd, read_buf, read_req_length);
+			if (borrow) {
+				struct script_lease *lease = &leases[lease_count];
+				lease->iovcnt = fs_read_borrow(fs_fd, read_req_length, &lease->iov);
+				count = lease->iovcnt < 0 ? -1 : 0;
+				for (int i = 0; i < lease->iovcnt; i++) {
+					memcpy(read_buf + count, lease->iov[i].base, lease->iov[i].len);
+					count += lease->iov[i].len;
+				}
+				if (count >= 0) {
+					lease->copy = malloc(count);
+					memcpy(lease->copy, read_buf, count);
+					lease->len = count;
+					lease_count++;
+				}
+			} else if (fs_stream)
+				count = fs_fread(fs_stream, read_buf, read_req_length);
+			else
+				count = fs_read(fs_fd, read_buf, read_req_length);
 
 			if (count < 0) {
 				fs_umount();
@@ -249,7 +618,10 @@ void thread_fs_script(void *arg)
 
 			// both data and read_buf were allocated with an extra zero byte
 			// +1 here to check for the canaries
-			if (memcmp(data, read_buf, data_size+1) == 0)
+			if (memcmp(data, read_buf, data_size+1) == 0 && borrow)
+				printf("Borrowed %d bytes in %d ranges. Compared %d correct.\n",
+				       count, leases[lease_count - 1].iovcnt, data_size);
+			else if (memcmp(data, read_buf, data_size+1) == 0)
 				printf("Read %d bytes from file. Compared %d correct.\n", count, data_size);
 			else
 				printf("Read unexpected data! %s read vs given %s\n", read_buf, data);
@@ -258,6 +630,172 @@ void thread_fs_script(void *arg)
 			if(file_loaded){
 				free(data);
 			}
+
+		} else if (strcmp(command, "RELEASE") == 0) {
+			int changed = 0;
+
+			for (int k = 0; k < lease_count; k++) {
+				struct script_lease *lease = &leases[k];
+				for (int i = 0, done = 0; i < lease->iovcnt; done += lease->iov[i++].len)
+					changed |= memcmp(lease->iov[i].base, lease->copy + done,
+							  lease->iov[i].len) != 0;
+				if (fs_release(lease->iov)) {
+					fs_umount();
+					die("Cannot release borrowed data");
+				}
+				free(lease->copy);
+			}
+			if (changed)
+				printf("Borrowed data changed before RELEASE!\n");
+			else
+				printf("Released %d leases. Borrowed data unchanged.\n", lease_count);
+			lease_count = 0;
+
+		} else if (strcmp(command, "MMAP") == 0) {
+			int writable = command_args[1] && strcmp(command_args[1], "rw") == 0;
+
+			if (map) {
+				fs_umount();
+				die("A file is already mapped");
+			}
+			map = fs_mmap(fs_fd, &map_len, writable);
+			if (!map) {
+				fs_umount();
+				die("Cannot map file");
+			}
+
+			printf("Mapped %zu bytes.\n", map_len);
+
+		} else if (strcmp(command, "MREAD") == 0 || strcmp(command, "MWRITE") == 0) {
+			if (!map || !command_args[1] || !command_args[2]) {
+				fs_umount();
+				die("Missing mapping, offset or data");
+			}
+			offset = atoi(command_args[1]);
+			data = command_args[2];
+			data_size = strlen(data);
+			if (offset < 0 || offset + (size_t)data_size > map_len) {
+				fs_umount();
+				die("Data past the end of the mapping");
+			}
+
+			if (command[1] == 'W') {
+				memcpy(map + offset, data, data_size);
+				printf("Stored %d bytes in mapping.\n", data_size);
+			} else if (memcmp(map + offset, data, data_size) == 0)
+				printf("Compared %d correct in mapping.\n", data_size);
+			else
+				printf("Mapping holds unexpected data! %.*s vs given %s\n",
+				       data_size, map + offset, data);
+
+		} else if (strcmp(command, "MSYNC") == 0 || strcmp(command, "MUNMAP") == 0) {
+			int ret = command[1] == 'S' ? fs_msync(map) : fs_munmap(map);
+
+			if (ret) {
+				fs_umount();
+				die("Cannot %s mapping", command[1] == 'S' ? "write back" : "remove");
+			}
+			if (command[1] == 'U')
+				map = NULL;
+
+			printf("%s successful.\n", command);
+
+		} else if (strcmp(command, "BATCH") == 0) {
+			char *op = command_args[1] ? command_args[1] : "";
+			int ret;
+
+			/* a failed commit is undone, which scripts then check */
+			if (strcmp(op, "commit") == 0) {
+				printf("BATCH commit %s.\n", fs_batch_commit() ? "failed, undone" : "successful");
+				continue;
+			}
+
+			if (strcmp(op, "begin") == 0)
+				ret = fs_batch_begin();
+			else if (strcmp(op, "create") == 0)
+				ret = fs_batch_create(command_args[2]);
+			else if (strcmp(op, "delete") == 0)
+				ret = fs_batch_delete(command_args[2]);
+			else if (strcmp(op, "rename") == 0)
+				ret = fs_batch_rename(command_args[2], command_args[3]);
+			else if (strcmp(op, "truncate") == 0)
+				ret = fs_batch_truncate(command_args[2],
+							command_args[3] ? atoi(command_args[3]) : 0);
+			else if (strcmp(op, "abort") == 0)
+				ret = fs_batch_abort();
+			else {
+				fs_umount();
+				die("Invalid batch operation %s", op);
+			}
+			if (ret) {
+				fs_umount();
+				die("Cannot %s in batch", op);
+			}
+
+			printf("BATCH %s successful.\n", op);
+
+		} else if (strcmp(command, "ASYNC") == 0) {
+			if (command_args[1] && strcmp(command_args[1], "off") == 0)
+				fs_async_stop();
+			else if (fs_async_start() < 0) {
+				fs_umount();
+				die("Cannot start the async worker");
+			}
+
+			printf("ASYNC successful.\n");
+
+		} else if (strcmp(command, "AWRITE") == 0 || strcmp(command, "AREAD") == 0 ||
+			   strcmp(command, "ACLOSE") == 0) {
+			struct script_async *req = calloc(1, sizeof(*req));
+			int ret;
+
+			if (fs_stream) {
+				fs_umount();
+				die("Cannot queue requests on a stream");
+			}
+			req->command = command[1] == 'W' ? "AWRITE" : command[1] == 'R' ? "AREAD" : "ACLOSE";
+			if (command[1] == 'C') {
+				ret = fs_async_close(fs_fd, req);
+			} else {
+				req->data = strdup(command_args[2]);
+				data_size = strlen(req->data);
+				if (command[1] == 'W') {
+					ret = fs_async_write(fs_fd, req->data, data_size,
+							     atoi(command_args[1]), req);
+				} else {
+					req->buf = calloc(data_size + 1, sizeof(char));
+					ret = fs_async_read(fs_fd, req->buf, data_size,
+							    atoi(command_args[1]), req);
+				}
+			}
+			if (ret) {
+				fs_umount();
+				die("Cannot queue request");
+			}
+			if (command[1] == 'C')
+				fs_fd = dup_count ? dup_fds[--dup_count] : -1;
+
+			printf("%s queued.\n", req->command);
+
+		} else if (strcmp(command, "REAP") == 0) {
+			struct fs_async_completion done;
+
+			/* completions come in submission order */
+			while (fs_async_reap(&done, 1, 1) == 1) {
+				struct script_async *req = done.userData;
+
+				if (req->buf && done.result >= 0 && strcmp(req->buf, req->data) == 0)
+					printf("%s read %d bytes. Compared %d correct.\n",
+					       req->command, done.result, (int)strlen(req->data));
+				else if (req->buf)
+					printf("%s read unexpected data! %s read vs given %s\n",
+					       req->command, req->buf, req->data);
+				else
+					printf("%s returned %d.\n", req->command, done.result);
+				free(req->data);
+				free(req->buf);
+				free(req);
+			}
 		}
 	}
 
@@ -272,9 +810,8 @@ void thread_fs_script(void *arg)
 void thread_fs_stat(void *arg)
 {
 	struct thread_arg *t_arg = arg;
+	struct fs_dirent dirent;
 	char *diskname, *filename;
-	int fs_fd;
-	int stat;
 
 	if (t_arg->argc < 2)
 		die("need <diskname> <filename>");
@@ -285,35 +822,21 @@ void thread_fs_stat(void *arg)
 	if (fs_mount(diskname))
 		die("Cannot mount diskname");
 
-	fs_fd = fs_open(filename);
-	if (fs_fd < 0) {
-		fs_umount();
-		die("Cannot open file");
-	}
-
-	stat = fs_stat(fs_fd);
-	if (stat < 0) {
-		fs_close(fs_fd);
+	/* No file descriptor needed to read the entry */
+	if (fs_stat_name(filename, &dirent)) {
 		fs_umount();
 		die("Cannot stat file");
 	}
-	if (!stat) {
-		fs_close(fs_fd);
-		fs_umount();
-		/* Nothing to read, file is empty */
-		printf("Empty file\n");
-		return;
-	}
-
-	if (fs_close(fs_fd)) {
-		fs_umount();
-		die("Cannot close file");
-	}
 
 	if (fs_umount())
 		die("cannot unmount diskname");
 
-	printf("Size of file '%s' is %d bytes\n", filename, stat);
+	if (!dirent.size) {
+		/* Nothing to read, file is empty */
+		printf("Empty file\n");
+		return;
+	}
+	printf("Size of file '%s' is %u bytes\n", filename, dirent.size);
 }
 
 void thread_fs_cat(void *arg)
@@ -507,6 +1030,109 @@ size_t get_argv(char *argv)
 	return (size_t)ret;
 }
 
+void thread_fs_defrag(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct fs_defrag_stats stats;
+	char *diskname;
+	size_t maxBlocks = 0, maxMillis = 0;
+	int ret;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [max blocks] [max ms]");
+
+	diskname = t_arg->argv[0];
+	if (t_arg->argc > 1)
+		maxBlocks = get_argv(t_arg->argv[1]);
+	if (t_arg->argc > 2)
+		maxMillis = get_argv(t_arg->argv[2]);
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	ret = fs_defrag(maxBlocks, maxMillis, &stats);
+	if (ret < 0) {
+		fs_umount();
+		die("Cannot defragment diskname");
+	}
+
+	printf("Files: %u\n", stats.files);
+	printf("Fragmented files: %u -> %u\n", stats.fragmentedBefore, stats.fragmentedAfter);
+	printf("Extents: %u -> %u\n", stats.extentsBefore, stats.extentsAfter);
+	printf("Moved: %u files, %u blocks\n", stats.movedFiles, stats.movedBlocks);
+	if (stats.skippedFiles)
+		printf("Skipped (no fewer free runs, or mapped): %u files\n", stats.skippedFiles);
+	if (stats.movedBlocks)
+		printf("Sequential read: %.1f MB/s -> %.1f MB/s\n",
+		       stats.readBeforeMBps, stats.readAfterMBps);
+	if (ret)
+		printf("Budget exhausted, run again to continue\n");
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
+void thread_fs_scrub(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct fs_checksum_stats stats;
+	char *diskname;
+	size_t rate = 0;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [blocks per second]");
+
+	diskname = t_arg->argv[0];
+	if (t_arg->argc > 1)
+		rate = get_argv(t_arg->argv[1]);
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_scrub_start(rate)) {
+		fs_umount();
+		die("Cannot scrub diskname");
+	}
+
+	/* Let the scrubber complete one pass over the disk */
+	do {
+		usleep(10000);
+		fs_checksum_stats(&stats);
+	} while (stats.scrubPasses == 0);
+	fs_scrub_stop();
+
+	printf("Scrubbed: %llu blocks in %u passes\n",
+	       (unsigned long long)stats.scrubbedBlocks, stats.scrubPasses);
+	printf("Corrupted: %u blocks\n", stats.scrubErrors);
+	if (stats.scrubErrors)
+		printf("Last corrupted block: %u\n", stats.lastBadBlock);
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
+void thread_fs_trim(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname>");
+
+	diskname = t_arg->argv[0];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (trim_print() < 0) {
+		fs_umount();
+		die("Cannot trim diskname");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
 static struct {
 	const char *name;
 	void(*func)(void *);
@@ -517,6 +1143,9 @@ static struct {
 	{ "rm",		thread_fs_rm },
 	{ "cat",	thread_fs_cat },
 	{ "stat",	thread_fs_stat },
+	{ "defrag",	thread_fs_defrag },
+	{ "scrub",	thread_fs_scrub },
+	{ "trim",	thread_fs_trim },
 	{ "script",	thread_fs_script }
 };
 
@@ -0,0 +1,101 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "crc32c.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CRC32C_X86 1
+#include <immintrin.h>
+#endif
+
+/** Reflected Castagnoli polynomial */
+#define CRC32C_POLY 0x82F63B78
+
+/** Slicing-by-8 tables: table[k][b] is the CRC of byte b followed by k zeros */
+static uint32_t crcTable[8][256];
+static int hardware;
+static pthread_once_t crcOnce = PTHREAD_ONCE_INIT;
+
+static void crc32c_init(void)
+{
+	for (uint32_t b = 0; b < 256; b++) {
+		uint32_t crc = b;
+		for (int i = 0; i < 8; i++)
+			crc = (crc >> 1) ^ (CRC32C_POLY & -(crc & 1));
+		crcTable[0][b] = crc;
+	}
+	for (uint32_t b = 0; b < 256; b++)
+		for (int k = 1; k < 8; k++)
+			crcTable[k][b] = (crcTable[k - 1][b] >> 8) ^ crcTable[0][crcTable[k - 1][b] & 0xFF];
+#ifdef CRC32C_X86
+	__builtin_cpu_init();
+	hardware = __builtin_cpu_supports("sse4.2") != 0;
+#endif
+}
+
+static uint32_t crc32c_soft(uint32_t crc, const uint8_t *p, size_t len)
+{
+	while (len && ((uintptr_t)p & 7)) {
+		crc = (crc >> 8) ^ crcTable[0][(crc ^ *p++) & 0xFF];
+		len--;
+	}
+	for (; len >= 8; len -= 8, p += 8) {
+		uint32_t lo, hi;
+
+		memcpy(&lo, p, 4);
+		memcpy(&hi, p + 4, 4);
+		lo ^= crc;
+		crc = crcTable[7][lo & 0xFF] ^ crcTable[6][(lo >> 8) & 0xFF] ^
+		      crcTable[5][(lo >> 16) & 0xFF] ^ crcTable[4][lo >> 24] ^
+		      crcTable[3][hi & 0xFF] ^ crcTable[2][(hi >> 8) & 0xFF] ^
+		      crcTable[1][(hi >> 16) & 0xFF] ^ crcTable[0][hi >> 24];
+	}
+	while (len--)
+		crc = (crc >> 8) ^ crcTable[0][(crc ^ *p++) & 0xFF];
+	return crc;
+}
+
+#ifdef CRC32C_X86
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hard(uint32_t crc, const uint8_t *p, size_t len)
+{
+#ifdef __x86_64__
+	uint64_t crc64 = crc;
+
+	for (; len >= 8; len -= 8, p += 8) {
+		uint64_t v;
+
+		memcpy(&v, p, 8);
+		crc64 = _mm_crc32_u64(crc64, v);
+	}
+	crc = (uint32_t)crc64;
+#endif
+	for (; len >= 4; len -= 4, p += 4) {
+		uint32_t v;
+
+		memcpy(&v, p, 4);
+		crc = _mm_crc32_u32(crc, v);
+	}
+	while (len--)
+		crc = _mm_crc32_u8(crc, *p++);
+	return crc;
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+	pthread_once(&crcOnce, crc32c_init);
+	crc = ~crc;
+#ifdef CRC32C_X86
+	if (hardware)
+		return ~crc32c_hard(crc, buf, len);
+#endif
+	return ~crc32c_soft(crc, buf, len);
+}
+
+int crc32c_hardware(void)
+{
+	pthread_once(&crcOnce, crc32c_init);
+	return hardware;
+}
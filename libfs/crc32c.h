@@ -0,0 +1,27 @@
+#ifndef _CRC32C_H
+#define _CRC32C_H
+
+#include <stddef.h> /* for size_t definition */
+#include <stdint.h>
+
+/**
+ * crc32c - Compute a CRC32C (Castagnoli) checksum
+ * @crc: Checksum of the preceding data, 0 to start
+ * @buf: Data
+ * @len: Length of @buf in bytes
+ *
+ * Uses the CRC32 instruction of SSE4.2 when CPUID reports it, a table-driven
+ * version otherwise; both give the same result.
+ *
+ * Return: the checksum of the data so far.
+ */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+/**
+ * crc32c_hardware - Tell whether crc32c() uses CRC instructions
+ *
+ * Return: 1 if it does, 0 otherwise.
+ */
+int crc32c_hardware(void);
+
+#endif /* _CRC32C_H */
@@ -1,6 +1,10 @@
+#define _GNU_SOURCE	/* for memfd_create() and fallocate() */
+#include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -19,11 +23,184 @@ struct disk {
 	int fd;
 	/* Block count */
 	size_t bcount;
+	/* RAM disk: content of the disk, or NULL */
+	char *mem;
+	/* RAM disk: image file to save the content to when closing, or NULL */
+	char *save;
+	/* RAM disk saved when closing: for each block, RAM_DISK_WRITTEN or
+	 * RAM_DISK_DISCARDED if changed since opened */
+	char *dirty;
+	/* 1 once the disk file turned out not to support holes */
+	int noDiscard;
 };
 
+#define RAM_DISK_WRITTEN 1
+#define RAM_DISK_DISCARDED 2
+
 /* Currently open virtual disk (invalid by default) */
 static struct disk disk = { .fd = INVALID_FD };
 
+/*
+ * A RAM disk lives in a memory file, so that block_disk_map() maps it like a
+ * disk file, and is also mapped for good so that blocks are read and written
+ * with plain copies. Holes of a sparse image and blocks of zeros are not
+ * copied, so they cost no memory. Saving only writes back the blocks written
+ * meanwhile.
+ */
+
+/* Blocks read at a time when loading a RAM disk */
+#define RAM_DISK_LOAD_BLOCKS 64
+
+/* Copy the blocks of @buf that are not all zeros to @dst */
+static void ram_disk_load(char *dst, const char *buf, size_t len)
+{
+	for (size_t off = 0; off < len; off += BLOCK_SIZE) {
+		size_t n = len - off < BLOCK_SIZE ? len - off : BLOCK_SIZE;
+		if (buf[off] == 0 && memcmp(buf + off, buf + off + 1, n - 1) == 0)
+			continue;
+		memcpy(dst + off, buf + off, n);
+	}
+}
+static int ram_disk_open(const char *image, int save)
+{
+	static char buf[RAM_DISK_LOAD_BLOCKS * BLOCK_SIZE];
+	int fd, memfd;
+	struct stat st;
+	char *mem;
+
+	if ((fd = open(image, O_RDONLY)) < 0) {
+		perror("open");
+		return -1;
+	}
+
+	if (fstat(fd, &st)) {
+		perror("fstat");
+		close(fd);
+		return -1;
+	}
+
+	if (st.st_size == 0 || st.st_size % BLOCK_SIZE != 0) {
+		block_error("size '%zu' is not multiple of '%d'",
+			    st.st_size, BLOCK_SIZE);
+		close(fd);
+		return -1;
+	}
+
+	if ((memfd = memfd_create("ram-disk", 0)) < 0) {
+		perror("memfd_create");
+		close(fd);
+		return -1;
+	}
+
+	if (ftruncate(memfd, st.st_size)) {
+		perror("ftruncate");
+		goto error;
+	}
+
+	mem = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		   memfd, 0);
+	if (mem == MAP_FAILED) {
+		perror("mmap");
+		goto error;
+	}
+
+	/* Load the image, extent by extent */
+	for (off_t start = 0; start < st.st_size; ) {
+		off_t data = lseek(fd, start, SEEK_DATA);
+		if (data < 0)
+			break;	/* only holes left */
+		off_t end = lseek(fd, data, SEEK_HOLE);
+		if (end < 0)
+			end = st.st_size;
+		while (data < end) {
+			size_t len = end - data < (off_t)sizeof(buf) ?
+				     (size_t)(end - data) : sizeof(buf);
+			ssize_t n = pread(fd, buf, len, data);
+			if (n <= 0) {
+				perror("pread");
+				goto error_unmap;
+			}
+			ram_disk_load(mem + data, buf, n);
+			data += n;
+		}
+		start = end;
+	}
+
+	disk.dirty = NULL;
+	disk.save = NULL;
+	if (save) {
+		disk.dirty = calloc(st.st_size / BLOCK_SIZE, 1);
+		disk.save = strdup(image);
+		if (!disk.dirty || !disk.save) {
+			perror("malloc");
+			free(disk.dirty);
+			free(disk.save);
+			goto error_unmap;
+		}
+	}
+	close(fd);
+
+	disk.fd = memfd;
+	disk.bcount = st.st_size / BLOCK_SIZE;
+	disk.mem = mem;
+	disk.noDiscard = 0;
+
+	return 0;
+
+error_unmap:
+	munmap(mem, st.st_size);
+error:
+	close(memfd);
+	close(fd);
+	return -1;
+}
+
+/* Write the content of the RAM disk back to its image file */
+static int ram_disk_save(void)
+{
+	int fd;
+
+	if ((fd = open(disk.save, O_WRONLY)) < 0) {
+		perror("open");
+		return -1;
+	}
+
+	for (size_t block = 0; block < disk.bcount; block++) {
+		char state = disk.dirty[block];
+		if (!state)
+			continue;
+
+		/* Write or punch runs of consecutive blocks at once */
+		size_t start = block * BLOCK_SIZE;
+		while (block + 1 < disk.bcount && disk.dirty[block + 1] == state)
+			block++;
+		size_t end = (block + 1) * BLOCK_SIZE;
+
+		/* discarded blocks read as zeros, which are written if need be */
+		if (state == RAM_DISK_DISCARDED &&
+		    fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			      start, end - start) == 0)
+			continue;
+
+		while (start < end) {
+			ssize_t n = pwrite(fd, disk.mem + start, end - start, start);
+			if (n <= 0) {
+				perror("pwrite");
+				close(fd);
+				return -1;
+			}
+			start += n;
+		}
+	}
+
+	if (close(fd)) {
+		perror("close");
+		return -1;
+	}
+
+	return 0;
+}
+
 int block_disk_open(const char *diskname)
 {
 	int fd;
@@ -39,6 +216,11 @@ int block_disk_open(const char *diskname)
 		return -1;
 	}
 
+	if (strncmp(diskname, RAM_DISK_PREFIX, strlen(RAM_DISK_PREFIX)) == 0)
+		return ram_disk_open(diskname + strlen(RAM_DISK_PREFIX), 0);
+	if (strncmp(diskname, RAM_DISK_SAVE_PREFIX, strlen(RAM_DISK_SAVE_PREFIX)) == 0)
+		return ram_disk_open(diskname + strlen(RAM_DISK_SAVE_PREFIX), 1);
+
 	if ((fd = open(diskname, O_RDWR, 0644)) < 0) {
 		perror("open");
 		return -1;
@@ -58,22 +240,36 @@ int block_disk_open(const char *diskname)
 
 	disk.fd = fd;
 	disk.bcount = st.st_size / BLOCK_SIZE;
+	disk.noDiscard = 0;
 
 	return 0;
 }
 
 int block_disk_close(void)
 {
+	int ret = 0;
+
 	if (disk.fd == INVALID_FD) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
+	if (disk.mem) {
+		if (disk.save && ram_disk_save())
+			ret = -1;
+		munmap(disk.mem, disk.bcount * BLOCK_SIZE);
+		free(disk.save);
+		free(disk.dirty);
+		disk.mem = NULL;
+		disk.save = NULL;
+		disk.dirty = NULL;
+	}
+
 	close(disk.fd);
 
 	disk.fd = INVALID_FD;
 
-	return 0;
+	return ret;
 }
 
 int block_disk_count(void)
@@ -99,15 +295,19 @@ int block_write(size_t block, const void *buf)
 		return -1;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
-		return -1;
+	if (disk.mem) {
+		memcpy(disk.mem + block * BLOCK_SIZE, buf, BLOCK_SIZE);
+		if (disk.dirty)
+			disk.dirty[block] = RAM_DISK_WRITTEN;
+		return 0;
 	}
 
-	/* Perform the actual write into the disk image */
-	if (write(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("write");
+	/*
+	 * Perform the actual write into the disk image, at the offset of
+	 * the block so that several threads can access the disk at once
+	 */
+	if (pwrite(disk.fd, buf, BLOCK_SIZE, block * BLOCK_SIZE) < 0) {
+		perror("pwrite");
 		return -1;
 	}
 
@@ -127,18 +327,90 @@ int block_read(size_t block, void *buf)
 		return -1;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
+	if (disk.mem) {
+		memcpy(buf, disk.mem + block * BLOCK_SIZE, BLOCK_SIZE);
+		return 0;
+	}
+
+	/*
+	 * Perform the actual read from the disk image, at the offset of
+	 * the block so that several threads can access the disk at once
+	 */
+	if (pread(disk.fd, buf, BLOCK_SIZE, block * BLOCK_SIZE) < 0) {
+		perror("pread");
+		return -1;
+	}
+
+	return 0;
+}
+
+int block_discard(size_t block, size_t count)
+{
+	if (disk.fd == INVALID_FD) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	if (count == 0 || block + count > disk.bcount) {
+		block_error("blocks out of bounds (%zu+%zu/%zu)",
+			    block, count, disk.bcount);
 		return -1;
 	}
 
-	/* Perform the actual read from the disk image */
-	if (read(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("read");
+	if (disk.noDiscard)
+		return -1;
+
+	/* The memory file of a RAM disk supports holes as well */
+	if (fallocate(disk.fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		      block * BLOCK_SIZE, count * BLOCK_SIZE)) {
+		if (errno == EOPNOTSUPP || errno == ENOSYS)
+			disk.noDiscard = 1;
+		else
+			perror("fallocate");
 		return -1;
 	}
 
+	if (disk.dirty)
+		memset(disk.dirty + block, RAM_DISK_DISCARDED, count);
+
 	return 0;
 }
 
+void *block_disk_map(size_t block, size_t count)
+{
+	void *addr;
+
+	if (disk.fd == INVALID_FD) {
+		block_error("no disk currently open");
+		return NULL;
+	}
+
+	if (count == 0 || block + count > disk.bcount) {
+		block_error("blocks out of bounds (%zu+%zu/%zu)",
+			    block, count, disk.bcount);
+		return NULL;
+	}
+
+	/* The kernel only maps the file from page boundaries */
+	if (block * BLOCK_SIZE % sysconf(_SC_PAGESIZE) != 0)
+		return NULL;
+
+	addr = mmap(NULL, count * BLOCK_SIZE, PROT_READ, MAP_SHARED, disk.fd,
+		    block * BLOCK_SIZE);
+	if (addr == MAP_FAILED) {
+		perror("mmap");
+		return NULL;
+	}
+
+	return addr;
+}
+
+int block_disk_unmap(void *addr, size_t count)
+{
+	if (munmap(addr, count * BLOCK_SIZE)) {
+		perror("munmap");
+		return -1;
+	}
+
+	return 0;
+}
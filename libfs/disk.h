@@ -6,6 +6,11 @@
 /** Size of a disk block in bytes */
 #define BLOCK_SIZE 4096
 
+/** Prefix of the name of a RAM disk, see block_disk_open() */
+#define RAM_DISK_PREFIX "ram:"
+/** Prefix of the name of a RAM disk saved when closed */
+#define RAM_DISK_SAVE_PREFIX "ram+save:"
+
 /**
  * block_disk_open - Open virtual disk file
  * @diskname: Name of the virtual disk file
@@ -14,15 +19,21 @@
  * blocks can be read from it with block_read() or written to it with
  * block_write().
  *
+ * A name of the form "ram:<image>" opens a RAM disk instead: the content of
+ * disk image <image> is loaded into memory, blocks are read and written there,
+ * and changes are lost when the disk is closed. With "ram+save:<image>",
+ * block_disk_close() writes the content back to <image>.
+ *
  * Return: -1 if @diskname is invalid, if the virtual disk file cannot be opened
- * or is already open. 0 otherwise.
+ * or is already open, or if a RAM disk cannot be allocated. 0 otherwise.
  */
 int block_disk_open(const char *diskname);
 
 /**
  * block_disk_close - Close virtual disk file
  *
- * Return: -1 if there was no virtual disk file opened. 0 otherwise.
+ * Return: -1 if there was no virtual disk file opened, or if a RAM disk could
+ * not be saved (it is closed nonetheless). 0 otherwise.
  */
 int block_disk_close(void);
 
@@ -53,12 +64,51 @@ int block_write(size_t block, const void *buf);
  * @buf: Data buffer to be filled with content of block
  *
  * Read the content of virtual disk's block @block (%BLOCK_SIZE bytes) into
- * buffer @buf.
+ * buffer @buf. Several threads may read and write blocks at the same time.
  *
  * Return: -1 if @block is out of bounds or inaccessible, or if the reading
  * operation fails. 0 otherwise.
  */
 int block_read(size_t block, void *buf);
 
+/**
+ * block_discard - Release blocks of the disk to the host
+ * @block: Index of the first block to release
+ * @count: Number of blocks to release
+ *
+ * Punch a hole of @count blocks in the virtual disk file starting at block
+ * @block, so that they no longer take space on the host. They read as zeros
+ * afterwards. A RAM disk releases the memory of the blocks, and punches the
+ * hole in its image when saved.
+ *
+ * Return: -1 if @block and @count are out of bounds, or if the disk file
+ * does not support holes (it then keeps the blocks as they are). 0 otherwise.
+ */
+int block_discard(size_t block, size_t count);
+
+/**
+ * block_disk_map - Map blocks of the disk into memory
+ * @block: Index of the first block to map
+ * @count: Number of blocks to map
+ *
+ * Map @count blocks of the virtual disk starting at block @block, read-only.
+ * The mapping shares the pages of the virtual disk file, so it sees later
+ * writes to these blocks.
+ *
+ * Return: NULL if no disk is open, if the blocks are out of bounds, if block
+ * @block does not start a memory page, or if the mapping fails. Otherwise
+ * the address of the mapping.
+ */
+void *block_disk_map(size_t block, size_t count);
+
+/**
+ * block_disk_unmap - Unmap blocks mapped with block_disk_map()
+ * @addr: Address of the mapping
+ * @count: Number of blocks mapped
+ *
+ * Return: -1 if the mapping cannot be removed. 0 otherwise.
+ */
+int block_disk_unmap(void *addr, size_t count);
+
 #endif /* _DISK_H */
 
@@ -1,705 +1,7643 @@
- 
-#include <assert.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <stdint.h>
-#include <string.h>
-
-#include "disk.h"
-#include "fs.h"
-
-
-
-
-#define FS_MAX_BLOCK 8192 
-#define FS_FILE_MAX_SIZE 32768
-#define FS_MAX_FAT 4 
-#define FAT_EOC 0xFFFF
-/**
- ========   TODO: Phase 0 , preparation ===============
-  It is important to observe that the file system must provide persistent storage. Let’s assume that you have created a file system on a virtual disk and mounted it. 
- 
-$ ./fs_make.x disk.fs 8192
-Creating virtual disk 'disk.fs' with '8192' data blocks
-$ ./fs_ref.x info disk.fs > ref_output
-$ ./test_fs.x info disk.fs > my_output
-$ diff ref_output my_output
-
-*/
-
-
-/** ========   TODO: Phase 1  ===============*/
-
-/**
-For this phase, you should probably start by defining the data structures corresponding to the blocks containing the meta-information about the file system 
-
-	superblock : block 0
-	Offset	Length (bytes)	Description
-	0x00	8	Signature (must be equal to “ECS150FS”)
-	0x08	2	Total amount of blocks of virtual disk
-	0x0A	2	Root directory block index
-	0x0C	2	Data block start index
-	0x0E	2	Amount of data blocks
-	0x10	1	Number of blocks for FAT
-	0x11	<=8192	Unused/Padding
-	
-	FAT : block 1~4 
-
-	root directory, block 5
-	The root directory is an array of 128 entries stored in the block following the FAT. Each entry is 32-byte wide and describes a file, according to the following format:
-        Offset	Length (bytes)	Description
-        0x00	16	Filename (including NULL character)
-        0x10	4	Size of the file (in bytes)
-        0x14	2	Index of the first data block
-        0x16	10	Unused/Padding
-    An empty entry is defined by the first character of the entry’s filename being equal to the NULL character.
-*/
-
-
- 
-struct _superblock {
-	char signature[8];				//"ECS150FS";
-	int16_t amountVD;				//FS_MAX_BLOCK+ 1+FS_MAX_FAT+1;
-	int16_t indexRootDirectory; 		//FS_MAX_FAT +1;
-	int16_t indexDataBlock; 			//FS_MAX_FAT+1+1;
-	int16_t amountDataBlock; 			//FS_MAX_BLOCK;
-	int8_t amountFAT;					//4;
- 	//int8_t padding[BLOCK_SIZE-17];
-};
-struct _superblock superblock;
-struct _directory {
-	char filename[FS_FILENAME_LEN];
-	uint32_t fileSize;
-	int16_t indexFirstDataBlock;
-	int8_t padding [10];
-};
-
-struct _directory directory [FS_FILE_MAX_COUNT];
-uint16_t FAT[FS_MAX_BLOCK];
-
-struct fd {
-		uint32_t fileSize;  //打开标志,初始值0，打开以后为了表示打开标志变为: 100+fd
-		uint16_t indexFirstDataBlock;
-		int32_t offset;
-	};
-
-struct fd FD[FS_OPEN_MAX_COUNT];
-
-int8_t mount=-1;
-
-/**
- * fs_mount - Mount a file system
- * @diskname: Name of the virtual disk file
- *
- * Open the virtual disk file @diskname and mount the file system that it
- * contains. A file system needs to be mounted before files can be read from it
- * with fs_read() or written to it with fs_write().
- *
- * Return: -1 if virtual disk file @diskname cannot be opened, or if no valid
- * file system can be located. 0 otherwise.
- */
-
-int fs_mount(const char *diskname)
-{
-
-	//  1 :  Open the virtual disk
-	//printf("mount start\n");
-	/*Return: -1 if no FS is currently mounted, or if the virtual disk cannot be closed, or if there are still open file descriptors.*/
-	if (block_disk_open(diskname)!=0){   
-			printf("Wrong disk name\n");
-			fprintf(stderr, "fs_mount:virtual disk file %s cannot be opened \n", diskname);
-			return -1;
-		}
-
-	//  2-1: Read  superblock
-
-	if (block_read(0, &superblock)!=0){   
-			fprintf(stderr, "fs_mount:read superBlock error\n");
-			return -1;
-		}
-
-	//  error checking signature 
-	if (strncmp(superblock.signature,"ECS150FS", 8)){
-			fprintf(stderr, "fs_mount:signature error: \n" );
-			return -1;
-		}
-
-	// error checking total amount of block = block_disk_count() returns.
-	if (superblock.amountVD <= 3 ){
-			fprintf(stderr, "fs_mount: amountVD %d too small \n", superblock.amountVD);
-			return -1;
-		}
-
-	if (superblock.amountVD != block_disk_count()){
-			perror("fs_mount:amountVD != block_disk_count \n");
-			return -1;
-		}
-
-
-	//  2-2: Read  FAT
-
-	for (int i=0; i< superblock.amountFAT;i++){
-		if (block_read(i+1, &FAT[i*BLOCK_SIZE])){   // virtual disk file @diskname cannot be opened or if no valid * file system can be located. 
-			perror("fs_mount:read error\n");
-			return -1;
-			}	
-	}
-	
-	//  2-3: Read  root directory
-	if (block_read(superblock.amountFAT+1, (void *)directory)){   // virtual disk file @diskname cannot be opened or if no valid * file system can be located. 
-		perror("fs_mount:read error\n");
-		return -1;
-	}	
-	
-
-	mount=0;
-	//printf("Successfully mounted\n");
-	return 0;
-}
-
-
-/**
- * fs_umount - Unmount file system
- *
- * Unmount the currently mounted file system and close the underlying virtual
- * disk file.
- *
- * Return: -1 if no FS is currently mounted, or if the virtual disk cannot be
- * closed, or if there are still open file descriptors. 0 otherwise.
- */
-
-int fs_umount(void)
-{
-	/**
-	1-2  fs_umount() makes sure that the virtual disk is properly closed and that all the internal data structures of the FS layer are properly cleaned.
-	*/
-	if(mount==-1){
-		perror("No disk is mounted\n");
-		return -1;
-	}
-	/* if there are still open file descriptors.*/
-	for (int i=0; i<FS_OPEN_MAX_COUNT;i++){
-		if (FD[i].indexFirstDataBlock!=0){  
-			fprintf(stderr, "fs_stat: file Descriptor %d still not closed. \n",i);
-			return -1;
-		}
-	}
-	/**free_blk
-	At this point, all data must be written onto the virtual disk. Another application that mounts the file system at a later point in time must see the previously created files and the data that was written. This means that whenever fs_umount() is called, all meta-information and file data must have been written out to disk.
-	*/		
-
-	/** CAN NOT Clean FAT/directory when unmount, format seems need erase FAT and Directory */
-	/**
-	for (int i=0; i< amountFAT;i++)
-			FAT[i*BLOCK_SIZE]=0;
-
-	for (int i=0; i< amountFAT;i++){
-		if (block_write(i+1, &FAT[i*BLOCK_SIZE])){   
-			perror("fs_mount:write error\n");
-			return -1;
-			}	
-	FAT[0]= FAT_EOC;
-	if (block_write(1, &FAT[0])){   
-			perror("fs_mount:write error\n");
-			return -1;
-			}
-
-	for (int i=0; i< FS_OPEN_MAX_COUNT;i++){
-			for (int j=0; j <FS_FILENAME_LEN; j++) directory[i].filename[j]= 0;
-			directory[i].sizeOfFile=0;
-			directory[i].indexFirstDataBlock=0;
-		}
-	if (block_write(amountFAT+1, &directory[0])){   
-			perror("fs_mount:write error\n");
-			return -1;
-			}
-	*/
-	
-	if (block_disk_close()==-1 ){  
-			perror("fs_umount: Close disk error\n");
-			return -1;
-		}
-	return 0;
-}
-
-/*
-1,8d0
-< FS Info:
-< total_blk_count=8198
-< fat_blk_count=4
-< rdir_blk=5
-< data_blk=6
-< data_blk_count=8192
-< fat_free_ratio=8191/8192
-< rdir_free_ratio=128/128
-*/
-
-/**
- * fs_ls - List files on file system
- *
- * List information about the files located in the root directory.
- *
- * Return: -1 if no FS is currently mounted. 0 otherwise.
- */
-
-int fs_info(void)
-{
-	
-	if(mount==-1){
-		perror("No filesystem is mounted\n");
-		return -1;
-	}
-	
-	//printf("1,8d0\n");
-	printf("FS Info:\n");
-	printf("total_blk_count=%d\n", superblock.amountVD);
-	printf("fat_blk_count=%d\n", superblock.amountFAT);
-	printf("rdir_blk=%d\n", superblock.indexRootDirectory);
-	printf("data_blk=%d\n", superblock.indexDataBlock);
-	printf("data_blk_count=%d\n", superblock.amountDataBlock);
-	uint16_t j=0;
-
-	for(int i=0;i<superblock.amountDataBlock;i++){
-		if(FAT[i]==0)j++;
-	}
-	//printf("fs_info: %d\n", FAT[0]);
-	printf("fat_free_ratio=%d/%d\n", j, superblock.amountDataBlock);
-	int free_dir=0;
-	for(int i=0;i<FS_FILE_MAX_COUNT; i++){
-		if(directory[i].indexFirstDataBlock==0)free_dir++;
-	}
-	printf("rdir_free_ratio=%d/%d\n", free_dir, FS_FILE_MAX_COUNT);
-	
-	return 0;
-}
-
-
-
-/* ========   TODO: Phase 2  ===============*/
-
-
-/**
- * fs_create - Create a new file
- * @filename: File name
- *
- * Create a new and empty file named @filename in the root directory of the
- * mounted file system. String @filename must be NULL-terminated and its total
- * length cannot exceed %FS_FILENAME_LEN characters (including the NULL
- * character).
- *
- * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if a
- * file named @filename already exists, or if string @filename is too long, or
- * if the root directory already contains %FS_FILE_MAX_COUNT files. 0 otherwise.
- */
-
-int fs_create(const char *filename)
-{
-	/** if @filename is invalid */ 
-	if (!filename) {
-		fprintf(stderr, "invalid file diskname: %s", filename);
-		return -1;
-	}
-
-	if (strlen(filename) >= FS_FILENAME_LEN ){  
-			perror("fs_create: file name too long! (1~16 character)\n");
-			return -1;
-			}
-
-	/**   file already exist! */
-	for (int i=0; i <FS_FILE_MAX_COUNT; i++)
-	{
-		if (strcmp(filename,directory[i].filename)==0 ){  
-			perror("fs_create: file already exist!\n");
-			return -1;
-		}
-	}
-
-	/**  Find an find an empty entry  */
-	for (uint32_t i=0; i <FS_FILE_MAX_COUNT; i++)
-	{
-		if (directory[i].filename[0]=='\0')
-		{  
-			strcpy(directory[i].filename,filename);
-			directory[i].fileSize =0;
-			directory[i].indexFirstDataBlock= FAT_EOC;
-			return 0;
-		}		
-	}
-	perror("fs_create: directory full! (max 128 file)\n");
-	return -1;
-		
-}
-
-/**
- * fs_delete - Delete a file
- * @filename: File name
- *
- * Delete the file named @filename from the root directory of the mounted file
- * system.
- *
- * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if
- * Return: -1 if @filename is invalid, if there is no file named @filename to
- * delete, or if file @filename is currently open. 0 otherwise.
- */
-
-int fs_delete(const char *filename)
-{
-	/*no FS mounted*/
-	if(mount==-1)return -1;
-
-	/** if @filename is invalid */ 
-	if (!filename) {
-		fprintf(stderr, "invalid file diskname: %s", filename);
-		return -1;
-	}
-
-	if (strlen(filename) >= FS_FILENAME_LEN || strlen(filename)==0 ){  
-		perror("fs_create: file name too long! (1~16 character)\n");
-		return -1;
-	}
-
-	for (uint32_t i=0; i <FS_FILE_MAX_COUNT; i++){
-		if (strcmp(filename,directory[i].filename)==0 )  {
-			/** and all the data blocks containing the file’s contents must be freed in the FAT.*/
-			int indexCurrentBlock=directory[i].indexFirstDataBlock; 		
-			for(;indexCurrentBlock < FS_MAX_BLOCK; ){
-				if (FAT[directory[i].indexFirstDataBlock]== FAT_EOC){
-					FAT[directory[i].indexFirstDataBlock]=0;
-					break;
-				}
-				else {
-					int indexOldBlock= indexCurrentBlock;
-					indexCurrentBlock= FAT[indexCurrentBlock];
-					FAT[indexOldBlock]=0;
-				}
-			}
-			/** the file’s entry must be emptied */			
-			for (int j=0; j <FS_FILENAME_LEN; j++) {
-				directory[i].filename[j]= '\0';
-			}
-			directory[i].fileSize = 0;
-			directory[i].indexFirstDataBlock= 0;	
-			return 0;	
-		}
-	}
-	perror("fs_create: no such file! \n");
-	return -1;
-}
-
-
-/**
- * fs_ls - List files on file system
- *
- * List information about the files located in the root directory.
- *
- * Return: -1 if no FS is currently mounted. 0 otherwise.
- */
-
-int fs_ls(void)
-{
-	if(mount==-1) return -1;
-	printf ("file name       size ");
-	for (int i=0; i <FS_FILE_MAX_COUNT; i++)
-	{
-		if (directory[i].filename[0]!='\0'){  
-			printf ( "%s \t %d Bytes\n",directory[i].filename,directory[i].fileSize);
-			
-		}
-	}
-	return 0;
-}
-
-/**========================== phase  3=============================================*/
-/**
- * fs_open - Open a file
- * @filename: File name
- *
- * Open file named @filename for reading and writing, and return the
- * corresponding file descriptor. The file descriptor is a non-negative integer
- * that is used subsequently to access the contents of the file. The file offset
- * of the file descriptor is set to 0 initially (beginning of the file). If the
- * same file is opened multiple files, fs_open() must return distinct file
- * descriptors. A maximum of %FS_OPEN_MAX_COUNT files can be open
- * simultaneously.
- *
- * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if
- * there is no file named @filename to open, or if there are already
- * %FS_OPEN_MAX_COUNT files currently open. Otherwise, return the file
- * descriptor.
- */
-int fs_open(const char *filename)
-{
-	int positionDir=0; 	
-	int positionFD=0; 	
-
-	/** Return: -1 if no FS is currently mounted,  */
-	if(mount==-1)return -1;
-	/** if @filename is invalid */ 
-	if (!filename) {
-		perror("invalid file diskname");
-		return -1;
-	}
-	
-	/** if string @filename is too long, */
-	if (strlen(filename) >= FS_FILENAME_LEN ){  
-		perror("fs_open: file name too long! (1~16 character)\n");
-		return -1;
-	}	
-
-	/*  search directory */
-	for (; positionDir <FS_FILE_MAX_COUNT; positionDir++){
-		if (strcmp(filename,directory[positionDir].filename)==0){
-			break;
-		}
-	}
-	/**if there is no file named @filename to open*/
-	if (positionDir>= FS_FILE_MAX_COUNT){  
-		fprintf(stderr, "fs_open: there is no file named %s to open\n",filename);
-		return -1;
-	}		
-			
-	/** find a empty item from FD array */
-	for (; positionFD <FS_OPEN_MAX_COUNT; positionFD++) {  
-		if (FD[positionFD].indexFirstDataBlock== 0){
-			FD[positionFD].fileSize =directory[positionDir].fileSize;
-			FD[positionFD].indexFirstDataBlock= directory[positionDir].indexFirstDataBlock;
-			FD[positionFD].offset= 0;
-			return positionFD;
-		}	
-	}
-	if (positionFD>= FS_OPEN_MAX_COUNT){  
-		fprintf(stderr, "fs_open: root directory already contains %d files. \n",FS_FILE_MAX_COUNT);
-		return -1;
-	}
-	return 0;
-}
-
-
-int fs_close(int fd)
-{
-	/**  Return: -1 if no FS is currently mounted */
-	if(mount==-1)return -1;
-	/** if file descriptor @fd is invalid (out of bounds or not currently open) */ 
-	if (fd >= FS_OPEN_MAX_COUNT || fd <0){  
-		fprintf(stderr, "fs_close: file Descriptor should between 0~31\n");
-		return -1;
-	}
-	if (FD[fd].indexFirstDataBlock == 0 ){  
-		fprintf(stderr, "fs_stat: fd NOT opened\n" );
-		return -1;
-	}
-	/** * Close file descriptor @fd. */		
-	FD[fd].fileSize=0;
-	FD[fd].indexFirstDataBlock= 0;
-	FD[fd].offset= 0;
-
-	return 0;
-}
-
-/**
- * fs_stat - Get file status
- * @fd: File descriptor
- *
- * Get the current size of the file pointed by file descriptor @fd.
- *
- * Return: -1 if no FS is currently mounted, of if file descriptor @fd is
- * invalid (out of bounds or not currently open). Otherwise return the current
- * size of file.
- */
-
-int fs_stat(int fd)
-{
-	/**  Return: -1 if no FS is currently mounted */
-	
-	/** if file descriptor @fd is invalid (i.e., out of bounds, or not currently open)*/
-	if (fd >= FS_OPEN_MAX_COUNT || fd <=0){  
-		fprintf(stderr, "fs_stat: file descriptor %d is invalid:out of bounds \n",fd);
-		return -1;
-	}
-	if (FD[fd].indexFirstDataBlock == 0 ){  
-		fprintf(stderr, "fs_stat: %d is invalid ：not currently open)", fd );
-		return -1;
-	}
-
-	return FD[fd].fileSize;
-}
-
-/**
- * fs_lseek - Set file offset
- * @fd: File descriptor
- * @offset: File offset
- *
- * Set the file offset (used for read and write operations) associated with file
- * descriptor @fd to the argument @offset. To append to a file, one can call
- * fs_lseek(fd, fs_stat(fd));
- *
- * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
- * invalid (i.e., out of bounds, or not currently open), or if @offset is larger
- * than the current file size. 0 otherwise.
- */
-
-int fs_lseek(int fd, size_t offset)
-{
-	/** Return: -1 if no FS is currently mounted, */
-	if(mount==-1)return -1;
-	/** if file descriptor @fd is invalid (i.e., out of bounds, or not currently open)*/
-	if (fd >= FS_OPEN_MAX_COUNT || fd <=0){  
-		fprintf(stderr, "fs_lseek:file descriptor %d is invalid:out of bounds\n", fd);
-		return -1;
-		}
-
-	if (FD[fd].indexFirstDataBlock == 0 ){  
-		fprintf(stderr, "fs_stat: file descriptor %d is invalid:not currently open\n", fd );
-		return -1;
-		}
-			
-	/**if @offset is larger than the current file size*/
-	if (offset >  FD[fd].fileSize ){  
-		fprintf(stderr, "fs_lseek: offset is larger than the current file size:\n");
-		return -1;
-		}
-			
-	FD[fd].offset = offset; 
-
-	return 0;
-}
-
-/**========================== phase  4 =============================================-*/
-
-int fs_write(int fd, void *buf, size_t count)
-{
-	char buffer[BLOCK_SIZE*FS_MAX_BLOCK];
-	int indexCurrentBlock =FD[fd].indexFirstDataBlock;
-	//
-	if (fd >= FS_OPEN_MAX_COUNT || fd <=0){  
-		fprintf(stderr,"fs_read: file descriptor %d is invalid:out of bounds \n",fd);
-		return -1;
-		}
-	if (FD[fd].indexFirstDataBlock == 0 ){  
-		fprintf(stderr, "fs_read: %d is invalid ：not currently open)", fd );
-		return -1;
-		}
-	/** if @buf is NULL*/
-	if ( buf == NULL ){  
-		perror("fs_read: buf is NULL)" );
-		return -1;
-	}
-	//
-	/** 1 ==========  no need expand =====================*/
-	if (count/BLOCK_SIZE <= (FD[fd].fileSize - FD[fd].offset)/BLOCK_SIZE ){ 
-		/** read total file blocks into buffer  */ 
-		for (uint32_t i=0 ;i< (FD[fd].fileSize/BLOCK_SIZE+1); i++ )	{
-			if (block_read(indexCurrentBlock, &buffer[i*BLOCK_SIZE])){ 
-				perror("fs_mount:read error\n");
-				return -1;
-				}	
-			indexCurrentBlock =FAT[indexCurrentBlock];
-			buf += BLOCK_SIZE;
-			}
-			
-		/** replace suitable part */	
-		memcpy (buffer + FD[fd].offset,buf,count);
-		
-		/** write back */
-		indexCurrentBlock =FD[fd].indexFirstDataBlock;
-		for (uint32_t i=0 ;i< (FD[fd].fileSize/BLOCK_SIZE+1); i++ ){
-			if (block_write(indexCurrentBlock, &buffer[i*BLOCK_SIZE])){ 
-				perror("fs_mount:read error\n");
-				return -1;
-				}	
-			indexCurrentBlock =FAT[indexCurrentBlock];
-			buf += BLOCK_SIZE;
-			}
-		return count;
-	}
-
-/**  2 ==========  NEED Expand file =====================*/
-else {
-	/** expand file, assum disk has enough free blocks */
-	/** move to last file block */
-	for (uint32_t i=0 ;i< FD[fd].fileSize/BLOCK_SIZE; i++ )
-		indexCurrentBlock =FAT[indexCurrentBlock];
-
-	/** Find a empty Block and add in link : first-fit strategy */
-	for (uint32_t i=0 ;i< ((count+-FD[fd].offset)/BLOCK_SIZE-FD[fd].fileSize/BLOCK_SIZE); i++ ){
-		for (int j=0 ;j< FS_MAX_BLOCK; j++ ){
-			if (FAT[j]==0) {
-				FAT[indexCurrentBlock]= j;
-				indexCurrentBlock=j;
-			} 
-		}
-		FAT[indexCurrentBlock]= FAT_EOC;
-	}
-	
-	
-	//FD[fd].fileSize = FD[fd].fileSize - FD[fd].offset + count;
-	indexCurrentBlock =FD[fd].indexFirstDataBlock;
-	/* read total file blocks into buffer  */ 
-	for (uint32_t i=0 ;i< (FD[fd].fileSize/BLOCK_SIZE+1); i++ )	{
-		if (block_read(indexCurrentBlock, &buffer[i*BLOCK_SIZE])){ 
-			perror("fs_mount:read error\n");
-			return -1;
-			}	
-		indexCurrentBlock =FAT[indexCurrentBlock];
-		buf += BLOCK_SIZE;
-		}
-		
-	/** replace suitable part */	
-	memcpy (buffer + FD[fd].offset,buf,count);
-	
-	FD[fd].fileSize = FD[fd].offset + count; 
-	/** write back */
-	indexCurrentBlock =FD[fd].indexFirstDataBlock;
-	for (uint32_t i=0 ;i< (FD[fd].fileSize/BLOCK_SIZE+1); i++ )	{
-		if (block_write(indexCurrentBlock, &buffer[i*BLOCK_SIZE])){ 
-			perror("fs_mount:read error\n");
-			return -1;
-			}	
-		indexCurrentBlock =FAT[indexCurrentBlock];
-		buf += BLOCK_SIZE;
-		}
-	return count;
-	}
-}
-
-
-int fs_read(int fd, void *buf, size_t count)
-
-{
-char buffer[BLOCK_SIZE*FS_MAX_BLOCK];
-int indexCurrentBlock =FD[fd].indexFirstDataBlock;
-
-/** if file descriptor @fd is invalid (i.e., out of bounds, or not currently open)*/
-if (fd >= FS_OPEN_MAX_COUNT || fd <=0){  
-	fprintf(stderr,"fs_read: file descriptor %d is invalid:out of bounds \n",fd);
-	return -1;
-	}
-if (FD[fd].indexFirstDataBlock == 0 ){  
-	fprintf(stderr, "fs_read: %d is invalid ：not currently open)", fd );
-	return -1;
-	}
-/** if @buf is NULL*/
-if ( buf == NULL ){  
-	perror("fs_read: buf is NULL)" );
-	return -1;
-	}
-
-/*  read all file into buffer */
-for (uint32_t i=0 ;i< (FD[fd].fileSize/BLOCK_SIZE+1); i++ )	{
-	if (block_read(indexCurrentBlock, &buffer[i*BLOCK_SIZE])){ 
-		perror("fs_mount:read error\n");
-		return -1;
-		}	
-	indexCurrentBlock =FAT[indexCurrentBlock];
-	buf += BLOCK_SIZE;
-	}
-	
-if (count <= FD[fd].fileSize-FD[fd].offset){
-	memcpy (buf, buffer+FD[fd].offset,count);
-	return count;
-	}
-else {
-	memcpy (buf, buffer+FD[fd].offset,FD[fd].fileSize-FD[fd].offset);
-	return FD[fd].fileSize-FD[fd].offset;
-	}
-}
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "crc32c.h"
+#include "disk.h"
+#include "fs.h"
+#include "lz.h"
+#include "scan.h"
+
+
+
+
+#define FS_MAX_BLOCK 8192
+#define FS_FILE_MAX_SIZE 32768
+#define FS_MAX_FAT 4
+#define FAT_EOC 0xFFFF
+/** Features known to this implementation */
+#define FS_FEATURE_ALL (FS_FEATURE_INLINE | FS_FEATURE_DEDUP | FS_FEATURE_CHECKSUM | \
+			FS_FEATURE_LOG)
+/** Number of FAT entries held by one FAT block */
+#define FAT_PER_BLOCK (BLOCK_SIZE / sizeof(uint16_t))
+/** Free-space summary kept in the superblock padding ("FSUM") */
+#define FS_SUMMARY_MAGIC 0x4D555346
+#define FS_SUMMARY_VERSION 1
+/** Largest FAT a 16-bit block index can address */
+#define FS_SUMMARY_MAX_FAT 32
+/**
+ ========   TODO: Phase 0 , preparation ===============
+  It is important to observe that the file system must provide persistent storage. Let’s assume that you have created a file system on a virtual disk and mounted it.
+
+$ ./fs_make.x disk.fs 8192
+Creating virtual disk 'disk.fs' with '8192' data blocks
+$ ./fs_ref.x info disk.fs > ref_output
+$ ./test_fs.x info disk.fs > my_output
+$ diff ref_output my_output
+
+*/
+
+
+/** ========   TODO: Phase 1  ===============*/
+
+/**
+For this phase, you should probably start by defining the data structures corresponding to the blocks containing the meta-information about the file system
+
+	superblock : block 0
+	Offset	Length (bytes)	Description
+	0x00	8	Signature (must be equal to “ECS150FS”)
+	0x08	2	Total amount of blocks of virtual disk
+	0x0A	2	Root directory block index
+	0x0C	2	Data block start index
+	0x0E	2	Amount of data blocks
+	0x10	1	Number of blocks for FAT
+	0x11	<=8192	Unused/Padding
+
+	FAT : block 1~4
+
+	root directory, block 5
+	The root directory is an array of 128 entries stored in the block following the FAT. Each entry is 32-byte wide and describes a file, according to the following format:
+        Offset	Length (bytes)	Description
+        0x00	16	Filename (including NULL character)
+        0x10	4	Size of the file (in bytes)
+        0x14	2	Index of the first data block
+        0x16	10	Unused/Padding
+    An empty entry is defined by the first character of the entry’s filename being equal to the NULL character.
+*/
+
+
+
+/**
+	Free-space summary, stored at offset 0x20 of the superblock padding
+	Offset	Length (bytes)	Description
+	0x00	4	Magic (FS_SUMMARY_MAGIC)
+	0x04	2	Version
+	0x06	1	Clean flag: 1 if written by a sync, 0 while metadata is being modified
+	0x07	1	Reserved
+	0x08	2	Amount of free data blocks
+	0x0A	2	Amount of free root directory entries
+	0x0C	4	Checksum of the summary (computed with this field set to 0)
+	0x10	64	Free entries in each FAT block
+	0x50	128	Checksum of each FAT block, verified when the block is faulted in
+*/
+struct _summary {
+	uint32_t magic;
+	uint16_t version;
+	uint8_t clean;
+	uint8_t reserved;
+	uint16_t freeBlocks;
+	uint16_t freeEntries;
+	uint32_t checksum;
+	uint16_t freeFAT[FS_SUMMARY_MAX_FAT];
+	uint32_t checksumFAT[FS_SUMMARY_MAX_FAT];
+};
+
+struct _superblock {
+	char signature[8];				//"ECS150FS";
+	uint16_t amountVD;				//FS_MAX_BLOCK+ 1+FS_MAX_FAT+1;
+	uint16_t indexRootDirectory; 		//FS_MAX_FAT +1;
+	uint16_t indexDataBlock; 			//FS_MAX_FAT+1+1;
+	uint16_t amountDataBlock; 			//FS_MAX_BLOCK;
+	uint8_t amountFAT;					//4;
+	uint8_t reserved0;
+	uint16_t features;				// FS_FEATURE_* enabled with fs_features()
+	uint16_t indexBlockTable;		// first block of the block table, 0 if none
+	uint16_t indexChecksums;		// first block of the checksum region, 0 if none
+	uint16_t logHead;				// FS_FEATURE_LOG: next block of the log
+	uint8_t reserved[6];
+	struct _summary summary;
+	uint16_t snapshots[FS_SNAPSHOT_MAX];	// root directory copy of each snapshot, 0 if unused
+	uint8_t padding[BLOCK_SIZE-0x20-sizeof(struct _summary)-FS_SNAPSHOT_MAX*sizeof(uint16_t)];
+};
+_Static_assert(sizeof(struct _superblock) == BLOCK_SIZE, "superblock must fill one block");
+struct _superblock superblock;
+/** Bytes of inline data held by the entry itself */
+#define DIRENT_INLINE_HEAD 8
+
+struct _directory {
+	char filename[FS_FILENAME_LEN];
+	uint32_t fileSize;
+	uint16_t indexFirstDataBlock;
+	uint8_t flags;				// DIRENT_* (first byte of the padding)
+	uint8_t inlineData[DIRENT_INLINE_HEAD];	// DIRENT_INLINE: first bytes of the file
+	int8_t padding [1];
+};
+_Static_assert(sizeof(struct _directory) == 32, "directory entries are 32 bytes");
+_Static_assert(sizeof(struct _directory) == SCAN_DIRENT_SIZE &&
+	       FS_FILENAME_LEN == SCAN_NAME_LEN, "scan kernels match directory entries");
+
+/** Entry is a subdirectory: indexFirstDataBlock is its B+tree root node */
+#define DIRENT_DIR 0x01
+/**
+ * Entry is an inline file: its content is stored in the entry and in up to
+ * DIRENT_INLINE_SLOTS continuation slots right after it, and it owns no data
+ * block (indexFirstDataBlock is FAT_EOC). A continuation slot starts with
+ * DIRENT_CONT and carries DIRENT_INLINE_CONT bytes of data.
+ */
+#define DIRENT_INLINE 0x02
+#define DIRENT_CONT 0x01
+#define DIRENT_INLINE_CONT (sizeof(struct _directory) - 1)
+#define DIRENT_INLINE_SLOTS 2
+#define DIRENT_INLINE_MAX (DIRENT_INLINE_HEAD + DIRENT_INLINE_SLOTS * DIRENT_INLINE_CONT)
+/** Largest record: an entry followed by all its continuation slots */
+#define DIRENT_MAX_SLOTS (1 + DIRENT_INLINE_SLOTS)
+/**
+ * Entry is a compressed file: its FAT chain is made of chunk index blocks,
+ * see struct _chunkref.
+ */
+#define DIRENT_COMPRESSED 0x04
+/**
+ * Entry is a deduplicated file: like a compressed file, but its chunks are
+ * single uncompressed blocks. Chunks of both kinds may be shared, see
+ * struct _blockinfo.
+ */
+#define DIRENT_DEDUP 0x08
+#define DIRENT_INDEXED (DIRENT_COMPRESSED | DIRENT_DEDUP)
+/** Flags describing how the content of a file is stored */
+#define DIRENT_LAYOUT (DIRENT_INLINE | DIRENT_INDEXED)
+
+/**
+ * A compressed file is cut into chunks of CHUNK_SIZE bytes, each compressed
+ * on its own so that any part of the file can be read by decompressing a
+ * single chunk. Every chunk is stored in its own FAT chain, whose head and
+ * length are recorded in the index blocks: entry i of the n-th index block of
+ * the file describes chunk n * CHUNK_PER_INDEX + i. A chunk that does not
+ * shrink by at least one block is stored raw.
+ */
+#define CHUNK_BLOCKS 4
+#define CHUNK_SIZE (CHUNK_BLOCKS * BLOCK_SIZE)
+#define CHUNK_NONE UINT32_MAX
+
+struct _chunkref {
+	uint16_t indexFirstBlock;	// 0 if the chunk was never written (all zeros)
+	uint16_t length;		// compressed length, or CHUNK_RAW | stored length
+};
+#define CHUNK_RAW 0x8000
+#define CHUNK_PER_INDEX (BLOCK_SIZE / sizeof(struct _chunkref))
+
+struct _directory directory [FS_FILE_MAX_COUNT];
+
+/**
+ * The FAT is not read at mount time: each FAT block is faulted in the first
+ * time one of its entries is accessed, and only blocks that were modified are
+ * written back at unmount. Memory use is therefore proportional to the part of
+ * the FAT that a job actually touches.
+ */
+uint16_t **FAT;				// one cached FAT block per slot, NULL until loaded
+_Atomic uint32_t *dirtyFAT;		// if the cached FAT block must be written back, see dirty_mark()
+/**
+ * Bumped when a link of a chain is changed or freed, or a block becomes
+ * shared or private, which invalidates the block maps of open files
+ */
+uint32_t chainEpoch=1;
+
+/** Root directory is loaded on first use as well */
+int8_t loadedDirectory=0;
+_Atomic uint32_t dirtyDirectory=0;
+
+/**
+ * A cached metadata block that must be written back holds, in its dirty flag,
+ * the time it was first modified since it was last written (dirty_now()), so
+ * that the flusher thread can write back the blocks that stay dirty too long.
+ * Flags are only set after the block is modified and cleared before it is
+ * copied out, so a modification racing a write-back leaves the block dirty.
+ * The flusher and fs_sync_meta() hold flushLock, so that an older copy of a
+ * block is never written over a newer one.
+ */
+_Atomic uint32_t dirtyBlocks;		// dirty flags set
+pthread_mutex_t flushLock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Cached FAT, root directory and block table blocks are stored to with
+ * metaLock held, and the flusher copies them out with it held, so that it
+ * never reads a block while it is being modified. Loading and reading them
+ * need no lock: only the flusher runs beside the modifications.
+ */
+pthread_mutex_t metaLock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Data blocks freed in the FAT are released to the host with block_discard(),
+ * in runs, once fs_sync_meta() has written back the FAT that no longer
+ * references them: until then, the metadata on disk may still point to them.
+ */
+uint64_t *discardMap;			// one bit per data block freed since the last sync
+uint32_t discardPending;		// bits set in discardMap
+uint32_t discardedBlocks;		// blocks released since mount
+
+/** Free blocks kept by fs_batch_commit() to undo the operations it applied */
+uint32_t reservedBlocks;
+
+/** 1 while the counters in superblock.summary match the FAT and directory */
+int8_t validSummary=0;
+/** 1 once metadata was modified since mount */
+int8_t modifiedMeta=0;
+
+/**
+ * Block table, created when FS_FEATURE_DEDUP is first enabled or a file is
+ * first cloned with fs_clone(): one record per
+ * data block, stored in a chain of data blocks starting at
+ * superblock.indexBlockTable. Once it exists, a block may be referenced more
+ * than once and chain_free() only releases blocks whose last reference goes.
+ * It is loaded in full on first use.
+ */
+struct _blockinfo {
+	uint32_t fingerprint;	// fingerprint of the chunk starting here, 0 if none
+	uint16_t refs;			// references to the block besides the first one
+	uint16_t reserved;
+};
+#define BLOCKINFO_PER_BLOCK (BLOCK_SIZE / sizeof(struct _blockinfo))
+
+struct _blockinfo *blockTable;	// NULL until loaded
+uint16_t *tableBlocks;			// data blocks holding the table, in order
+_Atomic uint32_t *dirtyTable;	// if the table block must be written back
+
+/** Open-addressing map from fingerprints to the blocks carrying them */
+uint16_t *fingerprintMap;
+uint32_t fingerprintMapSize;
+uint32_t fingerprintMapUsed;
+
+struct fs_dedup_stats dedupStats;
+
+/**
+ * Checksum region, created when FS_FEATURE_CHECKSUM is enabled: the CRC32C of
+ * every data block as it was last written with data_write(), 0 if unknown,
+ * stored in a chain of data blocks starting at superblock.indexChecksums
+ * (whose own entries stay 0). It is loaded in full on first use, and rebuilt
+ * from the data when the file system was not cleanly unmounted.
+ */
+#define CHECKSUM_PER_BLOCK (BLOCK_SIZE / sizeof(uint32_t))
+
+uint32_t *checksums;			// NULL until loaded
+uint16_t *checksumBlocks;		// data blocks holding the region, in order
+_Atomic uint32_t *dirtyChecksums;	// if the region block must be written back
+/** Held while writing a block and its checksum, and by the scrubber */
+pthread_mutex_t checksumLock = PTHREAD_MUTEX_INITIALIZER;
+struct fs_checksum_stats checksumStats;
+
+/** 1 if the mounted file system was cleanly unmounted */
+int8_t cleanMount=0;
+
+/**
+ * In log-structured mode (FS_FEATURE_LOG), data blocks are allocated in
+ * order from superblock.logHead, one segment of LOG_SEGMENT_BLOCKS at a time,
+ * and overwritten blocks of regular files move to the head of the log rather
+ * than being rewritten in place. The FAT remains the map from file blocks to
+ * their place in the log. Replaced blocks stay allocated as dead blocks until
+ * the next checkpoint (fs_sync_meta()), so that the metadata on disk never
+ * points to a block that was reused since it was written.
+ */
+#define LOG_SEGMENT_BLOCKS 64
+/** Dead blocks that trigger a checkpoint */
+#define LOG_CHECKPOINT_BLOCKS 1024
+/** The cleaner runs at checkpoints when fewer segments are free */
+#define LOG_CLEAN_RESERVE 8
+/** Segments cleaned per checkpoint, and their maximum live blocks */
+#define LOG_CLEAN_BATCH 4
+#define LOG_CLEAN_LIVE (LOG_SEGMENT_BLOCKS / 2)
+
+uint16_t *logDead;				// blocks replaced since the last checkpoint
+uint32_t logDeadCount;
+uint32_t logDeadMax;
+uint32_t logSegmentEnd=0;		// end of the segment being filled, 0 if none
+int32_t logVictim=-1;			// segment being cleaned, never filled
+struct fs_log_stats logStats;
+
+/**
+ * In-core inode: the state of an open file, shared by all the descriptors
+ * open on it, so that they all see the same size and content. It lives in
+ * the inode table from the first fs_open() of the file to its last
+ * fs_close().
+ */
+struct inode {
+		_Atomic uint32_t refs;			// descriptors open on the file
+		uint32_t fileSize;
+		uint16_t indexFirstDataBlock;
+		uint16_t parentDirectory;		// directory holding the entry of the open file
+		char filename[FS_FILENAME_LEN];	// name of that entry
+		uint8_t flags;					// DIRENT_* flags of the entry
+		uint8_t inlineData[DIRENT_INLINE_MAX];	// content of an inline file
+		uint8_t *chunk;					// DIRENT_INDEXED: current chunk, in @chunkBuffer
+		uint8_t *chunkBuffer;			// CHUNK_SIZE bytes, room for several uncompressed chunks
+		uint32_t chunkIndex;			// chunk held in @chunk, or CHUNK_NONE
+		int8_t chunkDirty;				// 1 if @chunk must be compressed back
+		uint32_t chunkBorrows;			// ranges of @chunkBuffer lent by fs_read_borrow()
+		struct retired *retired;		// earlier chunk buffers still lent
+		uint8_t *tail;					// last block of the file, cached for appends, or NULL
+		uint16_t tailBlock;				// data block holding @tail
+		int8_t tailDirty;				// 1 if @tail must be written back
+		uint32_t tailDirtySince;		// dirty_now() when @tail was first modified
+		uint16_t *map;					// data blocks of the first @mapLength file blocks
+		uint32_t mapLength;
+		uint32_t mapSize;				// room in @map
+		uint32_t mapPrivate;			// leading blocks of @map known not to be shared
+		uint32_t mapEpoch;				// chainEpoch when @map was last valid, 0 if never
+		uint32_t aliases;				// read-only mappings of its blocks in the disk image
+		pthread_mutex_t appendLock;		// held by a write through an append descriptor
+		int8_t entryStale;				// 1 if the entry must be updated again at close
+		struct inode *next;				// next in the inode table
+		struct inode *previous;			// previous in the inode table, NULL if first
+		struct inode *hashNext;			// next in the bucket of inodeHash
+	};
+
+/** A chunk buffer replaced while fs_read_borrow() still lends parts of it */
+struct retired {
+		uint8_t *chunk;
+		uint32_t borrows;
+		struct retired *next;
+	};
+
+/** Inode table: the open files, most recently opened first */
+struct inode *inodeTable;
+/** The same inodes, hashed by directory and name, see inode_find() */
+#define INODE_HASH_SIZE 1024
+struct inode *inodeHash[INODE_HASH_SIZE];
+/** Held to look up, add or remove inodes, but not to share an open one */
+pthread_mutex_t inodeLock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Descriptors are allocated without locks, so that threads opening and
+ * closing files do not serialize: a bit of fdBitmap is claimed with a
+ * compare-and-swap, and the slot it stands for lives in a page of
+ * FS_OPEN_MAX_COUNT slots that is allocated on first use and never moves.
+ * A descriptor number carries the slot index in its low FD_INDEX_BITS bits
+ * and the generation of the slot above them. Closing a descriptor bumps the
+ * generation, so that a stale number is rejected even once the slot is
+ * reused. Pages are kept across mounts, with their generations, so that a
+ * number from an earlier mount is rejected as well.
+ */
+#define FD_INDEX_BITS 16
+#define FD_MAX (1u << FD_INDEX_BITS)
+#define FD_GENERATION_MASK 0x7FFFu
+
+struct fd {
+		_Atomic(struct inode *) inode;	// NULL if the descriptor is not open
+		_Atomic uint32_t generation;	// bumped by each close
+		int32_t offset;
+		int8_t append;					// writes go to the end of the file, see fs_open_append()
+	};
+
+_Atomic(struct fd *) fdPages[FD_MAX / FS_OPEN_MAX_COUNT];
+_Atomic uint64_t fdBitmap[FD_MAX / 64];
+
+int8_t mount=-1;
+
+/** Block holding the root directory of the mounted snapshot, 0 if live */
+uint16_t snapshotDirectory=0;
+
+static int chunk_flush(struct inode *inode);
+static int tail_flush(struct inode *inode, int drop);
+static int data_read(uint16_t indexBlock, void *buf);
+static int chain_free(uint16_t indexBlock, int index);
+static int fs_writable(const char *func);
+static int chain_unshare(struct inode *inode, uint32_t last);
+static int fs_block_of(struct inode *inode, uint32_t indexFileBlock, int extend);
+static int inode_sync_entry(struct inode *inode);
+static int map_valid(struct inode *inode);
+static int log_release(void);
+static int chain_extents(uint16_t indexBlock, uint32_t *blocks, uint32_t *extents, int *shared);
+static void batch_discard(void);
+static int mapping_aliased(uint32_t index);
+
+/**
+ * rec_slots - Number of directory slots used by an entry
+ * @entry: Directory entry
+ *
+ * Return: 1 plus the number of continuation slots holding inline data.
+ */
+static int rec_slots(const struct _directory *entry)
+{
+	uint32_t size = entry->fileSize;
+
+	if (!(entry->flags & DIRENT_INLINE) || size <= DIRENT_INLINE_HEAD)
+		return 1;
+	if (size > DIRENT_INLINE_MAX)
+		size = DIRENT_INLINE_MAX;
+	return 1 + (size - DIRENT_INLINE_HEAD + DIRENT_INLINE_CONT - 1) / DIRENT_INLINE_CONT;
+}
+
+/** Bucket of inodeHash holding file @filename of directory @parent (FNV-1a) */
+static struct inode **inode_bucket(uint16_t parent, const char *filename)
+{
+	uint32_t hash = (2166136261u ^ parent) * 16777619u;
+
+	for (; *filename; filename++) {
+		hash ^= (uint8_t)*filename;
+		hash *= 16777619u;
+	}
+	return &inodeHash[hash & (INODE_HASH_SIZE - 1)];
+}
+
+/** Find the inode of the open file @filename in directory @parent, or NULL */
+static struct inode *inode_find(uint16_t parent, const char *filename)
+{
+	for (struct inode *inode = *inode_bucket(parent, filename); inode; inode = inode->hashNext)
+		if (inode->parentDirectory == parent && strcmp(inode->filename, filename) == 0)
+			return inode;
+	return NULL;
+}
+
+/** Slot of descriptor index @index, allocating its page if @create is set */
+static struct fd *fd_slot(uint32_t index, int create)
+{
+	_Atomic(struct fd *) *page = &fdPages[index / FS_OPEN_MAX_COUNT];
+	struct fd *slots = atomic_load(page);
+
+	if (!slots && create) {
+		struct fd *expected = NULL;
+		slots = calloc(FS_OPEN_MAX_COUNT, sizeof(*slots));
+		if (!slots)
+			return NULL;
+		/** another thread may have published the page first */
+		if (!atomic_compare_exchange_strong(page, &expected, slots)) {
+			free(slots);
+			slots = expected;
+		}
+	}
+	return slots ? &slots[index % FS_OPEN_MAX_COUNT] : NULL;
+}
+
+/**
+ * fd_alloc - Allocate a descriptor, lowest free index first
+ * @inode: Open file
+ * @offset: Initial offset
+ * @append: Non-zero for an append descriptor
+ *
+ * Return: -1 if all FD_MAX descriptors are in use or out of memory.
+ * Otherwise the descriptor.
+ */
+static int fd_alloc(struct inode *inode, int32_t offset, int append)
+{
+	for (uint32_t w = 0; w < FD_MAX / 64; w++) {
+		uint64_t bits = atomic_load(&fdBitmap[w]);
+
+		while (bits != UINT64_MAX) {
+			uint64_t bit = 1ull << __builtin_ctzll(~bits);
+			if (!atomic_compare_exchange_weak(&fdBitmap[w], &bits, bits | bit))
+				continue;
+
+			uint32_t index = w * 64 + __builtin_ctzll(bit);
+			struct fd *slot = fd_slot(index, 1);
+			if (!slot) {
+				atomic_fetch_and(&fdBitmap[w], ~bit);
+				fprintf(stderr, "fd_alloc: out of memory\n");
+				return -1;
+			}
+			slot->offset = offset;
+			slot->append = append;
+			atomic_store(&slot->inode, inode);
+			return (atomic_load(&slot->generation) & FD_GENERATION_MASK) << FD_INDEX_BITS | index;
+		}
+	}
+	fprintf(stderr, "fd_alloc: already %u files open\n", FD_MAX);
+	return -1;
+}
+
+/** Slot of open descriptor @fd, or NULL if it is invalid or stale */
+static struct fd *fd_get(int fd)
+{
+	if (fd < 0)
+		return NULL;
+
+	struct fd *slot = fd_slot(fd & (FD_MAX - 1), 0);
+	if (!slot || !atomic_load(&slot->inode) ||
+	    (atomic_load(&slot->generation) & FD_GENERATION_MASK) != (uint32_t)fd >> FD_INDEX_BITS)
+		return NULL;
+	return slot;
+}
+
+/**
+ * fd_free - Release descriptor @fd
+ *
+ * Of several threads closing the same descriptor, only one succeeds.
+ *
+ * Return: NULL if @fd is invalid or stale. Otherwise the inode it was open on.
+ */
+static struct inode *fd_free(int fd)
+{
+	struct fd *slot = fd_get(fd);
+	if (!slot)
+		return NULL;
+
+	uint32_t generation = atomic_load(&slot->generation);
+	if ((generation & FD_GENERATION_MASK) != (uint32_t)fd >> FD_INDEX_BITS ||
+	    !atomic_compare_exchange_strong(&slot->generation, &generation, generation + 1))
+		return NULL;
+
+	struct inode *inode = atomic_exchange(&slot->inode, NULL);
+	uint32_t index = fd & (FD_MAX - 1);
+	atomic_fetch_and(&fdBitmap[index / 64], ~(1ull << (index % 64)));
+	return inode;
+}
+
+/**
+ * rec_pack - Lay out an entry and its inline data over consecutive slots
+ * @slots: Destination, at least rec_slots(@entry) slots
+ * @entry: Directory entry
+ * @data: Inline content (ignored unless @entry is %DIRENT_INLINE)
+ *
+ * Return: the number of slots used.
+ */
+static int rec_pack(struct _directory *slots, const struct _directory *entry,
+		    const uint8_t *data)
+{
+	int count = rec_slots(entry);
+	uint32_t size = entry->fileSize;
+
+	slots[0] = *entry;
+	if (!(entry->flags & DIRENT_INLINE))
+		return 1;
+
+	memset(slots[0].inlineData, 0, DIRENT_INLINE_HEAD);
+	memcpy(slots[0].inlineData, data, size < DIRENT_INLINE_HEAD ? size : DIRENT_INLINE_HEAD);
+	for (int i = 1; i < count; i++) {
+		uint8_t *raw = (uint8_t *)&slots[i];
+		uint32_t at = DIRENT_INLINE_HEAD + (i - 1) * DIRENT_INLINE_CONT;
+		uint32_t len = size - at < DIRENT_INLINE_CONT ? size - at : DIRENT_INLINE_CONT;
+
+		memset(raw, 0, sizeof(slots[i]));
+		raw[0] = DIRENT_CONT;
+		memcpy(raw + 1, data + at, len);
+	}
+	return count;
+}
+
+/** Gather the inline data of the record starting at @slots into @data */
+static void rec_unpack(const struct _directory *slots, uint8_t *data)
+{
+	int count = rec_slots(&slots[0]);
+
+	if (!(slots[0].flags & DIRENT_INLINE))
+		return;
+	memcpy(data, slots[0].inlineData, DIRENT_INLINE_HEAD);
+	for (int i = 1; i < count; i++)
+		memcpy(data + DIRENT_INLINE_HEAD + (i - 1) * DIRENT_INLINE_CONT,
+		       (const uint8_t *)&slots[i] + 1, DIRENT_INLINE_CONT);
+}
+
+/**
+ * fs_checksum - FNV-1a hash of a buffer
+ * @buf: Data
+ * @len: Length of @buf in bytes
+ */
+static uint32_t fs_checksum(const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	uint32_t hash = 2166136261u;
+
+	for (size_t i = 0; i < len; i++) {
+		hash ^= p[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/** Checksum of the summary itself, with its checksum field zeroed */
+static uint32_t summary_checksum(void)
+{
+	struct _summary copy = superblock.summary;
+
+	copy.checksum = 0;
+	return fs_checksum(&copy, sizeof(copy));
+}
+
+/**
+ * summary_write - Write the superblock with an up-to-date summary checksum
+ *
+ * Return: -1 if the superblock cannot be written. 0 otherwise.
+ */
+static int summary_write(void)
+{
+	superblock.summary.checksum = summary_checksum();
+	if (block_write(0, &superblock)) {
+		fprintf(stderr, "summary_write: cannot write superblock\n");
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * summary_touch - Note that metadata is about to change
+ *
+ * The first modification after a sync clears the clean flag on disk, so that a
+ * crash before the next sync makes the next mount ignore the stale counters.
+ */
+static void summary_touch(void)
+{
+	modifiedMeta = 1;
+	if (!superblock.summary.clean)
+		return;
+	superblock.summary.clean = 0;
+	summary_write();
+}
+
+/** Time in milliseconds for dirty flags, never 0 */
+static uint32_t dirty_now(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint32_t)(now.tv_sec * 1000 + now.tv_nsec / 1000000) | 1;
+}
+
+/** Mark a cached metadata block as modified, after modifying it */
+static void dirty_mark(_Atomic uint32_t *flag)
+{
+	uint32_t clean = 0;
+
+	if (atomic_load(flag) == 0 &&
+	    atomic_compare_exchange_strong(flag, &clean, dirty_now()))
+		atomic_fetch_add(&dirtyBlocks, 1);
+}
+
+/**
+ * dirty_clear - Mark a cached metadata block as clean, before writing it
+ *
+ * Return: 1 if the block was dirty. 0 otherwise.
+ */
+static int dirty_clear(_Atomic uint32_t *flag)
+{
+	if (atomic_load(flag) == 0 || atomic_exchange(flag, 0) == 0)
+		return 0;
+	atomic_fetch_sub(&dirtyBlocks, 1);
+	return 1;
+}
+
+/** Mark the root directory as modified */
+static void dir_touch(void)
+{
+	summary_touch();
+	dirty_mark(&dirtyDirectory);
+}
+
+/**
+ * fat_load - Fault in a FAT block
+ * @indexFAT: Index of the FAT block (0 for the first block after superblock)
+ *
+ * Return: -1 if the block cannot be allocated or read. 0 otherwise.
+ */
+static int fat_load(int indexFAT)
+{
+	if (FAT[indexFAT])
+		return 0;
+
+	FAT[indexFAT] = malloc(BLOCK_SIZE);
+	if (!FAT[indexFAT]) {
+		perror("fat_load: malloc");
+		return -1;
+	}
+	if (block_read(indexFAT + 1, FAT[indexFAT])) {
+		fprintf(stderr, "fat_load: cannot read FAT block %d\n", indexFAT);
+		free(FAT[indexFAT]);
+		FAT[indexFAT] = NULL;
+		return -1;
+	}
+	/** a FAT block changed behind our back (e.g. by another implementation) */
+	if (validSummary && fs_checksum(FAT[indexFAT], BLOCK_SIZE) !=
+	    superblock.summary.checksumFAT[indexFAT])
+		validSummary = 0;
+	return 0;
+}
+
+/**
+ * fat_get - Read a FAT entry
+ * @index: Data block index
+ *
+ * Return: -1 if @index is out of bounds or its FAT block cannot be loaded.
+ * Otherwise the value of the FAT entry.
+ */
+static int fat_get(uint32_t index)
+{
+	if (index >= superblock.amountDataBlock) {
+		fprintf(stderr, "fat_get: index %u out of bounds\n", index);
+		return -1;
+	}
+	if (fat_load(index / FAT_PER_BLOCK))
+		return -1;
+	return FAT[index / FAT_PER_BLOCK][index % FAT_PER_BLOCK];
+}
+
+/** Queue data block @index, just freed, for release by discard_flush() */
+static void discard_queue(uint32_t index)
+{
+	uint64_t bit = 1ull << (index % 64);
+
+	/** a block still mapped is released by a later fs_trim() */
+	if ((discardMap[index / 64] & bit) || mapping_aliased(index))
+		return;
+	discardMap[index / 64] |= bit;
+	discardPending++;
+}
+
+/**
+ * fat_set - Write a FAT entry
+ * @index: Data block index
+ * @value: New value of the entry
+ *
+ * Return: -1 if @index is out of bounds or its FAT block cannot be loaded.
+ * 0 otherwise.
+ */
+static int fat_set(uint32_t index, uint16_t value)
+{
+	if (index >= superblock.amountDataBlock) {
+		fprintf(stderr, "fat_set: index %u out of bounds\n", index);
+		return -1;
+	}
+	if (fat_load(index / FAT_PER_BLOCK))
+		return -1;
+	summary_touch();
+
+	uint16_t *entry = &FAT[index / FAT_PER_BLOCK][index % FAT_PER_BLOCK];
+	if (validSummary && (*entry == 0) != (value == 0)) {
+		int delta = value == 0 ? 1 : -1;
+		superblock.summary.freeBlocks += delta;
+		superblock.summary.freeFAT[index / FAT_PER_BLOCK] += delta;
+	}
+	if (value == 0 && *entry != 0)
+		discard_queue(index);
+	/** linking a block after the end of a chain leaves block maps valid */
+	if (*entry != value && *entry != 0 && (*entry != FAT_EOC || value == 0))
+		chainEpoch++;
+	pthread_mutex_lock(&metaLock);
+	*entry = value;
+	pthread_mutex_unlock(&metaLock);
+	dirty_mark(&dirtyFAT[index / FAT_PER_BLOCK]);
+	return 0;
+}
+
+/**
+ * dir_load - Read the root directory if it was not read yet
+ *
+ * Return: -1 if the root directory cannot be read. 0 otherwise.
+ */
+static int dir_load(void)
+{
+	if (loadedDirectory)
+		return 0;
+	if (snapshotDirectory) {
+		if (data_read(snapshotDirectory, (void *)directory)) {
+			perror("dir_load:read error\n");
+			return -1;
+		}
+		loadedDirectory = 1;
+		return 0;
+	}
+	if (block_read(superblock.indexRootDirectory, (void *)directory)) {
+		perror("dir_load:read error\n");
+		return -1;
+	}
+	loadedDirectory = 1;
+
+	/** cheap validation of the persisted free-entry count */
+	int freeEntries = 0;
+	for (int i=0; i<FS_FILE_MAX_COUNT; i++)
+		if (directory[i].filename[0]=='\0') freeEntries++;
+	if (freeEntries != superblock.summary.freeEntries)
+		validSummary = 0;
+	return 0;
+}
+
+/** End of the range of data blocks described by FAT block @indexFAT */
+static uint32_t fat_block_end(int indexFAT)
+{
+	uint32_t last = (indexFAT + 1) * FAT_PER_BLOCK;
+
+	return last < superblock.amountDataBlock ? last : superblock.amountDataBlock;
+}
+
+/**
+ * summary_load - Make sure the free-space counters can be trusted
+ *
+ * When the persisted summary failed validation, rebuild it by scanning the
+ * whole FAT and the root directory (this is the only place doing so).
+ *
+ * Return: -1 on I/O error. 0 otherwise.
+ */
+static int summary_load(void)
+{
+	if (dir_load())
+		return -1;
+	if (validSummary)
+		return 0;
+
+	superblock.summary.freeBlocks = 0;
+	for (int i=0; i< superblock.amountFAT;i++){
+		uint32_t first = i * FAT_PER_BLOCK;
+		uint32_t last = fat_block_end(i);
+
+		if (fat_load(i))
+			return -1;
+		superblock.summary.freeFAT[i] = scan_count_zero16(FAT[i], last - first);
+		superblock.summary.freeBlocks += superblock.summary.freeFAT[i];
+	}
+
+	superblock.summary.freeEntries = 0;
+	for (int i=0; i<FS_FILE_MAX_COUNT; i++)
+		if (directory[i].filename[0]=='\0') superblock.summary.freeEntries++;
+
+	validSummary = 1;
+	return 0;
+}
+
+/**
+ * summary_check - Validate the summary read from disk at mount time
+ *
+ * Return: 1 if the summary can be trusted, 0 otherwise.
+ */
+static int summary_check(void)
+{
+	struct _summary *summary = &superblock.summary;
+	uint32_t freeBlocks = 0;
+
+	if (summary->magic != FS_SUMMARY_MAGIC ||
+	    summary->version != FS_SUMMARY_VERSION ||
+	    summary->clean != 1 ||
+	    summary->checksum != summary_checksum() ||
+	    summary->freeEntries > FS_FILE_MAX_COUNT ||
+	    summary->freeBlocks >= superblock.amountDataBlock)
+		return 0;
+
+	for (int i=0; i< superblock.amountFAT;i++) {
+		if (summary->freeFAT[i] > FAT_PER_BLOCK)
+			return 0;
+		freeBlocks += summary->freeFAT[i];
+	}
+	return freeBlocks == summary->freeBlocks;
+}
+
+/**
+ * fat_alloc - Allocate a free data block (first-fit)
+ *
+ * The block is marked as end of chain in the FAT.
+ *
+ * Return: -1 if the disk is full or on I/O error. Otherwise the index of the
+ * newly allocated data block.
+ */
+static int fat_alloc(void)
+{
+	if (summary_load() || superblock.summary.freeBlocks <= reservedBlocks)
+		return -1;
+
+	for (int b = 0; b < superblock.amountFAT; b++) {
+		/** skip FAT blocks without free entries, without faulting them in */
+		if (superblock.summary.freeFAT[b] == 0)
+			continue;
+		if (fat_load(b))
+			return -1;
+
+		/** entry 0 is reserved */
+		uint32_t first = b == 0 ? 1 : b * FAT_PER_BLOCK;
+		uint32_t last = fat_block_end(b);
+		uint32_t i = first + scan_find_zero16(&FAT[b][first % FAT_PER_BLOCK], last - first);
+		if (i < last) {
+			if (fat_set(i, FAT_EOC))
+				return -1;
+			return i;
+		}
+	}
+	return -1;
+}
+
+/**========================== checksums =============================================*/
+
+/** Number of blocks taken by the checksum region */
+static uint32_t checksum_blocks(void)
+{
+	return (superblock.amountDataBlock + CHECKSUM_PER_BLOCK - 1) / CHECKSUM_PER_BLOCK;
+}
+
+/**
+ * checksum_rebuild - Recompute the checksum of every allocated data block
+ *
+ * Return: -1 on I/O error. 0 otherwise.
+ */
+static int checksum_rebuild(void)
+{
+	char buf[BLOCK_SIZE];
+
+	for (uint32_t i = 1; i < superblock.amountDataBlock; i++) {
+		int entry = fat_get(i);
+		if (entry < 0)
+			return -1;
+		checksums[i] = 0;
+		if (entry == 0)
+			continue;
+		if (block_read(superblock.indexDataBlock + i, buf))
+			return -1;
+		checksums[i] = crc32c(0, buf, BLOCK_SIZE);
+	}
+	for (uint32_t i = 0; i < checksum_blocks(); i++) {
+		checksums[checksumBlocks[i]] = 0;
+		dirty_mark(&dirtyChecksums[i]);
+	}
+	summary_touch();
+	return 0;
+}
+
+/** Release the in-memory checksum region */
+static void checksum_release(void)
+{
+	for (uint32_t i = 0; dirtyChecksums && i < checksum_blocks(); i++)
+		dirty_clear(&dirtyChecksums[i]);
+	free(checksums);
+	free(checksumBlocks);
+	free(dirtyChecksums);
+	checksums = NULL;
+	checksumBlocks = NULL;
+	dirtyChecksums = NULL;
+}
+
+/**
+ * checksum_load - Read the checksum region if there is one and it was not read
+ * @rebuild: Recompute all checksums from the data
+ *
+ * Checksums are also recomputed when the file system was not cleanly
+ * unmounted, since blocks written after the last sync may not match them.
+ *
+ * Return: -1 on error. 0 otherwise, with @checksums still NULL if the file
+ * system has no checksum region.
+ */
+static int checksum_load(int rebuild)
+{
+	uint32_t count = checksum_blocks();
+	int indexBlock = superblock.indexChecksums;
+
+	if (checksums || indexBlock == 0)
+		return 0;
+
+	checksums = calloc(count, BLOCK_SIZE);
+	checksumBlocks = calloc(count, sizeof(*checksumBlocks));
+	dirtyChecksums = calloc(count, sizeof(*dirtyChecksums));
+	if (!checksums || !checksumBlocks || !dirtyChecksums) {
+		perror("checksum_load: calloc");
+		goto error;
+	}
+	for (uint32_t i = 0; i < count; i++) {
+		if (indexBlock <= 0 || indexBlock == FAT_EOC ||
+		    block_read(superblock.indexDataBlock + indexBlock,
+			       (char *)checksums + i * BLOCK_SIZE)) {
+			fprintf(stderr, "checksum_load: cannot read checksum region\n");
+			goto error;
+		}
+		checksumBlocks[i] = indexBlock;
+		indexBlock = fat_get(indexBlock);
+	}
+	if ((rebuild || !cleanMount) && checksum_rebuild())
+		goto error;
+	/** pick the CRC32C implementation before any read is timed */
+	crc32c_hardware();
+	return 0;
+
+error:
+	checksum_release();
+	return -1;
+}
+
+/**
+ * checksum_sync - Write back modified blocks of the checksum region
+ *
+ * Return: -1 if a block cannot be written. 0 otherwise.
+ */
+static int checksum_sync(void)
+{
+	if (!checksums)
+		return 0;
+	for (uint32_t i = 0; i < checksum_blocks(); i++) {
+		if (!dirty_clear(&dirtyChecksums[i]))
+			continue;
+		if (block_write(superblock.indexDataBlock + checksumBlocks[i],
+				(char *)checksums + i * BLOCK_SIZE)) {
+			dirty_mark(&dirtyChecksums[i]);
+			fprintf(stderr, "checksum_sync: write error\n");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * checksum_create - Allocate the checksum region and fill it
+ *
+ * Return: -1 if the disk is full or on I/O error. 0 otherwise.
+ */
+static int checksum_create(void)
+{
+	static const char zero[BLOCK_SIZE];
+	int head = FAT_EOC;
+
+	if (superblock.indexChecksums)
+		return checksum_load(0);
+
+	for (uint32_t i = 0; i < checksum_blocks(); i++) {
+		int indexBlock = fat_alloc();
+		if (indexBlock < 0 || fat_set(indexBlock, head) ||
+		    block_write(superblock.indexDataBlock + indexBlock, zero)) {
+			if (indexBlock >= 0)
+				fat_set(indexBlock, 0);
+			chain_free(head, 0);
+			fprintf(stderr, "checksum_create: no room for the checksum region\n");
+			return -1;
+		}
+		head = indexBlock;
+	}
+	summary_touch();
+	superblock.indexChecksums = head;
+	pthread_mutex_lock(&flushLock);
+	int ret = checksum_load(1);
+	pthread_mutex_unlock(&flushLock);
+	return ret;
+}
+
+/** Read a data block, verifying its checksum */
+static int data_read(uint16_t indexBlock, void *buf)
+{
+	struct timespec start, read, end;
+
+	if (!superblock.indexChecksums)
+		return block_read(superblock.indexDataBlock + indexBlock, buf);
+	if (checksum_load(0))
+		return -1;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (block_read(superblock.indexDataBlock + indexBlock, buf))
+		return -1;
+	clock_gettime(CLOCK_MONOTONIC, &read);
+	uint32_t expected = checksums[indexBlock];
+	uint32_t crc = expected ? crc32c(0, buf, BLOCK_SIZE) : 0;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	checksumStats.readNanoseconds += (read.tv_sec - start.tv_sec) * 1000000000ll +
+					 (read.tv_nsec - start.tv_nsec);
+	if (!expected)
+		return 0;
+	checksumStats.verifiedBlocks++;
+	checksumStats.verifyNanoseconds += (end.tv_sec - read.tv_sec) * 1000000000ll +
+					   (end.tv_nsec - read.tv_nsec);
+	if (crc != expected) {
+		checksumStats.readErrors++;
+		fprintf(stderr, "data_read: checksum mismatch in block %u\n", indexBlock);
+		return -1;
+	}
+	return 0;
+}
+
+/** Write a data block, recording its checksum */
+static int data_write(uint16_t indexBlock, const void *buf)
+{
+	if (!superblock.indexChecksums || indexBlock >= superblock.amountDataBlock)
+		return block_write(superblock.indexDataBlock + indexBlock, buf);
+	if (checksum_load(0))
+		return -1;
+
+	uint32_t crc = crc32c(0, buf, BLOCK_SIZE);
+	summary_touch();
+	pthread_mutex_lock(&checksumLock);
+	int ret = block_write(superblock.indexDataBlock + indexBlock, buf);
+	/** after a failed write, the block may hold either version */
+	checksums[indexBlock] = ret ? 0 : crc;
+	pthread_mutex_unlock(&checksumLock);
+	dirty_mark(&dirtyChecksums[indexBlock / CHECKSUM_PER_BLOCK]);
+	return ret;
+}
+
+/**
+ * The scrubber thread reads every block that has a checksum, one after the
+ * other and round and round, and reports those that no longer match. It
+ * holds checksumLock while reading a block, so that data_write() cannot
+ * change the block between the read and the lookup of its checksum.
+ */
+static pthread_t scrubThread;
+static int8_t scrubRunning=0;
+static int8_t scrubStop=0;			// protected by checksumLock
+static uint32_t scrubRate;			// blocks per second, 0 for no limit
+static pthread_cond_t scrubWake = PTHREAD_COND_INITIALIZER;
+
+/** Wait until @start + @ns (CLOCK_REALTIME), or until asked to stop */
+static void scrub_wait(const struct timespec *start, uint64_t ns)
+{
+	struct timespec deadline = *start;
+
+	deadline.tv_sec += ns / 1000000000ull;
+	deadline.tv_nsec += ns % 1000000000ull;
+	if (deadline.tv_nsec >= 1000000000l) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000l;
+	}
+	pthread_mutex_lock(&checksumLock);
+	while (!scrubStop &&
+	       pthread_cond_timedwait(&scrubWake, &checksumLock, &deadline) == 0)
+		;
+	pthread_mutex_unlock(&checksumLock);
+}
+
+static void *scrub_main(void *arg)
+{
+	char buf[BLOCK_SIZE];
+	uint32_t indexBlock = 1;
+	uint64_t done = 0, passDone = 0;
+	struct timespec start;
+
+	(void)arg;
+	clock_gettime(CLOCK_REALTIME, &start);
+	for (;;) {
+		pthread_mutex_lock(&checksumLock);
+		if (scrubStop) {
+			pthread_mutex_unlock(&checksumLock);
+			break;
+		}
+		uint32_t expected = checksums[indexBlock];
+		int ret = expected ? block_read(superblock.indexDataBlock + indexBlock, buf) : 0;
+		pthread_mutex_unlock(&checksumLock);
+
+		if (expected) {
+			int bad = ret || crc32c(0, buf, BLOCK_SIZE) != expected;
+
+			pthread_mutex_lock(&checksumLock);
+			checksumStats.scrubbedBlocks++;
+			if (bad) {
+				checksumStats.scrubErrors++;
+				checksumStats.lastBadBlock = indexBlock;
+			}
+			pthread_mutex_unlock(&checksumLock);
+			if (bad)
+				fprintf(stderr, "fs_scrub: checksum mismatch in block %u\n", indexBlock);
+			done++;
+			passDone++;
+			if (scrubRate)
+				scrub_wait(&start, done * 1000000000ull / scrubRate);
+		}
+
+		if (++indexBlock == superblock.amountDataBlock) {
+			indexBlock = 1;
+			pthread_mutex_lock(&checksumLock);
+			checksumStats.scrubPasses++;
+			pthread_mutex_unlock(&checksumLock);
+			/** nothing to verify: do not spin */
+			if (passDone == 0) {
+				struct timespec now;
+				clock_gettime(CLOCK_REALTIME, &now);
+				scrub_wait(&now, 100000000ull);
+			}
+			passDone = 0;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * fs_scrub_start - Start verifying the checksums in the background
+ */
+int fs_scrub_start(uint32_t blocksPerSecond)
+{
+	if(mount==-1)return -1;
+	if (!superblock.indexChecksums) {
+		fprintf(stderr, "fs_scrub_start: checksums are not enabled\n");
+		return -1;
+	}
+	if (scrubRunning) {
+		fprintf(stderr, "fs_scrub_start: already running\n");
+		return -1;
+	}
+	if (checksum_load(0))
+		return -1;
+
+	scrubRate = blocksPerSecond;
+	scrubStop = 0;
+	if (pthread_create(&scrubThread, NULL, scrub_main, NULL)) {
+		fprintf(stderr, "fs_scrub_start: cannot create thread\n");
+		return -1;
+	}
+	scrubRunning = 1;
+	return 0;
+}
+
+/**
+ * fs_scrub_stop - Stop the background verification
+ */
+int fs_scrub_stop(void)
+{
+	if (!scrubRunning)
+		return 0;
+	pthread_mutex_lock(&checksumLock);
+	scrubStop = 1;
+	pthread_cond_signal(&scrubWake);
+	pthread_mutex_unlock(&checksumLock);
+	pthread_join(scrubThread, NULL);
+	scrubRunning = 0;
+	return 0;
+}
+
+/**
+ * fs_checksum_stats - Get checksum statistics
+ */
+int fs_checksum_stats(struct fs_checksum_stats *stats)
+{
+	if(mount==-1)return -1;
+	if (!stats)
+		return -1;
+	pthread_mutex_lock(&checksumLock);
+	*stats = checksumStats;
+	pthread_mutex_unlock(&checksumLock);
+	stats->hardware = crc32c_hardware();
+	stats->scrubbing = scrubRunning;
+	return 0;
+}
+
+/**
+ * checksum_destroy - Release the checksum region
+ *
+ * Return: -1 on I/O error. 0 otherwise.
+ */
+static int checksum_destroy(void)
+{
+	uint16_t head = superblock.indexChecksums;
+
+	if (!head)
+		return 0;
+	fs_scrub_stop();
+	pthread_mutex_lock(&flushLock);
+	checksum_release();
+	pthread_mutex_unlock(&flushLock);
+	summary_touch();
+	superblock.indexChecksums = 0;
+	return chain_free(head, 0);
+}
+
+/** Number of blocks taken by the block table */
+static uint32_t table_blocks(void)
+{
+	return (superblock.amountDataBlock + BLOCKINFO_PER_BLOCK - 1) / BLOCKINFO_PER_BLOCK;
+}
+
+/**
+ * table_load - Read the block table if there is one and it was not read yet
+ *
+ * Return: -1 on error. 0 otherwise, with @blockTable still NULL if the file
+ * system has no block table.
+ */
+static int table_load(void)
+{
+	uint32_t count = table_blocks();
+	int indexBlock = superblock.indexBlockTable;
+
+	if (blockTable || indexBlock == 0)
+		return 0;
+
+	blockTable = calloc(count, BLOCK_SIZE);
+	tableBlocks = calloc(count, sizeof(*tableBlocks));
+	dirtyTable = calloc(count, sizeof(*dirtyTable));
+	if (!blockTable || !tableBlocks || !dirtyTable) {
+		perror("table_load: calloc");
+		goto error;
+	}
+	for (uint32_t i = 0; i < count; i++) {
+		if (indexBlock <= 0 || indexBlock == FAT_EOC ||
+		    data_read(indexBlock, (char *)blockTable + i * BLOCK_SIZE)) {
+			fprintf(stderr, "table_load: cannot read block table\n");
+			goto error;
+		}
+		tableBlocks[i] = indexBlock;
+		indexBlock = fat_get(indexBlock);
+	}
+	return 0;
+
+error:
+	free(blockTable);
+	free(tableBlocks);
+	free(dirtyTable);
+	blockTable = NULL;
+	tableBlocks = NULL;
+	dirtyTable = NULL;
+	return -1;
+}
+
+/** Mark the record of data block @index as modified */
+static void table_touch(uint32_t index)
+{
+	/** a block that becomes shared must be copied before the next write */
+	chainEpoch++;
+	summary_touch();
+	dirty_mark(&dirtyTable[index / BLOCKINFO_PER_BLOCK]);
+}
+
+/** Set the record of data block @index */
+static void table_set(uint32_t index, uint16_t refs, uint32_t fingerprint)
+{
+	pthread_mutex_lock(&metaLock);
+	blockTable[index].refs = refs;
+	blockTable[index].fingerprint = fingerprint;
+	pthread_mutex_unlock(&metaLock);
+	table_touch(index);
+}
+
+/** Add @delta to the references to data block @index */
+static void table_ref(uint32_t index, int delta)
+{
+	table_set(index, blockTable[index].refs + delta, blockTable[index].fingerprint);
+}
+
+/**
+ * table_sync - Write back modified blocks of the block table
+ *
+ * Return: -1 if a block cannot be written. 0 otherwise.
+ */
+static int table_sync(void)
+{
+	if (!blockTable)
+		return 0;
+	for (uint32_t i = 0; i < table_blocks(); i++) {
+		if (!dirty_clear(&dirtyTable[i]))
+			continue;
+		if (data_write(tableBlocks[i], (char *)blockTable + i * BLOCK_SIZE)) {
+			dirty_mark(&dirtyTable[i]);
+			fprintf(stderr, "table_sync: write error\n");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * discard_prepare - Drop the blocks queued for discard that were reused
+ *
+ * The checksums of the others are cleared, since they will read as zeros.
+ *
+ * Return: -1 on error. 0 otherwise.
+ */
+static int discard_prepare(void)
+{
+	if (!discardPending)
+		return 0;
+	if (superblock.indexChecksums && checksum_load(0))
+		return -1;
+	for (uint32_t i = 0; i < superblock.amountDataBlock; i++) {
+		uint64_t bit = 1ull << (i % 64);
+		if (!(discardMap[i / 64] & bit))
+			continue;
+		if (fat_get(i) != 0) {
+			discardMap[i / 64] &= ~bit;
+			discardPending--;
+		} else if (checksums && checksums[i]) {
+			pthread_mutex_lock(&checksumLock);
+			checksums[i] = 0;
+			pthread_mutex_unlock(&checksumLock);
+			dirty_mark(&dirtyChecksums[i / CHECKSUM_PER_BLOCK]);
+		}
+	}
+	return 0;
+}
+
+/**
+ * discard_flush - Release the blocks queued for discard, a run at a time
+ *
+ * Blocks are released on a best-effort basis: those of a disk file without
+ * support for holes simply stay as they are.
+ */
+static void discard_flush(void)
+{
+	uint32_t start = 0, count = 0;
+
+	if (!discardPending)
+		return;
+	for (uint32_t i = 0; i <= superblock.amountDataBlock; i++) {
+		if (i < superblock.amountDataBlock &&
+		    (discardMap[i / 64] >> (i % 64) & 1)) {
+			if (count++ == 0)
+				start = i;
+			continue;
+		}
+		if (count && block_discard(superblock.indexDataBlock + start, count) == 0)
+			discardedBlocks += count;
+		count = 0;
+	}
+	memset(discardMap, 0, (superblock.amountDataBlock + 63) / 64 * sizeof(*discardMap));
+	discardPending = 0;
+}
+
+/** Write back modified metadata, with flushLock held */
+static int sync_meta(void)
+{
+	if (log_release() || discard_prepare() || table_sync() || checksum_sync())
+		return -1;
+	for (int i=0; i< superblock.amountFAT;i++){
+		if (FAT[i] && dirty_clear(&dirtyFAT[i])) {
+			if (block_write(i+1, FAT[i])){
+				dirty_mark(&dirtyFAT[i]);
+				perror("fs_sync_meta:write error\n");
+				return -1;
+			}
+		}
+	}
+	if (dirty_clear(&dirtyDirectory)) {
+		if (block_write(superblock.indexRootDirectory, (void *)directory)){
+			dirty_mark(&dirtyDirectory);
+			perror("fs_sync_meta:write error\n");
+			return -1;
+		}
+	}
+	discard_flush();
+
+	/** persist the free-space summary, marking it clean */
+	if (!validSummary) {
+		/** never leave a stale summary marked clean on disk */
+		if (!modifiedMeta) {
+			if (!superblock.summary.clean)
+				return 0;
+			superblock.summary.clean = 0;
+			return summary_write();
+		}
+		if (summary_load())
+			return -1;
+	}
+	if (superblock.summary.clean)
+		return 0;
+	for (int i=0; i< superblock.amountFAT;i++)
+		if (FAT[i])
+			superblock.summary.checksumFAT[i] = fs_checksum(FAT[i], BLOCK_SIZE);
+	superblock.summary.magic = FS_SUMMARY_MAGIC;
+	superblock.summary.version = FS_SUMMARY_VERSION;
+	superblock.summary.clean = 1;
+	return summary_write();
+}
+
+/**
+ * fs_sync_meta - Write back modified FAT blocks and root directory
+ *
+ * Return: -1 if a block cannot be written. 0 otherwise.
+ */
+static int fs_sync_meta(void)
+{
+	pthread_mutex_lock(&flushLock);
+	int ret = sync_meta();
+	pthread_mutex_unlock(&flushLock);
+	return ret;
+}
+
+/** Release the in-memory FAT cache */
+static void fat_release(void)
+{
+	if (FAT) {
+		for (int i=0; i< superblock.amountFAT;i++)
+			free(FAT[i]);
+	}
+	free(FAT);
+	free(dirtyFAT);
+	free(discardMap);
+	FAT = NULL;
+	dirtyFAT = NULL;
+	discardMap = NULL;
+	discardPending = 0;
+	discardedBlocks = 0;
+	loadedDirectory = 0;
+	dirtyDirectory = 0;
+	dirtyBlocks = 0;
+	validSummary = 0;
+	modifiedMeta = 0;
+}
+
+/** Release the in-memory block table and fingerprint map */
+static void table_release(void)
+{
+	free(blockTable);
+	free(tableBlocks);
+	free(dirtyTable);
+	free(fingerprintMap);
+	blockTable = NULL;
+	tableBlocks = NULL;
+	dirtyTable = NULL;
+	fingerprintMap = NULL;
+	fingerprintMapSize = 0;
+	fingerprintMapUsed = 0;
+	memset(&dedupStats, 0, sizeof(dedupStats));
+}
+
+/**========================== write-back =============================================*/
+
+/**
+ * The flusher thread writes back cached metadata blocks (FAT, root directory,
+ * block table, checksum region) once they have been dirty for longer than
+ * the expiry time, or all of them once more than the background ratio of
+ * the cached blocks are dirty, so that fs_umount() and fs_sync_meta() find
+ * little left to write. Each pass sorts the blocks by disk address. Writers
+ * are held in fs_writable() while more than the limit ratio is dirty, until
+ * the next pass completes. The last blocks cached for appends are written
+ * back once expired as well; the free-space summary is never marked clean
+ * by the flusher.
+ */
+static pthread_t flusherThread;
+static int8_t flusherRunning=0;
+static int8_t flusherStop=0;			// protected by flushLock
+static int8_t flusherUrgent=0;			// protected by flushLock
+static uint32_t flusherExpire;			// milliseconds
+static uint32_t flusherBackground;		// percent of the cached blocks
+static uint32_t flusherLimit;			// percent of the cached blocks
+static pthread_cond_t flusherWake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t flusherDone = PTHREAD_COND_INITIALIZER;
+static struct fs_flusher_stats flusherStats;	// protected by flushLock
+
+/** Kinds of blocks written back by the flusher */
+enum flush_kind { FLUSH_FAT, FLUSH_DIRECTORY, FLUSH_TABLE, FLUSH_CHECKSUMS };
+
+struct flush_item {
+	uint32_t block;			// disk block, the sort key
+	enum flush_kind kind;
+	uint32_t index;			// block of the FAT, table or checksum region
+};
+static struct flush_item *flushItems;
+
+/** Number of metadata blocks cached in memory */
+static uint32_t flusher_cached(void)
+{
+	uint32_t count = superblock.amountFAT + 1;
+
+	if (blockTable)
+		count += table_blocks();
+	if (checksums)
+		count += checksum_blocks();
+	return count;
+}
+
+/** 1 if more than @percent of the cached blocks are dirty */
+static int flusher_over(uint32_t percent)
+{
+	return (uint64_t)atomic_load(&dirtyBlocks) * 100 >
+	       (uint64_t)flusher_cached() * percent;
+}
+
+/** Add the block of dirty flag @flag to @items if it must be written back */
+static uint32_t flusher_pick(_Atomic uint32_t *flag, int all, uint32_t now,
+			     uint32_t count, uint32_t block, enum flush_kind kind,
+			     uint32_t index)
+{
+	uint32_t since = atomic_load(flag);
+
+	if (!since || (!all && now - since < flusherExpire))
+		return count;
+	flushItems[count].block = block;
+	flushItems[count].kind = kind;
+	flushItems[count].index = index;
+	return count + 1;
+}
+
+static int flush_item_cmp(const void *a, const void *b)
+{
+	const struct flush_item *x = a, *y = b;
+
+	return (x->block > y->block) - (x->block < y->block);
+}
+
+/**
+ * flush_item_write - Write back one block picked by the flusher
+ *
+ * Return: -1 on I/O error, 0 if the block was clean meanwhile. 1 otherwise.
+ */
+static int flush_item_write(const struct flush_item *item)
+{
+	char copy[BLOCK_SIZE];
+	_Atomic uint32_t *flag;
+	int ret;
+
+	switch (item->kind) {
+	case FLUSH_FAT:
+		flag = &dirtyFAT[item->index];
+		if (!dirty_clear(flag))
+			return 0;
+		pthread_mutex_lock(&metaLock);
+		memcpy(copy, FAT[item->index], BLOCK_SIZE);
+		pthread_mutex_unlock(&metaLock);
+		ret = block_write(item->block, copy);
+		break;
+	case FLUSH_DIRECTORY:
+		flag = &dirtyDirectory;
+		if (!dirty_clear(flag))
+			return 0;
+		pthread_mutex_lock(&metaLock);
+		memcpy(copy, directory, BLOCK_SIZE);
+		pthread_mutex_unlock(&metaLock);
+		ret = block_write(item->block, copy);
+		break;
+	case FLUSH_TABLE:
+		flag = &dirtyTable[item->index];
+		if (!dirty_clear(flag))
+			return 0;
+		pthread_mutex_lock(&metaLock);
+		memcpy(copy, (char *)blockTable + item->index * BLOCK_SIZE, BLOCK_SIZE);
+		pthread_mutex_unlock(&metaLock);
+		ret = data_write(tableBlocks[item->index], copy);
+		break;
+	default:
+		flag = &dirtyChecksums[item->index];
+		if (!dirty_clear(flag))
+			return 0;
+		pthread_mutex_lock(&checksumLock);
+		memcpy(copy, (char *)checksums + item->index * BLOCK_SIZE, BLOCK_SIZE);
+		pthread_mutex_unlock(&checksumLock);
+		ret = block_write(item->block, copy);
+		break;
+	}
+	if (ret) {
+		dirty_mark(flag);
+		return -1;
+	}
+	return 1;
+}
+
+/**
+ * flusher_tails - Write back the expired last blocks cached for appends
+ *
+ * Files busy with an append, or opened or closed meanwhile, are left for the
+ * next pass.
+ */
+static void flusher_tails(int all, uint32_t now)
+{
+	if (pthread_mutex_trylock(&inodeLock))
+		return;
+	for (struct inode *inode = inodeTable; inode; inode = inode->next) {
+		if (pthread_mutex_trylock(&inode->appendLock))
+			continue;
+		if (inode->tail && inode->tailDirty &&
+		    (all || now - inode->tailDirtySince >= flusherExpire) &&
+		    data_write(inode->tailBlock, inode->tail) == 0) {
+			inode->tailDirty = 0;
+			flusherStats.tailBlocks++;
+		}
+		pthread_mutex_unlock(&inode->appendLock);
+	}
+	pthread_mutex_unlock(&inodeLock);
+}
+
+/** Write back the blocks due, with flushLock held */
+static void flusher_pass(void)
+{
+	uint32_t now = dirty_now();
+	int all = flusher_over(flusherBackground);
+	uint32_t count = 0;
+
+	for (uint32_t i = 0; i < superblock.amountFAT; i++)
+		count = flusher_pick(&dirtyFAT[i], all, now, count, i + 1, FLUSH_FAT, i);
+	count = flusher_pick(&dirtyDirectory, all, now, count,
+			     superblock.indexRootDirectory, FLUSH_DIRECTORY, 0);
+	/** table blocks are written with data_write(), which needs the checksums */
+	if (blockTable && (checksums || !superblock.indexChecksums))
+		for (uint32_t i = 0; i < table_blocks(); i++)
+			count = flusher_pick(&dirtyTable[i], all, now, count,
+					     superblock.indexDataBlock + tableBlocks[i],
+					     FLUSH_TABLE, i);
+	if (checksums)
+		for (uint32_t i = 0; i < checksum_blocks(); i++)
+			count = flusher_pick(&dirtyChecksums[i], all, now, count,
+					     superblock.indexDataBlock + checksumBlocks[i],
+					     FLUSH_CHECKSUMS, i);
+
+	qsort(flushItems, count, sizeof(*flushItems), flush_item_cmp);
+	for (uint32_t i = 0; i < count; i++) {
+		int ret = flush_item_write(&flushItems[i]);
+		if (ret < 0) {
+			fprintf(stderr, "fs_flusher: cannot write block %u\n", flushItems[i].block);
+			continue;
+		}
+		if (all)
+			flusherStats.backgroundBlocks += ret;
+		else
+			flusherStats.expiredBlocks += ret;
+	}
+	flusher_tails(all, now);
+}
+
+static void *flusher_main(void *arg)
+{
+	(void)arg;
+	/** a quarter of the expiry time, so that blocks are written soon after */
+	uint32_t interval = flusherExpire / 4;
+	if (interval < 10)
+		interval = 10;
+	if (interval > 1000)
+		interval = 1000;
+
+	pthread_mutex_lock(&flushLock);
+	while (!flusherStop) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += interval / 1000;
+		deadline.tv_nsec += interval % 1000 * 1000000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+		while (!flusherStop && !flusherUrgent &&
+		       pthread_cond_timedwait(&flusherWake, &flushLock, &deadline) == 0)
+			;
+		if (flusherStop)
+			break;
+		flusherUrgent = 0;
+		flusher_pass();
+		flusherStats.passes++;
+		pthread_cond_broadcast(&flusherDone);
+	}
+	pthread_mutex_unlock(&flushLock);
+	return NULL;
+}
+
+/**
+ * flusher_throttle - Hold a writer while too many blocks are dirty
+ *
+ * Waiting for a complete pass, rather than for the count to drop, always
+ * lets the writer go, even when every dirty block is expected to stay dirty.
+ */
+static void flusher_throttle(void)
+{
+	if (!flusherRunning || !flusher_over(flusherLimit))
+		return;
+	pthread_mutex_lock(&flushLock);
+	if (!flusherStop && flusher_over(flusherLimit)) {
+		uint32_t passes = flusherStats.passes;
+		flusherStats.throttles++;
+		flusherUrgent = 1;
+		pthread_cond_signal(&flusherWake);
+		while (!flusherStop && flusherStats.passes == passes)
+			pthread_cond_wait(&flusherDone, &flushLock);
+	}
+	pthread_mutex_unlock(&flushLock);
+}
+
+/**
+ * fs_flusher_start - Start writing back dirty metadata in the background
+ */
+int fs_flusher_start(uint32_t expireMillis, uint32_t backgroundRatio,
+		     uint32_t limitRatio)
+{
+	if(mount==-1)return -1;
+	if (fs_writable(__func__))
+		return -1;
+	if (flusherRunning) {
+		fprintf(stderr, "fs_flusher_start: already running\n");
+		return -1;
+	}
+	if (backgroundRatio > 100 || limitRatio > 100 || limitRatio < backgroundRatio) {
+		fprintf(stderr, "fs_flusher_start: invalid ratios %u/%u\n",
+			backgroundRatio, limitRatio);
+		return -1;
+	}
+	/** the flusher never loads anything itself */
+	if (dir_load() || table_load() || checksum_load(0))
+		return -1;
+	flushItems = malloc((superblock.amountFAT + 1 + table_blocks() + checksum_blocks()) *
+			    sizeof(*flushItems));
+	if (!flushItems) {
+		perror("fs_flusher_start: malloc");
+		return -1;
+	}
+
+	flusherExpire = expireMillis;
+	flusherBackground = backgroundRatio;
+	flusherLimit = limitRatio;
+	flusherStop = 0;
+	flusherUrgent = 0;
+	memset(&flusherStats, 0, sizeof(flusherStats));
+	if (pthread_create(&flusherThread, NULL, flusher_main, NULL)) {
+		fprintf(stderr, "fs_flusher_start: cannot create thread\n");
+		free(flushItems);
+		flushItems = NULL;
+		return -1;
+	}
+	flusherRunning = 1;
+	return 0;
+}
+
+/**
+ * fs_flusher_stop - Stop the background write-back
+ */
+int fs_flusher_stop(void)
+{
+	if (!flusherRunning)
+		return 0;
+	pthread_mutex_lock(&flushLock);
+	flusherStop = 1;
+	pthread_cond_signal(&flusherWake);
+	pthread_cond_broadcast(&flusherDone);
+	pthread_mutex_unlock(&flushLock);
+	pthread_join(flusherThread, NULL);
+	flusherRunning = 0;
+	free(flushItems);
+	flushItems = NULL;
+	return 0;
+}
+
+/**
+ * fs_flusher_stats - Get write-back statistics
+ */
+int fs_flusher_stats(struct fs_flusher_stats *stats)
+{
+	if(mount==-1)return -1;
+	if (!stats)
+		return -1;
+	pthread_mutex_lock(&flushLock);
+	*stats = flusherStats;
+	pthread_mutex_unlock(&flushLock);
+	stats->dirtyBlocks = atomic_load(&dirtyBlocks);
+	stats->cachedBlocks = flusher_cached();
+	stats->running = flusherRunning;
+	return 0;
+}
+
+/**========================== directories =============================================*/
+
+/**
+ * The root directory keeps the flat %FS_FILE_MAX_COUNT-entry table described
+ * above, so images stay readable by other ECS150FS implementations. Entries
+ * flagged %DIRENT_DIR are subdirectories: their first data block is the root
+ * node of a B+tree of directory entries sorted by name, one node per data
+ * block. The root node of a tree never moves (a root split pushes its content
+ * down into two new children), so a directory is identified by its root node
+ * for its whole life.
+ */
+
+/** Handle of the root directory table, as opposed to a B+tree root node */
+#define DIR_ROOT FAT_EOC
+
+/** B+tree node header magic ("BTRE") */
+#define BT_MAGIC 0x45525442
+/** Deepest tree we are willing to walk (fan-out is >= 127) */
+#define BT_MAX_DEPTH 16
+
+struct _btheader {
+	uint32_t magic;
+	uint8_t leaf;			// 1 for a leaf node
+	uint8_t reserved;
+	uint16_t count;			// entries (leaf) or keys (internal) in the node
+	uint32_t total;			// tree root only: entries in the directory
+	uint16_t child0;		// internal only: child holding names below key[0]
+	uint8_t padding[18];
+};
+
+struct _btkey {
+	char name[FS_FILENAME_LEN];	// smallest name found in @child
+	uint16_t child;
+};
+
+#define BT_LEAF_MAX ((BLOCK_SIZE - sizeof(struct _btheader)) / sizeof(struct _directory))
+#define BT_NODE_MAX ((BLOCK_SIZE - sizeof(struct _btheader)) / sizeof(struct _btkey))
+
+struct _btnode {
+	struct _btheader header;
+	union {
+		struct _directory entry[BT_LEAF_MAX];
+		struct _btkey key[BT_NODE_MAX];
+	};
+};
+_Static_assert(sizeof(struct _btnode) == BLOCK_SIZE, "B+tree node must fill one block");
+
+/**
+ * While fs_batch_commit() runs, nodes are read and written through a cache,
+ * so that each node changed by the batch is written once at the end rather
+ * than once per operation.
+ */
+#define BT_CACHE_BUCKETS 64
+
+struct bt_cached {
+	uint16_t node;
+	int8_t dirty;
+	struct _btnode n;
+	struct bt_cached *next;
+};
+
+static struct bt_cached **btCache;	// NULL when not caching
+
+static struct bt_cached *bt_cache_find(uint16_t node)
+{
+	struct bt_cached *c = btCache[node % BT_CACHE_BUCKETS];
+
+	while (c && c->node != node)
+		c = c->next;
+	return c;
+}
+
+static struct bt_cached *bt_cache_add(uint16_t node)
+{
+	struct bt_cached *c = malloc(sizeof(*c));
+
+	if (!c) {
+		perror("bt_cache_add: malloc");
+		return NULL;
+	}
+	c->node = node;
+	c->dirty = 0;
+	c->next = btCache[node % BT_CACHE_BUCKETS];
+	btCache[node % BT_CACHE_BUCKETS] = c;
+	return c;
+}
+
+static int bt_read(uint16_t node, struct _btnode *n)
+{
+	struct bt_cached *c = btCache ? bt_cache_find(node) : NULL;
+
+	if (c) {
+		*n = c->n;
+		return 0;
+	}
+	if (data_read(node, n))
+		return -1;
+	if (n->header.magic != BT_MAGIC) {
+		fprintf(stderr, "bt_read: block %u is not a directory node\n", node);
+		return -1;
+	}
+	if (btCache && (c = bt_cache_add(node)))
+		c->n = *n;
+	return 0;
+}
+
+static int bt_write(uint16_t node, const struct _btnode *n)
+{
+	if (!btCache)
+		return data_write(node, n);
+
+	struct bt_cached *c = bt_cache_find(node);
+	if (!c && !(c = bt_cache_add(node)))
+		return -1;
+	c->n = *n;
+	c->dirty = 1;
+	return 0;
+}
+
+/** Start caching nodes */
+static int bt_cache_start(void)
+{
+	btCache = calloc(BT_CACHE_BUCKETS, sizeof(*btCache));
+	if (!btCache) {
+		perror("bt_cache_start: calloc");
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * bt_cache_stop - Write back the nodes changed since bt_cache_start()
+ *
+ * Nodes freed meanwhile are dropped.
+ *
+ * Return: -1 if a node cannot be written (the nodes after it are dropped
+ * without being written). 0 otherwise.
+ */
+static int bt_cache_stop(void)
+{
+	struct bt_cached **cache = btCache;
+	int ret = 0;
+
+	btCache = NULL;
+	for (int i = 0; i < BT_CACHE_BUCKETS; i++) {
+		while (cache[i]) {
+			struct bt_cached *c = cache[i];
+			if (!ret && c->dirty && fat_get(c->node) != 0 && data_write(c->node, &c->n)) {
+				fprintf(stderr, "bt_cache_stop: cannot write directory node %u\n", c->node);
+				ret = -1;
+			}
+			cache[i] = c->next;
+			free(c);
+		}
+	}
+	free(cache);
+	return ret;
+}
+
+/** Child @i of internal node @n (0 <= i <= count) */
+static uint16_t bt_child(const struct _btnode *n, int i)
+{
+	return i == 0 ? n->header.child0 : n->key[i - 1].child;
+}
+
+/** Index of the child of internal node @n that may hold @name */
+static int bt_child_index(const struct _btnode *n, const char *name)
+{
+	int lo = 0, hi = n->header.count;
+
+	/** number of keys <= name */
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (strcmp(n->key[mid].name, name) <= 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/**
+ * bt_leaf_index - Find a name in a leaf
+ * @n: Leaf node
+ * @name: Entry name
+ * @found: Set to 1 if an entry named @name starts at the returned slot
+ *
+ * Entries are variable-sized records (see rec_slots()), so the leaf is scanned
+ * record by record; a leaf holds at most %BT_LEAF_MAX slots.
+ *
+ * Return: the slot of the first record whose name is not smaller than @name.
+ */
+static int bt_leaf_index(const struct _btnode *n, const char *name, int *found)
+{
+	int pos = 0, cmp = 1;
+
+	while (pos < n->header.count) {
+		cmp = strcmp(n->entry[pos].filename, name);
+		if (cmp >= 0)
+			break;
+		pos += rec_slots(&n->entry[pos]);
+	}
+	*found = pos < n->header.count && cmp == 0;
+	return pos;
+}
+
+/** Initialize an empty node */
+static void bt_init(struct _btnode *n, int leaf)
+{
+	memset(n, 0, sizeof(*n));
+	n->header.magic = BT_MAGIC;
+	n->header.leaf = leaf;
+}
+
+/**
+ * bt_descend - Walk from the tree root down to the leaf that may hold @name
+ * @root: Tree root node
+ * @name: Entry name
+ * @path: Filled with the nodes on the way (root first), may be NULL
+ * @childIndex: Filled with the child taken in each internal node, may be NULL
+ * @leaf: Filled with the content of the leaf
+ *
+ * Return: -1 on error. Otherwise the depth of the leaf (0 if root is a leaf).
+ */
+static int bt_descend(uint16_t root, const char *name, uint16_t *path,
+		      int *childIndex, struct _btnode *leaf)
+{
+	uint16_t node = root;
+
+	for (int depth = 0; depth < BT_MAX_DEPTH; depth++) {
+		if (bt_read(node, leaf))
+			return -1;
+		if (path)
+			path[depth] = node;
+		if (leaf->header.leaf)
+			return depth;
+
+		int i = bt_child_index(leaf, name);
+		if (childIndex)
+			childIndex[depth] = i;
+		node = bt_child(leaf, i);
+	}
+	fprintf(stderr, "bt_descend: directory tree too deep\n");
+	return -1;
+}
+
+/**
+ * bt_insert_node - Insert a record in the subtree rooted at @node
+ * @node: Subtree root
+ * @rec: New entry followed by its continuation slots
+ * @slots: Number of slots in @rec
+ * @upKey: Filled with the separator key if @node was split
+ * @upChild: Filled with the new right sibling if @node was split
+ * @depth: Depth of @node in the tree (0 for the tree root)
+ * @fullAbove: Number of full internal nodes right above @node
+ *
+ * A split of a leaf moves up through the full nodes above it, and splits the
+ * tree root too if they all are full. Before a leaf is split, and so before
+ * anything is written, the blocks that this takes are checked to be free.
+ *
+ * Return: -1 on error, -2 if the name already exists, 1 if @node was split,
+ * 0 otherwise.
+ */
+static int bt_insert_node(uint16_t node, const struct _directory *rec, int slots,
+			  char *upKey, uint16_t *upChild, int depth, int fullAbove)
+{
+	struct _btnode n, right;
+	int found;
+
+	if (bt_read(node, &n))
+		return -1;
+
+	if (n.header.leaf) {
+		int pos = bt_leaf_index(&n, rec->filename, &found);
+		if (found)
+			return -2;
+
+		if (n.header.count + slots <= (int)BT_LEAF_MAX) {
+			memmove(&n.entry[pos + slots], &n.entry[pos],
+				(n.header.count - pos) * sizeof(n.entry[0]));
+			memcpy(&n.entry[pos], rec, slots * sizeof(n.entry[0]));
+			n.header.count += slots;
+			return bt_write(node, &n);
+		}
+
+		/** one block per split node, plus a new child if the tree root splits */
+		if (summary_load())
+			return -1;
+		if (superblock.summary.freeBlocks <
+		    reservedBlocks + 1 + fullAbove + (fullAbove == depth)) {
+			fprintf(stderr, "bt_insert: not enough free blocks\n");
+			return -1;
+		}
+
+		/** full leaf: split the records in two halves of about the same size */
+		struct _directory all[BT_LEAF_MAX + DIRENT_MAX_SLOTS];
+		int total = n.header.count + slots;
+		int half = 0;
+		int indexRight = fat_alloc();
+		if (indexRight < 0)
+			return -1;
+
+		memcpy(all, n.entry, pos * sizeof(all[0]));
+		memcpy(&all[pos], rec, slots * sizeof(all[0]));
+		memcpy(&all[pos + slots], &n.entry[pos], (n.header.count - pos) * sizeof(all[0]));
+		while (half < total / 2)
+			half += rec_slots(&all[half]);
+
+		bt_init(&right, 1);
+		right.header.count = total - half;
+		memcpy(right.entry, &all[half], right.header.count * sizeof(all[0]));
+		n.header.count = half;
+		memcpy(n.entry, all, half * sizeof(all[0]));
+		memset(&n.entry[half], 0, (BT_LEAF_MAX - half) * sizeof(all[0]));
+
+		if (bt_write(indexRight, &right) || bt_write(node, &n))
+			return -1;
+		strcpy(upKey, right.entry[0].filename);
+		*upChild = indexRight;
+		return 1;
+	}
+
+	char childKey[FS_FILENAME_LEN];
+	uint16_t childRight;
+	int i = bt_child_index(&n, rec->filename);
+	if (depth + 1 >= BT_MAX_DEPTH) {
+		fprintf(stderr, "bt_insert: directory tree too deep\n");
+		return -1;
+	}
+	int ret = bt_insert_node(bt_child(&n, i), rec, slots, childKey, &childRight, depth + 1,
+				 n.header.count == BT_NODE_MAX ? fullAbove + 1 : 0);
+	if (ret != 1)
+		return ret;
+
+	/** the child was split: its new sibling goes right after it */
+	struct _btkey newKey;
+	memset(&newKey, 0, sizeof(newKey));
+	strcpy(newKey.name, childKey);
+	newKey.child = childRight;
+
+	if (n.header.count < BT_NODE_MAX) {
+		memmove(&n.key[i + 1], &n.key[i], (n.header.count - i) * sizeof(n.key[0]));
+		n.key[i] = newKey;
+		n.header.count++;
+		return bt_write(node, &n);
+	}
+
+	/** full internal node: the middle key moves up */
+	struct _btkey all[BT_NODE_MAX + 1];
+	int mid = (BT_NODE_MAX + 1) / 2;
+	int indexRight = fat_alloc();
+	if (indexRight < 0)
+		return -1;
+
+	memcpy(all, n.key, i * sizeof(all[0]));
+	all[i] = newKey;
+	memcpy(&all[i + 1], &n.key[i], (n.header.count - i) * sizeof(all[0]));
+
+	bt_init(&right, 0);
+	right.header.child0 = all[mid].child;
+	right.header.count = BT_NODE_MAX - mid;
+	memcpy(right.key, &all[mid + 1], right.header.count * sizeof(all[0]));
+	n.header.count = mid;
+	memcpy(n.key, all, mid * sizeof(all[0]));
+	memset(&n.key[mid], 0, (BT_NODE_MAX - mid) * sizeof(all[0]));
+
+	if (bt_write(indexRight, &right) || bt_write(node, &n))
+		return -1;
+	strcpy(upKey, all[mid].name);
+	*upChild = indexRight;
+	return 1;
+}
+
+/**
+ * bt_insert - Add a record to a directory tree
+ *
+ * Return: -1 on error or if the name already exists. 0 otherwise.
+ */
+static int bt_insert(uint16_t root, const struct _directory *rec, int slots)
+{
+	struct _btnode n, left;
+	char upKey[FS_FILENAME_LEN];
+	uint16_t upChild;
+
+	int ret = bt_insert_node(root, rec, slots, upKey, &upChild, 0, 0);
+	if (ret == -2)
+		fprintf(stderr, "bt_insert: %s already exists\n", rec->filename);
+	if (ret < 0)
+		return -1;
+
+	if (bt_read(root, &n))
+		return -1;
+	if (ret == 1) {
+		/** root split: move its (left) half into a new child */
+		int indexLeft = fat_alloc();
+		if (indexLeft < 0)
+			return -1;
+		left = n;
+		left.header.total = 0;
+		if (bt_write(indexLeft, &left))
+			return -1;
+
+		uint32_t total = n.header.total;
+		bt_init(&n, 0);
+		n.header.total = total;
+		n.header.count = 1;
+		n.header.child0 = indexLeft;
+		strcpy(n.key[0].name, upKey);
+		n.key[0].child = upChild;
+	}
+	n.header.total++;
+	return bt_write(root, &n);
+}
+
+/**
+ * bt_remove - Remove an entry from a directory tree
+ *
+ * Leaves that become empty are unlinked from their parent and freed; nodes are
+ * otherwise not rebalanced.
+ *
+ * Return: -1 on error or if there is no such entry. 0 otherwise.
+ */
+static int bt_remove(uint16_t root, const char *name)
+{
+	struct _btnode n;
+	uint16_t path[BT_MAX_DEPTH];
+	int childIndex[BT_MAX_DEPTH];
+	int found;
+
+	int depth = bt_descend(root, name, path, childIndex, &n);
+	if (depth < 0)
+		return -1;
+	int pos = bt_leaf_index(&n, name, &found);
+	if (!found)
+		return -1;
+
+	int slots = rec_slots(&n.entry[pos]);
+	memmove(&n.entry[pos], &n.entry[pos + slots],
+		(n.header.count - pos - slots) * sizeof(n.entry[0]));
+	n.header.count -= slots;
+	memset(&n.entry[n.header.count], 0, slots * sizeof(n.entry[0]));
+
+	if (n.header.count == 0 && depth > 0) {
+		struct _btnode parent;
+		int i = childIndex[depth - 1];
+
+		if (bt_read(path[depth - 1], &parent))
+			return -1;
+		if (parent.header.count > 0) {
+			/** unlink the empty leaf and give its block back */
+			if (i == 0) {
+				parent.header.child0 = parent.key[0].child;
+				i = 1;
+			}
+			memmove(&parent.key[i - 1], &parent.key[i],
+				(parent.header.count - i) * sizeof(parent.key[0]));
+			parent.header.count--;
+			memset(&parent.key[parent.header.count], 0, sizeof(parent.key[0]));
+			if (bt_write(path[depth - 1], &parent) || fat_set(path[depth], 0))
+				return -1;
+			depth = -1;
+		}
+	}
+	if (depth >= 0 && bt_write(path[depth], &n))
+		return -1;
+
+	if (bt_read(root, &n))
+		return -1;
+	n.header.total--;
+	return bt_write(root, &n);
+}
+
+/** Free every node of a directory tree */
+static int bt_free(uint16_t node, int depth)
+{
+	struct _btnode n;
+
+	if (depth >= BT_MAX_DEPTH || bt_read(node, &n))
+		return -1;
+	if (!n.header.leaf) {
+		for (int i = 0; i <= n.header.count; i++)
+			if (bt_free(bt_child(&n, i), depth + 1))
+				return -1;
+	}
+	return fat_set(node, 0);
+}
+
+/**
+ * root_find - Find an entry in the root directory table
+ *
+ * Return: -1 if there is no such entry. Otherwise the slot of the entry.
+ */
+static int root_find(const char *name)
+{
+	/** continuation slots start with DIRENT_CONT, which no name does */
+	if (name[0]=='\0' || name[0]==DIRENT_CONT)
+		return -1;
+	size_t i = scan_find_dirent(directory, FS_FILE_MAX_COUNT, name);
+	return i < FS_FILE_MAX_COUNT ? (int)i : -1;
+}
+
+/** Mark @count root slots starting at @slot as used (@used = 1) or free */
+static void root_account(int count, int used)
+{
+	dir_touch();
+	if (validSummary)
+		superblock.summary.freeEntries += used ? -count : count;
+}
+
+/**
+ * dir_find - Look up an entry in a directory
+ * @dir: %DIR_ROOT or the tree root of a subdirectory
+ * @name: Entry name
+ * @entry: Filled with the entry if found, may be NULL
+ * @data: Filled with the content of an inline file, may be NULL
+ *
+ * Return: -1 on error, 1 if there is no such entry, 0 otherwise.
+ */
+static int dir_find(uint16_t dir, const char *name, struct _directory *entry,
+		    uint8_t *data)
+{
+	const struct _directory *rec;
+	struct _btnode n;
+
+	if (dir == DIR_ROOT) {
+		if (dir_load())
+			return -1;
+		int slot = root_find(name);
+		if (slot < 0)
+			return 1;
+		rec = &directory[slot];
+	} else {
+		int found;
+		if (bt_descend(dir, name, NULL, NULL, &n) < 0)
+			return -1;
+		int pos = bt_leaf_index(&n, name, &found);
+		if (!found)
+			return 1;
+		rec = &n.entry[pos];
+	}
+	if (entry)
+		*entry = *rec;
+	if (data)
+		rec_unpack(rec, data);
+	return 0;
+}
+
+/**
+ * dir_add - Add a new entry to a directory
+ * @dir: %DIR_ROOT or the tree root of a subdirectory
+ * @entry: New entry
+ * @data: Content of an inline file
+ *
+ * Return: -1 on error, if the name exists or if the directory is full.
+ * 0 otherwise.
+ */
+static int dir_add(uint16_t dir, const struct _directory *entry, const uint8_t *data)
+{
+	struct _directory rec[DIRENT_MAX_SLOTS];
+	int slots = rec_pack(rec, entry, data);
+
+	if (dir != DIR_ROOT)
+		return bt_insert(dir, rec, slots);
+
+	if (dir_find(DIR_ROOT, entry->filename, NULL, NULL) != 1) {
+		fprintf(stderr, "dir_add: %s already exist!\n", entry->filename);
+		return -1;
+	}
+	/** first run of @slots empty slots */
+	for (int i = 0; i + slots <= FS_FILE_MAX_COUNT; i++)
+	{
+		i += scan_find_free_dirent(&directory[i], FS_FILE_MAX_COUNT - i);
+		int run = 1;
+		while (run < slots && i + run < FS_FILE_MAX_COUNT &&
+		       directory[i + run].filename[0]=='\0')
+			run++;
+		if (run == slots && i + slots <= FS_FILE_MAX_COUNT)
+		{
+			pthread_mutex_lock(&metaLock);
+			memcpy(&directory[i], rec, slots * sizeof(rec[0]));
+			pthread_mutex_unlock(&metaLock);
+			root_account(slots, 1);
+			return 0;
+		}
+		i += run;
+	}
+	fprintf(stderr, "dir_add: directory full! (max 128 file)\n");
+	return -1;
+}
+
+/**
+ * dir_update - Replace the entry that has the same name as @entry
+ * @dir: %DIR_ROOT or the tree root of a subdirectory
+ * @entry: New version of the entry
+ * @data: Content of an inline file
+ *
+ * The entry is updated in place. An inline file that grows needs free slots
+ * right after its entry (root table) or room in its leaf (subdirectory).
+ *
+ * Return: -1 on error, if there is no such entry or no room for it. 0 otherwise.
+ */
+static int dir_update(uint16_t dir, const struct _directory *entry, const uint8_t *data)
+{
+	struct _directory rec[DIRENT_MAX_SLOTS];
+	int slots = rec_pack(rec, entry, data);
+
+	if (dir == DIR_ROOT) {
+		if (dir_load())
+			return -1;
+		int slot = root_find(entry->filename);
+		if (slot < 0)
+			return -1;
+		int old = rec_slots(&directory[slot]);
+		for (int i = old; i < slots; i++)
+			if (slot + i >= FS_FILE_MAX_COUNT || directory[slot + i].filename[0]!='\0')
+				return -1;
+		pthread_mutex_lock(&metaLock);
+		memcpy(&directory[slot], rec, slots * sizeof(rec[0]));
+		if (old > slots)
+			memset(&directory[slot + slots], 0, (old - slots) * sizeof(rec[0]));
+		pthread_mutex_unlock(&metaLock);
+		dir_touch();
+		if (old != slots)
+			root_account(old > slots ? old - slots : slots - old, slots > old);
+		return 0;
+	}
+
+	struct _btnode n;
+	uint16_t path[BT_MAX_DEPTH];
+	int found;
+	int depth = bt_descend(dir, entry->filename, path, NULL, &n);
+	if (depth < 0)
+		return -1;
+	int pos = bt_leaf_index(&n, entry->filename, &found);
+	if (!found)
+		return -1;
+	int old = rec_slots(&n.entry[pos]);
+	if (n.header.count - old + slots > (int)BT_LEAF_MAX)
+		return -1;
+	memmove(&n.entry[pos + slots], &n.entry[pos + old],
+		(n.header.count - pos - old) * sizeof(n.entry[0]));
+	memcpy(&n.entry[pos], rec, slots * sizeof(rec[0]));
+	n.header.count += slots - old;
+	if (old > slots)
+		memset(&n.entry[n.header.count], 0, (old - slots) * sizeof(rec[0]));
+	return bt_write(path[depth], &n);
+}
+
+/**
+ * dir_remove - Remove an entry from a directory
+ *
+ * Return: -1 on error or if there is no such entry. 0 otherwise.
+ */
+static int dir_remove(uint16_t dir, const char *name)
+{
+	if (dir != DIR_ROOT)
+		return bt_remove(dir, name);
+
+	if (dir_load())
+		return -1;
+	int slot = root_find(name);
+	if (slot < 0)
+		return -1;
+	int slots = rec_slots(&directory[slot]);
+	pthread_mutex_lock(&metaLock);
+	memset(&directory[slot], 0, slots * sizeof(directory[0]));
+	pthread_mutex_unlock(&metaLock);
+	root_account(slots, 0);
+	return 0;
+}
+
+/**
+ * path_lookup - Resolve the directory part of a path
+ * @path: Path such as "name", "dir/name" or "/dir/sub/name"
+ * @parent: Filled with the directory that holds the last component
+ * @name: Filled with the last component (%FS_FILENAME_LEN bytes)
+ *
+ * Every component must be 1 to %FS_FILENAME_LEN - 1 characters long, and all
+ * components but the last must name existing directories.
+ *
+ * Return: -1 if @path is invalid or a directory does not exist. 0 otherwise.
+ */
+static int path_lookup(const char *path, uint16_t *parent, char *name)
+{
+	struct _directory entry;
+
+	if (!path)
+		return -1;
+	if (*path == '/')
+		path++;
+
+	*parent = DIR_ROOT;
+	for (;;) {
+		const char *end = strchr(path, '/');
+		size_t len = end ? (size_t)(end - path) : strlen(path);
+
+		if (len == 0 || len >= FS_FILENAME_LEN)
+			return -1;
+		/** control characters would clash with DIRENT_CONT slots */
+		for (size_t i = 0; i < len; i++)
+			if ((unsigned char)path[i] < ' ')
+				return -1;
+		memset(name, 0, FS_FILENAME_LEN);
+		memcpy(name, path, len);
+		if (!end)
+			return 0;
+
+		if (dir_find(*parent, name, &entry, NULL) || !(entry.flags & DIRENT_DIR))
+			return -1;
+		*parent = entry.indexFirstDataBlock;
+		path = end + 1;
+	}
+}
+
+/**
+ * chain_free - Drop a reference to a FAT chain
+ * @indexBlock: Head of the chain
+ * @index: Non-zero if the chain holds the index blocks of an indexed file, in
+ * which case the chunks they reference are dropped along with them
+ *
+ * Blocks are released up to the first one that is still referenced from
+ * elsewhere, which keeps the rest of the chain for its other owners.
+ */
+static int chain_free(uint16_t indexBlock, int index)
+{
+	struct _chunkref refs[CHUNK_PER_INDEX];
+
+	if (table_load())
+		return -1;
+
+	while (indexBlock != FAT_EOC) {
+		if (indexBlock >= superblock.amountDataBlock) {
+			fprintf(stderr, "chain_free: block %u out of bounds\n", indexBlock);
+			return -1;
+		}
+		if (blockTable) {
+			struct _blockinfo *info = &blockTable[indexBlock];
+			if (info->refs) {
+				table_ref(indexBlock, -1);
+				return 0;
+			}
+			if (info->fingerprint)
+				table_set(indexBlock, 0, 0);
+		}
+		if (index) {
+			if (data_read(indexBlock, refs))
+				return -1;
+			for (uint32_t i = 0; i < CHUNK_PER_INDEX; i++)
+				if (refs[i].indexFirstBlock != 0 && chain_free(refs[i].indexFirstBlock, 0))
+					return -1;
+		}
+		int indexNextBlock = fat_get(indexBlock);
+		if (indexNextBlock < 0 || fat_set(indexBlock, 0))
+			return -1;
+		indexBlock = indexNextBlock;
+	}
+	return 0;
+}
+
+/**========================== deduplication =============================================*/
+
+/**
+ * With FS_FEATURE_DEDUP, every chunk written to an indexed file (see
+ * DIRENT_INDEXED) is fingerprinted. If a chunk with the same content is
+ * already stored, the new index entry points to the existing chain and its
+ * reference count is raised instead of writing the data again. Chunks are
+ * never modified in place: rewriting one stores a new chain and drops a
+ * reference to the old one, which makes sharing copy-on-write.
+ */
+
+/** Fingerprint of a chunk, never 0 */
+static uint32_t fs_fingerprint(const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	uint64_t hash = 0x9E3779B97F4A7C15ull ^ len;
+
+	for (size_t i = 0; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)) {
+		uint64_t word;
+		memcpy(&word, p + i, sizeof(word));
+		hash = (hash ^ (word * 0xFF51AFD7ED558CCDull)) * 0xC4CEB9FE1A85EC53ull;
+		hash ^= hash >> 29;
+	}
+	for (size_t i = len & ~(sizeof(uint64_t) - 1); i < len; i++)
+		hash = (hash ^ p[i]) * 0x100000001B3ull;
+	hash ^= hash >> 32;
+	return (uint32_t)hash | 1;
+}
+
+/**
+ * fingerprint_map_build - Index all fingerprints of the block table
+ *
+ * Return: -1 if memory cannot be allocated. 0 otherwise.
+ */
+static int fingerprint_map_build(void)
+{
+	uint32_t size = 1024;
+
+	while (size < 2u * superblock.amountDataBlock)
+		size *= 2;
+	free(fingerprintMap);
+	fingerprintMap = calloc(size, sizeof(*fingerprintMap));
+	fingerprintMapUsed = 0;
+	if (!fingerprintMap) {
+		perror("fingerprint_map_build: calloc");
+		fingerprintMapSize = 0;
+		return -1;
+	}
+	fingerprintMapSize = size;
+
+	for (uint32_t i = 1; i < superblock.amountDataBlock; i++) {
+		uint32_t fingerprint = blockTable[i].fingerprint;
+		if (!fingerprint)
+			continue;
+		uint32_t slot = fingerprint & (size - 1);
+		while (fingerprintMap[slot])
+			slot = (slot + 1) & (size - 1);
+		fingerprintMap[slot] = i;
+		fingerprintMapUsed++;
+	}
+	return 0;
+}
+
+/**
+ * fingerprint_insert - Record that block @indexBlock carries its fingerprint
+ *
+ * Entries of released blocks are left behind and skipped by lookups, until
+ * the map is rebuilt.
+ */
+static int fingerprint_insert(uint16_t indexBlock)
+{
+	if (!fingerprintMap || 4 * (fingerprintMapUsed + 1) > 3 * fingerprintMapSize)
+		return fingerprint_map_build();
+
+	uint32_t slot = blockTable[indexBlock].fingerprint & (fingerprintMapSize - 1);
+	while (fingerprintMap[slot])
+		slot = (slot + 1) & (fingerprintMapSize - 1);
+	fingerprintMap[slot] = indexBlock;
+	fingerprintMapUsed++;
+	return 0;
+}
+
+/**
+ * chain_equals - Compare a chain of exactly @blocks blocks with @data
+ *
+ * Return: -1 on I/O error, 1 if they match, 0 otherwise.
+ */
+static int chain_equals(uint16_t indexBlock, const uint8_t *data, uint32_t blocks)
+{
+	char bounce[BLOCK_SIZE];
+
+	for (uint32_t i = 0; i < blocks; i++) {
+		if (indexBlock == FAT_EOC)
+			return 0;
+		if (data_read(indexBlock, bounce))
+			return -1;
+		if (memcmp(bounce, data + i * BLOCK_SIZE, BLOCK_SIZE))
+			return 0;
+		int indexNextBlock = fat_get(indexBlock);
+		if (indexNextBlock < 0)
+			return -1;
+		indexBlock = indexNextBlock;
+	}
+	return indexBlock == FAT_EOC;
+}
+
+/**
+ * dedup_find - Look for a stored chain holding @data
+ * @fingerprint: fs_fingerprint() of @data
+ * @data: Chunk content, @blocks whole blocks
+ * @blocks: Length of @data in blocks
+ *
+ * Candidates are compared byte for byte, so fingerprint collisions are
+ * harmless.
+ *
+ * Return: -1 on error, 0 if there is no such chain, otherwise its head.
+ */
+static int dedup_find(uint32_t fingerprint, const uint8_t *data, uint32_t blocks)
+{
+	if (!fingerprintMap && fingerprint_map_build())
+		return -1;
+
+	uint32_t slot = fingerprint & (fingerprintMapSize - 1);
+	for (; fingerprintMap[slot]; slot = (slot + 1) & (fingerprintMapSize - 1)) {
+		uint16_t candidate = fingerprintMap[slot];
+		if (blockTable[candidate].fingerprint != fingerprint ||
+		    blockTable[candidate].refs == UINT16_MAX)
+			continue;
+		int ret = chain_equals(candidate, data, blocks);
+		if (ret)
+			return ret < 0 ? -1 : candidate;
+	}
+	return 0;
+}
+
+/**
+ * chunk_store - Store a chunk in a new or shared FAT chain
+ * @data: Chunk content, padded with zeros up to a whole number of blocks
+ * @length: Length of @data in bytes (not counting the padding)
+ *
+ * Return: -1 if the disk is full or on I/O error. Otherwise the head of the
+ * chain.
+ */
+static int chunk_store(const uint8_t *data, uint32_t length)
+{
+	uint32_t blocks = (length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	uint32_t fingerprint = 0;
+
+	if (superblock.features & FS_FEATURE_DEDUP) {
+		struct timespec start, end;
+
+		if (table_load())
+			return -1;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		fingerprint = fs_fingerprint(data, blocks * BLOCK_SIZE);
+		int head = dedup_find(fingerprint, data, blocks);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		dedupStats.lookups++;
+		dedupStats.hashedBytes += blocks * BLOCK_SIZE;
+		dedupStats.hashNanoseconds += (end.tv_sec - start.tv_sec) * 1000000000ll +
+					      (end.tv_nsec - start.tv_nsec);
+		if (head < 0)
+			return -1;
+		if (head > 0) {
+			table_ref(head, 1);
+			dedupStats.hits++;
+			return head;
+		}
+	}
+
+	/** chain built from its end, so that each block is linked when written */
+	int head = FAT_EOC;
+	for (uint32_t i = blocks; i-- > 0; ) {
+		int indexBlock = fat_alloc();
+		if (indexBlock < 0 || fat_set(indexBlock, head) ||
+		    data_write(indexBlock, data + i * BLOCK_SIZE)) {
+			if (indexBlock >= 0)
+				fat_set(indexBlock, 0);
+			chain_free(head, 0);
+			return -1;
+		}
+		head = indexBlock;
+	}
+
+	if (fingerprint && blockTable) {
+		table_set(head, blockTable[head].refs, fingerprint);
+		if (fingerprint_insert(head))
+			return -1;
+	}
+	return head;
+}
+
+/**
+ * table_create - Allocate an empty block table
+ *
+ * Return: -1 if the disk is full or on I/O error. 0 otherwise.
+ */
+static int table_create(void)
+{
+	static const char zero[BLOCK_SIZE];
+	int head = FAT_EOC;
+
+	if (superblock.indexBlockTable)
+		return table_load();
+
+	for (uint32_t i = 0; i < table_blocks(); i++) {
+		int indexBlock = fat_alloc();
+		if (indexBlock < 0 || fat_set(indexBlock, head) ||
+		    data_write(indexBlock, zero)) {
+			if (indexBlock >= 0)
+				fat_set(indexBlock, 0);
+			chain_free(head, 0);
+			fprintf(stderr, "table_create: no room for the block table\n");
+			return -1;
+		}
+		head = indexBlock;
+	}
+	summary_touch();
+	superblock.indexBlockTable = head;
+	/** the flusher must not see the table half loaded */
+	pthread_mutex_lock(&flushLock);
+	int ret = table_load();
+	pthread_mutex_unlock(&flushLock);
+	return ret;
+}
+
+static int log_checkpoint(void);
+
+/**
+ * fs_writable - Refuse modifications while a snapshot is mounted
+ * @func: Name of the caller, for the error message
+ *
+ * Modifications first wait for the flusher if too many blocks are dirty, and
+ * take a checkpoint if enough blocks died in the log since the last one.
+ *
+ * Return: -1 if the mounted file system is a snapshot, or if the checkpoint
+ * fails. 0 otherwise.
+ */
+static int fs_writable(const char *func)
+{
+	if (!snapshotDirectory) {
+		flusher_throttle();
+		if (logDeadCount >= LOG_CHECKPOINT_BLOCKS && log_checkpoint())
+			return -1;
+		return 0;
+	}
+	fprintf(stderr, "%s: snapshots are read-only\n", func);
+	return -1;
+}
+
+/**========================== snapshots =============================================*/
+
+/**
+ * A snapshot is a copy of the root directory table, stored in a data block
+ * listed in superblock.snapshots. Subdirectory trees are copied node by node,
+ * but files are not copied at all: the snapshot takes a reference to their
+ * first block, so that later writes copy whatever they modify (see
+ * chain_unshare()). Creating a snapshot thus costs time proportional to the
+ * number of directory entries, whatever the amount of data.
+ */
+
+/** Recursion depth (directory nesting plus tree levels) accepted in a snapshot */
+#define SNAPSHOT_MAX_DEPTH 64
+
+static int snapshot_copy_tree(uint16_t node, int depth);
+static int snapshot_release_tree(uint16_t node, int depth);
+
+/**
+ * snapshot_hold - Take a snapshot reference to the content of an entry
+ * @entry: Entry of the snapshot, updated to point to the copy of a subdirectory
+ * @depth: Current recursion depth
+ *
+ * Return: -1 on error (no reference is taken). 0 otherwise.
+ */
+static int snapshot_hold(struct _directory *entry, int depth)
+{
+	uint16_t head = entry->indexFirstDataBlock;
+
+	if (entry->flags & DIRENT_DIR) {
+		int copy = snapshot_copy_tree(head, depth + 1);
+		if (copy < 0)
+			return -1;
+		entry->indexFirstDataBlock = copy;
+		return 0;
+	}
+	if (head == FAT_EOC)
+		return 0;
+	if (head >= superblock.amountDataBlock || blockTable[head].refs == UINT16_MAX) {
+		fprintf(stderr, "snapshot_hold: cannot share %s\n", entry->filename);
+		return -1;
+	}
+	table_ref(head, 1);
+	return 0;
+}
+
+/** Drop the reference taken by snapshot_hold() */
+static int snapshot_drop(const struct _directory *entry, int depth)
+{
+	if (entry->flags & DIRENT_DIR)
+		return snapshot_release_tree(entry->indexFirstDataBlock, depth + 1);
+	return chain_free(entry->indexFirstDataBlock, entry->flags & DIRENT_INDEXED);
+}
+
+/**
+ * snapshot_copy_tree - Copy a directory tree for a snapshot
+ *
+ * Return: -1 on error (nothing stays allocated or referenced). Otherwise the
+ * root node of the copy.
+ */
+static int snapshot_copy_tree(uint16_t node, int depth)
+{
+	struct _btnode n;
+	int i = 0, copy = -1;
+
+	if (depth >= SNAPSHOT_MAX_DEPTH) {
+		fprintf(stderr, "snapshot_copy_tree: directories nested too deep\n");
+		return -1;
+	}
+	if (bt_read(node, &n))
+		return -1;
+
+	if (n.header.leaf) {
+		for (; i < n.header.count; i += rec_slots(&n.entry[i]))
+			if (snapshot_hold(&n.entry[i], depth))
+				goto undo;
+	} else {
+		for (; i <= n.header.count; i++) {
+			int child = snapshot_copy_tree(bt_child(&n, i), depth + 1);
+			if (child < 0)
+				goto undo;
+			if (i == 0)
+				n.header.child0 = child;
+			else
+				n.key[i - 1].child = child;
+		}
+	}
+
+	copy = fat_alloc();
+	if (copy >= 0 && bt_write(copy, &n) == 0)
+		return copy;
+	if (copy >= 0)
+		fat_set(copy, 0);
+
+undo:
+	/** release what was copied before the failure */
+	for (int j = 0; j < i; ) {
+		if (n.header.leaf) {
+			snapshot_drop(&n.entry[j], depth);
+			j += rec_slots(&n.entry[j]);
+		} else {
+			snapshot_release_tree(bt_child(&n, j), depth + 1);
+			j++;
+		}
+	}
+	return -1;
+}
+
+/** Release a directory tree copied by snapshot_copy_tree() */
+static int snapshot_release_tree(uint16_t node, int depth)
+{
+	struct _btnode n;
+
+	if (depth >= SNAPSHOT_MAX_DEPTH || bt_read(node, &n))
+		return -1;
+	if (n.header.leaf) {
+		for (int i = 0; i < n.header.count; i += rec_slots(&n.entry[i]))
+			if (snapshot_drop(&n.entry[i], depth))
+				return -1;
+	} else {
+		for (int i = 0; i <= n.header.count; i++)
+			if (snapshot_release_tree(bt_child(&n, i), depth + 1))
+				return -1;
+	}
+	return fat_set(node, 0);
+}
+
+/** Close the disk of a mount that failed, which saves an unchanged RAM disk */
+static int mount_abort(void)
+{
+	if (block_disk_close())
+		fprintf(stderr, "fs_mount: cannot close the virtual disk\n");
+	return -1;
+}
+
+/**
+ * fs_mount - Mount a file system
+ * @diskname: Name of the virtual disk file
+ *
+ * Open the virtual disk file @diskname and mount the file system that it
+ * contains. A file system needs to be mounted before files can be read from it
+ * with fs_read() or written to it with fs_write().
+ *
+ * Return: -1 if virtual disk file @diskname cannot be opened, or if no valid
+ * file system can be located. 0 otherwise.
+ */
+
+int fs_mount(const char *diskname)
+{
+
+	//  1 :  Open the virtual disk
+	//printf("mount start\n");
+	/*Return: -1 if no FS is currently mounted, or if the virtual disk cannot be closed, or if there are still open file descriptors.*/
+	if (mount==0){
+		fprintf(stderr, "fs_mount: a file system is already mounted\n");
+		return -1;
+	}
+	if (block_disk_open(diskname)!=0){
+			printf("Wrong disk name\n");
+			fprintf(stderr, "fs_mount:virtual disk file %s cannot be opened \n", diskname);
+			return -1;
+		}
+
+	//  2-1: Read  superblock
+
+	if (block_read(0, &superblock)!=0){
+			fprintf(stderr, "fs_mount:read superBlock error\n");
+			return mount_abort();
+		}
+
+	//  error checking signature
+	if (strncmp(superblock.signature,"ECS150FS", 8)){
+			fprintf(stderr, "fs_mount:signature error: \n" );
+			return mount_abort();
+		}
+
+	// error checking total amount of block = block_disk_count() returns.
+	if (superblock.amountVD <= 3 ){
+			fprintf(stderr, "fs_mount: amountVD %d too small \n", superblock.amountVD);
+			return mount_abort();
+		}
+
+	if (superblock.amountVD != block_disk_count()){
+			fprintf(stderr, "fs_mount:amountVD != block_disk_count \n");
+			return mount_abort();
+		}
+
+	// error checking layout: FAT, then root directory, then data blocks
+	if (superblock.amountFAT == 0 ||
+	    superblock.amountFAT > FS_SUMMARY_MAX_FAT ||
+	    superblock.amountFAT * FAT_PER_BLOCK < superblock.amountDataBlock ||
+	    superblock.indexRootDirectory != superblock.amountFAT + 1 ||
+	    superblock.indexDataBlock != superblock.amountFAT + 2 ||
+	    superblock.indexDataBlock + superblock.amountDataBlock != superblock.amountVD){
+			fprintf(stderr, "fs_mount: inconsistent superblock layout\n");
+			return mount_abort();
+		}
+
+	if (superblock.features & ~FS_FEATURE_ALL) {
+			fprintf(stderr, "fs_mount: unsupported features 0x%x\n", superblock.features);
+			return mount_abort();
+		}
+
+	//  2-2: FAT and root directory are faulted in on first access
+
+	FAT = calloc(superblock.amountFAT, sizeof(*FAT));
+	dirtyFAT = calloc(superblock.amountFAT, sizeof(*dirtyFAT));
+	discardMap = calloc((superblock.amountDataBlock + 63) / 64, sizeof(*discardMap));
+	if (!FAT || !dirtyFAT || !discardMap) {
+		perror("fs_mount: calloc");
+		fat_release();
+		return mount_abort();
+	}
+	loadedDirectory = 0;
+	dirtyDirectory = 0;
+
+	//  2-3: Free-space summary, rebuilt lazily by summary_load() if invalid
+	validSummary = summary_check();
+	cleanMount = validSummary;
+	if (!validSummary)
+		superblock.summary.clean = 0;
+
+	mount=0;
+	//printf("Successfully mounted\n");
+	return 0;
+}
+
+
+/**
+ * fs_umount - Unmount file system
+ *
+ * Unmount the currently mounted file system and close the underlying virtual
+ * disk file.
+ *
+ * Return: -1 if no FS is currently mounted, or if the virtual disk cannot be
+ * closed, or if there are still open file descriptors. 0 otherwise.
+ */
+
+int fs_umount(void)
+{
+	/**
+	1-2  fs_umount() makes sure that the virtual disk is properly closed and that all the internal data structures of the FS layer are properly cleaned.
+	*/
+	if(mount==-1){
+		fprintf(stderr, "fs_umount: No disk is mounted\n");
+		return -1;
+	}
+	/** requests still queued may close descriptors */
+	fs_async_stop();
+	batch_discard();
+	/* if there are still open file descriptors.*/
+	for (uint32_t w=0; w<FD_MAX / 64;w++){
+		if (atomic_load(&fdBitmap[w])){
+			fprintf(stderr, "fs_stat: file Descriptor %u still not closed. \n",
+				w * 64 + __builtin_ctzll(atomic_load(&fdBitmap[w])));
+			return -1;
+		}
+	}
+	/** files stay open while data borrowed from them is not released */
+	if (inodeTable){
+		fprintf(stderr, "fs_umount: data borrowed from %s still not released\n",
+			inodeTable->filename);
+		return -1;
+	}
+	/**
+	At this point, all data must be written onto the virtual disk. Another application that mounts the file system at a later point in time must see the previously created files and the data that was written. This means that whenever fs_umount() is called, all meta-information and file data must have been written out to disk.
+	*/
+	/** nothing is modified while a snapshot is mounted */
+	fs_scrub_stop();
+	fs_flusher_stop();
+	if (!snapshotDirectory && fs_sync_meta())
+		return -1;
+	fat_release();
+	table_release();
+	checksum_release();
+	memset(&checksumStats, 0, sizeof(checksumStats));
+	free(logDead);
+	logDead = NULL;
+	logDeadCount = logDeadMax = 0;
+	logSegmentEnd = 0;
+	memset(&logStats, 0, sizeof(logStats));
+	snapshotDirectory = 0;
+
+	/** the file system is unmounted even if the disk could not be saved */
+	mount=-1;
+	if (block_disk_close()==-1 ){
+			fprintf(stderr, "fs_umount: Close disk error\n");
+			return -1;
+		}
+	return 0;
+}
+
+/*
+1,8d0
+< FS Info:
+< total_blk_count=8198
+< fat_blk_count=4
+< rdir_blk=5
+< data_blk=6
+< data_blk_count=8192
+< fat_free_ratio=8191/8192
+< rdir_free_ratio=128/128
+*/
+
+/**
+ * fs_ls - List files on file system
+ *
+ * List information about the files located in the root directory.
+ *
+ * Return: -1 if no FS is currently mounted. 0 otherwise.
+ */
+
+int fs_info(void)
+{
+
+	if(mount==-1){
+		fprintf(stderr, "fs_info: No filesystem is mounted\n");
+		return -1;
+	}
+	if (summary_load())
+		return -1;
+
+	//printf("1,8d0\n");
+	printf("FS Info:\n");
+	printf("total_blk_count=%d\n", superblock.amountVD);
+	printf("fat_blk_count=%d\n", superblock.amountFAT);
+	printf("rdir_blk=%d\n", superblock.indexRootDirectory);
+	printf("data_blk=%d\n", superblock.indexDataBlock);
+	printf("data_blk_count=%d\n", superblock.amountDataBlock);
+	//printf("fs_info: %d\n", FAT[0]);
+	printf("fat_free_ratio=%d/%d\n", superblock.summary.freeBlocks, superblock.amountDataBlock);
+	printf("rdir_free_ratio=%d/%d\n", superblock.summary.freeEntries, FS_FILE_MAX_COUNT);
+
+	if (superblock.features & FS_FEATURE_DEDUP) {
+		struct fs_dedup_stats stats;
+		if (fs_dedup_stats(&stats))
+			return -1;
+		printf("dedup_saved_blocks=%u\n", stats.savedBlocks);
+		printf("dedup_hits=%u/%u\n", stats.hits, stats.lookups);
+		if (stats.hashNanoseconds)
+			printf("dedup_hash_mbps=%.0f\n",
+			       stats.hashedBytes * 1e3 / stats.hashNanoseconds);
+	}
+
+	if (superblock.indexChecksums) {
+		struct fs_checksum_stats stats;
+		if (fs_checksum_stats(&stats))
+			return -1;
+		printf("checksum_crc32c=%s\n", stats.hardware ? "hardware" : "software");
+		printf("checksum_verified_blocks=%llu\n", (unsigned long long)stats.verifiedBlocks);
+		printf("checksum_errors=%u\n", stats.readErrors + stats.scrubErrors);
+		if (stats.readNanoseconds)
+			printf("checksum_read_overhead=%.1f%%\n",
+			       stats.verifyNanoseconds * 100.0 / stats.readNanoseconds);
+	}
+
+	if (superblock.features & FS_FEATURE_LOG) {
+		struct fs_log_stats stats;
+		if (fs_log_stats(&stats))
+			return -1;
+		printf("log_head=%u\n", superblock.logHead);
+		printf("log_free_segments=%u/%u\n", stats.freeSegments, stats.segments);
+	}
+
+	return 0;
+}
+
+
+
+/**
+ * fs_features - Enable or disable optional features
+ *
+ * Features are stored in the superblock and persist across mounts.
+ */
+int fs_features(int set, int clear)
+{
+	if(mount==-1)return -1;
+	if (fs_writable(__func__))
+		return -1;
+	if ((set | clear) & ~FS_FEATURE_ALL) {
+		fprintf(stderr, "fs_features: unknown feature\n");
+		return -1;
+	}
+	if ((set & FS_FEATURE_DEDUP) && table_create())
+		return -1;
+	if ((set & FS_FEATURE_CHECKSUM) && checksum_create())
+		return -1;
+	if ((clear & FS_FEATURE_CHECKSUM) && checksum_destroy())
+		return -1;
+	if (set & FS_FEATURE_LOG) {
+		/** blocks cached for appends would be written back in place */
+		for (struct inode *inode = inodeTable; inode; inode = inode->next)
+			if (tail_flush(inode, 1))
+				return -1;
+		logSegmentEnd = 0;
+	}
+	if (((superblock.features | set) & ~clear) != superblock.features) {
+		summary_touch();
+		superblock.features = (superblock.features | set) & ~clear;
+	}
+	return superblock.features;
+}
+
+/**
+ * fs_trim - Release every free data block to the host
+ */
+int fs_trim(void)
+{
+	if(mount==-1)return -1;
+	if (fs_writable(__func__))
+		return -1;
+	for (uint32_t i = 1; i < superblock.amountDataBlock; i++) {
+		int entry = fat_get(i);
+		if (entry < 0)
+			return -1;
+		if (entry == 0)
+			discard_queue(i);
+	}
+	uint32_t before = discardedBlocks;
+	if (fs_sync_meta())
+		return -1;
+	return discardedBlocks - before;
+}
+
+/**
+ * fs_dedup_stats - Get deduplication statistics
+ */
+int fs_dedup_stats(struct fs_dedup_stats *stats)
+{
+	if(mount==-1)return -1;
+	if (!stats || table_load())
+		return -1;
+
+	*stats = dedupStats;
+	stats->sharedBlocks = 0;
+	stats->savedBlocks = 0;
+	for (uint32_t i = 1; blockTable && i < superblock.amountDataBlock; i++) {
+		if (!blockTable[i].refs)
+			continue;
+		/** blocks after a shared one are shared along with it */
+		uint32_t length = 0;
+		for (int indexBlock = i; indexBlock != FAT_EOC; indexBlock = fat_get(indexBlock)) {
+			if (indexBlock < 0)
+				return -1;
+			length++;
+		}
+		stats->sharedBlocks += length;
+		stats->savedBlocks += length * blockTable[i].refs;
+	}
+	return 0;
+}
+
+/* ========   TODO: Phase 2  ===============*/
+
+
+/**
+ * fs_create - Create a new file
+ * @filename: File path
+ *
+ * Create a new and empty file named @filename, in the root directory or in
+ * the subdirectory named by its path. String @filename must be
+ * NULL-terminated and each component of the path cannot exceed
+ * %FS_FILENAME_LEN characters (including the NULL character).
+ *
+ * Return: -1 if no FS is currently mounted or it is read-only, or if
+ * @filename is invalid, or if a file named @filename already exists, or if a
+ * component of the path is too long or is not a directory, or if the root
+ * directory has no free entry left (it holds %FS_FILE_MAX_COUNT entries, and
+ * an inline file takes several), or if a subdirectory needs a new block and
+ * the disk is full. 0 otherwise.
+ */
+
+int fs_create(const char *filename)
+{
+	struct _directory entry;
+	uint16_t parent;
+
+	/*no FS mounted*/
+	if(mount==-1)return -1;
+	if (fs_writable(__func__))
+		return -1;
+
+	/** if @filename is invalid */
+	if (!filename) {
+		fprintf(stderr, "fs_create: invalid file name\n");
+		return -1;
+	}
+
+	memset(&entry, 0, sizeof(entry));
+	if (path_lookup(filename, &parent, entry.filename)){
+			fprintf(stderr, "fs_create: invalid path %s (1~16 character per name)\n", filename);
+			return -1;
+			}
+
+	/**  add an empty file to its directory */
+	entry.fileSize =0;
+	entry.indexFirstDataBlock= FAT_EOC;
+	if (dir_add(parent, &entry, NULL)) {
+		fprintf(stderr, "fs_create: cannot create %s\n", filename);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * fs_delete - Delete a file
+ * @filename: File path
+ *
+ * Delete the file named @filename from the root directory or from the
+ * subdirectory named by its path, and free the data blocks it does not share
+ * with another file.
+ *
+ * Return: -1 if no FS is currently mounted or it is read-only, or if
+ * @filename is invalid, or if there is no file named @filename to delete, or
+ * if @filename is a directory (see fs_rmdir()), or if file @filename is
+ * currently open. 0 otherwise.
+ */
+
+int fs_delete(const char *filename)
+{
+	struct _directory entry;
+	uint16_t parent;
+	char name[FS_FILENAME_LEN];
+
+	/*no FS mounted*/
+	if(mount==-1)return -1;
+	if (fs_writable(__func__))
+		return -1;
+
+	/** if @filename is invalid */
+	if (!filename) {
+		fprintf(stderr, "fs_delete: invalid file name\n");
+		return -1;
+	}
+
+	if (path_lookup(filename, &parent, name) || dir_find(parent, name, &entry, NULL)){
+		fprintf(stderr, "fs_delete: no such file %s\n", filename);
+		return -1;
+	}
+	if (entry.flags & DIRENT_DIR) {
+		fprintf(stderr, "fs_delete: %s is a directory\n", filename);
+		return -1;
+	}
+
+	/** file @filename is currently open */
+	if (inode_find(parent, name)) {
+		fprintf(stderr, "fs_delete: file %s is currently open\n", filename);
+		return -1;
+	}
+
+	/** the file’s entry must be emptied */
+	if (dir_remove(parent, name))
+		return -1;
+
+	/** and all the data blocks containing the file’s contents must be freed in the FAT.*/
+	return chain_free(entry.indexFirstDataBlock, entry.flags & DIRENT_INDEXED);
+}
+
+/**
+ * fs_mkdir - Create a new directory
+ * @dirname: Directory path
+ *
+ * Return: -1 if no FS is currently mounted, if @dirname is invalid or already
+ * exists, or if there is no space left. 0 otherwise.
+ */
+int fs_mkdir(const char *dirname)
+{
+	struct _directory entry;
+	struct _btnode n;
+	uint16_t parent;
+
+	if(mount==-1)return -1;
+	if (fs_writable(__func__))
+		return -1;
+
+	memset(&entry, 0, sizeof(entry));
+	if (path_lookup(dirname, &parent, entry.filename)){
+		fprintf(stderr, "fs_mkdir: invalid path\n");
+		return -1;
+	}
+	if (dir_find(parent, entry.filename, NULL, NULL) != 1) {
+		fprintf(stderr, "fs_mkdir: %s already exists\n", dirname);
+		return -1;
+	}
+
+	/** a new directory is a tree made of a single empty leaf */
+	int root = fat_alloc();
+	if (root < 0) {
+		fprintf(stderr, "fs_mkdir: disk full\n");
+		return -1;
+	}
+	bt_init(&n, 1);
+	entry.flags = DIRENT_DIR;
+	entry.indexFirstDataBlock = root;
+	if (bt_write(root, &n) || dir_add(parent, &entry, NULL)) {
+		fat_set(root, 0);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * fs_rmdir - Remove an empty directory
+ * @dirname: Directory path
+ *
+ * Return: -1 if no FS is currently mounted, if @dirname is not a directory or
+ * is not empty. 0 otherwise.
+ */
+int fs_rmdir(const char *dirname)
+{
+	struct _directory entry;
+	struct _btnode n;
+	uint16_t parent;
+	char name[FS_FILENAME_LEN];
+
+	if(mount==-1)return -1;
+	if (fs_writable(__func__))
+		return -1;
+
+	if (path_lookup(dirname, &parent, name) || dir_find(parent, name, &entry, NULL) ||
+	    !(entry.flags & DIRENT_DIR)) {
+		fprintf(stderr, "fs_rmdir: no such directory\n");
+		return -1;
+	}
+	if (bt_read(entry.indexFirstDataBlock, &n))
+		return -1;
+	if (n.header.total != 0) {
+		fprintf(stderr, "fs_rmdir: %s is not empty\n", dirname);
+		return -1;
+	}
+	if (dir_remove(parent, name))
+		return -1;
+	return bt_free(entry.indexFirstDataBlock, 0);
+}
+
+/**
+ * fs_clone - Create a copy of a file that shares its blocks
+ * @src: Path of the file to copy
+ * @dst: Path of the new file
+ *
+ * Return: -1 if no FS is currently mounted, if @src is not a file, if @dst is
+ * invalid or already exists, or if there is no space left. 0 otherwise.
+ */
+int fs_clone(const char *src, const char *dst)
+{
+	struct _directory entry;
+	uint8_t data[DIRENT_INLINE_MAX];
+	uint16_t parent;
+
+	if(mount==-1)return -1;
+	if (fs_writable(__func__))
+		return -1;
+
+	memset(&entry, 0, sizeof(entry));
+	if (path_lookup(src, &parent, entry.filename) ||
+	    dir_find(parent, entry.filename, NULL, NULL) != 0) {
+		fprintf(stderr, "fs_clone: no such file %s\n", src);
+		return -1;
+	}
+
+	/** data still cached for an open @src belongs to the copy */
+	struct inode *inode = inode_find(parent, entry.filename);
+	if (inode && (tail_flush(inode, 1) || chunk_flush(inode)))
+		return -1;
+	if (dir_find(parent, entry.filename, &entry, data))
+		return -1;
+	if (entry.flags & DIRENT_DIR) {
+		fprintf(stderr, "fs_clone: %s is a directory\n", src);
+		return -1;
+	}
+
+	if (path_lookup(dst, &parent, entry.filename)) {
+		fprintf(stderr, "fs_clone: invalid path %s\n", dst);
+		return -1;
+	}
+	if (dir_find(parent, entry.filename, NULL, NULL) != 1) {
+		fprintf(stderr, "fs_clone: %s already exists\n", dst);
+		return -1;
+	}
+
+	/** the new entry is one more reference to the first block */
+	uint16_t head = entry.indexFirstDataBlock;
+	if (head != FAT_EOC) {
+		if (table_create())
+			return -1;
+		if (blockTable[head].refs == UINT16_MAX) {
+			fprintf(stderr, "fs_clone: too many copies of %s\n", src);
+			return -1;
+		}
+		table_ref(head, 1);
+	}
+	if (dir_add(parent, &entry, data)) {
+		if (head != FAT_EOC)
+			table_ref(head, -1);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * fs_snapshot_create - Take a snapshot of the file system
+ */
+int fs_snapshot_create(void)
+{
+	struct _directory copy[FS_FILE_MAX_COUNT];
+	int snapshot = 0, i = 0;
+
+	if(mount==-1)return -1;
+	if (fs_writable(__func__))
+		return -1;
+
+	while (snapshot < FS_SNAPSHOT_MAX && superblock.snapshots[snapshot])
+		snapshot++;
+	if (snapshot == FS_SNAPSHOT_MAX) {
+		fprintf(stderr, "fs_snapshot_create: already %d snapshots\n", FS_SNAPSHOT_MAX);
+		return -1;
+	}
+
+	/** data still cached for open files belongs to the snapshot */
+	for (struct inode *inode = inodeTable; inode; inode = inode->next)
+		if (tail_flush(inode, 1) || chunk_flush(inode))
+			return -1;
+	if (dir_load() || table_create())
+		return -1;
+
+	memcpy(copy, directory, sizeof(copy));
+	for (; i < FS_FILE_MAX_COUNT; i++) {
+		if (copy[i].filename[0]=='\0' || copy[i].filename[0]==DIRENT_CONT)
+			continue;
+		if (snapshot_hold(&copy[i], 0))
+			goto undo;
+	}
+
+	int indexBlock = fat_alloc();
+	if (indexBlock >= 0 && data_write(indexBlock, copy) == 0) {
+		summary_touch();
+		superblock.snapshots[snapshot] = indexBlock;
+		return snapshot;
+	}
+	if (indexBlock >= 0)
+		fat_set(indexBlock, 0);
+	fprintf(stderr, "fs_snapshot_create: disk full\n");
+
+undo:
+	for (int j = 0; j < i; j++)
+		if (copy[j].filename[0]!='\0' && copy[j].filename[0]!=DIRENT_CONT)
+			snapshot_drop(&copy[j], 0);
+	return -1;
+}
+
+/**
+ * fs_snapshot_delete - Delete a snapshot
+ */
+int fs_snapshot_delete(int snapshot)
+{
+	struct _directory copy[FS_FILE_MAX_COUNT];
+
+	if(mount==-1)return -1;
+	if (fs_writable(__func__))
+		return -1;
+	if (snapshot < 0 || snapshot >= FS_SNAPSHOT_MAX || !superblock.snapshots[snapshot]) {
+		fprintf(stderr, "fs_snapshot_delete: no snapshot %d\n", snapshot);
+		return -1;
+	}
+
+	uint16_t indexBlock = superblock.snapshots[snapshot];
+	if (data_read(indexBlock, copy) || table_load())
+		return -1;
+	summary_touch();
+	superblock.snapshots[snapshot] = 0;
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+		if (copy[i].filename[0]!='\0' && copy[i].filename[0]!=DIRENT_CONT &&
+		    snapshot_drop(&copy[i], 0))
+			return -1;
+	return fat_set(indexBlock, 0);
+}
+
+/**
+ * fs_snapshot_mount - Mount a snapshot read-only
+ */
+int fs_snapshot_mount(const char *diskname, int snapshot)
+{
+	if (fs_mount(diskname))
+		return -1;
+	if (snapshot < 0 || snapshot >= FS_SNAPSHOT_MAX || !superblock.snapshots[snapshot] ||
+	    superblock.snapshots[snapshot] >= superblock.amountDataBlock) {
+		fprintf(stderr, "fs_snapshot_mount: no snapshot %d\n", snapshot);
+		fs_umount();
+		return -1;
+	}
+	snapshotDirectory = superblock.snapshots[snapshot];
+	return 0;
+}
+
+/**
+ * fs_compress - Turn compression on or off for an empty file
+ * @filename: File path
+ * @enable: Non-zero to compress the file
+ *
+ * Return: -1 if no FS is currently mounted, if there is no such file, if it is
+ * open or not empty. 0 otherwise.
+ */
+int fs_compress(const char *filename, int enable)
+{
+	struct _directory entry;
+	uint16_t parent;
+
+	if(mount==-1)return -1;
+	if (fs_writable(__func__))
+		return -1;
+
+	memset(&entry, 0, sizeof(entry));
+	if (path_lookup(filename, &parent, entry.filename) ||
+	    dir_find(parent, entry.filename, &entry, NULL) || (entry.flags & DIRENT_DIR)) {
+		fprintf(stderr, "fs_compress: no such file %s\n", filename);
+		return -1;
+	}
+	if (inode_find(parent, entry.filename)) {
+		fprintf(stderr, "fs_compress: file %s is currently open\n", filename);
+		return -1;
+	}
+	if (entry.fileSize != 0) {
+		fprintf(stderr, "fs_compress: file %s is not empty\n", filename);
+		return -1;
+	}
+
+	entry.flags &= ~DIRENT_LAYOUT;
+	if (enable)
+		entry.flags |= DIRENT_COMPRESSED;
+	return dir_update(parent, &entry, NULL);
+}
+
+
+/** Each nesting level adds at most a name and a slash to a listed path */
+#define LS_PATH_MAX (SNAPSHOT_MAX_DEPTH * (FS_FILENAME_LEN + 1) + 1)
+
+static int ls_tree(uint16_t node, char *path, size_t len, int depth);
+
+/**
+ * ls_entry - Print @entry, found in the directory named by the @len first
+ * characters of @path, then the content of @entry if it is a directory
+ */
+static int ls_entry(const struct _directory *entry, char *path, size_t len, int depth)
+{
+	if (entry->filename[0] == '\0' || entry->filename[0] == DIRENT_CONT)
+		return 0;
+	printf("%.*s%s \t %d Bytes\n", (int)len, path, entry->filename, entry->fileSize);
+	if (!(entry->flags & DIRENT_DIR))
+		return 0;
+	len += snprintf(path + len, LS_PATH_MAX - len, "%.*s/", FS_FILENAME_LEN, entry->filename);
+	return ls_tree(entry->indexFirstDataBlock, path, len, depth + 1);
+}
+
+/** Print the entries below node @node of a directory tree */
+static int ls_tree(uint16_t node, char *path, size_t len, int depth)
+{
+	struct _btnode n;
+
+	if (depth >= SNAPSHOT_MAX_DEPTH || bt_read(node, &n))
+		return -1;
+	if (n.header.leaf) {
+		for (int i = 0; i < n.header.count; i += rec_slots(&n.entry[i]))
+			if (ls_entry(&n.entry[i], path, len, depth))
+				return -1;
+	} else {
+		for (int i = 0; i <= n.header.count; i++)
+			if (ls_tree(bt_child(&n, i), path, len, depth + 1))
+				return -1;
+	}
+	return 0;
+}
+
+/**
+ * fs_ls - List files on file system
+ *
+ * List information about the files of the file system. Files in
+ * subdirectories are listed by path, right after their directory.
+ *
+ * Return: -1 if no FS is currently mounted or on I/O error. 0 otherwise.
+ */
+
+int fs_ls(void)
+{
+	char path[LS_PATH_MAX];
+
+	if(mount==-1) return -1;
+	if (dir_load())
+		return -1;
+	printf ("file name       size ");
+	for (int i=0; i <FS_FILE_MAX_COUNT; i++)
+	{
+		if (ls_entry(&directory[i], path, 0, 0))
+			return -1;
+	}
+	return 0;
+}
+
+/**========================== directory listing =============================================*/
+
+/**
+ * A directory cursor holds the status of every entry of the directory, taken
+ * when it is opened, so that it reads each node and chain once and is not
+ * disturbed by changes made while it is used: fs_readdir() only copies it.
+ * Continuation slots are left out.
+ */
+struct fs_dir {
+	uint16_t dir;
+	struct _directory *entries;	// collected by fs_opendir(), then freed
+	uint32_t count;
+	uint32_t size;
+	struct fs_dirent *dirents;
+	uint32_t next;				// next entry to return
+};
+
+static int dir_collect(struct fs_dir *d, const struct _directory *rec)
+{
+	if (rec->filename[0] == '\0' || rec->filename[0] == DIRENT_CONT)
+		return 0;
+	if (d->count == d->size) {
+		uint32_t size = d->size ? 2 * d->size : 64;
+		struct _directory *entries = realloc(d->entries, size * sizeof(*entries));
+		if (!entries) {
+			perror("fs_opendir: realloc");
+			return -1;
+		}
+		d->entries = entries;
+		d->size = size;
+	}
+	d->entries[d->count++] = *rec;
+	return 0;
+}
+
+/** Collect the entries of the tree below @node, in name order */
+static int dir_collect_tree(struct fs_dir *d, uint16_t node, int depth)
+{
+	struct _btnode n;
+
+	if (depth >= BT_MAX_DEPTH || bt_read(node, &n))
+		return -1;
+	if (!n.header.leaf) {
+		for (int i = 0; i <= n.header.count; i++)
+			if (dir_collect_tree(d, bt_child(&n, i), depth + 1))
+				return -1;
+		return 0;
+	}
+	for (int i = 0; i < n.header.count; i++)
+		if (dir_collect(d, &n.entry[i]))
+			return -1;
+	return 0;
+}
+
+/**
+ * file_blocks - Count the data blocks of a file
+ *
+ * Those of an indexed file are its index blocks and the blocks of the chunks
+ * they list. Blocks shared with other files are counted too.
+ *
+ * Return: -1 on I/O error or if a chain loops. Otherwise the number of blocks.
+ */
+static int file_blocks(const struct _directory *entry)
+{
+	struct _chunkref refs[CHUNK_PER_INDEX];
+	int indexBlock = entry->indexFirstDataBlock;
+	uint32_t count = 0;
+
+	if (entry->flags & (DIRENT_INLINE | DIRENT_DIR))
+		return 0;
+	while (indexBlock != FAT_EOC) {
+		if (indexBlock < 0 || ++count > superblock.amountDataBlock) {
+			fprintf(stderr, "file_blocks: bad chain in %s\n", entry->filename);
+			return -1;
+		}
+		if (entry->flags & DIRENT_INDEXED) {
+			if (data_read(indexBlock, refs))
+				return -1;
+			for (uint32_t i = 0; i < CHUNK_PER_INDEX; i++)
+				if (refs[i].indexFirstBlock != 0)
+					count += ((refs[i].length & ~CHUNK_RAW) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+		}
+		indexBlock = fat_get(indexBlock);
+	}
+	return count;
+}
+
+/** Fill @dirent from @entry of directory @dir */
+static int dirent_fill(uint16_t dir, const struct _directory *entry, struct fs_dirent *dirent)
+{
+	struct _directory e = *entry;
+
+	/** an open file may be ahead of its entry */
+	struct inode *inode = inode_find(dir, e.filename);
+	if (inode) {
+		if (inode->flags & DIRENT_INDEXED && chunk_flush(inode))
+			return -1;
+		e.fileSize = inode->fileSize;
+		e.indexFirstDataBlock = inode->indexFirstDataBlock;
+		e.flags = inode->flags;
+	}
+
+	int blocks = file_blocks(&e);
+	if (blocks < 0)
+		return -1;
+	memset(dirent, 0, sizeof(*dirent));
+	memcpy(dirent->filename, e.filename, FS_FILENAME_LEN);
+	dirent->size = e.fileSize;
+	dirent->firstBlock = e.flags & DIRENT_INLINE ? FAT_EOC : e.indexFirstDataBlock;
+	dirent->blocks = blocks;
+	dirent->isDirectory = !!(e.flags & DIRENT_DIR);
+	return 0;
+}
+
+/**
+ * fs_opendir - Open a directory for reading
+ */
+struct fs_dir *fs_opendir(const char *dirname)
+{
+	struct _directory entry;
+	char name[FS_FILENAME_LEN];
+	uint16_t parent;
+
+	if(mount==-1)return NULL;
+	if (!dirname) {
+		fprintf(stderr, "fs_opendir: invalid directory name\n");
+		return NULL;
+	}
+
+	struct fs_dir *d = calloc(1, sizeof(*d));
+	if (!d) {
+		perror("fs_opendir: calloc");
+		return NULL;
+	}
+	d->dir = DIR_ROOT;
+	if (dirname[0] != '\0' && strcmp(dirname, "/") != 0) {
+		if (path_lookup(dirname, &parent, name) ||
+		    dir_find(parent, name, &entry, NULL) || !(entry.flags & DIRENT_DIR)) {
+			fprintf(stderr, "fs_opendir: no such directory %s\n", dirname);
+			free(d);
+			return NULL;
+		}
+		d->dir = entry.indexFirstDataBlock;
+	}
+
+	int ret = 0;
+	if (d->dir != DIR_ROOT) {
+		ret = dir_collect_tree(d, d->dir, 0);
+	} else if (!(ret = dir_load())) {
+		for (int i = 0; i < FS_FILE_MAX_COUNT && !ret; i++)
+			ret = dir_collect(d, &directory[i]);
+	}
+	if (!ret && d->count) {
+		d->dirents = malloc(d->count * sizeof(*d->dirents));
+		if (!d->dirents) {
+			perror("fs_opendir: malloc");
+			ret = -1;
+		}
+	}
+	for (uint32_t i = 0; i < d->count && !ret; i++)
+		ret = dirent_fill(d->dir, &d->entries[i], &d->dirents[i]);
+	free(d->entries);
+	d->entries = NULL;
+	if (ret) {
+		fs_closedir(d);
+		return NULL;
+	}
+	return d;
+}
+
+/**
+ * fs_readdir - Read the next entry of a directory
+ */
+int fs_readdir(struct fs_dir *dir, struct fs_dirent *dirent)
+{
+	if(mount==-1)return -1;
+	if (!dir || !dirent) {
+		fprintf(stderr, "fs_readdir: invalid argument\n");
+		return -1;
+	}
+	if (dir->next == dir->count)
+		return 0;
+	*dirent = dir->dirents[dir->next++];
+	return 1;
+}
+
+/**
+ * fs_closedir - Close a directory
+ */
+int fs_closedir(struct fs_dir *dir)
+{
+	if (dir) {
+		free(dir->entries);
+		free(dir->dirents);
+		free(dir);
+	}
+	return 0;
+}
+
+/**
+ * fs_stat_name - Get the status of a file without opening it
+ */
+int fs_stat_name(const char *filename, struct fs_dirent *dirent)
+{
+	struct _directory entry;
+	uint16_t parent;
+
+	if(mount==-1)return -1;
+	if (!filename || !dirent) {
+		fprintf(stderr, "fs_stat_name: invalid argument\n");
+		return -1;
+	}
+
+	memset(&entry, 0, sizeof(entry));
+	if (path_lookup(filename, &parent, entry.filename) ||
+	    dir_find(parent, entry.filename, &entry, NULL)) {
+		fprintf(stderr, "fs_stat_name: no such file %s\n", filename);
+		return -1;
+	}
+	return dirent_fill(parent, &entry, dirent);
+}
+
+/**========================== metadata batches =============================================*/
+
+/**
+ * A batch queues namespace operations, then applies them in order in
+ * fs_batch_commit(). Each applied operation remembers what it changed, so
+ * that if one fails the ones before it are undone in reverse order. Blocks
+ * released by the batch are only freed once every operation succeeded, which
+ * keeps undoing a deletion or a truncation possible, and the blocks that
+ * undoing a removal may take to split directory nodes are reserved before
+ * it is applied. Nothing is written to disk before the end of the batch, but
+ * nothing records it there either: the batch is atomic in memory only.
+ */
+enum batch_op {
+	BATCH_CREATE,
+	BATCH_DELETE,
+	BATCH_RENAME,
+	BATCH_TRUNCATE,
+};
+
+struct batch_entry {
+	enum batch_op op;
+	char *path;
+	char *target;				// BATCH_RENAME: new path
+	uint32_t size;				// BATCH_TRUNCATE: new size
+	/** filled when applied */
+	uint16_t parent;
+	char name[FS_FILENAME_LEN];
+	uint16_t targetParent;
+	char targetName[FS_FILENAME_LEN];
+	struct _directory old;		// entry before the operation
+	uint8_t oldData[DIRENT_INLINE_MAX];
+	uint16_t cut;				// BATCH_TRUNCATE: new last block, or FAT_EOC
+	uint16_t freeHead;			// chain to free once the batch succeeded, or FAT_EOC
+	int freeIndex;				// chain_free() @index argument for @freeHead
+};
+
+static struct batch_entry *batch;
+static uint32_t batchCount;
+static uint32_t batchSize;
+static int8_t batchOpen=0;
+
+/** Forget the queued operations */
+static void batch_discard(void)
+{
+	for (uint32_t i = 0; i < batchCount; i++) {
+		free(batch[i].path);
+		free(batch[i].target);
+	}
+	free(batch);
+	batch = NULL;
+	batchCount = 0;
+	batchSize = 0;
+	batchOpen = 0;
+}
+
+/** Queue operation @op on @path */
+static int batch_queue(enum batch_op op, const char *path, const char *target,
+		       uint32_t size, const char *func)
+{
+	if(mount==-1)return -1;
+	if (!batchOpen) {
+		fprintf(stderr, "%s: no batch begun\n", func);
+		return -1;
+	}
+	if (!path || (op == BATCH_RENAME && !target)) {
+		fprintf(stderr, "%s: invalid file name\n", func);
+		return -1;
+	}
+	if (batchCount == batchSize) {
+		uint32_t size = batchSize ? 2 * batchSize : 64;
+		struct batch_entry *entries = realloc(batch, size * sizeof(*batch));
+		if (!entries) {
+			perror(func);
+			return -1;
+		}
+		batch = entries;
+		batchSize = size;
+	}
+
+	struct batch_entry *b = &batch[batchCount];
+	memset(b, 0, sizeof(*b));
+	b->op = op;
+	b->size = size;
+	b->path = strdup(path);
+	b->target = target ? strdup(target) : NULL;
+	if (!b->path || (target && !b->target)) {
+		perror(func);
+		free(b->path);
+		free(b->target);
+		return -1;
+	}
+	batchCount++;
+	return 0;
+}
+
+/**
+ * batch_reserve - Reserve the blocks needed to undo the removal of @b->name
+ *
+ * Operations are undone in reverse order, so an entry goes back to a leaf
+ * that has room for it again, unless its leaf was freed because it held
+ * nothing else. It then goes to another leaf, which may split along with a
+ * node at each level above it and the root.
+ *
+ * Return: -1 if there are not enough free blocks. 0 otherwise.
+ */
+static int batch_reserve(struct batch_entry *b)
+{
+	struct _btnode n;
+	uint16_t path[BT_MAX_DEPTH];
+	int found;
+
+	if (b->parent == DIR_ROOT)
+		return 0;
+	int depth = bt_descend(b->parent, b->name, path, NULL, &n);
+	if (depth < 0 || summary_load())
+		return -1;
+	int pos = bt_leaf_index(&n, b->name, &found);
+	if (!found || depth == 0 || n.header.count > rec_slots(&n.entry[pos]))
+		return 0;
+
+	uint32_t blocks = depth + 2;
+	if (superblock.summary.freeBlocks < reservedBlocks + blocks) {
+		fprintf(stderr, "fs_batch_commit: not enough free blocks to undo %s\n", b->path);
+		return -1;
+	}
+	reservedBlocks += blocks;
+	return 0;
+}
+
+/** Look up the existing, closed file or directory that @b operates on */
+static int batch_lookup(struct batch_entry *b, const char *func)
+{
+	if (path_lookup(b->path, &b->parent, b->name) ||
+	    dir_find(b->parent, b->name, &b->old, b->oldData)) {
+		fprintf(stderr, "%s: no such file %s\n", func, b->path);
+		return -1;
+	}
+	if (inode_find(b->parent, b->name)) {
+		fprintf(stderr, "%s: file %s is currently open\n", func, b->path);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * batch_truncate - Shrink the file of @b to @b->size bytes
+ *
+ * Return: -1 if the file is a directory, if it would grow, or if its blocks
+ * cannot be cut. 0 otherwise.
+ */
+static int batch_truncate(struct batch_entry *b)
+{
+	struct _directory entry = b->old;
+	uint8_t data[DIRENT_INLINE_MAX];
+
+	if (entry.flags & DIRENT_DIR || b->size > entry.fileSize) {
+		fprintf(stderr, "fs_batch_truncate: cannot truncate %s to %u bytes\n",
+			b->path, b->size);
+		return -1;
+	}
+	memcpy(data, b->oldData, sizeof(data));
+	entry.fileSize = b->size;
+
+	if (entry.flags & DIRENT_INLINE) {
+		memset(data + b->size, 0, sizeof(data) - b->size);
+	} else if (b->size == 0) {
+		b->freeHead = entry.indexFirstDataBlock;
+		b->freeIndex = entry.flags & DIRENT_INDEXED;
+		entry.indexFirstDataBlock = FAT_EOC;
+	} else if (entry.flags & DIRENT_INDEXED) {
+		fprintf(stderr, "fs_batch_truncate: %s is indexed, only truncated to 0\n", b->path);
+		return -1;
+	} else {
+		uint32_t blocks, extents;
+		int shared;
+
+		/** cutting a shared chain would cut it for its other owners too */
+		if (chain_extents(entry.indexFirstDataBlock, &blocks, &extents, &shared))
+			return -1;
+		if (shared) {
+			fprintf(stderr, "fs_batch_truncate: %s shares blocks, only truncated to 0\n",
+				b->path);
+			return -1;
+		}
+		int indexBlock = entry.indexFirstDataBlock;
+		for (uint32_t i = 1; i < (b->size + BLOCK_SIZE - 1) / BLOCK_SIZE; i++)
+			if ((indexBlock = fat_get(indexBlock)) < 0)
+				return -1;
+		int indexNextBlock = fat_get(indexBlock);
+		if (indexNextBlock < 0)
+			return -1;
+		if (indexNextBlock != FAT_EOC) {
+			if (fat_set(indexBlock, FAT_EOC))
+				return -1;
+			b->cut = indexBlock;
+			b->freeHead = indexNextBlock;
+		}
+	}
+
+	if (dir_update(b->parent, &entry, data)) {
+		if (b->cut != FAT_EOC)
+			fat_set(b->cut, b->freeHead);
+		b->cut = FAT_EOC;
+		b->freeHead = FAT_EOC;
+		return -1;
+	}
+	return 0;
+}
+
+/** Apply operation @b */
+static int batch_apply(struct batch_entry *b)
+{
+	struct _directory entry;
+
+	b->cut = FAT_EOC;
+	b->freeHead = FAT_EOC;
+	switch (b->op) {
+	case BATCH_CREATE:
+		memset(&entry, 0, sizeof(entry));
+		if (path_lookup(b->path, &b->parent, entry.filename)) {
+			fprintf(stderr, "fs_batch_create: invalid path %s\n", b->path);
+			return -1;
+		}
+		memcpy(b->name, entry.filename, FS_FILENAME_LEN);
+		entry.indexFirstDataBlock = FAT_EOC;
+		return dir_add(b->parent, &entry, NULL);
+
+	case BATCH_DELETE:
+		if (batch_lookup(b, "fs_batch_delete"))
+			return -1;
+		if (b->old.flags & DIRENT_DIR) {
+			fprintf(stderr, "fs_batch_delete: %s is a directory\n", b->path);
+			return -1;
+		}
+		if (batch_reserve(b) || dir_remove(b->parent, b->name))
+			return -1;
+		b->freeHead = b->old.indexFirstDataBlock;
+		b->freeIndex = b->old.flags & DIRENT_INDEXED;
+		return 0;
+
+	case BATCH_RENAME:
+		if (batch_lookup(b, "fs_batch_rename"))
+			return -1;
+		/** a directory moved below itself would be lost */
+		if (b->old.flags & DIRENT_DIR) {
+			fprintf(stderr, "fs_batch_rename: %s is a directory\n", b->path);
+			return -1;
+		}
+		entry = b->old;
+		memset(entry.filename, 0, FS_FILENAME_LEN);
+		if (path_lookup(b->target, &b->targetParent, entry.filename)) {
+			fprintf(stderr, "fs_batch_rename: invalid path %s\n", b->target);
+			return -1;
+		}
+		if (batch_reserve(b))
+			return -1;
+		memcpy(b->targetName, entry.filename, FS_FILENAME_LEN);
+		if (dir_add(b->targetParent, &entry, b->oldData))
+			return -1;
+		if (dir_remove(b->parent, b->name)) {
+			dir_remove(b->targetParent, b->targetName);
+			return -1;
+		}
+		return 0;
+
+	case BATCH_TRUNCATE:
+		if (batch_lookup(b, "fs_batch_truncate"))
+			return -1;
+		return batch_truncate(b);
+	}
+	return -1;
+}
+
+/**
+ * batch_undo - Undo operation @b, applied successfully
+ *
+ * Return: -1 if the directory or the FAT cannot be restored. 0 otherwise.
+ */
+static int batch_undo(struct batch_entry *b)
+{
+	switch (b->op) {
+	case BATCH_CREATE:
+		return dir_remove(b->parent, b->name);
+	case BATCH_DELETE:
+		return dir_add(b->parent, &b->old, b->oldData);
+	case BATCH_RENAME:
+		if (dir_remove(b->targetParent, b->targetName))
+			return -1;
+		return dir_add(b->parent, &b->old, b->oldData);
+	case BATCH_TRUNCATE:
+		if (b->cut != FAT_EOC && fat_set(b->cut, b->freeHead))
+			return -1;
+		return dir_update(b->parent, &b->old, b->oldData);
+	}
+	return -1;
+}
+
+/**
+ * fs_batch_begin - Start queueing namespace operations
+ */
+int fs_batch_begin(void)
+{
+	if(mount==-1)return -1;
+	if (fs_writable(__func__))
+		return -1;
+	if (batchOpen) {
+		fprintf(stderr, "fs_batch_begin: a batch is already begun\n");
+		return -1;
+	}
+	batchOpen = 1;
+	return 0;
+}
+
+/**
+ * fs_batch_create - Queue the creation of an empty file
+ */
+int fs_batch_create(const char *filename)
+{
+	return batch_queue(BATCH_CREATE, filename, NULL, 0, __func__);
+}
+
+/**
+ * fs_batch_delete - Queue the deletion of a file
+ */
+int fs_batch_delete(const char *filename)
+{
+	return batch_queue(BATCH_DELETE, filename, NULL, 0, __func__);
+}
+
+/**
+ * fs_batch_rename - Queue the renaming of a file
+ */
+int fs_batch_rename(const char *filename, const char *newname)
+{
+	return batch_queue(BATCH_RENAME, filename, newname, 0, __func__);
+}
+
+/**
+ * fs_batch_truncate - Queue the shrinking of a file
+ */
+int fs_batch_truncate(const char *filename, uint32_t size)
+{
+	return batch_queue(BATCH_TRUNCATE, filename, NULL, size, __func__);
+}
+
+/**
+ * fs_batch_commit - Apply the queued operations
+ */
+int fs_batch_commit(void)
+{
+	uint32_t applied = 0;
+	int ret = 0;
+
+	if(mount==-1)return -1;
+	if (!batchOpen) {
+		fprintf(stderr, "fs_batch_commit: no batch begun\n");
+		return -1;
+	}
+	if (bt_cache_start()) {
+		batch_discard();
+		return -1;
+	}
+
+	while (applied < batchCount && batch_apply(&batch[applied]) == 0)
+		applied++;
+	/** undoing may take the reserved blocks */
+	reservedBlocks = 0;
+	if (applied < batchCount) {
+		fprintf(stderr, "fs_batch_commit: operation %u failed, batch undone\n", applied);
+		while (applied > 0) {
+			if (batch_undo(&batch[--applied]) == 0)
+				continue;
+			fprintf(stderr, "fs_batch_commit: cannot undo operation %u, run fs_fsck()\n",
+				applied);
+		}
+		ret = -1;
+	}
+	for (uint32_t i = 0; i < applied; i++)
+		if (batch[i].freeHead != FAT_EOC &&
+		    chain_free(batch[i].freeHead, batch[i].freeIndex))
+			ret = -1;
+
+	if (bt_cache_stop() || fs_sync_meta())
+		ret = -1;
+	batch_discard();
+	return ret;
+}
+
+/**
+ * fs_batch_abort - Forget the queued operations
+ */
+int fs_batch_abort(void)
+{
+	if(mount==-1)return -1;
+	batch_discard();
+	return 0;
+}
+
+/**========================== phase  3=============================================*/
+
+/**
+ * inode_put - Drop a reference to an open file
+ *
+ * Other references are dropped without taking inodeLock. The last one takes
+ * it to remove the inode from the table, and flushes the last chunk written
+ * to a compressed file, which is still in memory.
+ *
+ * Return: -1 if that chunk cannot be written. 0 otherwise.
+ */
+static int inode_put(struct inode *inode)
+{
+	uint32_t refs = atomic_load(&inode->refs);
+
+	while (refs > 1)
+		if (atomic_compare_exchange_weak(&inode->refs, &refs, refs - 1))
+			return 0;
+
+	pthread_mutex_lock(&inodeLock);
+	if (atomic_fetch_sub(&inode->refs, 1) > 1) {
+		pthread_mutex_unlock(&inodeLock);
+		return 0;
+	}
+	struct inode **link = inode_bucket(inode->parentDirectory, inode->filename);
+	while (*link != inode)
+		link = &(*link)->hashNext;
+	*link = inode->hashNext;
+	if (inode->previous)
+		inode->previous->next = inode->next;
+	else
+		inodeTable = inode->next;
+	if (inode->next)
+		inode->next->previous = inode->previous;
+	pthread_mutex_unlock(&inodeLock);
+
+	int ret = tail_flush(inode, 1);
+	if (chunk_flush(inode))
+		ret = -1;
+	if (inode->entryStale && inode_sync_entry(inode))
+		ret = -1;
+	free(inode->chunkBuffer);
+	free(inode->map);
+	pthread_mutex_destroy(&inode->appendLock);
+	free(inode);
+	return ret;
+}
+
+/**
+ * fs_open - Open a file
+ * @filename: File name
+ *
+ * Open file named @filename for reading and writing, and return the
+ * corresponding file descriptor. The file descriptor is a non-negative integer
+ * that is used subsequently to access the contents of the file. The file offset
+ * of the file descriptor is set to 0 initially (beginning of the file). If the
+ * same file is opened multiple files, fs_open() must return distinct file
+ * descriptors, which share the state of the file: a write through one of them
+ * is seen by the others. The descriptor table grows as needed.
+ *
+ * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if
+ * there is no file named @filename to open, or if out of memory. Otherwise,
+ * return the file descriptor.
+ */
+int fs_open(const char *filename)
+{
+	struct _directory entry;
+	uint8_t data[DIRENT_INLINE_MAX];
+	uint16_t parent;
+	int fd;
+
+	/** Return: -1 if no FS is currently mounted,  */
+	if(mount==-1)return -1;
+	/** if @filename is invalid */
+	if (!filename) {
+		fprintf(stderr, "fs_open: invalid file name\n");
+		return -1;
+	}
+
+	/*  search directory */
+	memset(&entry, 0, sizeof(entry));
+	if (path_lookup(filename, &parent, entry.filename) ||
+	    dir_find(parent, entry.filename, &entry, data)) {
+		fprintf(stderr, "fs_open: there is no file named %s to open\n",filename);
+		return -1;
+	}
+	if (entry.flags & DIRENT_DIR) {
+		fprintf(stderr, "fs_open: %s is a directory\n",filename);
+		return -1;
+	}
+
+	/** the file may already be open */
+	pthread_mutex_lock(&inodeLock);
+	struct inode *inode = inode_find(parent, entry.filename);
+	if (!inode) {
+		inode = calloc(1, sizeof(*inode));
+		if (!inode) {
+			pthread_mutex_unlock(&inodeLock);
+			fprintf(stderr, "fs_open: out of memory\n");
+			return -1;
+		}
+		inode->fileSize = entry.fileSize;
+		inode->indexFirstDataBlock = entry.indexFirstDataBlock;
+		inode->parentDirectory = parent;
+		strcpy(inode->filename, entry.filename);
+		inode->flags = entry.flags;
+		if (entry.flags & DIRENT_INLINE)
+			memcpy(inode->inlineData, data, DIRENT_INLINE_MAX);
+		inode->chunkIndex = CHUNK_NONE;
+		if (entry.flags & DIRENT_INDEXED) {
+			inode->chunk = inode->chunkBuffer = malloc(CHUNK_SIZE);
+			if (!inode->chunk) {
+				pthread_mutex_unlock(&inodeLock);
+				fprintf(stderr, "fs_open: out of memory\n");
+				free(inode);
+				return -1;
+			}
+		}
+		pthread_mutex_init(&inode->appendLock, NULL);
+		inode->next = inodeTable;
+		if (inodeTable)
+			inodeTable->previous = inode;
+		inodeTable = inode;
+		struct inode **bucket = inode_bucket(parent, inode->filename);
+		inode->hashNext = *bucket;
+		*bucket = inode;
+	}
+	atomic_fetch_add(&inode->refs, 1);
+	pthread_mutex_unlock(&inodeLock);
+
+	fd = fd_alloc(inode, 0, 0);
+	if (fd < 0)
+		inode_put(inode);
+	return fd;
+}
+
+/**
+ * fs_open_append - Open a file for appending
+ */
+int fs_open_append(const char *filename)
+{
+	int fd = fs_open(filename);
+	if (fd < 0)
+		return -1;
+
+	/** not handed out yet: nobody else can use the descriptor */
+	struct fd *desc = fd_get(fd);
+	desc->append = 1;
+	desc->offset = desc->inode->fileSize;
+	return fd;
+}
+
+/**
+ * fs_dup - Duplicate a file descriptor
+ */
+int fs_dup(int fd)
+{
+	if(mount==-1)return -1;
+
+	struct fd *desc = fd_get(fd);
+	if (!desc) {
+		fprintf(stderr, "fs_dup: file descriptor %d is invalid\n", fd);
+		return -1;
+	}
+	/** @fd holds a reference: the inode cannot go away meanwhile */
+	struct inode *inode = atomic_load(&desc->inode);
+	atomic_fetch_add(&inode->refs, 1);
+	int dup = fd_alloc(inode, desc->offset, desc->append);
+	if (dup < 0)
+		inode_put(inode);
+	return dup;
+}
+
+
+int fs_close(int fd)
+{
+	/**  Return: -1 if no FS is currently mounted */
+	if(mount==-1)return -1;
+	/** if file descriptor @fd is invalid (out of bounds or not currently open) */
+	/** * Close file descriptor @fd. */
+	struct inode *inode = fd_free(fd);
+	if (!inode) {
+		fprintf(stderr, "fs_close: fd %d NOT opened\n", fd);
+		return -1;
+	}
+	return inode_put(inode);
+}
+
+/**
+ * fs_stat - Get file status
+ * @fd: File descriptor
+ *
+ * Get the current size of the file pointed by file descriptor @fd.
+ *
+ * Return: -1 if no FS is currently mounted, of if file descriptor @fd is
+ * invalid (out of bounds or not currently open). Otherwise return the current
+ * size of file.
+ */
+
+int fs_stat(int fd)
+{
+	/**  Return: -1 if no FS is currently mounted */
+	if(mount==-1)return -1;
+
+	/** if file descriptor @fd is invalid (i.e., out of bounds, or not currently open)*/
+	struct fd *desc = fd_get(fd);
+	if (!desc){
+		fprintf(stderr, "fs_stat: %d is invalid ：not currently open)\n", fd );
+		return -1;
+	}
+
+	return desc->inode->fileSize;
+}
+
+/**
+ * fs_lseek - Set file offset
+ * @fd: File descriptor
+ * @offset: File offset
+ *
+ * Set the file offset (used for read and write operations) associated with file
+ * descriptor @fd to the argument @offset. To append to a file, one can call
+ * fs_lseek(fd, fs_stat(fd));
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (i.e., out of bounds, or not currently open), or if @offset is larger
+ * than the current file size. 0 otherwise.
+ */
+
+int fs_lseek(int fd, size_t offset)
+{
+	/** Return: -1 if no FS is currently mounted, */
+	if(mount==-1)return -1;
+	/** if file descriptor @fd is invalid (i.e., out of bounds, or not currently open)*/
+	struct fd *desc = fd_get(fd);
+	if (!desc){
+		fprintf(stderr, "fs_lseek: file descriptor %d is invalid:not currently open\n", fd );
+		return -1;
+		}
+
+	/**if @offset is larger than the current file size*/
+	if (offset >  desc->inode->fileSize ){
+		fprintf(stderr, "fs_lseek: offset is larger than the current file size:\n");
+		return -1;
+		}
+
+	desc->offset = offset;
+
+	return 0;
+}
+
+/**========================== log-structured mode =============================================*/
+
+/** Number of segments, the last one possibly shorter */
+static uint32_t log_segments(void)
+{
+	return (superblock.amountDataBlock + LOG_SEGMENT_BLOCKS - 1) / LOG_SEGMENT_BLOCKS;
+}
+
+/** Bounds of segment @segment, leaving out the reserved block 0 */
+static void log_segment_bounds(uint32_t segment, uint32_t *first, uint32_t *end)
+{
+	*first = segment * LOG_SEGMENT_BLOCKS;
+	*end = *first + LOG_SEGMENT_BLOCKS;
+	if (*first == 0)
+		*first = 1;
+	if (*end > superblock.amountDataBlock)
+		*end = superblock.amountDataBlock;
+}
+
+/**
+ * log_segment_free - Count the free blocks of a segment
+ *
+ * Segments never straddle FAT blocks, so a single scan does.
+ *
+ * Return: -1 on I/O error. Otherwise the number of free blocks.
+ */
+static int log_segment_free(uint32_t segment)
+{
+	uint32_t first, end;
+
+	log_segment_bounds(segment, &first, &end);
+	if (fat_load(first / FAT_PER_BLOCK))
+		return -1;
+	return scan_count_zero16(&FAT[first / FAT_PER_BLOCK][first % FAT_PER_BLOCK], end - first);
+}
+
+/**
+ * log_pick - Move the head of the log to the next segment to fill
+ *
+ * Take the first free segment after the current one, or else the segment
+ * with the most free blocks.
+ *
+ * Return: -1 if the disk is full or on I/O error. 0 otherwise.
+ */
+static int log_pick(void)
+{
+	uint32_t segments = log_segments();
+	uint32_t current = superblock.logHead / LOG_SEGMENT_BLOCKS;
+	int best = -1, bestFree = 0;
+
+	for (uint32_t k = 1; k <= segments; k++) {
+		uint32_t segment = (current + k) % segments, first, end;
+		if ((int32_t)segment == logVictim)
+			continue;
+		int n = log_segment_free(segment);
+		if (n < 0)
+			return -1;
+		log_segment_bounds(segment, &first, &end);
+		if (n > bestFree) {
+			best = segment;
+			bestFree = n;
+		}
+		if ((uint32_t)n == end - first)
+			break;
+	}
+	if (best < 0) {
+		fprintf(stderr, "log_alloc: disk is full\n");
+		return -1;
+	}
+
+	uint32_t first, end;
+	log_segment_bounds(best, &first, &end);
+	summary_touch();
+	superblock.logHead = first;
+	logSegmentEnd = end;
+	return 0;
+}
+
+/**
+ * log_alloc - Allocate a data block at the head of the log
+ *
+ * Return: -1 if the disk is full or on I/O error. Otherwise the index of the
+ * newly allocated data block, marked as end of chain in the FAT.
+ */
+static int log_alloc(void)
+{
+	for (;;) {
+		uint32_t head = superblock.logHead;
+
+		if (logSegmentEnd == 0 || head >= logSegmentEnd) {
+			if (log_pick())
+				return -1;
+			continue;
+		}
+		if (fat_load(head / FAT_PER_BLOCK))
+			return -1;
+		uint32_t i = head + scan_find_zero16(&FAT[head / FAT_PER_BLOCK][head % FAT_PER_BLOCK],
+						     logSegmentEnd - head);
+		if (i < logSegmentEnd) {
+			if (fat_set(i, FAT_EOC))
+				return -1;
+			superblock.logHead = i + 1;
+			logStats.appendedBlocks++;
+			return i;
+		}
+		superblock.logHead = logSegmentEnd;
+	}
+}
+
+/** Allocate a data block for file data, at the head of the log in log-structured mode */
+static int data_alloc(void)
+{
+	if (superblock.features & FS_FEATURE_LOG)
+		return log_alloc();
+	return fat_alloc();
+}
+
+/**
+ * log_kill - Turn @indexBlock into a dead block, freed at the next checkpoint
+ *
+ * Return: -1 on error. 0 otherwise.
+ */
+static int log_kill(uint16_t indexBlock)
+{
+	if (logDeadCount == logDeadMax) {
+		uint32_t max = logDeadMax ? 2 * logDeadMax : LOG_CHECKPOINT_BLOCKS;
+		uint16_t *dead = realloc(logDead, max * sizeof(*dead));
+		if (!dead) {
+			perror("log_kill: realloc");
+			return -1;
+		}
+		logDead = dead;
+		logDeadMax = max;
+	}
+	if (fat_set(indexBlock, FAT_EOC))
+		return -1;
+	logDead[logDeadCount++] = indexBlock;
+	return 0;
+}
+
+/**
+ * log_release - Free the dead blocks, as the checkpoint about to be written
+ * no longer references them
+ *
+ * Return: -1 on I/O error. 0 otherwise.
+ */
+static int log_release(void)
+{
+	for (uint32_t i = 0; i < logDeadCount; i++)
+		if (fat_set(logDead[i], 0))
+			return -1;
+	logDeadCount = 0;
+	return 0;
+}
+
+/**
+ * log_relocate - Move block @indexFileBlock of a file to the head of the log
+ * @inode: Open file
+ * @indexFileBlock: Position of the block in the file, which must exist
+ * @source: Set to the data block that held it
+ *
+ * Only the chain is updated: the caller writes the new block, and may still
+ * read @source, which stays intact until the next checkpoint. The blocks of a
+ * file aliased by a read-only mapping do not move, as the checkpoint would
+ * free them under the mapping: @source itself is returned.
+ *
+ * Return: -1 if the disk is full or on I/O error. Otherwise the new block.
+ */
+static int log_relocate(struct inode *inode, uint32_t indexFileBlock, int *source)
+{
+	if (chain_unshare(inode, indexFileBlock))
+		return -1;
+	if (inode->aliases) {
+		*source = fs_block_of(inode, indexFileBlock, 0);
+		return *source;
+	}
+
+	int previous = indexFileBlock ? fs_block_of(inode, indexFileBlock - 1, 0) : FAT_EOC;
+	if (previous < 0)
+		return -1;
+	int indexBlock = previous == FAT_EOC ? inode->indexFirstDataBlock : fat_get(previous);
+	if (indexBlock < 0 || indexBlock == FAT_EOC)
+		return -1;
+	int next = fat_get(indexBlock);
+	if (next < 0)
+		return -1;
+	*source = indexBlock;
+
+	int mapped = map_valid(inode) && indexFileBlock < inode->mapLength;
+	uint32_t epoch = chainEpoch;
+	int moved = log_alloc();
+	if (moved < 0)
+		return -1;
+	if (fat_set(moved, next) || log_kill(indexBlock)) {
+		fat_set(moved, 0);
+		return -1;
+	}
+	if (previous == FAT_EOC)
+		inode->indexFirstDataBlock = moved;
+	else if (fat_set(previous, moved))
+		return -1;
+
+	/**
+	 * The links changed belong to this file alone, as its blocks up to this
+	 * one are private: other block maps stay valid, and this one is updated.
+	 */
+	if (mapped)
+		inode->map[indexFileBlock] = moved;
+	chainEpoch = epoch;
+	logStats.relocatedBlocks++;
+	return moved;
+}
+
+/** 1 if @indexBlock is in @blocks[0..@count) */
+static int log_listed(const uint16_t *blocks, uint32_t count, uint16_t indexBlock)
+{
+	for (uint32_t i = 0; blocks && i < count; i++)
+		if (blocks[i] == indexBlock)
+			return 1;
+	return 0;
+}
+
+/**
+ * log_movable - Whether the cleaner can move @indexBlock
+ * @previous: Block whose FAT entry points to each block, 0 if none
+ */
+static int log_movable(const uint16_t *previous, uint16_t indexBlock)
+{
+	if (!previous[indexBlock])
+		return 0;
+	if (blockTable && (blockTable[indexBlock].refs || blockTable[indexBlock].fingerprint))
+		return 0;
+	if (mapping_aliased(indexBlock))
+		return 0;
+	/** the table and the checksum region keep lists of their blocks */
+	return !log_listed(tableBlocks, blockTable ? table_blocks() : 0, indexBlock) &&
+	       !log_listed(checksumBlocks, checksums ? checksum_blocks() : 0, indexBlock);
+}
+
+/**
+ * log_clean - Move the live blocks out of sparsely used segments
+ * @maxSegments: Maximum number of segments to clean
+ *
+ * Segments with at most LOG_CLEAN_LIVE live blocks are cleaned, the least
+ * used first, by moving their blocks to the head of the log; they are free
+ * once the next checkpoint releases the old copies. Only blocks reached
+ * through a single FAT entry can move: first blocks of chains, which
+ * directory entries and open files point to, shared blocks and blocks
+ * aliased by a read-only mapping stay.
+ *
+ * Return: -1 on error. Otherwise the number of segments cleaned.
+ */
+static int log_clean(uint32_t maxSegments)
+{
+	uint32_t amount = superblock.amountDataBlock;
+	char buf[BLOCK_SIZE];
+	int cleaned = 0;
+
+	if (table_load())
+		return -1;
+	/** blocks cached for appends would be written back where they no longer are */
+	for (struct inode *inode = inodeTable; inode; inode = inode->next)
+		if (tail_flush(inode, 1))
+			return -1;
+	uint16_t *previous = calloc(amount, sizeof(*previous));
+	if (!previous) {
+		perror("log_clean: calloc");
+		return -1;
+	}
+	for (uint32_t i = 1; i < amount; i++) {
+		int next = fat_get(i);
+		if (next < 0)
+			goto error;
+		if (next != 0 && next != FAT_EOC && (uint32_t)next < amount)
+			previous[next] = i;
+	}
+
+	while ((uint32_t)cleaned < maxSegments) {
+		uint32_t current = logSegmentEnd ? (logSegmentEnd - 1) / LOG_SEGMENT_BLOCKS : UINT32_MAX;
+		int victim = -1, victimUsed = LOG_CLEAN_LIVE + 1;
+
+		/** the least used segment that has blocks to move */
+		for (uint32_t segment = 0; segment < log_segments(); segment++) {
+			uint32_t first, end, movable = 0;
+			if (segment == current)
+				continue;
+			int n = log_segment_free(segment);
+			if (n < 0)
+				goto error;
+			log_segment_bounds(segment, &first, &end);
+			int used = end - first - n;
+			if (used == 0 || used >= victimUsed)
+				continue;
+			for (uint32_t b = first; b < end && !movable; b++)
+				movable = log_movable(previous, b);
+			if (movable) {
+				victim = segment;
+				victimUsed = used;
+			}
+		}
+		if (victim < 0)
+			break;
+
+		uint32_t first, end;
+		log_segment_bounds(victim, &first, &end);
+		logVictim = victim;
+		for (uint32_t b = first; b < end; b++) {
+			if (!log_movable(previous, b))
+				continue;
+			int next = fat_get(b);
+			int moved = next < 0 ? -1 : log_alloc();
+			if (moved < 0 || data_read(b, buf) || data_write(moved, buf) ||
+			    fat_set(moved, next) || fat_set(previous[b], moved) || log_kill(b)) {
+				logVictim = -1;
+				goto error;
+			}
+			if (next != FAT_EOC && (uint32_t)next < amount)
+				previous[next] = moved;
+			previous[moved] = previous[b];
+			previous[b] = 0;
+			logStats.cleanedBlocks++;
+		}
+		logVictim = -1;
+		logStats.cleanedSegments++;
+		cleaned++;
+	}
+
+	free(previous);
+	return cleaned;
+
+error:
+	free(previous);
+	return -1;
+}
+
+/** Number of segments without any used block */
+static int log_free_segments(void)
+{
+	int count = 0;
+
+	for (uint32_t segment = 0; segment < log_segments(); segment++) {
+		uint32_t first, end;
+		int n = log_segment_free(segment);
+		if (n < 0)
+			return -1;
+		log_segment_bounds(segment, &first, &end);
+		count += (uint32_t)n == end - first;
+	}
+	return count;
+}
+
+/**
+ * log_checkpoint - Clean segments if needed, then write a checkpoint
+ *
+ * Return: -1 on error. 0 otherwise.
+ */
+static int log_checkpoint(void)
+{
+	int freeSegments = log_free_segments();
+
+	if (freeSegments < 0 ||
+	    (freeSegments < LOG_CLEAN_RESERVE && log_clean(LOG_CLEAN_BATCH) < 0))
+		return -1;
+	logStats.checkpoints++;
+	return fs_sync_meta();
+}
+
+/**
+ * fs_log_clean - Run the segment cleaner
+ */
+int fs_log_clean(uint32_t maxSegments)
+{
+	if(mount==-1)return -1;
+	if (fs_writable(__func__))
+		return -1;
+	int cleaned = log_clean(maxSegments);
+	/** the cleaned segments are free once a checkpoint drops the old copies */
+	if (cleaned > 0 && log_checkpoint())
+		return -1;
+	return cleaned;
+}
+
+/**
+ * fs_log_stats - Get log-structured mode statistics
+ */
+int fs_log_stats(struct fs_log_stats *stats)
+{
+	if(mount==-1)return -1;
+	if (!stats)
+		return -1;
+
+	int freeSegments = log_free_segments();
+	if (freeSegments < 0)
+		return -1;
+	*stats = logStats;
+	stats->deadBlocks = logDeadCount;
+	stats->segments = log_segments();
+	stats->freeSegments = freeSegments;
+	return 0;
+}
+
+/**========================== phase  4 =============================================-*/
+
+/**
+ * map_valid - Whether the block map of @inode still describes its chain
+ *
+ * The map is emptied if not.
+ */
+static int map_valid(struct inode *inode)
+{
+	if (inode->mapEpoch == chainEpoch && inode->mapLength &&
+	    inode->map[0] == inode->indexFirstDataBlock)
+		return 1;
+	inode->mapLength = 0;
+	inode->mapPrivate = 0;
+	inode->mapEpoch = chainEpoch;
+	return 0;
+}
+
+/** Add @indexBlock to the block map of @inode, as the block after the last mapped one */
+static int map_push(struct inode *inode, uint16_t indexBlock)
+{
+	if (inode->mapLength == inode->mapSize) {
+		uint32_t size = inode->mapSize ? 2 * inode->mapSize : 64;
+		uint16_t *map = realloc(inode->map, size * sizeof(*map));
+		if (!map) {
+			perror("fs_block_of: realloc");
+			return -1;
+		}
+		inode->map = map;
+		inode->mapSize = size;
+	}
+	inode->map[inode->mapLength++] = indexBlock;
+	return 0;
+}
+
+/**
+ * chain_unshare - Give @inode its own copy of the shared part of its chain
+ * @inode: Open file
+ * @last: Position of the last block that must be private
+ *
+ * A block referenced more than once is shared along with all the blocks after
+ * it. Blocks from the first shared one up to position @last (or the end of the
+ * chain) are copied, and the last copy links back to the rest of the shared
+ * chain. Copies of index blocks take a reference to the chunks they list.
+ *
+ * Return: -1 if the disk is full or on I/O error. 0 otherwise.
+ */
+static int chain_unshare(struct inode *inode, uint32_t last)
+{
+	struct _chunkref refs[CHUNK_PER_INDEX];
+	int previous = FAT_EOC;
+	int shared = inode->indexFirstDataBlock;
+	uint32_t i = 0;
+
+	if (table_load())
+		return -1;
+	if (!blockTable)
+		return 0;
+
+	/** start after the blocks already known to be private */
+	if (shared != FAT_EOC && map_valid(inode) && inode->mapPrivate) {
+		if (last < inode->mapPrivate)
+			return 0;
+		i = inode->mapPrivate;
+		previous = inode->map[i - 1];
+		shared = i < inode->mapLength ? inode->map[i] : fat_get(previous);
+	}
+
+	/** find the first shared block */
+	for (; shared != FAT_EOC; i++) {
+		if (shared < 0 || shared >= superblock.amountDataBlock)
+			return -1;
+		if (blockTable[shared].refs)
+			break;
+		if (i == last)
+			break;
+		previous = shared;
+		shared = fat_get(shared);
+	}
+	if (shared == FAT_EOC || !blockTable[shared].refs) {
+		if (map_valid(inode))
+			inode->mapPrivate = i < inode->mapLength ? i + 1 : inode->mapLength;
+		return 0;
+	}
+
+	/** copy it and its successors, building the copies as a separate chain */
+	int head = FAT_EOC, tail = FAT_EOC, indexBlock = shared, indexNextBlock;
+	for (;; i++) {
+		int copy = fat_alloc();
+		if (copy < 0 || data_read(indexBlock, refs) || data_write(copy, refs) ||
+		    (tail != FAT_EOC && fat_set(tail, copy))) {
+			if (copy >= 0)
+				fat_set(copy, 0);
+			goto error;
+		}
+		if (head == FAT_EOC)
+			head = copy;
+		tail = copy;
+		if (inode->flags & DIRENT_INDEXED) {
+			for (uint32_t j = 0; j < CHUNK_PER_INDEX; j++) {
+				if (refs[j].indexFirstBlock == 0)
+					continue;
+				table_ref(refs[j].indexFirstBlock, 1);
+			}
+		}
+		indexNextBlock = fat_get(indexBlock);
+		if (indexNextBlock < 0)
+			goto error;
+		if (i == last || indexNextBlock == FAT_EOC)
+			break;
+		indexBlock = indexNextBlock;
+	}
+
+	/** splice the copies in place of the shared blocks */
+	if (indexNextBlock != FAT_EOC) {
+		if (fat_set(tail, indexNextBlock))
+			goto error;
+		table_ref(indexNextBlock, 1);
+	}
+	if (previous == FAT_EOC)
+		inode->indexFirstDataBlock = head;
+	else if (fat_set(previous, head))
+		return -1;
+	table_ref(shared, -1);
+	return 0;
+
+error:
+	chain_free(head, inode->flags & DIRENT_INDEXED);
+	return -1;
+}
+
+/**
+ * fs_block_of - Find the data block holding a given file block
+ * @inode: Open file
+ * @indexFileBlock: Position of the block in the file (0 for the first block)
+ * @extend: Allocate missing blocks at the end of the chain if non-zero
+ *
+ * Blocks are looked up in the block map of @inode, which is filled by walking
+ * the FAT chain past its last mapped block, faulting in only the FAT blocks
+ * along the way. Each block is thus walked to once as long as no link is
+ * changed, whatever the access pattern. Index blocks added to an indexed file
+ * are cleared. Blocks shared with other files are copied first when @extend
+ * is set, as the caller is about to modify the block or the chain.
+ *
+ * Return: -1 if the chain is too short (and @extend is 0), if the disk is full
+ * or on I/O error. Otherwise the data block index.
+ */
+static int fs_block_of(struct inode *inode, uint32_t indexFileBlock, int extend)
+{
+	static const char zero[BLOCK_SIZE];
+	int indexed = inode->flags & DIRENT_INDEXED;
+
+	if (extend && chain_unshare(inode, indexFileBlock))
+		return -1;
+
+	int indexCurrentBlock = inode->indexFirstDataBlock;
+
+	if (indexCurrentBlock == FAT_EOC) {
+		if (!extend)
+			return -1;
+		indexCurrentBlock = data_alloc();
+		if (indexCurrentBlock < 0)
+			return -1;
+		if (indexed && data_write(indexCurrentBlock, zero)) {
+			fat_set(indexCurrentBlock, 0);
+			return -1;
+		}
+		inode->indexFirstDataBlock = indexCurrentBlock;
+	}
+
+	if (!map_valid(inode) && map_push(inode, indexCurrentBlock))
+		return -1;
+	if (indexFileBlock < inode->mapLength)
+		return inode->map[indexFileBlock];
+
+	indexCurrentBlock = inode->map[inode->mapLength - 1];
+	for (uint32_t i = inode->mapLength - 1; i < indexFileBlock; i++) {
+		int indexNextBlock = fat_get(indexCurrentBlock);
+		if (indexNextBlock < 0)
+			return -1;
+		if (indexNextBlock == FAT_EOC) {
+			if (!extend)
+				return -1;
+			indexNextBlock = data_alloc();
+			if (indexNextBlock < 0)
+				return -1;
+			if ((indexed && data_write(indexNextBlock, zero)) ||
+			    fat_set(indexCurrentBlock, indexNextBlock)) {
+				fat_set(indexNextBlock, 0);
+				return -1;
+			}
+		}
+		if (map_push(inode, indexNextBlock))
+			return -1;
+		indexCurrentBlock = indexNextBlock;
+	}
+	return indexCurrentBlock;
+}
+
+/**
+ * inode_sync_entry - Copy size, first block, layout and inline content of @inode to its entry
+ *
+ * Return: -1 on error or if an inline file does not fit next to its entry.
+ * 0 otherwise.
+ */
+static int inode_sync_entry(struct inode *inode)
+{
+	struct _directory entry;
+
+	if (dir_find(inode->parentDirectory, inode->filename, &entry, NULL))
+		return -1;
+	entry.fileSize = inode->fileSize;
+	entry.indexFirstDataBlock = inode->indexFirstDataBlock;
+	entry.flags = (entry.flags & ~DIRENT_LAYOUT) | (inode->flags & DIRENT_LAYOUT);
+	return dir_update(inode->parentDirectory, &entry, inode->inlineData);
+}
+
+/**
+ * inode_sync_written - Update the entry of @inode after a write
+ * @written: Bytes the write put on disk
+ *
+ * Data that reached the disk is reported even if the entry cannot be
+ * updated; the entry is then updated again when the file is closed.
+ *
+ * Return: -1 if nothing was written and the entry cannot be updated.
+ * Otherwise @written.
+ */
+static int inode_sync_written(struct inode *inode, size_t written)
+{
+	if (inode_sync_entry(inode)) {
+		if (!written)
+			return -1;
+		inode->entryStale = 1;
+	}
+	return written;
+}
+
+/** Size of the chunks of indexed file @inode */
+static uint32_t chunk_size(struct inode *inode)
+{
+	return (inode->flags & DIRENT_COMPRESSED) ? CHUNK_SIZE : BLOCK_SIZE;
+}
+
+/**
+ * chunk_ref - Locate the index entry of a chunk of a compressed file
+ * @inode: Open file
+ * @indexChunk: Chunk number
+ * @ref: Filled with the index entry
+ * @extend: Add index blocks if the index is too short
+ *
+ * Return: -1 on error, otherwise the index block holding the entry. A chunk
+ * past the end of the index reads as a hole when @extend is 0.
+ */
+static int chunk_ref(struct inode *inode, uint32_t indexChunk, struct _chunkref *ref, int extend)
+{
+	struct _chunkref refs[CHUNK_PER_INDEX];
+	int indexBlock = fs_block_of(inode, indexChunk / CHUNK_PER_INDEX, extend);
+
+	if (indexBlock < 0) {
+		memset(ref, 0, sizeof(*ref));
+		return extend ? -1 : 0;
+	}
+	if (data_read(indexBlock, refs))
+		return -1;
+	*ref = refs[indexChunk % CHUNK_PER_INDEX];
+	return indexBlock;
+}
+
+/**
+ * chunk_flush - Store the chunk cached by @inode back to disk
+ *
+ * The chunk is written to newly allocated (or shared) blocks before the old
+ * ones are released, so an interrupted flush leaves the previous content in
+ * place. The size in the directory entry is updated last, so that it never
+ * covers data that is only in the chunk cache.
+ *
+ * Return: -1 if the disk is full or on I/O error. 0 otherwise.
+ */
+static int chunk_flush(struct inode *inode)
+{
+	uint8_t packed[CHUNK_SIZE];
+	struct _chunkref refs[CHUNK_PER_INDEX];
+	struct _chunkref old;
+	uint32_t indexChunk = inode->chunkIndex;
+
+	if (!inode->chunkDirty)
+		return 0;
+
+	/** only the part of the chunk inside the file is kept */
+	uint32_t length = inode->fileSize - indexChunk * chunk_size(inode);
+	if (length > chunk_size(inode))
+		length = chunk_size(inode);
+	uint32_t rawBlocks = (length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+	/** bytes past the end of the file are zeros in the chunk buffer */
+	const uint8_t *data = inode->chunk;
+	uint16_t stored = CHUNK_RAW | length;
+	size_t packedLength = 0;
+	if (rawBlocks > 1 && (inode->flags & DIRENT_COMPRESSED))
+		packedLength = lz_compress(inode->chunk, length, packed,
+					   (rawBlocks - 1) * BLOCK_SIZE);
+	if (packedLength > 0) {
+		uint32_t padded = (packedLength + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+		memset(packed + packedLength, 0, padded - packedLength);
+		data = packed;
+		stored = packedLength;
+		length = packedLength;
+	}
+
+	int head = chunk_store(data, length);
+	if (head < 0) {
+		fprintf(stderr, "fs_write: cannot store chunk %u\n", indexChunk);
+		return -1;
+	}
+
+	int indexBlock = chunk_ref(inode, indexChunk, &old, 1);
+	if (indexBlock < 0 || data_read(indexBlock, refs)) {
+		chain_free(head, 0);
+		return -1;
+	}
+	refs[indexChunk % CHUNK_PER_INDEX].indexFirstBlock = head == FAT_EOC ? 0 : head;
+	refs[indexChunk % CHUNK_PER_INDEX].length = stored;
+	if (data_write(indexBlock, refs)) {
+		chain_free(head, 0);
+		return -1;
+	}
+	if (old.indexFirstBlock != 0 && chain_free(old.indexFirstBlock, 0))
+		return -1;
+
+	inode->chunkDirty = 0;
+	return inode_sync_entry(inode);
+}
+
+/**
+ * chunk_retire - Move the chunk of @inode off the memory lent from it
+ * @keep: Copy the content of the chunk to its new place
+ *
+ * Uncompressed chunks are a block long, so the buffer has room for
+ * CHUNK_BLOCKS of them: the chunk moves to the next free place in the
+ * buffer, and only a full buffer is left to its borrowers for a new one.
+ *
+ * Return: -1 if out of memory. 0 otherwise.
+ */
+static int chunk_retire(struct inode *inode, int keep)
+{
+	uint32_t size = chunk_size(inode);
+
+	if (inode->chunk + 2 * size <= inode->chunkBuffer + CHUNK_SIZE) {
+		if (keep)
+			memcpy(inode->chunk + size, inode->chunk, size);
+		inode->chunk += size;
+		return 0;
+	}
+
+	struct retired *retired = malloc(sizeof(*retired));
+	uint8_t *chunk = malloc(CHUNK_SIZE);
+
+	if (!retired || !chunk) {
+		perror("chunk_retire: malloc");
+		free(retired);
+		free(chunk);
+		return -1;
+	}
+	if (keep)
+		memcpy(chunk, inode->chunk, size);
+	retired->chunk = inode->chunkBuffer;
+	retired->borrows = inode->chunkBorrows;
+	retired->next = inode->retired;
+	inode->retired = retired;
+	inode->chunk = inode->chunkBuffer = chunk;
+	inode->chunkBorrows = 0;
+	return 0;
+}
+
+/** Give back a range of chunk buffer @chunk lent by fs_read_borrow() */
+static void chunk_return(struct inode *inode, uint8_t *chunk)
+{
+	if (chunk == inode->chunkBuffer) {
+		inode->chunkBorrows--;
+		return;
+	}
+	for (struct retired **link = &inode->retired; *link; link = &(*link)->next) {
+		struct retired *retired = *link;
+		if (retired->chunk != chunk)
+			continue;
+		if (--retired->borrows == 0) {
+			*link = retired->next;
+			free(retired->chunk);
+			free(retired);
+		}
+		return;
+	}
+}
+
+/**
+ * chunk_load - Make @indexChunk the chunk cached by @inode
+ *
+ * Return: -1 on error or if the stored chunk is corrupted. 0 otherwise.
+ */
+static int chunk_load(struct inode *inode, uint32_t indexChunk)
+{
+	uint8_t packed[CHUNK_SIZE];
+	struct _chunkref ref;
+
+	if (inode->chunkIndex == indexChunk)
+		return 0;
+	if (chunk_flush(inode))
+		return -1;
+	/** a lent chunk is left to its borrowers; with none, the whole buffer is free */
+	if (inode->chunkBorrows && chunk_retire(inode, 0))
+		return -1;
+	if (!inode->chunkBorrows)
+		inode->chunk = inode->chunkBuffer;
+	inode->chunkIndex = CHUNK_NONE;
+
+	/** chunks past the end of the file are not on disk yet */
+	ref.indexFirstBlock = 0;
+	if ((uint64_t)indexChunk * chunk_size(inode) < inode->fileSize &&
+	    chunk_ref(inode, indexChunk, &ref, 0) < 0)
+		return -1;
+	if (ref.indexFirstBlock == 0) {
+		memset(inode->chunk, 0, chunk_size(inode));
+		inode->chunkIndex = indexChunk;
+		return 0;
+	}
+
+	uint32_t length = ref.length & ~CHUNK_RAW;
+	uint8_t *data = (ref.length & CHUNK_RAW) ? inode->chunk : packed;
+	uint16_t indexBlock = ref.indexFirstBlock;
+	if (length > chunk_size(inode))
+		goto corrupted;
+	for (uint32_t done = 0; done < length; done += BLOCK_SIZE) {
+		char bounce[BLOCK_SIZE];
+		int indexNextBlock;
+
+		if (indexBlock == FAT_EOC)
+			goto corrupted;
+		if (data_read(indexBlock, bounce) ||
+		    (indexNextBlock = fat_get(indexBlock)) < 0)
+			return -1;
+		memcpy(data + done, bounce,
+		       length - done < BLOCK_SIZE ? length - done : BLOCK_SIZE);
+		indexBlock = indexNextBlock;
+	}
+
+	if (ref.length & CHUNK_RAW) {
+		memset(inode->chunk + length, 0, chunk_size(inode) - length);
+	} else {
+		int n = lz_decompress(packed, length, inode->chunk, chunk_size(inode));
+		if (n < 0)
+			goto corrupted;
+		memset(inode->chunk + n, 0, chunk_size(inode) - n);
+	}
+	inode->chunkIndex = indexChunk;
+	return 0;
+
+corrupted:
+	fprintf(stderr, "fs_read: chunk %u of %s is corrupted\n", indexChunk, inode->filename);
+	return -1;
+}
+
+/**
+ * fs_write_indexed - Write to an indexed file through its chunk cache
+ *
+ * The directory entry is updated by chunk_flush().
+ */
+static int fs_write_indexed(struct fd *desc, const void *buf, size_t count)
+{
+	struct inode *inode = desc->inode;
+	size_t written = 0;
+
+	while (written < count) {
+		uint32_t offset = desc->offset;
+		uint32_t inChunk = offset % chunk_size(inode);
+		size_t n = chunk_size(inode) - inChunk;
+		if (n > count - written)
+			n = count - written;
+
+		if (chunk_load(inode, offset / chunk_size(inode)))
+			break;
+		/** borrowers keep seeing the chunk as it was when they borrowed it */
+		if (inode->chunkBorrows && chunk_retire(inode, 1))
+			break;
+		memcpy(inode->chunk + inChunk, (const char *)buf + written, n);
+		inode->chunkDirty = 1;
+
+		written += n;
+		desc->offset += n;
+		if ((uint32_t)desc->offset > inode->fileSize)
+			inode->fileSize = desc->offset;
+	}
+	return written;
+}
+
+/**
+ * fs_write_inline - Write to a file stored in its directory entry
+ *
+ * Return: -1 if the file cannot stay inline (it would exceed
+ * %DIRENT_INLINE_MAX bytes or there is no room next to its entry). Otherwise
+ * the number of bytes written.
+ */
+static int fs_write_inline(struct fd *desc, const void *buf, size_t count)
+{
+	struct inode *inode = desc->inode;
+	uint8_t data[DIRENT_INLINE_MAX];
+	uint32_t offset = desc->offset;
+	uint32_t fileSize = inode->fileSize;
+
+	if (offset + count > DIRENT_INLINE_MAX)
+		return -1;
+
+	memcpy(data, inode->inlineData, DIRENT_INLINE_MAX);
+	memcpy(inode->inlineData + offset, buf, count);
+	if (offset + count > fileSize)
+		inode->fileSize = offset + count;
+	if (inode_sync_entry(inode)) {
+		memcpy(inode->inlineData, data, DIRENT_INLINE_MAX);
+		inode->fileSize = fileSize;
+		return -1;
+	}
+	desc->offset += count;
+	return count;
+}
+
+/**
+ * fs_inline_promote - Move the content of an inline file to a data block
+ *
+ * Return: -1 if the disk is full or on error (the file stays inline).
+ * 0 otherwise.
+ */
+static int fs_inline_promote(struct inode *inode)
+{
+	char bounce[BLOCK_SIZE];
+
+	inode->flags &= ~DIRENT_INLINE;
+	if (inode->fileSize > 0) {
+		int indexBlock = fs_block_of(inode, 0, 1);
+		if (indexBlock < 0) {
+			inode->flags |= DIRENT_INLINE;
+			return -1;
+		}
+		memset(bounce, 0, BLOCK_SIZE);
+		memcpy(bounce, inode->inlineData, inode->fileSize);
+		if (data_write(indexBlock, bounce) || inode_sync_entry(inode)) {
+			fat_set(indexBlock, 0);
+			inode->indexFirstDataBlock = FAT_EOC;
+			inode->flags |= DIRENT_INLINE;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * fs_make_dedup - Store an empty or inline file as deduplicated chunks
+ *
+ * The directory entry is updated along with the size by the write that
+ * follows.
+ *
+ * Return: -1 if memory cannot be allocated. 0 otherwise.
+ */
+static int fs_make_dedup(struct inode *inode)
+{
+	uint8_t *chunk = calloc(1, CHUNK_SIZE);
+
+	if (!chunk) {
+		perror("fs_write: calloc");
+		return -1;
+	}
+	inode->chunk = inode->chunkBuffer = chunk;
+	inode->chunkIndex = CHUNK_NONE;
+	inode->chunkDirty = 0;
+	if (inode->flags & DIRENT_INLINE) {
+		memcpy(chunk, inode->inlineData, inode->fileSize);
+		inode->chunkIndex = 0;
+		inode->chunkDirty = 1;
+	}
+	inode->flags = (inode->flags & ~DIRENT_INLINE) | DIRENT_DEDUP;
+	return 0;
+}
+
+/**
+ * fs_write_at - Write at the offset of a descriptor
+ *
+ * Data is written block by block: whole blocks are written directly, partial
+ * blocks go through a read-modify-write of a single bounce block.
+ */
+static int fs_write_at(struct fd *desc, void *buf, size_t count)
+{
+	char bounce[BLOCK_SIZE];
+	size_t written = 0;
+	struct inode *inode = desc->inode;
+
+	int dedup = superblock.features & FS_FEATURE_DEDUP;
+	if (!(inode->flags & DIRENT_INDEXED)) {
+		/** tiny files live in their directory entry, see DIRENT_INLINE */
+		if ((superblock.features & FS_FEATURE_INLINE) && !(inode->flags & DIRENT_INLINE) &&
+		    inode->indexFirstDataBlock == FAT_EOC && desc->offset + count <= DIRENT_INLINE_MAX)
+			inode->flags |= DIRENT_INLINE;
+		if (inode->flags & DIRENT_INLINE) {
+			int ret = fs_write_inline(desc, buf, count);
+			if (ret >= 0)
+				return ret;
+			/** grown too large: continue with data blocks */
+			if (dedup ? fs_make_dedup(inode) : fs_inline_promote(inode))
+				return 0;
+		} else if (dedup && inode->indexFirstDataBlock == FAT_EOC) {
+			/** new files are deduplicated while the feature is on */
+			if (fs_make_dedup(inode))
+				return -1;
+		}
+	}
+	if (inode->flags & DIRENT_INDEXED)
+		return fs_write_indexed(desc, buf, count);
+
+	uint32_t fileSize = inode->fileSize;
+	uint16_t indexFirstDataBlock = inode->indexFirstDataBlock;
+
+	while (written < count) {
+		uint32_t offset = desc->offset;
+		uint32_t inBlock = offset % BLOCK_SIZE;
+		size_t chunk = BLOCK_SIZE - inBlock;
+		if (chunk > count - written)
+			chunk = count - written;
+
+		/** checkpoint between blocks, with the entry up to date */
+		if (logDeadCount >= LOG_CHECKPOINT_BLOCKS &&
+		    (inode_sync_entry(inode) || log_checkpoint()))
+			break;
+
+		/**
+		 * extend the chain when writing past the end; stop when disk is full.
+		 * In log-structured mode, data already in the file is not overwritten.
+		 */
+		int indexBlock, source;
+		if ((superblock.features & FS_FEATURE_LOG) && offset - inBlock < inode->fileSize)
+			indexBlock = log_relocate(inode, offset / BLOCK_SIZE, &source);
+		else
+			indexBlock = source = fs_block_of(inode, offset / BLOCK_SIZE, 1);
+		if (indexBlock < 0)
+			break;
+
+		if (chunk == BLOCK_SIZE) {
+			if (data_write(indexBlock, (char *)buf + written))
+				break;
+		} else {
+			/** partial block: keep bytes that are already in the file */
+			if (inBlock > 0 || offset + chunk < inode->fileSize) {
+				if (data_read(source, bounce))
+					break;
+			} else {
+				memset(bounce, 0, BLOCK_SIZE);
+			}
+			memcpy(bounce + inBlock, (char *)buf + written, chunk);
+			if (data_write(indexBlock, bounce))
+				break;
+		}
+
+		written += chunk;
+		desc->offset += chunk;
+		if ((uint32_t)desc->offset > inode->fileSize)
+			inode->fileSize = desc->offset;
+	}
+
+	/** keep the directory entry up to date */
+	if (inode->fileSize != fileSize || inode->indexFirstDataBlock != indexFirstDataBlock)
+		return inode_sync_written(inode, written);
+	return written;
+}
+
+/**========================== append mode =============================================*/
+
+/**
+ * Appends through fs_open_append() descriptors skip the chain walk and the
+ * read of the partial last block that fs_write() does: the inode caches the
+ * last block of the file and the data block holding it, and new blocks are
+ * linked after it directly. A block is written once, when it is full, or
+ * when the cache is flushed. The directory entry is updated when the chain
+ * grows, so that the chain never extends past the size in the entry, and
+ * when the cache is flushed.
+ */
+
+/** tail_flush() with the appendLock of @inode held */
+static int tail_flush_locked(struct inode *inode, int drop)
+{
+	if (!inode->tail)
+		return 0;
+	if (inode->tailDirty) {
+		if (data_write(inode->tailBlock, inode->tail) || inode_sync_entry(inode))
+			return -1;
+		inode->tailDirty = 0;
+	}
+	if (drop) {
+		if (inode_sync_entry(inode))
+			return -1;
+		free(inode->tail);
+		inode->tail = NULL;
+	}
+	return 0;
+}
+
+/**
+ * tail_flush - Write back the last block cached for appends to @inode
+ * @drop: Also drop the cache, before the chain is changed by other means
+ *
+ * Takes the appendLock of @inode, which the flusher holds while writing the
+ * block back.
+ *
+ * Return: -1 on error. 0 otherwise.
+ */
+static int tail_flush(struct inode *inode, int drop)
+{
+	if (!inode->tail)
+		return 0;
+	pthread_mutex_lock(&inode->appendLock);
+	int ret = tail_flush_locked(inode, drop);
+	pthread_mutex_unlock(&inode->appendLock);
+	return ret;
+}
+
+/** Cache the last block of non-empty file @inode, copying it if it is shared */
+static int tail_load(struct inode *inode)
+{
+	uint8_t *tail = malloc(BLOCK_SIZE);
+	if (!tail) {
+		perror("fs_write: malloc");
+		return -1;
+	}
+
+	int indexBlock = fs_block_of(inode, (inode->fileSize - 1) / BLOCK_SIZE, 1);
+	/** a full block is only kept to link the next one to it */
+	if (indexBlock < 0 || (inode->fileSize % BLOCK_SIZE && data_read(indexBlock, tail))) {
+		free(tail);
+		return -1;
+	}
+	inode->tail = tail;
+	inode->tailBlock = indexBlock;
+	inode->tailDirty = 0;
+	return 0;
+}
+
+/** Append @count bytes of @buf to the cached last block of @inode */
+static int tail_append(struct inode *inode, const void *buf, size_t count)
+{
+	uint16_t indexFirstDataBlock = inode->indexFirstDataBlock;
+	int grown = 0;
+	size_t written = 0;
+
+	if (!inode->tail && tail_load(inode))
+		return -1;
+
+	while (written < count) {
+		uint32_t inBlock = inode->fileSize % BLOCK_SIZE;
+		size_t n = BLOCK_SIZE - inBlock;
+		if (n > count - written)
+			n = count - written;
+
+		if (inBlock == 0) {
+			int indexNextBlock = data_alloc();
+			if (indexNextBlock < 0)
+				break;
+			if (fat_set(inode->tailBlock, indexNextBlock)) {
+				fat_set(indexNextBlock, 0);
+				break;
+			}
+			inode->tailBlock = indexNextBlock;
+			memset(inode->tail, 0, BLOCK_SIZE);
+			grown = 1;
+		}
+
+		memcpy(inode->tail + inBlock, (const char *)buf + written, n);
+		if (!inode->tailDirty)
+			inode->tailDirtySince = dirty_now();
+		inode->tailDirty = 1;
+		inode->fileSize += n;
+		if (inode->fileSize % BLOCK_SIZE == 0) {
+			if (data_write(inode->tailBlock, inode->tail)) {
+				inode->fileSize -= n;
+				break;
+			}
+			inode->tailDirty = 0;
+		}
+		written += n;
+	}
+
+	if (grown || inode->indexFirstDataBlock != indexFirstDataBlock)
+		return inode_sync_written(inode, written);
+	return written;
+}
+
+/**
+ * fs_write_append - Write at the end of the file, through an append descriptor
+ *
+ * Inline, indexed and empty files, and files in log-structured mode, go
+ * through fs_write_at() instead.
+ */
+static int fs_write_append(struct fd *desc, void *buf, size_t count)
+{
+	struct inode *inode = desc->inode;
+	int ret;
+
+	/** a record is never split by another append to the same file */
+	pthread_mutex_lock(&inode->appendLock);
+	desc->offset = inode->fileSize;
+	if ((inode->flags & (DIRENT_INLINE | DIRENT_INDEXED)) || inode->fileSize == 0 ||
+	    (superblock.features & FS_FEATURE_LOG)) {
+		ret = tail_flush_locked(inode, 1) ? -1 : fs_write_at(desc, buf, count);
+	} else {
+		ret = tail_append(inode, buf, count);
+		desc->offset = inode->fileSize;
+	}
+	pthread_mutex_unlock(&inode->appendLock);
+	return ret;
+}
+
+/**
+ * fs_write - Write to a file
+ */
+int fs_write(int fd, void *buf, size_t count)
+{
+	/** Return: -1 if no FS is currently mounted, */
+	if(mount==-1)return -1;
+	if (fs_writable(__func__))
+		return -1;
+	//
+	struct fd *desc = fd_get(fd);
+	if (!desc){
+		fprintf(stderr, "fs_write: %d is invalid ：not currently open)\n", fd );
+		return -1;
+		}
+	/** if @buf is NULL*/
+	if ( buf == NULL ){
+		fprintf(stderr, "fs_write: buf is NULL\n" );
+		return -1;
+	}
+
+	if (desc->append)
+		return fs_write_append(desc, buf, count);
+	if (tail_flush(desc->inode, 1))
+		return -1;
+	return fs_write_at(desc, buf, count);
+}
+
+
+/**
+ * fs_read - Read from a file
+ *
+ * Only the blocks covering [offset, offset + count) are read from disk.
+ */
+int fs_read(int fd, void *buf, size_t count)
+
+{
+char bounce[BLOCK_SIZE];
+size_t done = 0;
+
+/** Return: -1 if no FS is currently mounted, */
+if(mount==-1)return -1;
+/** if file descriptor @fd is invalid (i.e., out of bounds, or not currently open)*/
+struct fd *desc = fd_get(fd);
+if (!desc){
+	fprintf(stderr, "fs_read: %d is invalid ：not currently open)\n", fd );
+	return -1;
+	}
+/** if @buf is NULL*/
+if ( buf == NULL ){
+	fprintf(stderr, "fs_read: buf is NULL\n" );
+	return -1;
+	}
+
+struct inode *inode = desc->inode;
+if (tail_flush(inode, 0))
+	return -1;
+
+/** never read past the end of the file */
+if (count > inode->fileSize - desc->offset)
+	count = inode->fileSize - desc->offset;
+
+/** content of an inline file was read along with its entry */
+if (inode->flags & DIRENT_INLINE) {
+	memcpy(buf, inode->inlineData + desc->offset, count);
+	desc->offset += count;
+	return count;
+	}
+
+/** indexed files are read one (decompressed) chunk at a time */
+if (inode->flags & DIRENT_INDEXED) {
+	while (done < count) {
+		uint32_t offset = desc->offset;
+		size_t n = chunk_size(inode) - offset % chunk_size(inode);
+		if (n > count - done)
+			n = count - done;
+		if (chunk_load(inode, offset / chunk_size(inode)))
+			return -1;
+		memcpy((char *)buf + done, inode->chunk + offset % chunk_size(inode), n);
+		done += n;
+		desc->offset += n;
+		}
+	return done;
+	}
+
+while (done < count) {
+	uint32_t offset = desc->offset;
+	uint32_t inBlock = offset % BLOCK_SIZE;
+	size_t chunk = BLOCK_SIZE - inBlock;
+	if (chunk > count - done)
+		chunk = count - done;
+
+	int indexBlock = fs_block_of(inode, offset / BLOCK_SIZE, 0);
+	if (indexBlock < 0)
+		return -1;
+
+	if (chunk == BLOCK_SIZE) {
+		if (data_read(indexBlock, (char *)buf + done))
+			return -1;
+	} else {
+		if (data_read(indexBlock, bounce))
+			return -1;
+		memcpy((char *)buf + done, bounce + inBlock, chunk);
+	}
+	done += chunk;
+	desc->offset += chunk;
+	}
+return done;
+}
+
+/**========================== borrowed reads =============================================*/
+
+/**
+ * A lease is what fs_read_borrow() hands out: the caller only sees its iov[]
+ * array, and gives it back to fs_release(). It holds a reference to the
+ * inode, so the file stays open until then.
+ */
+struct lease {
+	struct inode *inode;
+	uint8_t *data;				// blocks or inline content read for the lease, or NULL
+	int iovcnt;
+	uint8_t **chunks;			// DIRENT_INDEXED: chunk buffer lent by each iov[] entry
+	struct fs_iovec iov[];
+};
+
+/**
+ * fs_read_borrow - Read from a file without copying
+ *
+ * Indexed files lend their decompressed chunks. Other files have no cache to
+ * lend from: their blocks are read straight into a buffer owned by the lease,
+ * with no bounce block for the partial ones at either end.
+ */
+int fs_read_borrow(int fd, size_t count, struct fs_iovec **iov)
+{
+	if(mount==-1)return -1;
+
+	struct fd *desc = fd_get(fd);
+	if (!desc) {
+		fprintf(stderr, "fs_read_borrow: %d is invalid ：not currently open)\n", fd);
+		return -1;
+	}
+	if (iov == NULL) {
+		fprintf(stderr, "fs_read_borrow: iov is NULL\n");
+		return -1;
+	}
+	*iov = NULL;
+
+	struct inode *inode = desc->inode;
+	if (tail_flush(inode, 0))
+		return -1;
+	uint32_t offset = desc->offset;
+	if (count > inode->fileSize - offset)
+		count = inode->fileSize - offset;
+	if (count == 0)
+		return 0;
+
+	int iovcnt = 1;
+	if (inode->flags & DIRENT_INDEXED)
+		iovcnt = (offset + count - 1) / chunk_size(inode) - offset / chunk_size(inode) + 1;
+	struct lease *lease = calloc(1, sizeof(*lease) +
+				     iovcnt * (sizeof(struct fs_iovec) + sizeof(uint8_t *)));
+	if (!lease) {
+		perror("fs_read_borrow: calloc");
+		return -1;
+	}
+	atomic_fetch_add(&inode->refs, 1);
+	lease->inode = inode;
+	lease->chunks = (uint8_t **)(lease->iov + iovcnt);
+
+	if (inode->flags & DIRENT_INDEXED) {
+		for (size_t done = 0; done < count; lease->iovcnt++) {
+			uint32_t inChunk = (offset + done) % chunk_size(inode);
+			size_t n = chunk_size(inode) - inChunk;
+			if (n > count - done)
+				n = count - done;
+			if (chunk_load(inode, (offset + done) / chunk_size(inode)))
+				goto failed;
+			inode->chunkBorrows++;
+			lease->chunks[lease->iovcnt] = inode->chunkBuffer;
+			lease->iov[lease->iovcnt].base = inode->chunk + inChunk;
+			lease->iov[lease->iovcnt].len = n;
+			done += n;
+		}
+	} else if (inode->flags & DIRENT_INLINE) {
+		lease->data = malloc(count);
+		if (!lease->data) {
+			perror("fs_read_borrow: malloc");
+			goto failed;
+		}
+		memcpy(lease->data, inode->inlineData + offset, count);
+		lease->iov[0].base = lease->data;
+		lease->iov[0].len = count;
+		lease->iovcnt = 1;
+	} else {
+		uint32_t first = offset / BLOCK_SIZE;
+		uint32_t last = (offset + count - 1) / BLOCK_SIZE;
+		lease->data = malloc((last - first + 1) * BLOCK_SIZE);
+		if (!lease->data) {
+			perror("fs_read_borrow: malloc");
+			goto failed;
+		}
+		for (uint32_t b = first; b <= last; b++) {
+			int indexBlock = fs_block_of(inode, b, 0);
+			if (indexBlock < 0 ||
+			    data_read(indexBlock, lease->data + (b - first) * BLOCK_SIZE))
+				goto failed;
+		}
+		lease->iov[0].base = lease->data + offset % BLOCK_SIZE;
+		lease->iov[0].len = count;
+		lease->iovcnt = 1;
+	}
+
+	desc->offset += count;
+	*iov = lease->iov;
+	return lease->iovcnt;
+
+failed:
+	fs_release(lease->iov);
+	return -1;
+}
+
+/**
+ * fs_release - Give back data borrowed with fs_read_borrow()
+ */
+int fs_release(struct fs_iovec *iov)
+{
+	if(mount==-1)return -1;
+	if (iov == NULL)
+		return 0;
+
+	struct lease *lease = (struct lease *)((char *)iov - offsetof(struct lease, iov));
+	struct inode *inode = lease->inode;
+	for (int i = 0; i < lease->iovcnt; i++)
+		chunk_return(inode, lease->chunks[i]);
+	free(lease->data);
+	free(lease);
+	return inode_put(inode);
+}
+
+/**========================== memory mappings =============================================*/
+
+/**
+ * A mapping keeps a descriptor of its own on the file, so that the file
+ * stays open until it is unmapped. A read-only mapping of a plain file
+ * stored in contiguous blocks aliases these blocks of the disk image.
+ * Such files are not defragmented, and their blocks are not discarded
+ * if they are freed, until they are unmapped. Other mappings are anonymous
+ * memory filled with the content of the file, and a writable one keeps a
+ * shadow copy of it, so that fs_msync() only writes back the pages that
+ * differ.
+ */
+struct mapping {
+	uint8_t *addr;
+	size_t len;					// length of the file when mapped
+	size_t mapped;				// bytes mapped, a whole number of blocks
+	int fd;
+	int alias;					// 1 if the disk image is mapped
+	uint16_t firstBlock;		// alias: first data block mapped
+	uint8_t *shadow;			// writable mappings: content at the last fs_msync()
+	struct mapping *next;
+};
+
+struct mapping *mappings;
+
+/** Whether data block @index is aliased by a read-only mapping */
+static int mapping_aliased(uint32_t index)
+{
+	for (struct mapping *map = mappings; map; map = map->next)
+		if (map->alias && index >= map->firstBlock &&
+		    index < map->firstBlock + map->mapped / BLOCK_SIZE)
+			return 1;
+	return 0;
+}
+
+/** Map @len bytes of the file of @inode straight from the disk image, or NULL */
+static uint8_t *mapping_alias(struct inode *inode, size_t mapped)
+{
+	uint32_t blocks, extents;
+	int shared;
+
+	/** the log moves the blocks of files written meanwhile */
+	if (inode->flags & (DIRENT_INLINE | DIRENT_INDEXED) ||
+	    superblock.features & FS_FEATURE_LOG)
+		return NULL;
+	if (chain_extents(inode->indexFirstDataBlock, &blocks, &extents, &shared) ||
+	    extents != 1 || blocks * BLOCK_SIZE < mapped)
+		return NULL;
+
+	uint8_t *addr = block_disk_map(superblock.indexDataBlock + inode->indexFirstDataBlock,
+				       mapped / BLOCK_SIZE);
+	if (!addr)
+		return NULL;
+
+	/** the blocks are not read through data_read(): verify them now */
+	if (superblock.indexChecksums) {
+		if (checksum_load(0))
+			goto failed;
+		for (size_t b = 0; b < mapped / BLOCK_SIZE; b++) {
+			uint32_t expected = checksums[inode->indexFirstDataBlock + b];
+			if (expected && crc32c(0, addr + b * BLOCK_SIZE, BLOCK_SIZE) != expected) {
+				checksumStats.readErrors++;
+				fprintf(stderr, "fs_mmap: checksum mismatch in block %zu\n",
+					inode->indexFirstDataBlock + b);
+				goto failed;
+			}
+		}
+	}
+	return addr;
+
+failed:
+	block_disk_unmap(addr, mapped / BLOCK_SIZE);
+	return NULL;
+}
+
+/**
+ * fs_mmap - Map a file into memory
+ */
+void *fs_mmap(int fd, size_t *len, int writable)
+{
+	if(mount==-1)return NULL;
+
+	struct fd *desc = fd_get(fd);
+	if (!desc) {
+		fprintf(stderr, "fs_mmap: %d is invalid ：not currently open)\n", fd);
+		return NULL;
+	}
+	if (len == NULL) {
+		fprintf(stderr, "fs_mmap: len is NULL\n");
+		return NULL;
+	}
+	if (writable && fs_writable(__func__))
+		return NULL;
+
+	struct inode *inode = desc->inode;
+	if (tail_flush(inode, 0))
+		return NULL;
+	if (inode->fileSize == 0) {
+		fprintf(stderr, "fs_mmap: %s is empty\n", inode->filename);
+		return NULL;
+	}
+
+	struct mapping *map = calloc(1, sizeof(*map));
+	if (!map) {
+		perror("fs_mmap: calloc");
+		return NULL;
+	}
+	map->len = inode->fileSize;
+	map->mapped = (map->len + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+	map->fd = fs_dup(fd);
+	if (map->fd < 0) {
+		free(map);
+		return NULL;
+	}
+	/** fs_msync() writes at explicit offsets, even for an append descriptor */
+	fd_get(map->fd)->append = 0;
+
+	if (!writable)
+		map->addr = mapping_alias(inode, map->mapped);
+	map->alias = map->addr != NULL;
+	if (map->alias) {
+		map->firstBlock = inode->indexFirstDataBlock;
+		inode->aliases++;
+	} else {
+		map->addr = mmap(NULL, map->mapped, PROT_READ | PROT_WRITE,
+				 MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+		if (map->addr == MAP_FAILED) {
+			perror("fs_mmap: mmap");
+			goto failed;
+		}
+		if (fs_lseek(map->fd, 0) ||
+		    fs_read(map->fd, map->addr, map->len) != (int)map->len) {
+			munmap(map->addr, map->mapped);
+			goto failed;
+		}
+		if (writable) {
+			map->shadow = malloc(map->mapped);
+			if (!map->shadow) {
+				perror("fs_mmap: malloc");
+				munmap(map->addr, map->mapped);
+				goto failed;
+			}
+			memcpy(map->shadow, map->addr, map->mapped);
+		} else if (mprotect(map->addr, map->mapped, PROT_READ)) {
+			perror("fs_mmap: mprotect");
+			munmap(map->addr, map->mapped);
+			goto failed;
+		}
+	}
+
+	map->next = mappings;
+	mappings = map;
+	*len = map->len;
+	return map->addr;
+
+failed:
+	fs_close(map->fd);
+	free(map);
+	return NULL;
+}
+
+/** Mapping at @addr, and the link pointing to it in @link if not NULL */
+static struct mapping *mapping_find(const void *addr, struct mapping ***link)
+{
+	for (struct mapping **m = &mappings; *m; m = &(*m)->next) {
+		if ((*m)->addr == addr) {
+			if (link)
+				*link = m;
+			return *m;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * fs_msync - Write the changes made to a mapping back to its file
+ */
+int fs_msync(void *addr)
+{
+	if(mount==-1)return -1;
+
+	struct mapping *map = mapping_find(addr, NULL);
+	if (!map) {
+		fprintf(stderr, "fs_msync: %p is not a mapping\n", addr);
+		return -1;
+	}
+	if (!map->shadow)
+		return 0;
+
+	for (size_t offset = 0; offset < map->mapped; offset += BLOCK_SIZE) {
+		if (!memcmp(map->addr + offset, map->shadow + offset, BLOCK_SIZE))
+			continue;
+
+		/** bytes past the end of the file when mapped are not written */
+		size_t n = map->len - offset < BLOCK_SIZE ? map->len - offset : BLOCK_SIZE;
+		if (fs_lseek(map->fd, offset) ||
+		    fs_write(map->fd, map->addr + offset, n) != (int)n)
+			return -1;
+		memcpy(map->shadow + offset, map->addr + offset, BLOCK_SIZE);
+	}
+	return 0;
+}
+
+/**
+ * fs_munmap - Remove a mapping
+ */
+int fs_munmap(void *addr)
+{
+	struct mapping **link;
+
+	if(mount==-1)return -1;
+
+	struct mapping *map = mapping_find(addr, &link);
+	if (!map) {
+		fprintf(stderr, "fs_munmap: %p is not a mapping\n", addr);
+		return -1;
+	}
+	*link = map->next;
+
+	int ret = 0;
+	if (map->alias) {
+		fd_get(map->fd)->inode->aliases--;
+		ret = block_disk_unmap(map->addr, map->mapped / BLOCK_SIZE);
+	} else if (munmap(map->addr, map->mapped)) {
+		perror("fs_munmap: munmap");
+		ret = -1;
+	}
+	if (fs_close(map->fd))
+		ret = -1;
+	free(map->shadow);
+	free(map);
+	return ret;
+}
+
+/**========================== asynchronous requests =============================================*/
+
+/**
+ * Requests wait in asyncQueue until the worker takes them, then in
+ * asyncCompleted until fs_async_reap(), both in submission order. The file
+ * system itself is not reentrant, so a single worker runs them one at a
+ * time, in that order, but never on the submitting thread: a close is never
+ * run before an earlier read of the same descriptor. asyncEvent is readable
+ * exactly when asyncCompleted is not empty.
+ */
+enum async_op {
+	ASYNC_OPEN,
+	ASYNC_CLOSE,
+	ASYNC_READ,
+	ASYNC_WRITE,
+};
+
+struct async_request {
+	enum async_op op;
+	char filename[FS_FILENAME_LEN];
+	int fd;
+	void *buf;
+	size_t count;
+	uint32_t offset;
+	void *userData;
+	int result;
+	struct async_request *next;
+};
+
+struct async_queue {
+	struct async_request *head;
+	struct async_request *tail;
+};
+
+static pthread_t asyncWorker;
+static int8_t asyncStop=0;			// protected by asyncLock
+static int asyncEvent=-1;			// eventfd, -1 when not started
+static uint32_t asyncPending;		// submitted and not reaped yet
+static struct async_queue asyncQueue;
+static struct async_queue asyncCompleted;
+static pthread_mutex_t asyncLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t asyncWork = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t asyncDone = PTHREAD_COND_INITIALIZER;
+
+static void async_push(struct async_queue *queue, struct async_request *req)
+{
+	req->next = NULL;
+	if (queue->tail)
+		queue->tail->next = req;
+	else
+		queue->head = req;
+	queue->tail = req;
+}
+
+static struct async_request *async_pop(struct async_queue *queue)
+{
+	struct async_request *req = queue->head;
+
+	if (req) {
+		queue->head = req->next;
+		if (!queue->head)
+			queue->tail = NULL;
+	}
+	return req;
+}
+
+/** Run @req, as fs_lseek() then fs_read() or fs_write() for I/O */
+static int async_run(struct async_request *req)
+{
+	switch (req->op) {
+	case ASYNC_OPEN:
+		return fs_open(req->filename);
+	case ASYNC_CLOSE:
+		return fs_close(req->fd);
+	case ASYNC_READ:
+		if (fs_lseek(req->fd, req->offset))
+			return -1;
+		return fs_read(req->fd, req->buf, req->count);
+	case ASYNC_WRITE:
+		if (fs_lseek(req->fd, req->offset))
+			return -1;
+		return fs_write(req->fd, req->buf, req->count);
+	}
+	return -1;
+}
+
+static void *async_main(void *arg)
+{
+	(void)arg;
+	pthread_mutex_lock(&asyncLock);
+	for (;;) {
+		struct async_request *req = async_pop(&asyncQueue);
+		if (!req) {
+			/** the queue is drained before stopping */
+			if (asyncStop)
+				break;
+			pthread_cond_wait(&asyncWork, &asyncLock);
+			continue;
+		}
+		pthread_mutex_unlock(&asyncLock);
+
+		req->result = async_run(req);
+
+		pthread_mutex_lock(&asyncLock);
+		if (!asyncCompleted.head) {
+			uint64_t one = 1;
+			if (write(asyncEvent, &one, sizeof(one)) < 0)
+				perror("fs_async: write");
+		}
+		async_push(&asyncCompleted, req);
+		pthread_cond_broadcast(&asyncDone);
+	}
+	pthread_mutex_unlock(&asyncLock);
+	return NULL;
+}
+
+/**
+ * fs_async_start - Start the worker running asynchronous requests
+ */
+int fs_async_start(void)
+{
+	if(mount==-1)return -1;
+	if (asyncEvent >= 0) {
+		fprintf(stderr, "fs_async_start: already running\n");
+		return -1;
+	}
+
+	asyncEvent = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (asyncEvent < 0) {
+		perror("fs_async_start");
+		return -1;
+	}
+	asyncStop = 0;
+	if (pthread_create(&asyncWorker, NULL, async_main, NULL)) {
+		fprintf(stderr, "fs_async_start: cannot create thread\n");
+		close(asyncEvent);
+		asyncEvent = -1;
+		return -1;
+	}
+	return asyncEvent;
+}
+
+/**
+ * fs_async_stop - Finish the queued requests and stop the worker
+ */
+int fs_async_stop(void)
+{
+	if (asyncEvent < 0)
+		return 0;
+
+	pthread_mutex_lock(&asyncLock);
+	asyncStop = 1;
+	pthread_cond_broadcast(&asyncWork);
+	pthread_mutex_unlock(&asyncLock);
+	pthread_join(asyncWorker, NULL);
+
+	struct async_request *req;
+	while ((req = async_pop(&asyncCompleted)))
+		free(req);
+	asyncPending = 0;
+	close(asyncEvent);
+	asyncEvent = -1;
+	return 0;
+}
+
+/** Queue @req, or free it if the worker does not run */
+static int async_submit(struct async_request *req, void *userData)
+{
+	req->userData = userData;
+	pthread_mutex_lock(&asyncLock);
+	if (asyncEvent < 0 || asyncStop) {
+		pthread_mutex_unlock(&asyncLock);
+		fprintf(stderr, "fs_async: the worker is not running\n");
+		free(req);
+		return -1;
+	}
+	async_push(&asyncQueue, req);
+	asyncPending++;
+	pthread_cond_signal(&asyncWork);
+	pthread_mutex_unlock(&asyncLock);
+	return 0;
+}
+
+static struct async_request *async_request(enum async_op op, int fd)
+{
+	struct async_request *req = calloc(1, sizeof(*req));
+
+	if (!req) {
+		perror("fs_async: calloc");
+		return NULL;
+	}
+	req->op = op;
+	req->fd = fd;
+	return req;
+}
+
+/**
+ * fs_async_open - Queue fs_open()
+ */
+int fs_async_open(const char *filename, void *userData)
+{
+	if (filename == NULL || strlen(filename) >= FS_FILENAME_LEN) {
+		fprintf(stderr, "fs_async_open: invalid filename\n");
+		return -1;
+	}
+	struct async_request *req = async_request(ASYNC_OPEN, -1);
+	if (!req)
+		return -1;
+	strcpy(req->filename, filename);
+	return async_submit(req, userData);
+}
+
+/**
+ * fs_async_close - Queue fs_close()
+ */
+int fs_async_close(int fd, void *userData)
+{
+	struct async_request *req = async_request(ASYNC_CLOSE, fd);
+
+	if (!req)
+		return -1;
+	return async_submit(req, userData);
+}
+
+/**
+ * fs_async_read - Queue a read at @offset
+ */
+int fs_async_read(int fd, void *buf, size_t count, uint32_t offset, void *userData)
+{
+	struct async_request *req = async_request(ASYNC_READ, fd);
+
+	if (!req)
+		return -1;
+	req->buf = buf;
+	req->count = count;
+	req->offset = offset;
+	return async_submit(req, userData);
+}
+
+/**
+ * fs_async_write - Queue a write at @offset
+ */
+int fs_async_write(int fd, void *buf, size_t count, uint32_t offset, void *userData)
+{
+	struct async_request *req = async_request(ASYNC_WRITE, fd);
+
+	if (!req)
+		return -1;
+	req->buf = buf;
+	req->count = count;
+	req->offset = offset;
+	return async_submit(req, userData);
+}
+
+/**
+ * fs_async_reap - Collect completed requests
+ */
+int fs_async_reap(struct fs_async_completion *completions, int max, int wait)
+{
+	int n = 0;
+
+	if (completions == NULL || max < 1) {
+		fprintf(stderr, "fs_async_reap: no room for completions\n");
+		return -1;
+	}
+
+	pthread_mutex_lock(&asyncLock);
+	while (wait && asyncPending && !asyncCompleted.head)
+		pthread_cond_wait(&asyncDone, &asyncLock);
+	while (n < max && asyncCompleted.head) {
+		struct async_request *req = async_pop(&asyncCompleted);
+		completions[n].userData = req->userData;
+		completions[n].result = req->result;
+		free(req);
+		asyncPending--;
+		n++;
+	}
+	/** nothing left to reap: the notification fd is no longer readable */
+	if (asyncEvent >= 0 && !asyncCompleted.head) {
+		uint64_t count;
+		if (read(asyncEvent, &count, sizeof(count)) < 0 && errno != EAGAIN)
+			perror("fs_async_reap: read");
+	}
+	pthread_mutex_unlock(&asyncLock);
+	return n;
+}
+
+/**========================== defragmentation =============================================*/
+
+/**
+ * The defragmenter moves the chain of each fragmented file to a free run of
+ * contiguous blocks, or when no run is large enough, to the fewest longest
+ * runs if they are fewer than the runs the file is in. The data is copied and the new chain linked before the
+ * directory entry switches to it, and the old blocks are released last, so
+ * that the FAT holds the complete file at its old place or at its new one at
+ * every step. Shared chains (see fs_clone()) and indexed files are left
+ * alone, since their other references could not be updated.
+ */
+
+struct defrag_state {
+	struct fs_defrag_stats *stats;
+	uint32_t maxBlocks;
+	uint32_t maxMillis;
+	struct timespec start;
+	int stop;					// budget exhausted
+	uint64_t readBytes;			// bytes of the moved files
+	uint64_t readBefore;		// nanoseconds reading them from their old place
+	uint64_t readAfter;			// nanoseconds reading them from their new place
+};
+
+static uint64_t elapsed_ns(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000000000ull + now.tv_nsec - start->tv_nsec;
+}
+
+/**
+ * chain_extents - Measure the layout of a chain
+ * @indexBlock: Head of the chain
+ * @blocks: Filled with the length of the chain
+ * @extents: Filled with the number of runs of contiguous blocks
+ * @shared: Filled with 1 if a block of the chain is shared, 0 otherwise
+ *
+ * Return: -1 on I/O error or if the chain loops. 0 otherwise.
+ */
+static int chain_extents(uint16_t indexBlock, uint32_t *blocks, uint32_t *extents, int *shared)
+{
+	*blocks = 0;
+	*extents = 0;
+	*shared = 0;
+	if (table_load())
+		return -1;
+	while (indexBlock != FAT_EOC) {
+		if (++*blocks > superblock.amountDataBlock) {
+			fprintf(stderr, "chain_extents: chain of block %u loops\n", indexBlock);
+			return -1;
+		}
+		if (blockTable && blockTable[indexBlock].refs)
+			*shared = 1;
+		int indexNextBlock = fat_get(indexBlock);
+		if (indexNextBlock < 0)
+			return -1;
+		if (indexNextBlock != indexBlock + 1)
+			(*extents)++;
+		indexBlock = indexNextBlock;
+	}
+	return 0;
+}
+
+/** A run of contiguous free blocks */
+struct free_run {
+	uint32_t start;
+	uint32_t length;
+};
+
+/**
+ * fat_free_runs - List the runs of free blocks, in block order
+ * @runs: Filled with the runs, room for amountDataBlock / 2 + 1 of them
+ *
+ * Return: -1 on I/O error. Otherwise the number of runs.
+ */
+static int fat_free_runs(struct free_run *runs)
+{
+	int count = 0;
+	uint32_t run = 0;
+
+	if (summary_load())
+		return -1;
+	for (int b = 0; b < superblock.amountFAT; b++) {
+		/** skip FAT blocks without free entries, without faulting them in */
+		if (superblock.summary.freeFAT[b] == 0) {
+			run = 0;
+			continue;
+		}
+		if (fat_load(b))
+			return -1;
+
+		uint32_t i = b == 0 ? 1 : b * FAT_PER_BLOCK;
+		uint32_t last = fat_block_end(b);
+		while (i < last) {
+			/** a run may go on from the previous FAT block */
+			if (run == 0) {
+				i += scan_find_zero16(&FAT[b][i % FAT_PER_BLOCK], last - i);
+				if (i == last)
+					break;
+				runs[count].start = i;
+				runs[count++].length = 0;
+			}
+			uint32_t end = i + scan_find_nonzero16(&FAT[b][i % FAT_PER_BLOCK], last - i);
+			runs[count - 1].length += end - i;
+			run = end < last ? 0 : runs[count - 1].length;
+			i = end;
+		}
+	}
+	return count;
+}
+
+static int free_run_longer(const void *a, const void *b)
+{
+	const struct free_run *x = a, *y = b;
+
+	return x->length < y->length ? 1 : x->length > y->length ? -1 : 0;
+}
+
+static int free_run_before(const void *a, const void *b)
+{
+	const struct free_run *x = a, *y = b;
+
+	return x->start < y->start ? -1 : x->start > y->start;
+}
+
+/**
+ * defrag_place - Choose the blocks a file moves to
+ * @blocks: Length of the file
+ * @extents: Runs the file is in now
+ * @target: Filled with the new blocks of the file, in chain order
+ *
+ * The first free run large enough takes the whole file. Failing that, the
+ * longest free runs take it, in block order, if they are fewer than
+ * @extents.
+ *
+ * Return: -1 on error, 0 if the file cannot be placed in fewer runs.
+ * Otherwise the number of runs it is placed in.
+ */
+static int defrag_place(uint32_t blocks, uint32_t extents, uint16_t *target)
+{
+	struct free_run *runs = malloc((superblock.amountDataBlock / 2 + 1) * sizeof(*runs));
+	int used = 0;
+
+	if (!runs) {
+		perror("fs_defrag: malloc");
+		return -1;
+	}
+	int count = fat_free_runs(runs);
+	if (count < 0) {
+		free(runs);
+		return -1;
+	}
+
+	for (int r = 0; r < count && !used; r++) {
+		if (runs[r].length >= blocks) {
+			runs[0] = runs[r];
+			used = 1;
+		}
+	}
+	if (!used) {
+		uint32_t total = 0;
+		qsort(runs, count, sizeof(*runs), free_run_longer);
+		while (used < count && total < blocks)
+			total += runs[used++].length;
+		if (total < blocks || (uint32_t)used >= extents)
+			used = 0;
+		qsort(runs, used, sizeof(*runs), free_run_before);
+	}
+
+	uint32_t n = 0;
+	for (int r = 0; r < used; r++)
+		for (uint32_t i = 0; i < runs[r].length && n < blocks; i++)
+			target[n++] = runs[r].start + i;
+	free(runs);
+	return used;
+}
+
+/**
+ * defrag_file - Move a file to fewer runs of blocks if it is fragmented
+ * @parent: Directory holding the file
+ * @entry: Entry of the file, updated if the file moves
+ * @st: Pass state
+ *
+ * Return: -1 on error. 0 otherwise.
+ */
+static int defrag_file(uint16_t parent, struct _directory *entry, struct defrag_state *st)
+{
+	struct fs_defrag_stats *stats = st->stats;
+	char bounce[BLOCK_SIZE];
+	uint32_t blocks, extents;
+	int shared;
+
+	/** the tail cached for appends to an open file is written first */
+	struct inode *inode = inode_find(parent, entry->filename);
+	if (inode) {
+		if (tail_flush(inode, 1))
+			return -1;
+		entry->fileSize = inode->fileSize;
+	}
+
+	if (chain_extents(entry->indexFirstDataBlock, &blocks, &extents, &shared))
+		return -1;
+	stats->files++;
+	stats->extentsBefore += extents;
+	stats->extentsAfter += extents;
+	if (extents <= 1)
+		return 0;
+	stats->fragmentedBefore++;
+	stats->fragmentedAfter++;
+
+	/** stop at the first file that does not fit in the budget */
+	if (!st->stop && ((st->maxBlocks && stats->movedBlocks + blocks > st->maxBlocks) ||
+			  (st->maxMillis && elapsed_ns(&st->start) >= st->maxMillis * 1000000ull)))
+		st->stop = 1;
+	if (st->stop)
+		return 0;
+	/** a read-only mapping may alias the blocks in the disk image */
+	if (inode && inode->aliases) {
+		stats->skippedFiles++;
+		return 0;
+	}
+
+	uint16_t *target = malloc(blocks * sizeof(*target));
+	if (!target) {
+		perror("fs_defrag: malloc");
+		return -1;
+	}
+	int runs = shared ? 0 : defrag_place(blocks, extents, target);
+	if (runs <= 0) {
+		free(target);
+		if (runs < 0)
+			return -1;
+		stats->skippedFiles++;
+		return 0;
+	}
+
+	/** build the new chain, then copy the data over */
+	for (uint32_t i = 0; i < blocks; i++) {
+		if (fat_set(target[i], i + 1 < blocks ? target[i + 1] : FAT_EOC)) {
+			while (i-- > 0)
+				fat_set(target[i], 0);
+			free(target);
+			return -1;
+		}
+	}
+	uint16_t start = target[0];
+	uint16_t indexBlock = entry->indexFirstDataBlock;
+	for (uint32_t i = 0; i < blocks; i++) {
+		struct timespec t;
+		clock_gettime(CLOCK_MONOTONIC, &t);
+		int ret = data_read(indexBlock, bounce);
+		st->readBefore += elapsed_ns(&t);
+		int indexNextBlock = fat_get(indexBlock);
+		if (ret || indexNextBlock < 0 || data_write(target[i], bounce)) {
+			chain_free(start, 0);
+			free(target);
+			return -1;
+		}
+		indexBlock = indexNextBlock;
+	}
+	for (uint32_t i = 0; i < blocks; i++) {
+		struct timespec t;
+		clock_gettime(CLOCK_MONOTONIC, &t);
+		int ret = data_read(target[i], bounce);
+		st->readAfter += elapsed_ns(&t);
+		if (ret) {
+			chain_free(start, 0);
+			free(target);
+			return -1;
+		}
+	}
+	free(target);
+	st->readBytes += (uint64_t)blocks * BLOCK_SIZE;
+
+	/** switch the entry and the open file over, then release the old blocks */
+	uint16_t old = entry->indexFirstDataBlock;
+	entry->indexFirstDataBlock = start;
+	if (dir_update(parent, entry, NULL)) {
+		entry->indexFirstDataBlock = old;
+		chain_free(start, 0);
+		return -1;
+	}
+	if (inode)
+		inode->indexFirstDataBlock = start;
+	if (chain_free(old, 0))
+		return -1;
+
+	stats->movedFiles++;
+	stats->movedBlocks += blocks;
+	if (runs == 1)
+		stats->fragmentedAfter--;
+	stats->extentsAfter -= extents - runs;
+	return 0;
+}
+
+static int defrag_tree(uint16_t dir, uint16_t node, int depth, struct defrag_state *st);
+
+/** Defragment the file of @entry, or the directory it points to */
+static int defrag_entry(uint16_t parent, struct _directory *entry, int depth,
+			struct defrag_state *st)
+{
+	if (entry->flags & DIRENT_DIR)
+		return defrag_tree(entry->indexFirstDataBlock, entry->indexFirstDataBlock,
+				   depth + 1, st);
+	if ((entry->flags & (DIRENT_INLINE | DIRENT_INDEXED)) ||
+	    entry->indexFirstDataBlock == FAT_EOC)
+		return 0;
+	return defrag_file(parent, entry, st);
+}
+
+/** Defragment the files below node @node of directory @dir */
+static int defrag_tree(uint16_t dir, uint16_t node, int depth, struct defrag_state *st)
+{
+	struct _btnode n;
+
+	if (depth >= SNAPSHOT_MAX_DEPTH || bt_read(node, &n))
+		return -1;
+	if (n.header.leaf) {
+		for (int i = 0; i < n.header.count; i += rec_slots(&n.entry[i]))
+			if (defrag_entry(dir, &n.entry[i], depth, st))
+				return -1;
+	} else {
+		for (int i = 0; i <= n.header.count; i++)
+			if (defrag_tree(dir, bt_child(&n, i), depth + 1, st))
+				return -1;
+	}
+	return 0;
+}
+
+/**
+ * fs_defrag - Move fragmented files to contiguous blocks
+ */
+int fs_defrag(uint32_t maxBlocks, uint32_t maxMillis, struct fs_defrag_stats *stats)
+{
+	struct defrag_state st;
+
+	if(mount==-1)return -1;
+	if (fs_writable(__func__))
+		return -1;
+	if (!stats || dir_load())
+		return -1;
+
+	memset(stats, 0, sizeof(*stats));
+	memset(&st, 0, sizeof(st));
+	st.stats = stats;
+	st.maxBlocks = maxBlocks;
+	st.maxMillis = maxMillis;
+	clock_gettime(CLOCK_MONOTONIC, &st.start);
+
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if (directory[i].filename[0]=='\0' || directory[i].filename[0]==DIRENT_CONT)
+			continue;
+		struct _directory entry = directory[i];
+		if (defrag_entry(DIR_ROOT, &entry, 0, &st))
+			return -1;
+	}
+
+	if (st.readBefore)
+		stats->readBeforeMBps = st.readBytes * 1e3 / st.readBefore;
+	if (st.readAfter)
+		stats->readAfterMBps = st.readBytes * 1e3 / st.readAfter;
+	return st.stop;
+}
+
+/**
+ * fs_fragmentation - Count the runs of contiguous blocks of a file
+ */
+int fs_fragmentation(const char *filename)
+{
+	struct _directory entry;
+	uint16_t parent;
+	uint32_t blocks, extents;
+	int shared;
+
+	if(mount==-1)return -1;
+
+	memset(&entry, 0, sizeof(entry));
+	if (path_lookup(filename, &parent, entry.filename) ||
+	    dir_find(parent, entry.filename, &entry, NULL) || (entry.flags & DIRENT_DIR)) {
+		fprintf(stderr, "fs_fragmentation: no such file %s\n", filename);
+		return -1;
+	}
+	if (entry.flags & DIRENT_INLINE)
+		return 0;
+	if (chain_extents(entry.indexFirstDataBlock, &blocks, &extents, &shared))
+		return -1;
+	return extents;
+}
+
+/**========================== consistency check =============================================*/
+
+/**
+ * Every block in use must be reached exactly once, plus the number of extra
+ * references recorded for it in the block table, from the chains starting at
+ * the superblock, the directories, the index blocks of indexed files and the
+ * snapshots; every other block must be free. The walk goes through each block
+ * once: a block reached again (a shared tail, see fs_clone()) is counted but
+ * not followed a second time, so the check is linear in the size of the FAT.
+ * Loading the FAT and comparing it with the reference counts are split among
+ * threads by FAT block, so at most one thread per FAT block is used. The walk
+ * itself runs in the calling thread.
+ */
+
+struct fsck_state {
+	struct fs_fsck_report *report;
+	int repair;
+	uint32_t *seen;			// references found to each block
+	uint32_t *walk;			// walk that went through each block, 0 if none
+	uint16_t *remaining;	// blocks from each walked block to the end of its chain
+	uint16_t *path;			// blocks of the walks in progress
+	uint32_t pathUsed;
+	uint32_t walks;
+};
+
+/** Part of the FAT handled by one thread */
+struct fsck_segment {
+	struct fsck_state *st;
+	int firstFAT;			// FAT blocks [firstFAT, lastFAT)
+	int lastFAT;
+	int ret;
+	uint32_t used;
+	uint16_t *leaked;		// allocated blocks nobody references
+	uint32_t leakedCount;
+	uint16_t *mismatched;	// blocks whose reference count is wrong
+	uint32_t mismatchedCount;
+	uint32_t summaryErrors;
+};
+
+/**
+ * fsck_found - Record a problem
+ * @st: Check state
+ * @counter: Counter of this kind of problem in the report
+ * @fmt: Description of the problem
+ *
+ * Return: 1 if the problem must be repaired, 0 otherwise.
+ */
+static int fsck_found(struct fsck_state *st, uint32_t *counter, const char *fmt, ...)
+{
+	va_list ap;
+
+	(*counter)++;
+	st->report->errors++;
+	fprintf(stderr, "fs_fsck: ");
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fprintf(stderr, "%s\n", st->repair ? ", repaired" : "");
+	if (st->repair)
+		st->report->repaired++;
+	return st->repair;
+}
+
+/** End the chain starting at @head before the block following @prev (-1: @head) */
+static void fsck_cut(uint16_t *head, int prev)
+{
+	if (prev < 0)
+		*head = FAT_EOC;
+	else
+		fat_set(prev, FAT_EOC);
+}
+
+/**
+ * fsck_measure - Check that a chain has exactly @blocks valid blocks
+ *
+ * The chain is not followed past @blocks blocks, so a loop does no harm.
+ *
+ * Return: -1 on I/O error, 1 if the chain is valid, 0 otherwise.
+ */
+static int fsck_measure(uint16_t indexBlock, uint32_t blocks)
+{
+	for (uint32_t i = 0; i < blocks; i++) {
+		if (indexBlock == 0 || indexBlock >= superblock.amountDataBlock)
+			return 0;
+		int indexNextBlock = fat_get(indexBlock);
+		if (indexNextBlock <= 0)
+			return indexNextBlock;
+		indexBlock = indexNextBlock;
+	}
+	return indexBlock == FAT_EOC;
+}
+
+static int fsck_index(struct fsck_state *st, uint16_t indexBlock, uint32_t chunkSize);
+
+/**
+ * fsck_chain - Walk a chain and count the references it makes
+ * @st: Check state
+ * @head: Head of the chain, set to FAT_EOC if the head itself is invalid
+ * @maxLength: Blocks the chain may have, the rest is cut off
+ * @chunkSize: Non-zero if the chain is the index of an indexed file with
+ *	chunks of @chunkSize bytes, whose chunks are walked as well
+ *
+ * Return: -1 on I/O error. Otherwise the length of the chain, once repaired.
+ */
+static int fsck_chain(struct fsck_state *st, uint16_t *head, uint32_t maxLength,
+		      uint32_t chunkSize)
+{
+	struct fs_fsck_report *report = st->report;
+	uint16_t *path = st->path + st->pathUsed;
+	uint32_t walk = ++st->walks, walked = 0, length = 0;
+	uint16_t indexBlock = *head;
+	int prev = -1, tooLong = 0;
+
+	while (indexBlock != FAT_EOC) {
+		if (indexBlock == 0 || indexBlock >= superblock.amountDataBlock) {
+			if (fsck_found(st, &report->badPointers, "link to invalid block %u", indexBlock))
+				fsck_cut(head, prev);
+			break;
+		}
+		if (st->walk[indexBlock] == walk) {
+			if (fsck_found(st, &report->cycles, "chain loops back to block %u", indexBlock))
+				fsck_cut(head, prev);
+			break;
+		}
+		if (length == maxLength && !tooLong) {
+			tooLong = 1;
+			if (fsck_found(st, &report->sizeMismatches,
+				       "chain longer than %u blocks", maxLength)) {
+				fsck_cut(head, prev);
+				break;
+			}
+		}
+
+		st->seen[indexBlock]++;
+		if (st->walk[indexBlock]) {
+			/** the rest of the chain was walked from another reference */
+			length += st->remaining[indexBlock];
+			break;
+		}
+		st->walk[indexBlock] = walk;
+		path[walked++] = indexBlock;
+		length++;
+
+		int indexNextBlock = fat_get(indexBlock);
+		if (indexNextBlock < 0)
+			return -1;
+		if (indexNextBlock == 0) {
+			/** keep the free block the chain runs into as its last one */
+			if (fsck_found(st, &report->badPointers, "chain uses free block %u", indexBlock))
+				fat_set(indexBlock, FAT_EOC);
+			break;
+		}
+		prev = indexBlock;
+		indexBlock = indexNextBlock;
+	}
+	for (uint32_t i = 0; i < walked; i++)
+		st->remaining[path[i]] = length - i;
+
+	if (chunkSize) {
+		int ret = 0;
+		st->pathUsed += walked;
+		for (uint32_t i = 0; i < walked && ret == 0; i++)
+			ret = fsck_index(st, path[i], chunkSize);
+		st->pathUsed -= walked;
+		if (ret)
+			return -1;
+	}
+	return length;
+}
+
+/** Walk the chunks listed in an index block, dropping the unreadable ones */
+static int fsck_index(struct fsck_state *st, uint16_t indexBlock, uint32_t chunkSize)
+{
+	struct _chunkref refs[CHUNK_PER_INDEX];
+	int changed = 0;
+
+	if (data_read(indexBlock, refs))
+		return -1;
+	for (uint32_t i = 0; i < CHUNK_PER_INDEX; i++) {
+		struct _chunkref *ref = &refs[i];
+		uint32_t length = ref->length & ~CHUNK_RAW;
+		uint32_t blocks = (length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+		if (ref->indexFirstBlock == 0)
+			continue;
+		int ret = length > 0 && length <= chunkSize ?
+			fsck_measure(ref->indexFirstBlock, blocks) : 0;
+		if (ret < 0)
+			return -1;
+		if (ret == 0) {
+			if (fsck_found(st, &st->report->badChunks, "chunk at block %u is damaged",
+				       ref->indexFirstBlock)) {
+				memset(ref, 0, sizeof(*ref));
+				changed = 1;
+			}
+			continue;
+		}
+		if (fsck_chain(st, &ref->indexFirstBlock, blocks, 0) < 0)
+			return -1;
+	}
+	if (changed && data_write(indexBlock, refs))
+		return -1;
+	return 0;
+}
+
+static int fsck_tree(struct fsck_state *st, uint16_t node, int depth, uint32_t *entries);
+
+/**
+ * fsck_entry - Check the blocks of a directory entry
+ * @st: Check state
+ * @entry: Directory entry, repaired in place
+ * @depth: Current recursion depth
+ * @changed: Set to 1 if @entry was modified
+ *
+ * Return: -1 on I/O error. 0 otherwise.
+ */
+static int fsck_entry(struct fsck_state *st, struct _directory *entry, int depth, int *changed)
+{
+	struct fs_fsck_report *report = st->report;
+	uint16_t head = entry->indexFirstDataBlock;
+
+	if (entry->flags & DIRENT_DIR) {
+		struct _btnode n;
+		uint32_t entries = 0;
+
+		report->directories++;
+		int ret = fsck_tree(st, head, depth + 1, &entries);
+		if (ret < 0)
+			return -1;
+		if (ret > 0) {
+			/** the tree cannot be used: keep the name as an empty file */
+			if (fsck_found(st, &report->badDirectories, "directory %s is damaged",
+				       entry->filename)) {
+				entry->flags = 0;
+				entry->fileSize = 0;
+				entry->indexFirstDataBlock = FAT_EOC;
+				*changed = 1;
+			}
+			return 0;
+		}
+		/** fs_rmdir() trusts the entry count kept in the tree root */
+		if (bt_read(head, &n))
+			return -1;
+		if (n.header.total != entries &&
+		    fsck_found(st, &report->badDirectories, "directory %s has %u entries, %u recorded",
+			       entry->filename, entries, n.header.total)) {
+			n.header.total = entries;
+			if (bt_write(head, &n))
+				return -1;
+		}
+		return 0;
+	}
+
+	report->files++;
+	if (entry->flags & DIRENT_INLINE) {
+		if (head != FAT_EOC && fsck_found(st, &report->badPointers,
+						  "inline file %s has blocks", entry->filename)) {
+			entry->indexFirstDataBlock = FAT_EOC;
+			*changed = 1;
+		}
+		return 0;
+	}
+	if (entry->flags & DIRENT_INDEXED) {
+		uint32_t chunkSize = (entry->flags & DIRENT_COMPRESSED) ? CHUNK_SIZE : BLOCK_SIZE;
+		uint32_t chunks = (entry->fileSize + chunkSize - 1) / chunkSize;
+
+		if (fsck_chain(st, &head, (chunks + CHUNK_PER_INDEX - 1) / CHUNK_PER_INDEX,
+			       chunkSize) < 0)
+			return -1;
+	} else {
+		uint32_t blocks = (entry->fileSize + BLOCK_SIZE - 1) / BLOCK_SIZE;
+		int length = fsck_chain(st, &head, blocks, 0);
+
+		if (length < 0)
+			return -1;
+		if ((uint32_t)length < blocks &&
+		    fsck_found(st, &report->sizeMismatches, "%s has %u bytes in %d blocks",
+			       entry->filename, entry->fileSize, length)) {
+			entry->fileSize = length * BLOCK_SIZE;
+			*changed = 1;
+		}
+	}
+	if (head != entry->indexFirstDataBlock) {
+		entry->indexFirstDataBlock = head;
+		*changed = 1;
+	}
+	return 0;
+}
+
+/**
+ * fsck_tree - Check a directory B+tree
+ * @st: Check state
+ * @node: Node to check, with its subtree
+ * @depth: Current recursion depth
+ * @entries: Incremented by the number of entries found
+ *
+ * Return: -1 on I/O error, 1 if @node is not a node that can be used, 0
+ * otherwise.
+ */
+static int fsck_tree(struct fsck_state *st, uint16_t node, int depth, uint32_t *entries)
+{
+	struct _btnode n;
+	int changed = 0;
+
+	if (depth >= SNAPSHOT_MAX_DEPTH || node == 0 || node >= superblock.amountDataBlock ||
+	    st->walk[node])
+		return 1;
+	if (data_read(node, &n))
+		return -1;
+	if (n.header.magic != BT_MAGIC ||
+	    n.header.count > (n.header.leaf ? BT_LEAF_MAX : BT_NODE_MAX))
+		return 1;
+	if (fsck_chain(st, &node, 1, 0) < 0)
+		return -1;
+
+	if (n.header.leaf) {
+		for (int i = 0; i < n.header.count; i += rec_slots(&n.entry[i])) {
+			(*entries)++;
+			if (fsck_entry(st, &n.entry[i], depth, &changed))
+				return -1;
+		}
+	} else {
+		for (int i = 0; i <= n.header.count; i++) {
+			uint16_t child = bt_child(&n, i);
+			int ret = fsck_tree(st, child, depth + 1, entries);
+			if (ret <= 0) {
+				if (ret < 0)
+					return -1;
+				continue;
+			}
+			if (child == 0 || child >= superblock.amountDataBlock || st->walk[child]) {
+				/** no block of its own to rebuild the child in */
+				st->report->badDirectories++;
+				st->report->errors++;
+				fprintf(stderr, "fs_fsck: child %d of directory node %u is invalid\n",
+					i, node);
+				continue;
+			}
+			/** the keys of the parent stay valid for an empty leaf */
+			if (fsck_found(st, &st->report->badDirectories,
+				       "directory node %u is damaged, its entries are lost", child)) {
+				struct _btnode empty;
+
+				bt_init(&empty, 1);
+				if (bt_write(child, &empty))
+					return -1;
+			}
+			if (fsck_chain(st, &child, 1, 0) < 0)
+				return -1;
+		}
+	}
+	if (changed && st->repair && bt_write(node, &n))
+		return -1;
+	return 0;
+}
+
+/** Check the entries of a root directory table (live or snapshot) */
+static int fsck_root(struct fsck_state *st, struct _directory *table, int *changed)
+{
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if (table[i].filename[0]=='\0' || table[i].filename[0]==DIRENT_CONT)
+			continue;
+		if (fsck_entry(st, &table[i], 0, changed))
+			return -1;
+	}
+	return 0;
+}
+
+/** Fault in the FAT blocks of a segment */
+static void *fsck_load(void *arg)
+{
+	struct fsck_segment *seg = arg;
+
+	for (int i = seg->firstFAT; i < seg->lastFAT; i++) {
+		if (FAT[i])
+			continue;
+		uint16_t *buf = malloc(BLOCK_SIZE);
+		if (!buf || block_read(i + 1, buf)) {
+			fprintf(stderr, "fs_fsck: cannot read FAT block %d\n", i);
+			free(buf);
+			seg->ret = -1;
+			return NULL;
+		}
+		if (validSummary && fs_checksum(buf, BLOCK_SIZE) != superblock.summary.checksumFAT[i])
+			seg->summaryErrors++;
+		FAT[i] = buf;
+	}
+	return NULL;
+}
+
+/** Compare the FAT entries of a segment with the references found */
+static void *fsck_sweep(void *arg)
+{
+	struct fsck_segment *seg = arg;
+	struct fsck_state *st = seg->st;
+	uint32_t first = seg->firstFAT * FAT_PER_BLOCK;
+	uint32_t last = seg->lastFAT * FAT_PER_BLOCK;
+
+	if (last > superblock.amountDataBlock)
+		last = superblock.amountDataBlock;
+	seg->leaked = malloc((last - first) * sizeof(uint16_t));
+	seg->mismatched = malloc((last - first) * sizeof(uint16_t));
+	if (!seg->leaked || !seg->mismatched) {
+		perror("fs_fsck: malloc");
+		seg->ret = -1;
+		return NULL;
+	}
+
+	for (int i = seg->firstFAT; i < seg->lastFAT; i++) {
+		uint32_t end = fat_block_end(i);
+		uint32_t freeBlocks = scan_count_zero16(FAT[i], end - i * FAT_PER_BLOCK);
+
+		for (uint32_t j = i * FAT_PER_BLOCK; j < end; j++) {
+			uint16_t entry = FAT[i][j % FAT_PER_BLOCK];
+			uint32_t refs = blockTable ? blockTable[j].refs : 0;
+
+			if (j == 0)
+				continue;
+			if (st->seen[j]) {
+				seg->used++;
+				if (st->seen[j] != 1 + refs)
+					seg->mismatched[seg->mismatchedCount++] = j;
+			} else if (entry != 0) {
+				seg->leaked[seg->leakedCount++] = j;
+			} else if (blockTable && (blockTable[j].refs || blockTable[j].fingerprint)) {
+				seg->mismatched[seg->mismatchedCount++] = j;
+			}
+		}
+		if (validSummary && superblock.summary.freeFAT[i] != freeBlocks)
+			seg->summaryErrors++;
+	}
+	return NULL;
+}
+
+/** Run @func on every segment, each in its own thread */
+static int fsck_parallel(struct fsck_segment *segs, int count, void *(*func)(void *))
+{
+	pthread_t threads[FS_SUMMARY_MAX_FAT];
+	int started[FS_SUMMARY_MAX_FAT];
+
+	for (int i = 0; i < count; i++) {
+		/** fall back to the calling thread when threads cannot be created */
+		started[i] = pthread_create(&threads[i], NULL, func, &segs[i]) == 0;
+		if (!started[i])
+			func(&segs[i]);
+	}
+	for (int i = 0; i < count; i++)
+		if (started[i])
+			pthread_join(threads[i], NULL);
+	for (int i = 0; i < count; i++)
+		if (segs[i].ret)
+			return -1;
+	return 0;
+}
+
+/** Fix the problems found by fsck_sweep() */
+static int fsck_repair(struct fsck_state *st, struct fsck_segment *segs, int count)
+{
+	struct fs_fsck_report *report = st->report;
+	uint32_t leaked = 0;
+
+	for (int i = 0; i < count; i++) {
+		for (uint32_t j = 0; j < segs[i].leakedCount; j++) {
+			uint16_t indexBlock = segs[i].leaked[j];
+			leaked++;
+			if (!st->repair)
+				continue;
+			if (fat_set(indexBlock, 0))
+				return -1;
+			if (blockTable)
+				table_set(indexBlock, 0, 0);
+		}
+	}
+	if (leaked) {
+		report->leakedBlocks += leaked;
+		report->errors += leaked;
+		fprintf(stderr, "fs_fsck: %u blocks are allocated but not used%s\n", leaked,
+			st->repair ? ", released" : "");
+		if (st->repair)
+			report->repaired += leaked;
+	}
+
+	for (int i = 0; i < count; i++) {
+		for (uint32_t j = 0; j < segs[i].mismatchedCount; j++) {
+			uint16_t indexBlock = segs[i].mismatched[j];
+			uint32_t seen = st->seen[indexBlock];
+			uint32_t refs = blockTable ? blockTable[indexBlock].refs : 0;
+
+			if (seen > 1 + refs) {
+				/** shared blocks are legal once recorded, see fs_clone() */
+				if (!fsck_found(st, &report->crossLinks, "block %u is used %u times",
+						indexBlock, seen))
+					continue;
+				if (table_create())
+					return -1;
+			} else if (seen && !fsck_found(st, &report->badRefcounts,
+						       "block %u is used %u times, %u recorded",
+						       indexBlock, seen, 1 + refs)) {
+				continue;
+			} else if (!seen && !fsck_found(st, &report->badRefcounts,
+							"free block %u has a block table record",
+							indexBlock)) {
+				continue;
+			}
+			table_set(indexBlock, seen ? seen - 1 : 0,
+				  seen ? blockTable[indexBlock].fingerprint : 0);
+		}
+	}
+	return 0;
+}
+
+/**
+ * fs_fsck - Check the consistency of the mounted file system
+ */
+int fs_fsck(int repair, int threads, struct fs_fsck_report *report)
+{
+	struct fsck_segment segs[FS_SUMMARY_MAX_FAT];
+	struct fsck_state st;
+	int changed = 0, ret = -1;
+
+	if(mount==-1)return -1;
+	if (fs_writable(__func__))
+		return -1;
+	if (!report)
+		return -1;
+	if (inodeTable) {
+		fprintf(stderr, "fs_fsck: file %s still open\n", inodeTable->filename);
+		return -1;
+	}
+
+	if (threads <= 0)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads <= 0)
+		threads = 1;
+	if (threads > superblock.amountFAT)
+		threads = superblock.amountFAT;
+
+	memset(report, 0, sizeof(*report));
+	memset(&st, 0, sizeof(st));
+	memset(segs, 0, sizeof(segs));
+	st.report = report;
+	st.repair = repair;
+	report->threads = threads;
+	for (int i = 0; i < threads; i++) {
+		segs[i].st = &st;
+		segs[i].firstFAT = superblock.amountFAT * i / threads;
+		segs[i].lastFAT = superblock.amountFAT * (i + 1) / threads;
+	}
+
+	/** 1: read the FAT in parallel */
+	if (fsck_parallel(segs, threads, fsck_load) || dir_load())
+		return -1;
+	if (table_load()) {
+		fprintf(stderr, "fs_fsck: the block table is damaged\n");
+		return -1;
+	}
+
+	st.seen = calloc(superblock.amountDataBlock, sizeof(*st.seen));
+	st.walk = calloc(superblock.amountDataBlock, sizeof(*st.walk));
+	st.remaining = calloc(superblock.amountDataBlock, sizeof(*st.remaining));
+	st.path = calloc(superblock.amountDataBlock, sizeof(*st.path));
+	if (!st.seen || !st.walk || !st.remaining || !st.path) {
+		perror("fs_fsck: calloc");
+		goto out;
+	}
+
+	/** 2: walk everything that references blocks */
+	if (fat_get(0) != FAT_EOC &&
+	    fsck_found(&st, &report->badPointers, "FAT entry 0 is not reserved") &&
+	    fat_set(0, FAT_EOC))
+		goto out;
+	if (superblock.indexBlockTable) {
+		uint16_t head = superblock.indexBlockTable;
+		if (fsck_chain(&st, &head, table_blocks(), 0) < 0)
+			goto out;
+	}
+	if (superblock.indexChecksums) {
+		uint16_t head = superblock.indexChecksums;
+		if (fsck_chain(&st, &head, checksum_blocks(), 0) < 0)
+			goto out;
+	}
+	/** dead blocks are still allocated until the next checkpoint */
+	for (uint32_t i = 0; i < logDeadCount; i++) {
+		uint16_t head = logDead[i];
+		if (fsck_chain(&st, &head, 1, 0) < 0)
+			goto out;
+	}
+	for (int i = 0; i < FS_SNAPSHOT_MAX; i++) {
+		struct _directory copy[FS_FILE_MAX_COUNT];
+		uint16_t head = superblock.snapshots[i];
+
+		if (!head)
+			continue;
+		if (head >= superblock.amountDataBlock || st.walk[head]) {
+			if (fsck_found(&st, &report->badDirectories, "snapshot %d is damaged", i)) {
+				summary_touch();
+				superblock.snapshots[i] = 0;
+			}
+			continue;
+		}
+		changed = 0;
+		if (fsck_chain(&st, &head, 1, 0) < 0 || data_read(head, copy) ||
+		    fsck_root(&st, copy, &changed) ||
+		    (changed && repair && data_write(head, copy)))
+			goto out;
+	}
+	/** the root table is checked on a copy, stored back under metaLock */
+	struct _directory root[FS_FILE_MAX_COUNT];
+	memcpy(root, directory, sizeof(root));
+	changed = 0;
+	if (fsck_root(&st, root, &changed))
+		goto out;
+	if (changed && repair) {
+		pthread_mutex_lock(&metaLock);
+		memcpy(directory, root, sizeof(root));
+		pthread_mutex_unlock(&metaLock);
+		dir_touch();
+	}
+
+	/** 3: compare with the FAT and the block table in parallel, then repair */
+	if (fsck_parallel(segs, threads, fsck_sweep))
+		goto out;
+	uint32_t summaryErrors = 0;
+	for (int i = 0; i < threads; i++) {
+		report->usedBlocks += segs[i].used;
+		summaryErrors += segs[i].summaryErrors;
+	}
+	if (summaryErrors &&
+	    fsck_found(&st, &report->summaryErrors, "free-space summary is out of date")) {
+		validSummary = 0;
+		summary_touch();
+	}
+	if (fsck_repair(&st, segs, threads))
+		goto out;
+	if (repair && report->repaired && fs_sync_meta())
+		goto out;
+	ret = report->errors;
+
+out:
+	for (int i = 0; i < threads; i++) {
+		free(segs[i].leaked);
+		free(segs[i].mismatched);
+	}
+	free(st.seen);
+	free(st.walk);
+	free(st.remaining);
+	free(st.path);
+	return ret;
+}
@@ -2,6 +2,7 @@
 #define _FS_H
 
 #include <stddef.h> /* for size_t definition */
+#include <stdint.h>
 
 /** Maximum filename length (including the NULL character) */
 #define FS_FILENAME_LEN 16
@@ -9,9 +10,30 @@
 /** Maximum number of files in the root directory */
 #define FS_FILE_MAX_COUNT 128
 
-/** Maximum number of open files */
+/** Files of up to 70 bytes are stored inside their directory entry */
+#define FS_FEATURE_INLINE 0x0001
+/** Identical data blocks of new files are stored once */
+#define FS_FEATURE_DEDUP 0x0002
+/** Data blocks are checksummed, and verified when read */
+#define FS_FEATURE_CHECKSUM 0x0004
+/** Data is written sequentially, as a log */
+#define FS_FEATURE_LOG 0x0008
+
+/*
+ * File names may be paths such as "dir/sub/name" (a leading '/' is ignored).
+ * Each component of a path follows the %FS_FILENAME_LEN limit. Subdirectories
+ * are not limited to %FS_FILE_MAX_COUNT entries.
+ */
+
+/**
+ * Number of file descriptors allocated at a time. The descriptor table grows
+ * by as many whenever it is full, up to 65536 open descriptors.
+ */
 #define FS_OPEN_MAX_COUNT 32
 
+/** Maximum number of snapshots of a file system */
+#define FS_SNAPSHOT_MAX 16
+
 /**
  * fs_mount - Mount a file system
  * @diskname: Name of the virtual disk file
@@ -20,6 +42,10 @@
  * contains. A file system needs to be mounted before files can be read from it
  * with fs_read() or written to it with fs_write().
  *
+ * "ram:<image>" mounts a copy of disk image <image> held in memory, discarded
+ * when unmounted, and "ram+save:<image>" one written back to <image> by
+ * fs_umount() (see block_disk_open()).
+ *
  * Return: -1 if virtual disk file @diskname cannot be opened, or if no valid
  * file system can be located. 0 otherwise.
  */
@@ -29,7 +55,8 @@ int fs_mount(const char *diskname);
  * fs_umount - Unmount file system
  *
  * Unmount the currently mounted file system and close the underlying virtual
- * disk file.
+ * disk file. If the disk cannot be closed, for instance because a "ram+save:"
+ * disk cannot be saved, the FS is unmounted all the same.
  *
  * Return: -1 if no FS is currently mounted, or if the virtual disk cannot be
  * closed, or if there are still open file descriptors. 0 otherwise.
@@ -45,43 +72,484 @@ int fs_umount(void);
  */
 int fs_info(void);
 
+/**
+ * fs_features - Enable or disable optional features
+ * @set: FS_FEATURE_* flags to enable
+ * @clear: FS_FEATURE_* flags to disable
+ *
+ * Features are recorded in the superblock of the mounted file system and stay
+ * in effect for later mounts. Disabling a feature only affects new data: files
+ * already stored with it remain readable.
+ *
+ * With %FS_FEATURE_INLINE, small files are kept in their directory entry
+ * without using a data block, and move to data blocks when they grow.
+ *
+ * With %FS_FEATURE_DEDUP, files created while the feature is on are stored as
+ * a list of blocks that are fingerprinted when written: a block identical to
+ * one already on disk is shared instead of written again, and gets copied when
+ * one of its sharers modifies it. Compressed files (see fs_compress()) share
+ * identical chunks the same way. Enabling it the first time reserves a block
+ * table of 8 bytes per data block.
+ *
+ * With %FS_FEATURE_CHECKSUM, the CRC32C of every data block is kept in a
+ * region of 4 bytes per data block, updated when the block is written and
+ * verified when it is read: a block that no longer matches makes the read
+ * fail instead of returning corrupted data. Enabling it computes the
+ * checksums of all blocks in use; disabling it releases the region.
+ *
+ * With %FS_FEATURE_LOG, data blocks are allocated in order at the head of a
+ * log that moves through the disk one segment of 64 blocks at a time, and
+ * overwriting a block of a regular file writes the new content at the head
+ * of the log instead of in place, so that scattered small writes become
+ * sequential ones. The blocks they replace are freed at the next checkpoint,
+ * taken by the first write or other modification once there are 1024 of
+ * them, by fs_log_clean() and by fs_umount(), and a segment cleaner then
+ * compacts sparsely used segments to keep free ones available (see
+ * fs_log_clean()). Compressed and deduplicated files are not affected.
+ *
+ * Images using any of these features can no longer be read by implementations
+ * unaware of them.
+ *
+ * Return: -1 if no FS is currently mounted or if a flag is unknown. Otherwise
+ * the features enabled after the change.
+ */
+int fs_features(int set, int clear);
+
+/**
+ * fs_trim - Release every free data block to the host
+ *
+ * Data blocks freed by deletions and truncations are released with
+ * block_discard() at the next sync of the metadata (fs_umount(), and
+ * checkpoints in log-structured mode), so that the disk file keeps as holes
+ * only the blocks in use. fs_trim() also releases the free blocks written
+ * before, for instance in an image that was copied without holes, and syncs
+ * the metadata.
+ *
+ * Return: -1 if no FS is currently mounted, if it is a snapshot or on I/O
+ * error. Otherwise the number of blocks released, 0 if the disk file does not
+ * support holes.
+ */
+int fs_trim(void);
+
+/** Deduplication statistics, see fs_dedup_stats() */
+struct fs_dedup_stats {
+	uint32_t sharedBlocks;		/* blocks referenced more than once */
+	uint32_t savedBlocks;		/* blocks that sharing saved */
+	uint32_t lookups;		/* chunks fingerprinted since mount */
+	uint32_t hits;			/* chunks found already stored */
+	uint64_t hashedBytes;		/* bytes fingerprinted since mount */
+	uint64_t hashNanoseconds;	/* time spent fingerprinting and looking up */
+};
+
+/**
+ * fs_dedup_stats - Get deduplication statistics
+ * @stats: Filled with the statistics
+ *
+ * Block counts describe the whole file system, the other counters the writes
+ * done since it was mounted. fs_info() prints a summary of them when
+ * deduplication is enabled.
+ *
+ * Return: -1 if no FS is currently mounted or on I/O error. 0 otherwise.
+ */
+int fs_dedup_stats(struct fs_dedup_stats *stats);
+
+/** Checksum statistics, see fs_checksum_stats() */
+struct fs_checksum_stats {
+	uint64_t verifiedBlocks;	/* blocks verified by reads since mount */
+	uint64_t readNanoseconds;	/* time reading blocks from disk */
+	uint64_t verifyNanoseconds;	/* time verifying them */
+	uint32_t readErrors;		/* reads that failed verification */
+	uint32_t scrubPasses;		/* complete passes of the scrubber */
+	uint64_t scrubbedBlocks;	/* blocks verified by the scrubber */
+	uint32_t scrubErrors;		/* blocks the scrubber found corrupted */
+	uint32_t lastBadBlock;		/* last of them */
+	int hardware;			/* 1 if CRC32C instructions are used */
+	int scrubbing;			/* 1 while the scrubber runs */
+};
+
+/**
+ * fs_checksum_stats - Get checksum statistics
+ * @stats: Filled with the statistics, gathered since mount
+ *
+ * The cost of checksums on reads is @verifyNanoseconds compared with
+ * @readNanoseconds; fs_info() prints it as a percentage.
+ *
+ * Return: -1 if no FS is currently mounted. 0 otherwise.
+ */
+int fs_checksum_stats(struct fs_checksum_stats *stats);
+
+/**
+ * fs_scrub_start - Start verifying the checksums in the background
+ * @blocksPerSecond: Blocks to verify per second (0 for no limit)
+ *
+ * A thread reads every data block that has a checksum, over and over, and
+ * reports the ones that no longer match on stderr and in
+ * fs_checksum_stats(). It runs until fs_scrub_stop() or fs_umount().
+ *
+ * Return: -1 if no FS is currently mounted, if checksums are not enabled or
+ * if the scrubber already runs. 0 otherwise.
+ */
+int fs_scrub_start(uint32_t blocksPerSecond);
+
+/**
+ * fs_scrub_stop - Stop the background verification
+ *
+ * Return: 0.
+ */
+int fs_scrub_stop(void);
+
+/** Write-back statistics, see fs_flusher_stats() */
+struct fs_flusher_stats {
+	uint32_t passes;		/* passes of the flusher */
+	uint64_t expiredBlocks;		/* blocks written because they stayed dirty */
+	uint64_t backgroundBlocks;	/* blocks written because too many were dirty */
+	uint64_t tailBlocks;		/* last blocks of files written in append mode */
+	uint32_t throttles;		/* writes held until a pass completed */
+	uint32_t dirtyBlocks;		/* metadata blocks to write back now */
+	uint32_t cachedBlocks;		/* metadata blocks cached in memory now */
+	int running;			/* 1 while the flusher runs */
+};
+
+/**
+ * fs_flusher_start - Start writing back dirty metadata in the background
+ * @expireMillis: Age after which a modified block is written back
+ * @backgroundRatio: Percentage of the cached metadata blocks that, once
+ * dirty, has all of them written back at the next pass
+ * @limitRatio: Percentage over which writers wait for the next pass
+ *
+ * A thread writes back the modified blocks of the FAT, root directory, block
+ * table and checksum region, in disk order, several times per
+ * @expireMillis, and the last blocks cached for fs_open_append(). Data left
+ * for fs_umount() is then mostly what changed during the last @expireMillis.
+ * It runs until fs_flusher_stop() or fs_umount(). A crash still leaves the
+ * file system not cleanly unmounted.
+ *
+ * Return: -1 if no FS is currently mounted, if it is a snapshot, if the
+ * ratios are invalid or if the flusher already runs. 0 otherwise.
+ */
+int fs_flusher_start(uint32_t expireMillis, uint32_t backgroundRatio,
+		     uint32_t limitRatio);
+
+/**
+ * fs_flusher_stop - Stop the background write-back
+ *
+ * Return: 0.
+ */
+int fs_flusher_stop(void);
+
+/**
+ * fs_flusher_stats - Get write-back statistics
+ * @stats: Filled with the statistics, gathered since fs_flusher_start()
+ *
+ * Return: -1 if no FS is currently mounted. 0 otherwise.
+ */
+int fs_flusher_stats(struct fs_flusher_stats *stats);
+
+/** Log-structured mode statistics, see fs_log_stats() */
+struct fs_log_stats {
+	uint64_t appendedBlocks;	/* blocks allocated at the head of the log */
+	uint64_t relocatedBlocks;	/* overwritten blocks moved to the log */
+	uint64_t cleanedBlocks;		/* blocks moved by the cleaner */
+	uint32_t cleanedSegments;	/* segments it emptied */
+	uint32_t checkpoints;		/* checkpoints taken before fs_umount() */
+	uint32_t deadBlocks;		/* blocks waiting for the next checkpoint */
+	uint32_t freeSegments;		/* segments without any used block */
+	uint32_t segments;
+};
+
+/**
+ * fs_log_stats - Get log-structured mode statistics
+ * @stats: Filled with the statistics, gathered since mount
+ *
+ * Return: -1 if no FS is currently mounted or on I/O error. 0 otherwise.
+ */
+int fs_log_stats(struct fs_log_stats *stats);
+
+/**
+ * fs_log_clean - Run the segment cleaner
+ * @maxSegments: Maximum number of segments to clean
+ *
+ * Move the blocks of the least used segments (at most half full) to the head
+ * of the log, then take a checkpoint so that they are free. The first
+ * block of each chain and shared blocks do not move. The cleaner also runs
+ * by itself at checkpoints when few segments are free.
+ *
+ * Return: -1 if no FS is currently mounted, if it is read-only or on error.
+ * Otherwise the number of segments cleaned.
+ */
+int fs_log_clean(uint32_t maxSegments);
+
 /**
  * fs_create - Create a new file
- * @filename: File name
+ * @filename: File path
  *
- * Create a new and empty file named @filename in the root directory of the
- * mounted file system. String @filename must be NULL-terminated and its total
- * length cannot exceed %FS_FILENAME_LEN characters (including the NULL
- * character).
+ * Create a new and empty file named @filename, in the root directory or in
+ * the subdirectory named by its path. String @filename must be
+ * NULL-terminated and each component of the path cannot exceed
+ * %FS_FILENAME_LEN characters (including the NULL character).
  *
- * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if a
- * file named @filename already exists, or if string @filename is too long, or
- * if the root directory already contains %FS_FILE_MAX_COUNT files. 0 otherwise.
+ * Return: -1 if no FS is currently mounted or it is read-only, or if
+ * @filename is invalid, or if a file named @filename already exists, or if a
+ * component of the path is too long or is not a directory, or if the root
+ * directory has no free entry left (it holds %FS_FILE_MAX_COUNT entries, and
+ * an inline file takes several), or if a subdirectory needs a new block and
+ * the disk is full. 0 otherwise.
  */
 int fs_create(const char *filename);
 
 /**
  * fs_delete - Delete a file
- * @filename: File name
+ * @filename: File path
  *
- * Delete the file named @filename from the root directory of the mounted file
- * system.
+ * Delete the file named @filename from the root directory or from the
+ * subdirectory named by its path, and free the data blocks it does not share
+ * with another file.
  *
- * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if
- * Return: -1 if @filename is invalid, if there is no file named @filename to
- * delete, or if file @filename is currently open. 0 otherwise.
+ * Return: -1 if no FS is currently mounted or it is read-only, or if
+ * @filename is invalid, or if there is no file named @filename to delete, or
+ * if @filename is a directory (see fs_rmdir()), or if file @filename is
+ * currently open. 0 otherwise.
  */
 int fs_delete(const char *filename);
 
 /**
- * fs_ls - List files on file system
+ * fs_batch_begin - Start queueing namespace operations
+ *
+ * fs_batch_create(), fs_batch_delete(), fs_batch_rename() and
+ * fs_batch_truncate() then queue operations, checked and applied in order by
+ * fs_batch_commit(). Applying a batch writes each directory node it changes
+ * once, and the metadata once at the end, rather than once per operation.
+ *
+ * Return: -1 if no FS is currently mounted, if it is mounted read-only, or if
+ * a batch is already begun. 0 otherwise.
+ */
+int fs_batch_begin(void);
+
+/**
+ * fs_batch_create - Queue the creation of an empty file
+ * @filename: File name
+ *
+ * Return: -1 if no FS is currently mounted, if no batch is begun, if
+ * @filename is NULL, or if out of memory. 0 otherwise.
+ */
+int fs_batch_create(const char *filename);
+
+/**
+ * fs_batch_delete - Queue the deletion of a file
+ * @filename: File name
+ *
+ * Return: -1 if no FS is currently mounted, if no batch is begun, if
+ * @filename is NULL, or if out of memory. 0 otherwise.
+ */
+int fs_batch_delete(const char *filename);
+
+/**
+ * fs_batch_rename - Queue the renaming of a file
+ * @filename: File name
+ * @newname: New name, possibly in another directory, that must not exist
+ *
+ * Return: -1 if no FS is currently mounted, if no batch is begun, if a name is
+ * NULL, or if out of memory. 0 otherwise.
+ */
+int fs_batch_rename(const char *filename, const char *newname);
+
+/**
+ * fs_batch_truncate - Queue the shrinking of a file
+ * @filename: File name
+ * @size: New size, at most the current one
+ *
+ * Compressed or deduplicated files, and files sharing blocks with a clone or
+ * a snapshot, can only be truncated to 0.
+ *
+ * Return: -1 if no FS is currently mounted, if no batch is begun, if
+ * @filename is NULL, or if out of memory. 0 otherwise.
+ */
+int fs_batch_truncate(const char *filename, uint32_t size);
+
+/**
+ * fs_batch_commit - Apply the queued operations
+ *
+ * Operations fail as the corresponding single calls would, and may not touch
+ * open files. If one fails, the ones before it are undone: the batch applies
+ * completely or not at all. Either way, the batch is over. An operation also
+ * fails if the blocks that undoing it may need are not free.
  *
- * List information about the files located in the root directory.
+ * This holds in memory only: no intent is recorded on disk, so an I/O error
+ * while the batch is written back, or a crash, may leave part of it on disk,
+ * to be repaired with fs_fsck().
+ *
+ * Return: -1 if no FS is currently mounted, if no batch is begun, if an
+ * operation fails, or on I/O error. 0 otherwise.
+ */
+int fs_batch_commit(void);
+
+/**
+ * fs_batch_abort - Forget the queued operations
  *
  * Return: -1 if no FS is currently mounted. 0 otherwise.
  */
+int fs_batch_abort(void);
+
+/**
+ * fs_mkdir - Create a new directory
+ * @dirname: Directory path
+ *
+ * Create a new and empty directory named @dirname. Lookups in a directory stay
+ * logarithmic in the number of entries it holds.
+ *
+ * Return: -1 if no FS is currently mounted, or if @dirname is invalid, or if a
+ * file or directory named @dirname already exists, or if there is no space
+ * left. 0 otherwise.
+ */
+int fs_mkdir(const char *dirname);
+
+/**
+ * fs_rmdir - Remove a directory
+ * @dirname: Directory path
+ *
+ * Return: -1 if no FS is currently mounted, or if @dirname is not an existing
+ * directory, or if the directory is not empty. 0 otherwise.
+ */
+int fs_rmdir(const char *dirname);
+
+/**
+ * fs_clone - Copy a file without copying its data
+ * @src: Path of the file to copy
+ * @dst: Path of the new file
+ *
+ * Create file @dst with the content of file @src in constant time: both files
+ * share the data blocks of @src, and a shared block is copied the first time
+ * either file modifies it. Writing to a block copies the shared blocks that
+ * precede it in the file, and appending copies the whole shared part.
+ *
+ * Return: -1 if no FS is currently mounted, if @src is not a file, if @dst is
+ * invalid or already exists, or if there is no space left. 0 otherwise.
+ */
+int fs_clone(const char *src, const char *dst);
+
+/**
+ * fs_snapshot_create - Take a snapshot of the file system
+ *
+ * Record the current content of all files and directories. Files are not
+ * copied: they share their blocks with the snapshot, and a block is copied
+ * the first time it is modified afterwards. The cost of a snapshot depends on
+ * the number of files and directories, not on the amount of data.
+ *
+ * Return: -1 if no FS is currently mounted, if a snapshot is mounted, if there
+ * are already %FS_SNAPSHOT_MAX snapshots or if there is no space left.
+ * Otherwise the number of the new snapshot.
+ */
+int fs_snapshot_create(void);
+
+/**
+ * fs_snapshot_delete - Delete a snapshot
+ * @snapshot: Number returned by fs_snapshot_create()
+ *
+ * Blocks kept only for the snapshot are released.
+ *
+ * Return: -1 if no FS is currently mounted, if a snapshot is mounted or if
+ * there is no such snapshot. 0 otherwise.
+ */
+int fs_snapshot_delete(int snapshot);
+
+/**
+ * fs_snapshot_mount - Mount a snapshot of a file system
+ * @diskname: Name of the virtual disk file
+ * @snapshot: Number returned by fs_snapshot_create()
+ *
+ * Mount the file system of @diskname as it was when @snapshot was taken, like
+ * fs_mount() does for its current state. The snapshot is read-only: every
+ * function modifying the file system fails until fs_umount() is called.
+ *
+ * Return: -1 if the file system cannot be mounted or has no such snapshot.
+ * 0 otherwise.
+ */
+int fs_snapshot_mount(const char *diskname, int snapshot);
+
+/**
+ * fs_compress - Turn compression on or off for an empty file
+ * @filename: File path
+ * @enable: Non-zero to compress the file
+ *
+ * Data written to a compressed file is compressed in chunks of 16 KiB that are
+ * each stored in as few blocks as possible, and decompressed when read.
+ * fs_read() and fs_write() work as for any other file; the chunk at the
+ * current offset is kept in memory until another chunk is accessed or the
+ * file descriptor is closed. Compressed files cannot be read by
+ * implementations unaware of compression.
+ *
+ * Return: -1 if no FS is currently mounted, if @filename is invalid or is not
+ * a file, if the file is open or is not empty. 0 otherwise.
+ */
+int fs_compress(const char *filename, int enable);
+
+/**
+ * fs_ls - List files on file system
+ *
+ * List information about the files of the file system. Files in
+ * subdirectories are listed by path, such as "dir/sub/name", right after
+ * their directory.
+ *
+ * Return: -1 if no FS is currently mounted or on I/O error. 0 otherwise.
+ */
 int fs_ls(void);
 
+/** Directory entry, see fs_readdir() and fs_stat_name() */
+struct fs_dirent {
+	char filename[FS_FILENAME_LEN];
+	uint32_t size;		/* file size in bytes */
+	uint16_t firstBlock;	/* first data block, 0xFFFF if none */
+	uint32_t blocks;	/* data blocks used, including shared ones */
+	int isDirectory;
+};
+
+/** Directory cursor, see fs_opendir() */
+struct fs_dir;
+
+/**
+ * fs_opendir - Open a directory for reading
+ * @dirname: Directory path, "" or "/" for the root directory
+ *
+ * The cursor lists the entries the directory held when it was opened, in
+ * the order of the directory (by name for subdirectories), with the size and
+ * blocks they had then. It does not use a file descriptor.
+ *
+ * Return: NULL if no FS is currently mounted, if @dirname is not a directory,
+ * or on error. Otherwise the cursor, to be closed with fs_closedir().
+ */
+struct fs_dir *fs_opendir(const char *dirname);
+
+/**
+ * fs_readdir - Read the next entry of a directory
+ * @dir: Cursor returned by fs_opendir()
+ * @dirent: Filled with the entry
+ *
+ * The entry is returned as it was when @dir was opened, even if it was
+ * modified or deleted since.
+ *
+ * Return: -1 if no FS is currently mounted, if an argument is NULL, or on I/O
+ * error. 0 past the last entry. 1 otherwise.
+ */
+int fs_readdir(struct fs_dir *dir, struct fs_dirent *dirent);
+
+/**
+ * fs_closedir - Close a directory cursor
+ * @dir: Cursor returned by fs_opendir(), or NULL
+ *
+ * Return: 0.
+ */
+int fs_closedir(struct fs_dir *dir);
+
+/**
+ * fs_stat_name - Get the status of a file without opening it
+ * @filename: File or directory path
+ * @dirent: Filled with its entry, as fs_readdir() would
+ *
+ * Return: -1 if no FS is currently mounted, if an argument is NULL, if there
+ * is no such file, or on I/O error. 0 otherwise.
+ */
+int fs_stat_name(const char *filename, struct fs_dirent *dirent);
+
 /**
  * fs_open - Open a file
  * @filename: File name
@@ -91,24 +559,75 @@ int fs_ls(void);
  * that is used subsequently to access the contents of the file. The file offset
  * of the file descriptor is set to 0 initially (beginning of the file). If the
  * same file is opened multiple files, fs_open() must return distinct file
- * descriptors. A maximum of %FS_OPEN_MAX_COUNT files can be open
- * simultaneously.
+ * descriptors. They have their own offset but share everything else about
+ * the file, such as its size: a write through one of them is seen by the
+ * others.
+ *
+ * Descriptor values are opaque: besides a table index, they carry a
+ * generation that changes when the descriptor is closed, so that using a
+ * descriptor after closing it fails even if its slot was reused since, or
+ * after the file system was unmounted and mounted again.
+ *
+ * fs_open() looks the file up in its directory, so it must not run at the
+ * same time as any other call. Only fs_dup() and fs_close() of a descriptor
+ * that is not the last one open on its file may run from several threads at
+ * once.
  *
  * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if
- * there is no file named @filename to open, or if there are already
- * %FS_OPEN_MAX_COUNT files currently open. Otherwise, return the file
- * descriptor.
+ * there is no file named @filename to open, or if out of memory or
+ * descriptors. Otherwise, return the file descriptor.
  */
 int fs_open(const char *filename);
 
+/**
+ * fs_open_append - Open a file for appending
+ * @filename: File name
+ *
+ * Like fs_open(), but every write through the descriptor, or through its
+ * duplicates, goes to the end of the file and leaves the offset there. Each
+ * write lands whole, after the data of earlier writes through any append
+ * descriptor of the file. The last block of the file is cached between
+ * writes, and written when it is full, when the file is read, written
+ * through another descriptor or closed, or when a snapshot or a clone is
+ * made. Small appends thus neither walk the chain of the file nor read its
+ * last block again.
+ *
+ * Only appends to the same file are serialized: a write that fills the last
+ * block allocates the next one and updates the directory entry without a
+ * lock, so threads must not append to different files at the same time.
+ *
+ * Return: same as fs_open().
+ */
+int fs_open_append(const char *filename);
+
+/**
+ * fs_dup - Duplicate a file descriptor
+ * @fd: File descriptor
+ *
+ * Return a new file descriptor on the same file as @fd, starting at the same
+ * offset. Unlike fs_open(), fs_dup() does not look the file up, and is safe to
+ * call from several threads at once. A descriptor must not be duplicated or
+ * otherwise used while another thread closes it.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid, or if out of memory or descriptors. Otherwise, return the new file
+ * descriptor.
+ */
+int fs_dup(int fd);
+
 /**
  * fs_close - Close a file
  * @fd: File descriptor
  *
- * Close file descriptor @fd.
+ * Close file descriptor @fd. Closing the last descriptor open on a file
+ * writes back the data still buffered for it, so it must not run at the same
+ * time as any other call; other closes may run alongside fs_dup() and
+ * fs_close() in other threads.
  *
  * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
- * invalid (out of bounds or not currently open). 0 otherwise.
+ * invalid (out of bounds or not currently open), or if data still buffered for
+ * a compressed file could not be written (the descriptor is closed anyway).
+ * 0 otherwise.
  */
 int fs_close(int fd);
 
@@ -130,8 +649,8 @@ int fs_stat(int fd);
  * @offset: File offset
  *
  * Set the file offset (used for read and write operations) associated with file
- * descriptor @fd to the argument @offset. To append to a file, one can call
- * fs_lseek(fd, fs_stat(fd));
+ * descriptor @fd to the argument @offset. To append to a file, open it with
+ * fs_open_append(), or call fs_lseek(fd, fs_stat(fd)) before each write.
  *
  * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
  * invalid (i.e., out of bounds, or not currently open), or if @offset is larger
@@ -182,4 +701,386 @@ int fs_write(int fd, void *buf, size_t count);
  */
 int fs_read(int fd, void *buf, size_t count);
 
+/**
+ * struct fs_iovec - Range of file data lent by fs_read_borrow()
+ * @base: First byte
+ * @len: Number of bytes
+ */
+struct fs_iovec {
+	const void *base;
+	size_t len;
+};
+
+/**
+ * fs_read_borrow - Read from a file without copying
+ * @fd: File descriptor
+ * @count: Number of bytes of data to be read
+ * @iov: Filled with the ranges holding the data, in file order
+ *
+ * Like fs_read(), but rather than copying the data into a buffer, lend the
+ * memory the file system read it into. The ranges stay valid, and keep the
+ * content they had when borrowed even if the file is written meanwhile, until
+ * they are given back with fs_release(). The file stays open until then, so
+ * it can be neither deleted nor unmounted.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @iov is NULL, or on
+ * error. Otherwise return the number of ranges in *@iov, 0 at the end of the
+ * file (*@iov is then NULL).
+ */
+int fs_read_borrow(int fd, size_t count, struct fs_iovec **iov);
+
+/**
+ * fs_release - Give back data borrowed with fs_read_borrow()
+ * @iov: Ranges filled by fs_read_borrow(), or NULL
+ *
+ * Return: -1 if no FS is currently mounted, or if the file was last closed
+ * and its data still buffered could not be written. 0 otherwise.
+ */
+int fs_release(struct fs_iovec *iov);
+
+/**
+ * fs_mmap - Map a file into memory
+ * @fd: File descriptor
+ * @len: Filled with the length of the mapping
+ * @writable: 1 for a writable mapping, 0 for a read-only one
+ *
+ * Map the whole content of the file referenced by file descriptor @fd, so
+ * that it can be accessed as an array of *@len bytes. The file stays open
+ * until the mapping is removed with fs_munmap(), and its size is that of the
+ * file when it was mapped.
+ *
+ * A read-only mapping of a file stored in contiguous blocks shares the pages
+ * of the disk image, without copying anything. Other mappings get a copy of
+ * the file. Changes made to a writable mapping reach the file at the next
+ * fs_msync(), and the content of a read-only mapping is undefined once the
+ * file has been written through a descriptor. While a mapping shares the
+ * pages of the disk image, the blocks of the file stay in place: fs_defrag()
+ * and the log cleaner skip them, and log-structured mode overwrites them in
+ * place.
+ *
+ * Return: NULL if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @len is NULL, or if
+ * the file is empty, or if @writable is set and the FS is mounted read-only,
+ * or on error. Otherwise return the address of the mapping.
+ */
+void *fs_mmap(int fd, size_t *len, int writable);
+
+/**
+ * fs_msync - Write the changes made to a mapping back to its file
+ * @addr: Address returned by fs_mmap()
+ *
+ * Only the blocks that changed since the mapping was created, or since the
+ * previous fs_msync(), are written. Nothing is written for a read-only
+ * mapping.
+ *
+ * Return: -1 if no FS is currently mounted, or if @addr is not a mapping, or
+ * if the disk is full or on error. 0 otherwise.
+ */
+int fs_msync(void *addr);
+
+/**
+ * fs_munmap - Remove a mapping
+ * @addr: Address returned by fs_mmap()
+ *
+ * Changes made to a writable mapping since the last fs_msync() are lost.
+ *
+ * Return: -1 if no FS is currently mounted, or if @addr is not a mapping, or
+ * on error. 0 otherwise.
+ */
+int fs_munmap(void *addr);
+
+/** Default buffer size of a stream, see fs_setvbuf() */
+#define FS_STREAM_BUFSIZE 16384
+
+/** Stream buffering modes, see fs_setvbuf() */
+#define FS_STREAM_FULL 0	/* write when the buffer is full */
+#define FS_STREAM_LINE 1	/* also write after each newline */
+
+/** Buffered stream over a file descriptor, see fs_fopen() */
+struct fs_stream;
+
+/**
+ * fs_fopen - Open a file as a buffered stream
+ * @filename: File name
+ *
+ * Small reads and writes through the stream are gathered in a buffer and
+ * passed to the file system a block or more at a time. The stream owns the
+ * file descriptor it opens.
+ *
+ * Return: NULL if no FS is currently mounted, if there is no such file, or on
+ * error. Otherwise the stream, to be closed with fs_fclose().
+ */
+struct fs_stream *fs_fopen(const char *filename);
+
+/**
+ * fs_fdopen - Open a buffered stream over an open file
+ * @fd: File descriptor
+ *
+ * The stream starts at offset 0 and takes ownership of @fd, which should not
+ * be used directly until the stream is closed.
+ *
+ * Return: NULL if no FS is currently mounted, if file descriptor @fd is
+ * invalid, or on error. Otherwise the stream.
+ */
+struct fs_stream *fs_fdopen(int fd);
+
+/**
+ * fs_setvbuf - Set the buffering of a stream
+ * @stream: Stream
+ * @size: Buffer size in bytes, rounded up to whole blocks, 0 for none
+ * @mode: FS_STREAM_FULL or FS_STREAM_LINE
+ *
+ * Buffered data is written first.
+ *
+ * Return: -1 if an argument is invalid or on error. 0 otherwise.
+ */
+int fs_setvbuf(struct fs_stream *stream, size_t size, int mode);
+
+/**
+ * fs_fwrite - Write to a stream
+ * @stream: Stream
+ * @data: Data to be written
+ * @count: Number of bytes of data to be written
+ *
+ * Writes as large as the buffer go to the file directly.
+ *
+ * Return: -1 if an argument is invalid, or if nothing could be written.
+ * Otherwise the number of bytes written, which is smaller than @count only on
+ * error.
+ */
+int fs_fwrite(struct fs_stream *stream, const void *data, size_t count);
+
+/**
+ * fs_fread - Read from a stream
+ * @stream: Stream
+ * @data: Buffer receiving the data
+ * @count: Number of bytes of data to be read
+ *
+ * Return: -1 if an argument is invalid, or if nothing could be read on error.
+ * Otherwise the number of bytes read, smaller than @count at the end of the
+ * file.
+ */
+int fs_fread(struct fs_stream *stream, void *data, size_t count);
+
+/**
+ * fs_fflush - Write the buffered data of a stream
+ * @stream: Stream
+ *
+ * Return: -1 if @stream is NULL, or if the disk is full or on error. 0
+ * otherwise.
+ */
+int fs_fflush(struct fs_stream *stream);
+
+/**
+ * fs_fseek - Set the position of a stream
+ * @stream: Stream
+ * @offset: Offset, at most the size of the file
+ *
+ * Return: -1 if @stream is NULL, if @offset is past the end of the file, or on
+ * error. 0 otherwise.
+ */
+int fs_fseek(struct fs_stream *stream, uint32_t offset);
+
+/**
+ * fs_ftell - Get the position of a stream
+ * @stream: Stream
+ *
+ * Return: -1 if @stream is NULL. Otherwise the position.
+ */
+int fs_ftell(struct fs_stream *stream);
+
+/**
+ * fs_fclose - Close a stream
+ * @stream: Stream
+ *
+ * Write the buffered data and close the file descriptor of the stream.
+ *
+ * Return: -1 if @stream is NULL, or if the buffered data could not be
+ * written. 0 otherwise. The stream is freed in all cases but the first.
+ */
+int fs_fclose(struct fs_stream *stream);
+
+/**
+ * fs_async_start - Start the worker running asynchronous requests
+ *
+ * Requests submitted with fs_async_open(), fs_async_close(), fs_async_read()
+ * and fs_async_write() return at once, and are run by a worker thread. Each
+ * one then completes with the value the corresponding blocking call returns,
+ * collected with fs_async_reap(). Many requests may be in flight at once.
+ *
+ * The file system is not reentrant, so the worker runs one request at a
+ * time, in submission order, and they complete in that order: a request
+ * sees the effects of every request submitted before it, such as a close
+ * queued after a read of the same descriptor. No other function of this
+ * interface may be called while requests are in flight, except the fs_async
+ * ones.
+ *
+ * Return: -1 if no FS is currently mounted, if the worker already runs, or if
+ * it cannot be started. Otherwise a notification file descriptor, readable
+ * (for poll(2) and the like) whenever completions wait to be reaped.
+ */
+int fs_async_start(void);
+
+/**
+ * fs_async_stop - Finish the queued requests and stop the worker
+ *
+ * Completions not reaped yet are discarded, and the notification file
+ * descriptor is closed. fs_umount() stops the worker too.
+ *
+ * Return: 0.
+ */
+int fs_async_stop(void);
+
+/** Result of an asynchronous request, see fs_async_reap() */
+struct fs_async_completion {
+	void *userData;		/* as given when submitting the request */
+	int result;		/* return value of the blocking call */
+};
+
+/**
+ * fs_async_open - Queue fs_open()
+ * @filename: File name
+ * @userData: Returned with the completion
+ *
+ * Return: -1 if the worker does not run, if @filename is invalid, or if out of
+ * memory. 0 otherwise.
+ */
+int fs_async_open(const char *filename, void *userData);
+
+/**
+ * fs_async_close - Queue fs_close()
+ * @fd: File descriptor
+ * @userData: Returned with the completion
+ *
+ * Return: -1 if the worker does not run, or if out of memory. 0 otherwise.
+ */
+int fs_async_close(int fd, void *userData);
+
+/**
+ * fs_async_read - Queue a read at a given offset
+ * @fd: File descriptor
+ * @buf: Data buffer to be filled with data, untouched until the completion
+ * @count: Number of bytes of data to be read
+ * @offset: File offset to read from
+ * @userData: Returned with the completion
+ *
+ * The request sets the file offset of @fd to @offset, then reads as
+ * fs_read() does.
+ *
+ * Return: -1 if the worker does not run, or if out of memory. 0 otherwise.
+ */
+int fs_async_read(int fd, void *buf, size_t count, uint32_t offset, void *userData);
+
+/**
+ * fs_async_write - Queue a write at a given offset
+ * @fd: File descriptor
+ * @buf: Data buffer, left unchanged until the completion
+ * @count: Number of bytes of data to be written
+ * @offset: File offset to write at
+ * @userData: Returned with the completion
+ *
+ * The request sets the file offset of @fd to @offset, then writes as
+ * fs_write() does.
+ *
+ * Return: -1 if the worker does not run, or if out of memory. 0 otherwise.
+ */
+int fs_async_write(int fd, void *buf, size_t count, uint32_t offset, void *userData);
+
+/**
+ * fs_async_reap - Collect completed requests
+ * @completions: Filled with the completions, oldest first
+ * @max: Room in @completions
+ * @wait: 1 to wait for a completion if there is none yet, 0 not to
+ *
+ * Return: -1 if @completions is NULL or @max is less than 1. Otherwise the
+ * number of completions collected, 0 if there is none (or with @wait, if no
+ * request is in flight).
+ */
+int fs_async_reap(struct fs_async_completion *completions, int max, int wait);
+
+/** Result of a defragmentation pass, see fs_defrag() */
+struct fs_defrag_stats {
+	uint32_t files;			/* files examined */
+	uint32_t fragmentedBefore;	/* files in more than one extent before the pass */
+	uint32_t fragmentedAfter;	/* and after the pass */
+	uint32_t extentsBefore;		/* runs of contiguous blocks before the pass */
+	uint32_t extentsAfter;		/* and after the pass */
+	uint32_t movedFiles;		/* files moved to fewer runs of blocks */
+	uint32_t movedBlocks;		/* blocks moved */
+	uint32_t skippedFiles;		/* fragmented files that could not be moved or are mapped */
+	double readBeforeMBps;		/* sequential read of moved files at their old place */
+	double readAfterMBps;		/* and at their new place */
+};
+
+/**
+ * fs_defrag - Move fragmented files to contiguous blocks
+ * @maxBlocks: Stop before moving more than @maxBlocks blocks (0 for no limit)
+ * @maxMillis: Stop after about @maxMillis milliseconds (0 for no limit)
+ * @stats: Filled with the result of the pass
+ *
+ * Every file whose blocks are not contiguous is moved to the first run of
+ * free blocks large enough to hold it or, if there is none, to the longest
+ * free runs, provided they are fewer than the runs it is in. A file is
+ * switched to its new blocks only once they hold all its data, so the pass
+ * can be interrupted between two files and be resumed later by calling
+ * fs_defrag() again. Files may stay open during the pass. Files sharing blocks
+ * with others (see fs_clone()), compressed and deduplicated files, and files
+ * with a read-only mapping of the disk image (see fs_mmap()) are not moved.
+ *
+ * Return: -1 if no FS is currently mounted, if a snapshot is mounted or on
+ * error. 1 if the budget ran out before all files were examined, 0 otherwise.
+ */
+int fs_defrag(uint32_t maxBlocks, uint32_t maxMillis, struct fs_defrag_stats *stats);
+
+/**
+ * fs_fragmentation - Measure the fragmentation of a file
+ * @filename: File path
+ *
+ * Return: -1 if no FS is currently mounted or if there is no such file.
+ * Otherwise the number of runs of contiguous blocks in the FAT chain of the
+ * file (0 if it has no data block, 1 if it is contiguous).
+ */
+int fs_fragmentation(const char *filename);
+
+/** Result of a consistency check, see fs_fsck() */
+struct fs_fsck_report {
+	uint32_t files;			/* files found */
+	uint32_t directories;		/* subdirectories found */
+	uint32_t usedBlocks;		/* data blocks in use */
+	uint32_t leakedBlocks;		/* allocated blocks nobody uses */
+	uint32_t cycles;		/* chains looping on themselves */
+	uint32_t crossLinks;		/* blocks used more often than recorded */
+	uint32_t badRefcounts;		/* blocks used less often than recorded */
+	uint32_t badPointers;		/* links to invalid or free blocks */
+	uint32_t sizeMismatches;	/* files whose size does not match their chain */
+	uint32_t badChunks;		/* damaged chunks of compressed or deduplicated files */
+	uint32_t badDirectories;	/* damaged directories and snapshots */
+	uint32_t summaryErrors;		/* stale free-space summary */
+	uint32_t errors;		/* problems found, in total */
+	uint32_t repaired;		/* problems repaired */
+	int threads;			/* threads used */
+};
+
+/**
+ * fs_fsck - Check the consistency of the mounted file system
+ * @repair: Non-zero to repair the problems found
+ * @threads: Threads reading and checking the FAT (0 for one per CPU), at most
+ * one per FAT block
+ * @report: Filled with the problems found
+ *
+ * Walk the chain of every file, directory and snapshot and check that every
+ * data block is used as many times as the FAT and the block table say.
+ * Allocated blocks nobody uses are released, loops and links to invalid blocks
+ * cut, chains longer than their file truncated, file sizes larger than their
+ * chain reduced, and blocks used by several chains recorded as shared (see
+ * fs_clone()). Each problem is described on stderr. Run time is linear in the
+ * size of the FAT. Only loading the FAT and comparing it with the counts are
+ * split among threads; the chains are walked by the calling thread.
+ *
+ * Return: -1 if no FS is currently mounted, if a snapshot is mounted, if
+ * files are open or on error. Otherwise the number of problems found.
+ */
+int fs_fsck(int repair, int threads, struct fs_fsck_report *report);
+
 #endif /* _FS_H */
@@ -0,0 +1,180 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+/*
+ * Compressed data is a series of sequences:
+ *
+ *   token | [literal length bytes] | literals | offset | [match length bytes]
+ *
+ * The high nibble of the token is the number of literals, the low nibble the
+ * match length minus LZ_MIN_MATCH. A nibble of 15 is followed by extra bytes
+ * added to it, each 255 meaning another byte follows. The offset is a
+ * little-endian 16-bit distance back into the output. The last sequence stops
+ * right after its literals.
+ */
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 0xFFFF
+#define LZ_HASH_BITS 12
+#define LZ_NIBBLE 15
+
+static uint32_t lz_read32(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint32_t lz_hash(uint32_t v)
+{
+	return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/**
+ * lz_put_length - Write the extra bytes of a length that overflows its nibble
+ *
+ * Return: -1 if the output is full, 0 otherwise.
+ */
+static int lz_put_length(uint8_t **op, const uint8_t *oend, size_t n)
+{
+	for (n -= LZ_NIBBLE; ; n -= 255) {
+		if (*op >= oend)
+			return -1;
+		*(*op)++ = n < 255 ? n : 255;
+		if (n < 255)
+			return 0;
+	}
+}
+
+/**
+ * lz_put_sequence - Write a sequence of literals, then a match if @match > 0
+ *
+ * Return: -1 if the output is full, 0 otherwise.
+ */
+static int lz_put_sequence(uint8_t **op, const uint8_t *oend, const uint8_t *lit,
+			   size_t litLen, size_t offset, size_t match)
+{
+	size_t matchCode = match ? match - LZ_MIN_MATCH : 0;
+	uint8_t *token = *op;
+
+	if (*op >= oend)
+		return -1;
+	(*op)++;
+	*token = (litLen < LZ_NIBBLE ? litLen : LZ_NIBBLE) << 4;
+	if (litLen >= LZ_NIBBLE && lz_put_length(op, oend, litLen))
+		return -1;
+	if ((size_t)(oend - *op) < litLen)
+		return -1;
+	memcpy(*op, lit, litLen);
+	*op += litLen;
+
+	if (!match)
+		return 0;
+	*token |= matchCode < LZ_NIBBLE ? matchCode : LZ_NIBBLE;
+	if (oend - *op < 2)
+		return -1;
+	*(*op)++ = offset & 0xFF;
+	*(*op)++ = offset >> 8;
+	if (matchCode >= LZ_NIBBLE && lz_put_length(op, oend, matchCode))
+		return -1;
+	return 0;
+}
+
+size_t lz_compress(const void *src, size_t len, void *dst, size_t cap)
+{
+	const uint8_t *in = src;
+	uint8_t *op = dst;
+	const uint8_t *oend = op + cap;
+	int32_t table[1 << LZ_HASH_BITS];
+	size_t ip = 0, anchor = 0;
+
+	/** every slot starts out as -1, i.e. no earlier position */
+	memset(table, 0xFF, sizeof(table));
+
+	while (ip + LZ_MIN_MATCH <= len) {
+		uint32_t v = lz_read32(in + ip);
+		uint32_t h = lz_hash(v);
+		int32_t ref = table[h];
+
+		table[h] = ip;
+		if (ref < 0 || ip - ref > LZ_MAX_OFFSET || lz_read32(in + ref) != v) {
+			/** skip faster through data that does not compress */
+			ip += 1 + ((ip - anchor) >> 6);
+			continue;
+		}
+
+		size_t match = LZ_MIN_MATCH;
+		while (ip + match < len && in[ref + match] == in[ip + match])
+			match++;
+		if (lz_put_sequence(&op, oend, in + anchor, ip - anchor, ip - ref, match))
+			return 0;
+		ip += match;
+		anchor = ip;
+	}
+
+	if (lz_put_sequence(&op, oend, in + anchor, len - anchor, 0, 0))
+		return 0;
+	return op - (uint8_t *)dst;
+}
+
+/**
+ * lz_get_length - Read the extra bytes of a length that overflows its nibble
+ *
+ * Return: -1 if the input ends too early, 0 otherwise.
+ */
+static int lz_get_length(const uint8_t **ip, const uint8_t *iend, size_t *n)
+{
+	uint8_t b;
+
+	do {
+		if (*ip >= iend)
+			return -1;
+		b = *(*ip)++;
+		*n += b;
+	} while (b == 255);
+	return 0;
+}
+
+int lz_decompress(const void *src, size_t len, void *dst, size_t cap)
+{
+	const uint8_t *ip = src;
+	const uint8_t *iend = ip + len;
+	uint8_t *out = dst;
+	uint8_t *op = out;
+	const uint8_t *oend = out + cap;
+
+	while (ip < iend) {
+		uint8_t token = *ip++;
+		size_t litLen = token >> 4;
+
+		if (litLen == LZ_NIBBLE && lz_get_length(&ip, iend, &litLen))
+			return -1;
+		if ((size_t)(iend - ip) < litLen || (size_t)(oend - op) < litLen)
+			return -1;
+		memcpy(op, ip, litLen);
+		ip += litLen;
+		op += litLen;
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return -1;
+		size_t offset = ip[0] | (ip[1] << 8);
+		size_t match = token & LZ_NIBBLE;
+		ip += 2;
+		if (match == LZ_NIBBLE && lz_get_length(&ip, iend, &match))
+			return -1;
+		match += LZ_MIN_MATCH;
+		if (offset == 0 || offset > (size_t)(op - out) || (size_t)(oend - op) < match)
+			return -1;
+
+		/** byte by byte: the match may overlap the bytes it produces */
+		const uint8_t *ref = op - offset;
+		for (size_t i = 0; i < match; i++)
+			op[i] = ref[i];
+		op += match;
+	}
+	return op - out;
+}
@@ -0,0 +1,37 @@
+#ifndef _LZ_H
+#define _LZ_H
+
+#include <stddef.h> /* for size_t definition */
+
+/**
+ * lz_compress - Compress a buffer
+ * @src: Data to compress
+ * @len: Length of @src in bytes, at most 65536
+ * @dst: Buffer receiving the compressed data
+ * @cap: Size of @dst in bytes
+ *
+ * Compress @src with a byte-oriented LZ77 codec tuned for speed rather than
+ * ratio: literal runs and back-references (up to 65535 bytes back, at least 4
+ * bytes long) are packed into sequences introduced by a one-byte token.
+ *
+ * Return: 0 if the compressed data does not fit in @cap bytes, otherwise the
+ * compressed length.
+ */
+size_t lz_compress(const void *src, size_t len, void *dst, size_t cap);
+
+/**
+ * lz_decompress - Decompress a buffer
+ * @src: Data produced by lz_compress()
+ * @len: Length of @src in bytes
+ * @dst: Buffer receiving the original data
+ * @cap: Size of @dst in bytes
+ *
+ * Corrupted input is detected rather than trusted: nothing is ever read past
+ * @src + @len or written past @dst + @cap.
+ *
+ * Return: -1 if @src is not valid compressed data or does not fit in @cap
+ * bytes, otherwise the decompressed length.
+ */
+int lz_decompress(const void *src, size_t len, void *dst, size_t cap);
+
+#endif /* _LZ_H */
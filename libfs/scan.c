@@ -0,0 +1,394 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+struct scan_ops {
+	size_t (*count_zero16)(const uint16_t *v, size_t n);
+	size_t (*find_zero16)(const uint16_t *v, size_t n);
+	size_t (*find_nonzero16)(const uint16_t *v, size_t n);
+	size_t (*find_free_dirent)(const uint8_t *entries, size_t count);
+	size_t (*find_dirent)(const uint8_t *entries, size_t count, const uint8_t *key,
+			      uint32_t need);
+};
+
+/**=== portable kernels ===*/
+
+static size_t count_zero16_scalar(const uint16_t *v, size_t n)
+{
+	size_t count = 0;
+
+	for (size_t i = 0; i < n; i++)
+		count += v[i] == 0;
+	return count;
+}
+
+static size_t find_zero16_scalar(const uint16_t *v, size_t n)
+{
+	size_t i = 0;
+
+	while (i < n && v[i] != 0)
+		i++;
+	return i;
+}
+
+static size_t find_nonzero16_scalar(const uint16_t *v, size_t n)
+{
+	size_t i = 0;
+
+	while (i < n && v[i] == 0)
+		i++;
+	return i;
+}
+
+static size_t find_free_dirent_scalar(const uint8_t *entries, size_t count)
+{
+	size_t i = 0;
+
+	while (i < count && entries[i * SCAN_DIRENT_SIZE] != '\0')
+		i++;
+	return i;
+}
+
+/**
+ * @key is the name padded with NULs, @need has one bit per byte of the name
+ * that must match, NUL included.
+ */
+static size_t find_dirent_scalar(const uint8_t *entries, size_t count, const uint8_t *key,
+				 uint32_t need)
+{
+	size_t len = __builtin_popcount(need);
+
+	for (size_t i = 0; i < count; i++)
+		if (memcmp(entries + i * SCAN_DIRENT_SIZE, key, len) == 0)
+			return i;
+	return count;
+}
+
+static const struct scan_ops scan_scalar = {
+	count_zero16_scalar,
+	find_zero16_scalar,
+	find_nonzero16_scalar,
+	find_free_dirent_scalar,
+	find_dirent_scalar,
+};
+
+#ifdef SCAN_X86
+
+/**=== SSE2 kernels ===*/
+
+__attribute__((target("sse2")))
+static size_t count_zero16_sse2(const uint16_t *v, size_t n)
+{
+	const __m128i zero = _mm_setzero_si128();
+	size_t count = 0, i = 0;
+
+	while (i + 8 <= n) {
+		/** 16-bit lanes count up to 0x7FFF matches before being folded */
+		__m128i acc = zero;
+		size_t end = n - i > 8 * 0x7FFF ? i + 8 * 0x7FFF : n;
+
+		for (; i + 8 <= end; i += 8) {
+			__m128i x = _mm_loadu_si128((const __m128i *)(v + i));
+			acc = _mm_sub_epi16(acc, _mm_cmpeq_epi16(x, zero));
+		}
+		acc = _mm_madd_epi16(acc, _mm_set1_epi16(1));
+		acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+		acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+		count += (uint32_t)_mm_cvtsi128_si32(acc);
+	}
+	return count + count_zero16_scalar(v + i, n - i);
+}
+
+/** First entry of @v equal (@zero = 1) or not equal (@zero = 0) to zero */
+__attribute__((target("sse2")))
+static inline size_t find16_sse2(const uint16_t *v, size_t n, int zero)
+{
+	const __m128i z = _mm_setzero_si128();
+	uint32_t flip = zero ? 0 : 0xFFFF;
+	size_t i = 0;
+
+	for (; i + 8 <= n; i += 8) {
+		__m128i x = _mm_loadu_si128((const __m128i *)(v + i));
+		uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi16(x, z)) ^ flip;
+		if (mask)
+			return i + __builtin_ctz(mask) / 2;
+	}
+	return i + (zero ? find_zero16_scalar(v + i, n - i) : find_nonzero16_scalar(v + i, n - i));
+}
+
+__attribute__((target("sse2")))
+static size_t find_zero16_sse2(const uint16_t *v, size_t n)
+{
+	return find16_sse2(v, n, 1);
+}
+
+__attribute__((target("sse2")))
+static size_t find_nonzero16_sse2(const uint16_t *v, size_t n)
+{
+	return find16_sse2(v, n, 0);
+}
+
+__attribute__((target("sse2")))
+static size_t find_free_dirent_sse2(const uint8_t *entries, size_t count)
+{
+	size_t i = 0;
+
+	/** first bytes of 8 entries, tested at once */
+	for (; i + 8 <= count; i += 8) {
+		const uint8_t *e = entries + i * SCAN_DIRENT_SIZE;
+		__m128i x = _mm_setr_epi16(e[0], e[32], e[64], e[96],
+					   e[128], e[160], e[192], e[224]);
+		uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi16(x, _mm_setzero_si128()));
+		if (mask)
+			return i + __builtin_ctz(mask) / 2;
+	}
+	return i + find_free_dirent_scalar(entries + i * SCAN_DIRENT_SIZE, count - i);
+}
+
+__attribute__((target("sse2")))
+static size_t find_dirent_sse2(const uint8_t *entries, size_t count, const uint8_t *key,
+			       uint32_t need)
+{
+	const __m128i k = _mm_loadu_si128((const __m128i *)key);
+
+	for (size_t i = 0; i < count; i++) {
+		__m128i x = _mm_loadu_si128((const __m128i *)(entries + i * SCAN_DIRENT_SIZE));
+		if ((_mm_movemask_epi8(_mm_cmpeq_epi8(x, k)) & need) == need)
+			return i;
+	}
+	return count;
+}
+
+static const struct scan_ops scan_sse2 = {
+	count_zero16_sse2,
+	find_zero16_sse2,
+	find_nonzero16_sse2,
+	find_free_dirent_sse2,
+	find_dirent_sse2,
+};
+
+/**=== AVX2 kernels ===*/
+
+__attribute__((target("avx2")))
+static size_t count_zero16_avx2(const uint16_t *v, size_t n)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	size_t count = 0, i = 0;
+
+	while (i + 16 <= n) {
+		__m256i acc = zero;
+		size_t end = n - i > 16 * 0x7FFF ? i + 16 * 0x7FFF : n;
+
+		/** two loads per iteration keep both load ports busy */
+		__m256i acc2 = zero;
+		for (; i + 32 <= end; i += 32) {
+			__m256i x = _mm256_loadu_si256((const __m256i *)(v + i));
+			__m256i y = _mm256_loadu_si256((const __m256i *)(v + i + 16));
+			acc = _mm256_sub_epi16(acc, _mm256_cmpeq_epi16(x, zero));
+			acc2 = _mm256_sub_epi16(acc2, _mm256_cmpeq_epi16(y, zero));
+		}
+		for (; i + 16 <= end; i += 16) {
+			__m256i x = _mm256_loadu_si256((const __m256i *)(v + i));
+			acc = _mm256_sub_epi16(acc, _mm256_cmpeq_epi16(x, zero));
+		}
+		acc = _mm256_madd_epi16(acc, _mm256_set1_epi16(1));
+		acc = _mm256_add_epi32(acc, _mm256_madd_epi16(acc2, _mm256_set1_epi16(1)));
+		__m128i sum = _mm_add_epi32(_mm256_castsi256_si128(acc),
+					    _mm256_extracti128_si256(acc, 1));
+		sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+		sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+		count += (uint32_t)_mm_cvtsi128_si32(sum);
+	}
+	return count + count_zero16_scalar(v + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static inline size_t find16_avx2(const uint16_t *v, size_t n, int zero)
+{
+	const __m256i z = _mm256_setzero_si256();
+	uint32_t flip = zero ? 0 : 0xFFFFFFFF;
+	size_t i = 0;
+
+	for (; i + 16 <= n; i += 16) {
+		__m256i x = _mm256_loadu_si256((const __m256i *)(v + i));
+		uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi16(x, z)) ^ flip;
+		if (mask)
+			return i + __builtin_ctz(mask) / 2;
+	}
+	return i + (zero ? find_zero16_scalar(v + i, n - i) : find_nonzero16_scalar(v + i, n - i));
+}
+
+__attribute__((target("avx2")))
+static size_t find_zero16_avx2(const uint16_t *v, size_t n)
+{
+	return find16_avx2(v, n, 1);
+}
+
+__attribute__((target("avx2")))
+static size_t find_nonzero16_avx2(const uint16_t *v, size_t n)
+{
+	return find16_avx2(v, n, 0);
+}
+
+__attribute__((target("avx2")))
+static size_t find_free_dirent_avx2(const uint8_t *entries, size_t count)
+{
+	const __m256i offsets = _mm256_setr_epi32(0, 32, 64, 96, 128, 160, 192, 224);
+	const __m256i low = _mm256_set1_epi32(0xFF);
+	size_t i = 0;
+
+	/** gather the first bytes of 8 entries */
+	for (; i + 8 <= count; i += 8) {
+		__m256i x = _mm256_i32gather_epi32((const int *)(entries + i * SCAN_DIRENT_SIZE),
+						   offsets, 1);
+		x = _mm256_cmpeq_epi32(_mm256_and_si256(x, low), _mm256_setzero_si256());
+		uint32_t mask = _mm256_movemask_ps(_mm256_castsi256_ps(x));
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+	return i + find_free_dirent_scalar(entries + i * SCAN_DIRENT_SIZE, count - i);
+}
+
+__attribute__((target("avx2")))
+static size_t find_dirent_avx2(const uint8_t *entries, size_t count, const uint8_t *key,
+			       uint32_t need)
+{
+	const __m256i k = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)key));
+	uint32_t need2 = need | need << 16;
+	size_t i = 0;
+
+	/** names of 2 entries per comparison */
+	for (; i + 2 <= count; i += 2) {
+		const uint8_t *e = entries + i * SCAN_DIRENT_SIZE;
+		__m256i x = _mm256_inserti128_si256(
+			_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)e)),
+			_mm_loadu_si128((const __m128i *)(e + SCAN_DIRENT_SIZE)), 1);
+		uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, k)) & need2;
+		if ((mask & need) == need)
+			return i;
+		if ((mask >> 16) == need)
+			return i + 1;
+	}
+	if (i < count)
+		i += find_dirent_sse2(entries + i * SCAN_DIRENT_SIZE, count - i, key, need);
+	return i;
+}
+
+static const struct scan_ops scan_avx2 = {
+	count_zero16_avx2,
+	find_zero16_avx2,
+	find_nonzero16_avx2,
+	find_free_dirent_avx2,
+	find_dirent_avx2,
+};
+
+#endif /* SCAN_X86 */
+
+/**=== dispatch ===*/
+
+static const struct scan_ops *scan_ops = &scan_scalar;
+static int scanLevel = SCAN_SCALAR;
+static int supportedLevel = SCAN_SCALAR;
+static pthread_once_t scanOnce = PTHREAD_ONCE_INIT;
+
+static int scan_select(int level);
+
+/** Pick the best kernels, from the features CPUID reports */
+static void scan_init(void)
+{
+#ifdef SCAN_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2"))
+		supportedLevel = SCAN_SSE2;
+	if (__builtin_cpu_supports("avx2"))
+		supportedLevel = SCAN_AVX2;
+#endif
+	scan_select(supportedLevel);
+}
+
+int scan_level(void)
+{
+	pthread_once(&scanOnce, scan_init);
+	return scanLevel;
+}
+
+int scan_set_level(int level)
+{
+	pthread_once(&scanOnce, scan_init);
+	return scan_select(level);
+}
+
+static int scan_select(int level)
+{
+	if (level > supportedLevel)
+		level = supportedLevel;
+	switch (level) {
+#ifdef SCAN_X86
+	case SCAN_AVX2:
+		scan_ops = &scan_avx2;
+		break;
+	case SCAN_SSE2:
+		scan_ops = &scan_sse2;
+		break;
+#endif
+	default:
+		level = SCAN_SCALAR;
+		scan_ops = &scan_scalar;
+		break;
+	}
+	scanLevel = level;
+	return level;
+}
+
+const char *scan_level_name(int level)
+{
+	static const char *names[] = { "scalar", "sse2", "avx2" };
+
+	if (level < SCAN_SCALAR || level > SCAN_AVX2)
+		return "unknown";
+	return names[level];
+}
+
+size_t scan_count_zero16(const uint16_t *v, size_t n)
+{
+	pthread_once(&scanOnce, scan_init);
+	return scan_ops->count_zero16(v, n);
+}
+
+size_t scan_find_zero16(const uint16_t *v, size_t n)
+{
+	pthread_once(&scanOnce, scan_init);
+	return scan_ops->find_zero16(v, n);
+}
+
+size_t scan_find_nonzero16(const uint16_t *v, size_t n)
+{
+	pthread_once(&scanOnce, scan_init);
+	return scan_ops->find_nonzero16(v, n);
+}
+
+size_t scan_find_free_dirent(const void *entries, size_t count)
+{
+	pthread_once(&scanOnce, scan_init);
+	return scan_ops->find_free_dirent(entries, count);
+}
+
+size_t scan_find_dirent(const void *entries, size_t count, const char *name)
+{
+	uint8_t key[SCAN_NAME_LEN] = { 0 };
+	size_t len = strnlen(name, SCAN_NAME_LEN);
+
+	/** a name that does not fit cannot be found */
+	if (len == SCAN_NAME_LEN)
+		return count;
+	memcpy(key, name, len);
+	pthread_once(&scanOnce, scan_init);
+	return scan_ops->find_dirent(entries, count, key, (1u << (len + 1)) - 1);
+}
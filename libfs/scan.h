@@ -0,0 +1,91 @@
+#ifndef _SCAN_H
+#define _SCAN_H
+
+#include <stddef.h> /* for size_t definition */
+#include <stdint.h>
+
+/**
+ * Kernels scanning the FAT and directory tables. Each has a portable version
+ * and, on x86, SSE2 and AVX2 versions; the fastest one the CPU supports is
+ * picked on first use, as reported by CPUID.
+ */
+
+/** Size of a directory entry scanned by scan_find_free_dirent() */
+#define SCAN_DIRENT_SIZE 32
+/** Bytes of the name at the start of a directory entry, NUL included */
+#define SCAN_NAME_LEN 16
+
+enum scan_level {
+	SCAN_SCALAR,
+	SCAN_SSE2,
+	SCAN_AVX2,
+};
+
+/**
+ * scan_level - Get the kernels in use
+ *
+ * Return: the %SCAN_* level of the kernels in use.
+ */
+int scan_level(void);
+
+/**
+ * scan_set_level - Choose the kernels to use
+ * @level: %SCAN_* level wanted
+ *
+ * Meant for benchmarks and tests: a level the CPU does not support is
+ * lowered to the best one it does.
+ *
+ * Return: the level in use from now on.
+ */
+int scan_set_level(int level);
+
+/** scan_level_name - Name of a %SCAN_* level */
+const char *scan_level_name(int level);
+
+/**
+ * scan_count_zero16 - Count the zero entries of an array
+ * @v: Array, e.g. a FAT block
+ * @n: Number of entries in @v
+ */
+size_t scan_count_zero16(const uint16_t *v, size_t n);
+
+/**
+ * scan_find_zero16 - Find the first zero entry of an array
+ *
+ * Return: the index of the first zero entry, or @n if there is none.
+ */
+size_t scan_find_zero16(const uint16_t *v, size_t n);
+
+/**
+ * scan_find_nonzero16 - Find the first non-zero entry of an array
+ *
+ * Return: the index of the first non-zero entry, or @n if there is none.
+ */
+size_t scan_find_nonzero16(const uint16_t *v, size_t n);
+
+/**
+ * scan_find_free_dirent - Find the first free directory entry
+ * @entries: Table of @count entries of %SCAN_DIRENT_SIZE bytes
+ * @count: Number of entries
+ *
+ * An entry is free when the first byte of its name is NUL.
+ *
+ * Return: the index of the first free entry, or @count if there is none.
+ */
+size_t scan_find_free_dirent(const void *entries, size_t count);
+
+/**
+ * scan_find_dirent - Find the directory entry with a given name
+ * @entries: Table of @count entries of %SCAN_DIRENT_SIZE bytes
+ * @count: Number of entries
+ * @name: Name to look for
+ *
+ * Only the name is compared, up to its NUL: bytes of the entry past the NUL
+ * are ignored.
+ *
+ * Return: the index of the first entry named @name, or @count if there is
+ * none.
+ */
+size_t scan_find_dirent(const void *entries, size_t count, const char *name);
+
+#endif /* _SCAN_H */
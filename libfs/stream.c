@@ -0,0 +1,269 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "disk.h"
+#include "fs.h"
+
+/*
+ * A stream buffers either data read ahead of the stream position, or data
+ * written and not yet passed to fs_write(), never both. Buffered writes are
+ * flushed when they reach a block boundary, and reads fill the buffer from
+ * the start of a block, so that the file system sees whole blocks rather than
+ * a read-modify-write for every small operation.
+ */
+struct fs_stream {
+	int fd;
+	uint32_t pos;			/* stream position */
+	char *buf;
+	size_t size;			/* 0 when unbuffered */
+	int mode;			/* FS_STREAM_FULL or FS_STREAM_LINE */
+	uint32_t bufStart;		/* file offset of buf[0] */
+	size_t bufLen;			/* bytes of buf in use */
+	int writing;			/* 1 if buf holds data to write */
+};
+
+struct fs_stream *fs_fdopen(int fd)
+{
+	struct fs_stream *stream;
+
+	if (fs_stat(fd) < 0)
+		return NULL;
+
+	stream = calloc(1, sizeof(*stream));
+	if (!stream) {
+		perror("fs_fdopen: calloc");
+		return NULL;
+	}
+	stream->fd = fd;
+	if (fs_setvbuf(stream, FS_STREAM_BUFSIZE, FS_STREAM_FULL)) {
+		free(stream);
+		return NULL;
+	}
+	return stream;
+}
+
+struct fs_stream *fs_fopen(const char *filename)
+{
+	struct fs_stream *stream;
+	int fd = fs_open(filename);
+
+	if (fd < 0)
+		return NULL;
+	stream = fs_fdopen(fd);
+	if (!stream)
+		fs_close(fd);
+	return stream;
+}
+
+int fs_fflush(struct fs_stream *stream)
+{
+	if (!stream) {
+		fprintf(stderr, "fs_fflush: invalid stream\n");
+		return -1;
+	}
+	if (!stream->writing)
+		return 0;
+
+	if (fs_lseek(stream->fd, stream->bufStart) ||
+	    fs_write(stream->fd, stream->buf, stream->bufLen) != (int)stream->bufLen) {
+		fprintf(stderr, "fs_fflush: cannot write %zu bytes at %u\n",
+			stream->bufLen, stream->bufStart);
+		return -1;
+	}
+	stream->bufStart += stream->bufLen;
+	stream->bufLen = 0;
+	stream->writing = 0;
+	return 0;
+}
+
+int fs_setvbuf(struct fs_stream *stream, size_t size, int mode)
+{
+	char *buf = NULL;
+
+	if (!stream || (mode != FS_STREAM_FULL && mode != FS_STREAM_LINE)) {
+		fprintf(stderr, "fs_setvbuf: invalid argument\n");
+		return -1;
+	}
+	if (fs_fflush(stream))
+		return -1;
+
+	/* Whole blocks, so that flushes end on block boundaries */
+	size = (size + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+	if (size) {
+		buf = malloc(size);
+		if (!buf) {
+			perror("fs_setvbuf: malloc");
+			return -1;
+		}
+	}
+	free(stream->buf);
+	stream->buf = buf;
+	stream->size = size;
+	stream->mode = mode;
+	stream->bufLen = 0;
+	return 0;
+}
+
+/* Room left in the write buffer before its end falls on a block boundary */
+static size_t stream_room(const struct fs_stream *stream)
+{
+	return stream->size - stream->bufStart % BLOCK_SIZE - stream->bufLen;
+}
+
+int fs_fwrite(struct fs_stream *stream, const void *data, size_t count)
+{
+	const char *p = data;
+	size_t done = 0;
+
+	if (!stream || !data) {
+		fprintf(stderr, "fs_fwrite: invalid argument\n");
+		return -1;
+	}
+
+	if (!stream->writing) {
+		/* Data read ahead is stale once written over */
+		stream->bufStart = stream->pos;
+		stream->bufLen = 0;
+	}
+
+	while (done < count) {
+		size_t n = count - done;
+
+		/* Large writes skip the buffer, up to a block boundary */
+		if (stream->size == 0) {
+			/* unbuffered: everything at once */
+		} else if (stream->bufLen == 0 && n >= stream_room(stream)) {
+			uint32_t end = stream->pos + n;
+
+			if (end % BLOCK_SIZE < n)
+				n -= end % BLOCK_SIZE;
+		} else {
+			n = 0;
+		}
+		if (n) {
+			if (fs_lseek(stream->fd, stream->pos) ||
+			    fs_write(stream->fd, (void *)(p + done), n) != (int)n) {
+				fprintf(stderr, "fs_fwrite: cannot write %zu bytes at %u\n",
+					n, stream->pos);
+				return done ? (int)done : -1;
+			}
+			done += n;
+			stream->pos += n;
+			stream->bufStart = stream->pos;
+			continue;
+		}
+
+		n = count - done;
+		if (n > stream_room(stream))
+			n = stream_room(stream);
+		memcpy(stream->buf + stream->bufLen, p + done, n);
+		stream->bufLen += n;
+		stream->writing = 1;
+		done += n;
+		stream->pos += n;
+		if (stream_room(stream) == 0 && fs_fflush(stream))
+			return -1;
+	}
+
+	if (stream->mode == FS_STREAM_LINE && memchr(data, '\n', count) &&
+	    fs_fflush(stream))
+		return -1;
+	return done;
+}
+
+int fs_fread(struct fs_stream *stream, void *data, size_t count)
+{
+	char *p = data;
+	size_t done = 0;
+
+	if (!stream || !data) {
+		fprintf(stderr, "fs_fread: invalid argument\n");
+		return -1;
+	}
+	if (fs_fflush(stream))
+		return -1;
+
+	while (done < count) {
+		/* Serve what was read ahead */
+		if (stream->pos >= stream->bufStart &&
+		    stream->pos < stream->bufStart + stream->bufLen) {
+			size_t n = stream->bufStart + stream->bufLen - stream->pos;
+
+			if (n > count - done)
+				n = count - done;
+			memcpy(p + done, stream->buf + (stream->pos - stream->bufStart), n);
+			done += n;
+			stream->pos += n;
+			continue;
+		}
+
+		/* Large reads skip the buffer */
+		if (count - done >= stream->size) {
+			if (fs_lseek(stream->fd, stream->pos))
+				break;
+			int n = fs_read(stream->fd, p + done, count - done);
+			if (n < 0)
+				return done ? (int)done : -1;
+			done += n;
+			stream->pos += n;
+			break;
+		}
+
+		stream->bufStart = stream->pos - stream->pos % BLOCK_SIZE;
+		stream->bufLen = 0;
+		if (fs_lseek(stream->fd, stream->bufStart))
+			break;
+		int n = fs_read(stream->fd, stream->buf, stream->size);
+		if (n < 0)
+			return done ? (int)done : -1;
+		stream->bufLen = n;
+		/* End of file */
+		if (stream->pos >= stream->bufStart + stream->bufLen)
+			break;
+	}
+	return done;
+}
+
+int fs_fseek(struct fs_stream *stream, uint32_t offset)
+{
+	if (!stream) {
+		fprintf(stderr, "fs_fseek: invalid stream\n");
+		return -1;
+	}
+	if (fs_fflush(stream))
+		return -1;
+
+	int size = fs_stat(stream->fd);
+	if (size < 0 || offset > (uint32_t)size) {
+		fprintf(stderr, "fs_fseek: offset %u is past the end of the file\n", offset);
+		return -1;
+	}
+	stream->pos = offset;
+	return 0;
+}
+
+int fs_ftell(struct fs_stream *stream)
+{
+	if (!stream) {
+		fprintf(stderr, "fs_ftell: invalid stream\n");
+		return -1;
+	}
+	return stream->pos;
+}
+
+int fs_fclose(struct fs_stream *stream)
+{
+	int ret;
+
+	if (!stream) {
+		fprintf(stderr, "fs_fclose: invalid stream\n");
+		return -1;
+	}
+	ret = fs_fflush(stream);
+	if (fs_close(stream->fd))
+		ret = -1;
+	free(stream->buf);
+	free(stream);
+	return ret;
+}